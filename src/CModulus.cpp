@@ -26,6 +26,7 @@
  */
 #include "CModulus.h"
 #include "timing.h"
+#include "counters.h"
 
 // It is assumed that m,q,context, and root are already set. If root is set
 // to zero, it will be computed by the compRoots() method. Then rInv is
@@ -55,6 +56,7 @@ Cmodulus::Cmodulus(const PAlgebra &zms, long qq, long rt)
     q = qq;
 
   qinv = PrepMulMod(q);
+  cntSlot = registerCounterPrime(q);
 
   zMStar = &zms;
   root = rt;
@@ -158,6 +160,7 @@ Cmodulus& Cmodulus::operator=(const Cmodulus &other)
   zMStar  =  other.zMStar; // Yes, really copy this pointer
   q       = other.q;
   qinv    = other.qinv;
+  cntSlot = other.cntSlot;
   m_inv   = other.m_inv;
 
   context = other.context;
@@ -246,6 +249,8 @@ void Cmodulus::FFT_aux(vec_long &y, zz_pX& tmp) const
 void Cmodulus::FFT(vec_long &y, const ZZX& x) const
 {
   FHE_TIMER_START;
+  FHE_COUNT(FHE_CNT_FFT, 1);
+  FHE_COUNT_PRIME_NTT(cntSlot, false, 1);
   zz_pBak bak; bak.save();
   context.restore();
 
@@ -260,12 +265,29 @@ void Cmodulus::FFT(vec_long &y, const ZZX& x) const
 void Cmodulus::FFT(vec_long &y, const zzX& x) const
 {
   FHE_TIMER_START;
+  FHE_COUNT(FHE_CNT_FFT, 1);
+  FHE_COUNT_PRIME_NTT(cntSlot, false, 1);
   zz_pBak bak; bak.save();
   context.restore();
 
   zz_pX& tmp = Cmodulus::getScratch_zz_pX();
   { FHE_NTIMER_START(FFT_remainder);
-    convert(tmp,x);      // convert input to zpx format
+    // The coefficients are typically small (sampled noise and keys), so
+    // reducing them mod q is a conditional add, no division is needed
+    long n = x.length();
+    const long *xp = x.elts();
+    tmp.rep.SetLength(n);
+    zz_p *tp = tmp.rep.elts();
+    for (long i = 0; i < n; i++) {
+      long c = xp[i];
+      c += (c < 0)? q : 0;
+      if (c < 0 || c >= q) { // a large coefficient
+        c = xp[i] % q;
+        if (c < 0) c += q;
+      }
+      tp[i].LoopHole() = c;
+    }
+    tmp.normalize();
   }
 
   FFT_aux(y, tmp);
@@ -276,6 +298,8 @@ void Cmodulus::FFT(vec_long &y, const zzX& x) const
 void Cmodulus::iFFT(zz_pX &x, const vec_long& y)const
 {
   FHE_TIMER_START;
+  FHE_COUNT(FHE_CNT_IFFT, 1);
+  FHE_COUNT_PRIME_NTT(cntSlot, true, 1);
   zz_pBak bak; bak.save();
   context.restore();
 
@@ -60,6 +60,8 @@ class Cmodulus {
 
   copied_ptr<zz_pXModulus1> phimx; // PhimX modulo q, for faster division w/ remainder
 
+  long        cntSlot; // the slot of q in the per-prime NTT counters
+
 
   // Allocate memory and compute roots
   void privateInit(const PAlgebra&, long rt);
@@ -75,7 +77,7 @@ class Cmodulus {
   // Destructor and constructors
 
   // Default constructor
-  Cmodulus() {}
+  Cmodulus() : cntSlot(-1) {}
 
   Cmodulus(const Cmodulus &other) { *this = other; }
 
@@ -94,6 +96,7 @@ class Cmodulus {
   long getQ() const          { return q; }
   mulmod_t getQInv() const          { return qinv; }
   long getRoot() const       { return root; }
+  long getCounterSlot() const { return cntSlot; } // see counters.h
   const zz_pXModulus1& getPhimX() const  { return *phimx; }
 
   //! @brief Restore NTL's current modulus
@@ -9,8 +9,9 @@
  * See the License for the specific language governing permissions and
  * limitations under the License. See accompanying LICENSE file.
  */
-#include <NTL/BasicThreadPool.h>
+#include "multicore.h"
 #include "timing.h"
+#include "counters.h"
 #include "Ctxt.h"
 #include "FHE.h"
 
@@ -104,20 +105,24 @@ std::pair<long, NTL::xdouble> Ctxt::computeKSNoise(long partIdx, long pSpace)
 // It is assumed that W has at least as many b[i]'s as there are digits.
 // The vector of digits is modified in place.
 void Ctxt::keySwitchDigits(const KeySwitch& W, vector<DoubleCRT>& digits)
-{  // An object to hold the pseudorandom ai's, note that it must be defined
-  // with the maximum number of levels, else the PRG will go out of synch.
-  // FIXME: This is a bug waiting to happen.
-  DoubleCRT ai(context);
+{
+  FHE_COUNT_KEY_SWITCH(FHEkeySwitchId(W.fromKey.getSecretKeyID(),
+                                      W.fromKey.getPowerOfS(),
+                                      W.fromKey.getPowerOfX(), W.toKeyID), 1);
 
-  // Subsequent ai's use the evolving RNG state
-  RandomState state; // backup the NTL PRG seed
-  NTL::SetSeed(W.prgSeed);
+  // The copy of W on this NUMA node, only the rows of its columns that
+  // multiply the digits are read from it
+  bool isLocal;
+  const KeySwitch& LW = pubKey.localKSW(W, &isLocal);
 
   // Add the columns in, one by one
   DoubleCRT tmpDCRT(context, IndexSet::emptySet());  
   for (size_t i=0; i<digits.size(); i++) {
     FHE_NTIMER_START(KS_loop);
-    ai.randomize();
+    // The pseudorandom ai is regenerated from (W.prgSeed, i), only over
+    // the primes of the digit, as each row has its own PRG stream
+    DoubleCRT ai(context, digits[i].getIndexSet());
+    ai.randomize(W.prgSeed, i);
     tmpDCRT = digits[i];
   
     // The operations below all use the IndexSet of tmpDCRT
@@ -133,7 +138,9 @@ void Ctxt::keySwitchDigits(const KeySwitch& W, vector<DoubleCRT>& digits)
   
     // add digit*b[i] with a handle pointing to one
 { FHE_NTIMER_START(KS_loop_3);
-    digits[i].Mul(W.b[i], /*matchIndexSet=*/false);
+    digits[i].Mul(LW.b[i], /*matchIndexSet=*/false);
+    FHE_COUNT_NUMA(isLocal, card(digits[i].getIndexSet())
+                   * context.zMStar.getPhiM() * sizeof(long));
 }
 
 { FHE_NTIMER_START(KS_loop_4);
@@ -263,6 +270,15 @@ void Ctxt::modDownToSet(const IndexSet &s)
   FHE_TIMER_START;
 
   IndexSet setDiff = primeSet / intersection; // set-minus
+  FHE_COUNT(FHE_CNT_MOD_SWITCH, 1);
+  FHE_COUNT(FHE_CNT_PRIMES_DROPPED, card(setDiff));
+  if (areCountersOn()) { // the levels of the ciphertext primes in setDiff
+    IndexSet dropped = setDiff & context.ctxtPrimes;
+    long levels = card(dropped);
+    if (context.containsSmallPrime())
+      levels = 2*levels - (dropped.contains(context.ctxtPrimes.first())? 1:0);
+    FHE_COUNT(FHE_CNT_LEVELS_CONSUMED, levels);
+  }
 
   // Scale down all the parts: use either a simple "drop down" (just removing
   // primes, i.e., reducing the ctxt modulo the samaller modulus), or a "real
@@ -450,11 +466,13 @@ void Ctxt::keySwitchPart(const CtxtPart& p, const KeySwitch& W)
 
   vector<DoubleCRT> polyDigits;
   p.breakIntoDigits(polyDigits, nDigits);
+  FHE_COUNT(FHE_CNT_KEY_SWITCH, 1);
+  FHE_COUNT(FHE_CNT_KS_DIGITS, polyDigits.size());
 
   // Finally we multiply the vector of digits by the key-switching matrix
   keySwitchDigits(W, polyDigits);
   noiseVar += addedNoise; // update the noise estimate
-} // restore random state upon destruction of the RandomState, see NumbTh.h
+}
 
 
 // Find the IndexSet such that modDown to that set of primes makes the
@@ -1137,10 +1155,10 @@ static void recursiveIncrementalProduct(Ctxt array[], long n)
 
   // Multiply the last product in the 1st part into every product in the 2nd
   if (n-n1 > 1) {
-    NTL_EXEC_RANGE(n-n1, first, last)
+    FHE_EXEC_RANGE(n-n1, first, last)
     for (long i=n1+first; i<n1+last; i++)
       array[i].multiplyBy(array[n1-1]);
-    NTL_EXEC_RANGE_END
+    FHE_EXEC_RANGE_END
   }
   else
     for (long i=n1; i<n; i++) array[i].multiplyBy(array[n1-1]);
@@ -1169,10 +1187,13 @@ static void recursiveTotalProduct(Ctxt& out, const Ctxt array[], long n)
   long ell = NTL::NumBits(n-1); // 2^{l-1} <= n-1
   long n1 = 1UL << (ell-1);     // n/2 <= n1 = 2^l < n
 
-  // Call the recursive procedure separately on the first and second parts
+  // Call the recursive procedure separately on the first and second parts,
+  // the two halves are independent so they are computed in parallel
   Ctxt out2(ZeroCtxtLike, out);
-  recursiveTotalProduct(out, array, n1);
-  recursiveTotalProduct(out2, &array[n1], n-n1);
+  FHE_EXEC_INDEX(2, index)
+    if (index == 0) recursiveTotalProduct(out, array, n1);
+    else            recursiveTotalProduct(out2, &array[n1], n-n1);
+  FHE_EXEC_INDEX_END
 
   // Multiply the beginning of the two halves
   out.multiplyBy(out2);
@@ -1180,7 +1201,8 @@ static void recursiveTotalProduct(Ctxt& out, const Ctxt array[], long n)
 
 // set out=prod_{i=0}^{n-1} v[j], takes depth log n and n-1 products
 // out could point to v[0], but having it pointing to any other v[i]
-// will make the result unpredictable.
+// will make the result unpredictable. The two halves of every level in the
+// product tree are evaluated in parallel.
 void totalProduct(Ctxt& out, const vector<Ctxt>& v)
 {
   long n = v.size();  // how many ciphertexts do we have
@@ -1247,9 +1269,17 @@ void innerProduct(Ctxt& result,
 // The ciphertext *this is not affected, instead the result is returned in
 // the zzParts vector, as a vector of ZZX'es. Returns an extimate for the
 // noise variance after mod-switching.
+//
+// The coefficients c (in the powerful basis) are never reconstructed mod Q.
+// With y_j = c*(Q/q_j)^{-1} mod q_j we have c = sum_j y_j*(Q/q_j) - v*Q,
+// where v is the rounding of sum_j y_j/q_j (for c in the symmetric
+// interval), so
+//    c*toModulus/Q = sum_j y_j*(toModulus/q_j) - v*toModulus, and
+//    c mod p2r = sum_j y_j*((Q/q_j) mod p2r) - v*(Q mod p2r) mod p2r.
 #include "powerful.h"
 double Ctxt::rawModSwitch(vector<ZZX>& zzParts, long toModulus) const
 {
+  FHE_TIMER_START;
   // Ensure that new modulus is co-prime with plaintetx space
   assert(toModulus>1 && GCD(toModulus, getPtxtSpace())==1);
   const long p2r = getPtxtSpace();
@@ -1260,46 +1290,78 @@ double Ctxt::rawModSwitch(vector<ZZX>& zzParts, long toModulus) const
   xdouble ratio = xexp(log((double)toModulus)
 		       - context.logOfProduct(getPrimeSet()));
 
-  // Compute also the ratio modulo ptxtSpace
-  const ZZ fromModulus = context.productOfPrimes(getPrimeSet());
-  long ratioModP = MulMod(toModulus % p2r, 
-			  InvMod(rem(fromModulus,p2r),p2r), p2r);
+  // The per-prime constants, all in single precision
+  const IndexSet& s = getPrimeSet();
+  long k = card(s);
+  Vec<long> qvec(INIT_SIZE, k), tvec(INIT_SIZE, k), qhatModP(INIT_SIZE, k);
+  Vec<mulmod_precon_t> tqinv(INIT_SIZE, k);
+  Vec<long double> scale(INIT_SIZE, k); // toModulus/q_j
+  Vec<double> qrecip(INIT_SIZE, k);
+  for (long i = s.first(), j = 0; i <= s.last(); i = s.next(i), j++) {
+    qvec[j] = context.ithPrime(i);
+    scale[j] = (long double) toModulus / qvec[j];
+    qrecip[j] = 1/double(qvec[j]);
+  }
+  long qModP = 1 % p2r; // Q mod p2r
+  for (long j = 0; j < k; j++) {
+    long q = qvec[j];
+    long inv = 1, hat = 1 % p2r;
+    for (long l = 0; l < k; l++) if (l != j) {
+      inv = MulMod(inv, qvec[l] % q, q);
+      hat = MulMod(hat, qvec[l] % p2r, p2r);
+    }
+    tvec[j] = InvMod(inv, q);
+    tqinv[j] = PrepMulModPrecon(tvec[j], q);
+    qhatModP[j] = hat;
+    qModP = MulMod(qModP, q % p2r, p2r);
+  }
 
+  // Compute also the ratio modulo ptxtSpace
+  long ratioModP = MulMod(toModulus % p2r, InvMod(qModP, p2r), p2r);
   mulmod_precon_t precon = PrepMulModPrecon(ratioModP, p2r);
 
-  // cerr << "## converting from mod-"<<context.productOfPrimes(getPrimeSet())
-  //      << " to mod-"<<toModulus<<" (ratio="<<ratio
-  //      << "), ptxtSpace="<<p2r<<endl;
-
   // Scale and round all the integers in all the parts
   zzParts.resize(parts.size());
   const PowerfulDCRT& p2d_conv = *context.rcData.p2dConv;
   for (size_t i=0; i<parts.size(); i++) {
-
-    Vec<ZZ> powerful;
-    p2d_conv.dcrtToPowerful(powerful, parts[i]); // conver to powerful rep
-
-    for (long j=0; j<powerful.length(); j++) {
-      const ZZ& coef = powerful[j];
-      long c_mod_p = MulModPrecon(rem(coef,p2r), ratioModP, p2r, precon);
-      xdouble xcoef = ratio*conv<xdouble>(coef); // the scaled coefficient
-
-      // round xcoef to an integer which is equal to c_mod_p modulo ptxtSpace
-      long rounded = conv<long>(floor(xcoef));
-      long r_mod_p = rounded % p2r;
-      if (r_mod_p < 0) r_mod_p += p2r; // r_mod_p in [0,p-1]
-
-      if (r_mod_p != c_mod_p) {
-        long delta = SubMod(c_mod_p, r_mod_p, p2r);
-	// either add delta or subtract toModulus-delta
-	rounded += delta;
-	if (delta > toModulus-delta) rounded -= p2r;
+    assert(parts[i].getIndexSet() == s);
+
+    Vec< Vec<long> > rows;
+    p2d_conv.dcrtToPowerful(rows, parts[i]); // powerful rep, mod each q_j
+
+    long n = (k > 0)? rows[0].length() : 0;
+    Vec<long> scaled(INIT_SIZE, n);
+    FHE_EXEC_RANGE(n, first, last)
+      for (long h = first; h < last; h++) {
+        long double xcoef = 0;   // sum_j y_j*(toModulus/q_j)
+        double quotient = 0;     // sum_j y_j/q_j
+        long c_mod_p = 0;
+        for (long j = 0; j < k; j++) {
+          long y = MulModPrecon(rows[j][h], tvec[j], qvec[j], tqinv[j]);
+          xcoef += y*scale[j];
+          quotient += y*qrecip[j];
+          c_mod_p = AddMod(c_mod_p, MulMod(y % p2r, qhatModP[j], p2r), p2r);
+        }
+        long v = long(std::floor(quotient + 0.5));
+        xcoef -= (long double) v * toModulus; // the scaled coefficient
+        c_mod_p = SubMod(c_mod_p, MulMod(v % p2r, qModP, p2r), p2r);
+        c_mod_p = MulModPrecon(c_mod_p, ratioModP, p2r, precon);
+
+        // round xcoef to an integer which is equal to c_mod_p modulo ptxtSpace
+        long rounded = (long) std::floor(xcoef);
+        long r_mod_p = rounded % p2r;
+        if (r_mod_p < 0) r_mod_p += p2r; // r_mod_p in [0,p-1]
+
+        if (r_mod_p != c_mod_p) {
+          long delta = SubMod(c_mod_p, r_mod_p, p2r);
+          // either add delta or subtract toModulus-delta
+          rounded += delta;
+          if (delta > toModulus-delta) rounded -= p2r;
+        }
+        scaled[h] = rounded;
       }
-      // SetCoeff(zzParts[i],j,rounded);
-      conv(powerful[j], rounded);  // store back in the powerful vector
-    }
-    //  if (deg(zzParts[i])<20) cerr << "]\n   scaled poly="<<zzParts[i]<<endl;
-    p2d_conv.powerfulToZZX(zzParts[i],powerful); // conver to ZZX
+    FHE_EXEC_RANGE_END
+    p2d_conv.powerfulToZZX(zzParts[i],scaled); // conver to ZZX
   }
 
   // Return an estimate for the noise
@@ -249,6 +249,7 @@ class Ctxt {
   friend class FHEPubKey;
   friend class FHESecKey;
   friend class BasicAutomorphPrecon;
+  friend class RNSDecryptor;
 
   const FHEcontext& context; // points to the parameters of this FHE instance
   const FHEPubKey& pubKey;   // points to the public encryption key;
@@ -19,10 +19,10 @@
  * a vector of Cmodulus objects. 
  */
 #include <NTL/ZZVec.h>
-#include <NTL/BasicThreadPool.h>
 
 #include "DoubleCRT.h"
 #include "timing.h"
+#include "multicore.h"
 
 
 // A threaded implementation of DoubleCRT operations
@@ -43,25 +43,138 @@ long MakeIndexVector(const IndexSet& s, Vec<long>& v)
 // the used moduli, they are effectively reduced modulo that product
 
 
+// Reduces integers modulo several single-precision primes at once. The
+// absolute value is written in 32-bit words, a = sum_j w_j 2^{32j}, and
+// then a mod q = sum_j w_j (2^{32j} mod q) mod q, using only word-size
+// products with precomputed constants. The words are extracted once for
+// all the primes, instead of a multi-precision remainder for each prime.
+class MultiModReducer {
+  long nWords;
+  Vec<long> qvec;
+  Vec< Vec<long> > pow;                   // pow[i][j] = 2^{32j} mod q_i
+  Vec< Vec<mulmod_precon_t> > powPrecon;
+
+public:
+  // For the primes in qvec and integers of up to maxBits bits
+  MultiModReducer(const Vec<long>& _qvec, long maxBits)
+    : nWords(divc(maxBits, 32)), qvec(_qvec)
+  {
+    long k = qvec.length();
+    pow.SetLength(k);
+    powPrecon.SetLength(k);
+    for (long i = 0; i < k; i++) {
+      long q = qvec[i];
+      long base = (1L << 32) % q;
+      pow[i].SetLength(nWords);
+      powPrecon[i].SetLength(nWords);
+      for (long j = 0; j < nWords; j++) {
+        pow[i][j] = (j==0)? (1 % q) : MulMod(pow[i][j-1], base, q);
+        powPrecon[i][j] = PrepMulModPrecon(pow[i][j], q);
+      }
+    }
+  }
+
+  // res[i*stride] = a mod q_i, bytes and words are scratch space
+  void reduce(long* res, long stride, const ZZ& a,
+              Vec<unsigned char>& bytes, Vec<long>& words) const
+  {
+    long k = qvec.length();
+    if (NumBits(a) < NTL_BITS_PER_LONG) { // a single word
+      long v = conv<long>(a);
+      for (long i = 0; i < k; i++) {
+        long r = v % qvec[i];
+        res[i*stride] = (r < 0)? r + qvec[i] : r;
+      }
+      return;
+    }
+
+    long nb = NumBytes(a);
+    long nw = divc(nb, 4);
+    assert(nw <= nWords);
+    bytes.SetLength(4*nw);
+    BytesFromZZ(bytes.elts(), a, 4*nw); // |a|, zero-padded
+    words.SetLength(nw);
+    for (long j = 0; j < nw; j++) {
+      const unsigned char *b = &bytes[4*j];
+      words[j] = long(b[0]) | (long(b[1]) << 8) | (long(b[2]) << 16)
+                 | (long(b[3]) << 24);
+    }
+
+    bool negative = (sign(a) < 0);
+    for (long i = 0; i < k; i++) {
+      long q = qvec[i];
+      const long *pw = pow[i].elts();
+      const mulmod_precon_t *pp = powPrecon[i].elts();
+      long r = 0;
+      for (long j = 0; j < nw; j++) {
+        long w = words[j];
+        if (w >= q) w %= q; // only for primes below 2^32
+        r = AddMod(r, MulModPrecon(w, pw[j], q, pp[j]), q);
+      }
+      res[i*stride] = (negative && r != 0)? q - r : r;
+    }
+  }
+};
+
+// The words of the coefficients of poly, once per prime in s, that a
+// conversion of poly to the rows in s reduces
+static inline unsigned long reduceWords(const ZZX& poly, const IndexSet& s)
+{
+  unsigned long words = 0;
+  for (long h = 0; h < poly.rep.length(); h++)
+    words += (NumBits(poly.rep[h]) + NTL_BITS_PER_LONG-1) / NTL_BITS_PER_LONG;
+  return words * card(s);
+}
+
+// The residues of all the coefficients are computed in one pass over
+// poly, in parallel over blocks of coefficients, and then the rows are
+// transformed in parallel over the primes
 void DoubleCRT::FFT(const ZZX& poly, const IndexSet& s)
 {
   FHE_TIMER_START;
 
   if (empty(s)) return;
+  FHE_COUNT(FHE_CNT_ZZX_REDUCE_WORDS, reduceWords(poly, s));
 
-  static thread_local Vec<long> tls_ivec;
-  Vec<long>& ivec = tls_ivec;
-
+  Vec<long> ivec;
   long icard = MakeIndexVector(s, ivec);
-  NTL_EXEC_RANGE(icard, first, last)
+
+  long n = poly.rep.length();
+  long maxBits = 0;
+  for (long h = 0; h < n; h++) {
+    long b = NumBits(poly.rep[h]);
+    if (b > maxBits) maxBits = b;
+  }
+
+  Vec<long> qvec(INIT_SIZE, icard);
+  for (long j = 0; j < icard; j++) qvec[j] = context.ithPrime(ivec[j]);
+
+  // the residues, coefficient-major so that each block writes its own range
+  Vec<long> residues(INIT_SIZE, n*icard);
+  { FHE_NTIMER_START(FFT_multiMod);
+  MultiModReducer reducer(qvec, maxBits);
+  FHE_EXEC_RANGE(n, first, last)
+      Vec<unsigned char> bytes;
+      Vec<long> words;
+      for (long h = first; h < last; h++)
+        reducer.reduce(&residues[h*icard], 1, poly.rep[h], bytes, words);
+  FHE_EXEC_RANGE_END
+  }
+
+  FHE_EXEC_RANGE(icard, first, last)
+      zzX row;
+      row.SetLength(n);
       for (long j = first; j < last; j++) {
+        for (long h = 0; h < n; h++) row[h] = residues[h*icard + j];
         long i = ivec[j];
-        context.ithModulus(i).FFT(map[i], poly); 
+        // the entries are already in [0,q), so Cmodulus::FFT takes them
+        // as they are
+        context.ithModulus(i).FFT(map[i], row);
       }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
 }
 
-// FIXME: "code bloat": this just replicates the above with ZZX -> zzX
+// With a zzX the conversion mod each prime is cheap, see Cmodulus::FFT
 void DoubleCRT::FFT(const zzX& poly, const IndexSet& s)
 {
   FHE_TIMER_START;
@@ -72,12 +185,12 @@ void DoubleCRT::FFT(const zzX& poly, const IndexSet& s)
   Vec<long>& ivec = tls_ivec;
 
   long icard = MakeIndexVector(s, ivec);
-  NTL_EXEC_RANGE(icard, first, last)
+  FHE_EXEC_RANGE(icard, first, last)
       for (long j = first; j < last; j++) {
         long i = ivec[j];
         context.ithModulus(i).FFT(map[i], poly); 
       }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
 }
 
 
@@ -107,12 +220,62 @@ void DoubleCRT::verify()
 // Arithmetic operations. Only the "destructive" versions are used,
 // i.e., a += b is implemented but not a + b.
 
+// In dry-run mode the operations below return early, so they count the NTTs
+// that they would have spent, to let the counters reflect the same work in
+// both modes. This one counts the NTTs (or inverse NTTs) of the rows in s,
+// also for each prime separately.
+static void countDryRunNTTs(const FHEcontext& context, const IndexSet& s,
+                            bool inverse)
+{
+  if (!areCountersOn()) return;
+  FHE_COUNT(inverse? FHE_CNT_IFFT : FHE_CNT_FFT, card(s));
+  for (long i = s.first(); i <= s.last(); i = s.next(i))
+    FHE_COUNT_PRIME_NTT(context.ithModulus(i).getCounterSlot(), inverse, 1);
+}
+
+// The words of the coefficients of a polynomial that is reconstructed from
+// the rows in o, as large as the product of these primes, once per prime in
+// s. Used in dry-run mode, where that polynomial is not computed.
+static inline unsigned long crtReduceWords(const FHEcontext& context,
+                                           const IndexSet& o,
+                                           const IndexSet& s)
+{
+  if (empty(o)) return 0;
+  long bits = long(ceil(context.logOfProduct(o)/log(2.0)));
+  long words = (bits + NTL_BITS_PER_LONG-1) / NTL_BITS_PER_LONG;
+  return (unsigned long) context.zMStar.getPhiM() * words * card(s);
+}
+
+// The NTTs of matching the index set s of *this with the index set o of
+// the other operand.
+static void countDryRunMatch(const FHEcontext& context, const IndexSet& s,
+                             const IndexSet& o, bool matchIndexSets)
+{
+  IndexSet s1 = s;
+  if (matchIndexSets && !(s >= o)) { // addPrimes on *this
+    countDryRunNTTs(context, s, true);
+    countDryRunNTTs(context, o / s, false);
+    s1 = s | o;
+  }
+  if (!(s1 <= o)) {                  // addPrimes on a copy of the other
+    countDryRunNTTs(context, o, true);
+    countDryRunNTTs(context, s1 / o, false);
+  }
+}
+
 // Generic operation, Fnc is AddMod, SubMod, or MulMod (from NTL's ZZ module)
 template<class Fun>
 DoubleCRT& DoubleCRT::Op(const DoubleCRT &other, Fun fun,
 			 bool matchIndexSets)
 {
-  if (isDryRun()) return *this;
+  FHE_COUNT(fun.counter(), card(matchIndexSets?
+                (map.getIndexSet() | other.map.getIndexSet()) : map.getIndexSet()));
+  if (isDryRun()) {
+    if (areCountersOn())
+      countDryRunMatch(context, map.getIndexSet(), other.map.getIndexSet(),
+                       matchIndexSets);
+    return *this;
+  }
 
   if (&context != &other.context)
     Error("DoubleCRT::Op: incompatible objects");
@@ -159,7 +322,14 @@ DoubleCRT& DoubleCRT::do_mul(const DoubleCRT &other,
 {
   FHE_TIMER_START;
 
-  if (isDryRun()) return *this;
+  FHE_COUNT(FHE_CNT_DCRT_MUL, card(matchIndexSets?
+                (map.getIndexSet() | other.map.getIndexSet()) : map.getIndexSet()));
+  if (isDryRun()) {
+    if (areCountersOn())
+      countDryRunMatch(context, map.getIndexSet(), other.map.getIndexSet(),
+                       matchIndexSets);
+    return *this;
+  }
 
   if (&context != &other.context)
     Error("DoubleCRT::Op: incompatible objects");
@@ -215,6 +385,7 @@ DoubleCRT& DoubleCRT::Op<DoubleCRT::SubFun>(const DoubleCRT &other, SubFun fun,
 template<class Fun>
 DoubleCRT& DoubleCRT::Op(const ZZ &num, Fun fun)
 {
+  FHE_COUNT(FHE_CNT_DCRT_ADD, card(map.getIndexSet()));
   if (isDryRun()) return *this;
 
   const IndexSet& s = map.getIndexSet();
@@ -241,6 +412,7 @@ DoubleCRT& DoubleCRT::Op<DoubleCRT::SubFun>(const ZZ &num, SubFun fun);
 
 DoubleCRT& DoubleCRT::Negate(const DoubleCRT& other)
 {
+  FHE_COUNT(FHE_CNT_DCRT_ADD, card(other.map.getIndexSet()));
   if (isDryRun()) return *this;
 
   if (&context != &other.context) 
@@ -264,7 +436,12 @@ DoubleCRT& DoubleCRT::Negate(const DoubleCRT& other)
 template<class Fun>
 DoubleCRT& DoubleCRT::Op(const ZZX &poly, Fun fun)
 {
-  if (isDryRun()) return *this;
+  if (isDryRun()) { // the conversion of poly, then Op(other, fun)
+    FHE_COUNT(FHE_CNT_ZZX_REDUCE_WORDS, reduceWords(poly, map.getIndexSet()));
+    countDryRunNTTs(context, map.getIndexSet(), false);
+    FHE_COUNT(fun.counter(), card(map.getIndexSet()));
+    return *this;
+  }
 
   const IndexSet& s = map.getIndexSet();
   DoubleCRT other(poly, context, s); // other defined wrt same primes as *this
@@ -289,7 +466,22 @@ void DoubleCRT::breakIntoDigits(vector<DoubleCRT>& digits, long n) const
   assert(n <= (long)context.digits.size());
 
   digits.resize(n, DoubleCRT(context, IndexSet::emptySet()));
-  if (isDryRun()) return;
+  if (isDryRun()) {
+    // The digits are allocated as they would be in the real computation,
+    // and the NTTs of the loops below are counted
+    for (long i=0; i<(long)digits.size(); i++) {
+      IndexSet digitPrimes = getIndexSet() & context.digits[i];
+      long inDigit = card(digitPrimes);
+      countDryRunNTTs(context, digitPrimes, true);
+      countDryRunNTTs(context, allPrimes / digitPrimes, false);
+      FHE_COUNT(FHE_CNT_ZZX_REDUCE_WORDS,
+                crtReduceWords(context, digitPrimes, allPrimes / digitPrimes));
+      FHE_COUNT(FHE_CNT_DCRT_ADD, 2*inDigit*i); // the Sub and /= by the
+                                                 // previous digits
+      digits[i].map.insert(allPrimes);
+    }
+    return;
+  }
 
   for (long i=0; i<(long)digits.size(); i++) {
     digits[i]=*this;
@@ -324,7 +516,12 @@ void DoubleCRT::addPrimes(const IndexSet& s1)
   toPoly(poly); // recover in coefficient representation
 
   map.insert(s1);  // add new rows to the map
-  if (isDryRun()) return;
+  if (isDryRun()) {
+    FHE_COUNT(FHE_CNT_ZZX_REDUCE_WORDS,
+              crtReduceWords(context, map.getIndexSet() / s1, s1));
+    countDryRunNTTs(context, s1, false);
+    return;
+  }
 
   // fill in new rows
   FFT(poly, s1);
@@ -336,6 +533,7 @@ double DoubleCRT::addPrimesAndScale(const IndexSet& s1)
 {
   if (empty(s1)) return 0.0; // nothing to do
   assert(empty(s1 & map.getIndexSet())); // s1 is disjoint from *this
+  FHE_COUNT(FHE_CNT_DCRT_ADD, card(map.getIndexSet()));
 
   // compute factor to scale existing rows
   ZZ factor = to_ZZ(1);
@@ -379,7 +577,11 @@ DoubleCRT::DoubleCRT(const ZZX& poly, const FHEcontext &_context, const IndexSet
   assert(s.last() < context.numPrimes());
 
   map.insert(s);
-  if (isDryRun()) return;
+  if (isDryRun()) {
+    FHE_COUNT(FHE_CNT_ZZX_REDUCE_WORDS, reduceWords(poly, s));
+    countDryRunNTTs(context, s, false);
+    return;
+  }
 
   // convert the integer polynomial to FFT representation modulo the primes
   FFT(poly, s);
@@ -393,7 +595,11 @@ DoubleCRT::DoubleCRT(const ZZX& poly, const FHEcontext &_context)
   // FIXME: maybe the default index set should be determined by context?
 
   map.insert(s);
-  if (isDryRun()) return;
+  if (isDryRun()) {
+    FHE_COUNT(FHE_CNT_ZZX_REDUCE_WORDS, reduceWords(poly, s));
+    countDryRunNTTs(context, s, false);
+    return;
+  }
 
   // convert the integer polynomial to FFT representation modulo the primes
   FFT(poly, s);
@@ -407,7 +613,11 @@ DoubleCRT::DoubleCRT(const ZZX& poly)
   // FIXME: maybe the default index set should be determined by context?
 
   map.insert(s);
-  if (isDryRun()) return;
+  if (isDryRun()) {
+    FHE_COUNT(FHE_CNT_ZZX_REDUCE_WORDS, reduceWords(poly, s));
+    countDryRunNTTs(context, s, false);
+    return;
+  }
 
   // convert the integer polynomial to FFT representation modulo the primes
   FFT(poly, s);
@@ -424,7 +634,10 @@ DoubleCRT::DoubleCRT(const zzX& poly, const FHEcontext &_context, const IndexSet
   assert(s.last() < context.numPrimes());
 
   map.insert(s);
-  if (isDryRun()) return;
+  if (isDryRun()) {
+    countDryRunNTTs(context, s, false);
+    return;
+  }
 
   // convert the integer polynomial to FFT representation modulo the primes
   FFT(poly, s);
@@ -438,7 +651,10 @@ DoubleCRT::DoubleCRT(const zzX& poly, const FHEcontext &_context)
   // FIXME: maybe the default index set should be determined by context?
 
   map.insert(s);
-  if (isDryRun()) return;
+  if (isDryRun()) {
+    countDryRunNTTs(context, s, false);
+    return;
+  }
 
   // convert the integer polynomial to FFT representation modulo the primes
   FFT(poly, s);
@@ -452,7 +668,10 @@ DoubleCRT::DoubleCRT(const zzX& poly)
   // FIXME: maybe the default index set should be determined by context?
 
   map.insert(s);
-  if (isDryRun()) return;
+  if (isDryRun()) {
+    countDryRunNTTs(context, s, false);
+    return;
+  }
 
   // convert the integer polynomial to FFT representation modulo the primes
   FFT(poly, s);
@@ -501,6 +720,10 @@ DoubleCRT& DoubleCRT::operator=(const DoubleCRT& other)
    if (&context != &other.context) 
       Error("DoubleCRT assignment: incompatible contexts");
 
+   FHE_COUNT(FHE_CNT_DCRT_COPY, 1);
+   FHE_COUNT(FHE_CNT_DCRT_COPY_BYTES,
+             card(other.map.getIndexSet())*context.zMStar.getPhiM()*sizeof(long));
+
    if (map.getIndexSet() != other.map.getIndexSet()) {
       map = other.map; // copy the data
    }
@@ -520,9 +743,25 @@ DoubleCRT& DoubleCRT::operator=(const DoubleCRT& other)
 
 DoubleCRT& DoubleCRT::operator=(const ZZX&poly)
 {
-  if (isDryRun()) return *this;
+  const IndexSet& s = map.getIndexSet();
+  if (isDryRun()) {
+    FHE_COUNT(FHE_CNT_ZZX_REDUCE_WORDS, reduceWords(poly, s));
+    countDryRunNTTs(context, s, false);
+    return *this;
+  }
 
+  FFT(poly, s);
+
+  return *this;
+}
+
+DoubleCRT& DoubleCRT::operator=(const zzX&poly)
+{
   const IndexSet& s = map.getIndexSet();
+  if (isDryRun()) {
+    countDryRunNTTs(context, s, false);
+    return *this;
+  }
 
   FFT(poly, s);
 
@@ -586,7 +825,11 @@ void DoubleCRT::toPoly(ZZX& poly, const IndexSet& s,
 		       bool positive) const
 {
   FHE_TIMER_START;
-  if (isDryRun()) return;
+  FHE_COUNT(FHE_CNT_CRT_ROWS, card(map.getIndexSet() & s));
+  if (isDryRun()) {
+    countDryRunNTTs(context, map.getIndexSet() & s, true);
+    return;
+  }
 
   IndexSet s1 = map.getIndexSet() & s;
 
@@ -599,32 +842,22 @@ void DoubleCRT::toPoly(ZZX& poly, const IndexSet& s,
   static thread_local Vec<long> tls_ivec;
   static thread_local Vec<long> tls_pvec;
   static thread_local Vec< Vec<long> > tls_remtab;
-  static thread_local Vec<zz_pX> tls_tmpvec;
 
   Vec<long>& ivec = tls_ivec;
   Vec<long>& pvec = tls_pvec;
   Vec< Vec<long> >& remtab = tls_remtab;
-  Vec<zz_pX>& tmpvec = tls_tmpvec;
 
   long phim = context.zMStar.getPhiM();
   long icard = MakeIndexVector(s1, ivec);
 
-  PartitionInfo pinfo(icard);
-  long cnt = pinfo.NumIntervals();
-
   remtab.SetLength(phim);
   for (long h = 0; h < phim; h++) remtab[h].SetLength(icard);
 
-  tmpvec.SetLength(cnt);
-  for (long i = 0; i < cnt; i++) tmpvec[i].SetMaxLength(phim);
-
   { FHE_NTIMER_START(toPoly_FFT);
   
-  NTL_EXEC_INDEX(cnt, index)
-      long first, last;
-      pinfo.interval(first, last, index);
-
-      zz_pX& tmp = tmpvec[index];
+  FHE_EXEC_RANGE(icard, first, last)
+      zz_pX tmp;
+      tmp.SetMaxLength(phim);
   
       for (long j = first; j < last; j++) {
         long i = ivec[j];
@@ -634,15 +867,12 @@ void DoubleCRT::toPoly(ZZX& poly, const IndexSet& s,
         for (long h = 0; h <= d; h++) remtab[h][j] = rep(tmp.rep[h]);
         for (long h = d+1; h < phim; h++) remtab[h][j] = 0;
       }
-  NTL_EXEC_INDEX_END
+  FHE_EXEC_RANGE_END
 
   }
 
   {FHE_NTIMER_START(toPoly_CRT);
 
-  PartitionInfo pinfo1(phim);
-  long cnt1 = pinfo1.NumIntervals();
-
   static thread_local ZZ tls_prod;
   static thread_local ZZ tls_prod_half;
   static thread_local Vec<long> tls_qvec;
@@ -703,11 +933,7 @@ void DoubleCRT::toPoly(ZZX& poly, const IndexSet& s,
     div(prod_half, prod_half, 2);
   }
   
-  NTL_EXEC_INDEX(cnt1, index)
-  NTL_IMPORT(icard)
-      long first, last;
-      pinfo1.interval(first, last, index);
-
+  FHE_EXEC_RANGE(phim, first, last)
       long *qvecp = qvec.elts();
       double *qrecipvecp = qrecipvec.elts();
       long *tvecp = tvec.elts();
@@ -740,7 +966,7 @@ void DoubleCRT::toPoly(ZZX& poly, const IndexSet& s,
           tmp -= prod;
         resvec[h] = tmp;
       }
-  NTL_EXEC_INDEX_END
+  FHE_EXEC_RANGE_END
 
   poly.SetLength(phim);
   for (long j = 0; j < phim; j++) poly[j] = resvec[j];
@@ -764,6 +990,7 @@ void DoubleCRT::toPoly(ZZX& p, bool positive) const
 // Division by constant
 DoubleCRT& DoubleCRT::operator/=(const ZZ &num)
 {
+  FHE_COUNT(FHE_CNT_DCRT_ADD, card(map.getIndexSet()));
   if (isDryRun()) return *this;
 
   const IndexSet& s = map.getIndexSet();
@@ -783,6 +1010,7 @@ DoubleCRT& DoubleCRT::operator/=(const ZZ &num)
 // Small-exponent polynomial exponentiation
 void DoubleCRT::Exp(long e)
 {
+  FHE_COUNT(FHE_CNT_DCRT_MUL, card(map.getIndexSet()));
   if (isDryRun()) return;
 
   const IndexSet& s = map.getIndexSet();
@@ -801,6 +1029,7 @@ void DoubleCRT::Exp(long e)
 // Apply the automorphism F(X) --> F(X^k)  (with gcd(k,m)=1)
 void DoubleCRT::automorph(long k)
 {
+  FHE_COUNT(FHE_CNT_DCRT_AUTOMORPH, card(map.getIndexSet()));
   if (isDryRun()) return;
 
   const PAlgebra& zMStar = context.zMStar;
@@ -851,6 +1080,7 @@ void DoubleCRT::automorph(long k)
 // Apply the automorphism F(X) --> F(X^k)  (with gcd(k,m)=1)
 void DoubleCRT::automorph(long k)
 {
+  FHE_COUNT(FHE_CNT_DCRT_AUTOMORPH, card(map.getIndexSet()));
   if (isDryRun()) return;
 
   const PAlgebra& zMStar = context.zMStar;
@@ -885,100 +1115,134 @@ void DoubleCRT::automorph(long k)
 
 #endif
 
-// fills each row i with random integers mod pi
-void DoubleCRT::randomize(const ZZ* seed) 
+// Fills row with random integers mod pi, by rejection sampling over
+// the bytes of stream
+static void randomRow(vec_long& row, long pi, long phim, RandomStream& stream)
 {
-  FHE_TIMER_START;
-
-  if (isDryRun()) return;
-
-  if (seed != NULL) SetSeed(*seed);
-
-  const IndexSet& s = map.getIndexSet();
-  long phim = context.zMStar.getPhiM();
-
-  RandomStream& stream = GetCurrentRandomStream();
   const long bufsz = 2048;
+  unsigned char buf[bufsz];
 
-  Vec<unsigned char> buf_storage;
-  buf_storage.SetLength(bufsz);
-
-  unsigned char *buf = buf_storage.elts();
+  long k = NumBits(pi-1);
+  long nb = (k+7)/8;
+  unsigned long mask = (1UL << k) - 1UL;
 
-  for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-    long pi = context.ithPrime(i);
-    long k = NumBits(pi-1);
-    long nb = (k+7)/8;
-    unsigned long mask = (1UL << k) - 1UL;
+  row.SetLength(phim);
+  long j = 0;
 
-    vec_long& row = map[i];
-    long j = 0;
-    
-    for (;;) {
-      { FHE_NTIMER_START(randomize_stream);
-      stream.get(buf, bufsz);
-      }
+  for (;;) {
+    { FHE_NTIMER_START(randomize_stream);
+    stream.get(buf, bufsz);
+    }
+    FHE_COUNT(FHE_CNT_PRG_BYTES, bufsz);
 
-      for (long pos = 0; pos <= bufsz-nb; pos += nb) {
+    for (long pos = 0; pos <= bufsz-nb; pos += nb) {
 #if 0
-        unsigned long utmp = 0;
-        for (long cnt = nb-1;  cnt >= 0; cnt--)
-          utmp = (utmp << 8) | buf[pos+cnt]; 
+      unsigned long utmp = 0;
+      for (long cnt = nb-1;  cnt >= 0; cnt--)
+        utmp = (utmp << 8) | buf[pos+cnt]; 
 #elif 0
 
-        // "Duff's device" to avoid loops
-        // It's a bit faster...but not much
-       
-        unsigned long utmp = buf[pos+nb-1];
-        switch (nb) {
-        case 8: utmp = (utmp << 8) | buf[pos+6];
-        case 7: utmp = (utmp << 8) | buf[pos+5];
-        case 6: utmp = (utmp << 8) | buf[pos+4];
-        case 5: utmp = (utmp << 8) | buf[pos+3];
-        case 4: utmp = (utmp << 8) | buf[pos+2];
-        case 3: utmp = (utmp << 8) | buf[pos+1];
-        case 2: utmp = (utmp << 8) | buf[pos+0];
-        }
+      // "Duff's device" to avoid loops
+      // It's a bit faster...but not much
+     
+      unsigned long utmp = buf[pos+nb-1];
+      switch (nb) {
+      case 8: utmp = (utmp << 8) | buf[pos+6];
+      case 7: utmp = (utmp << 8) | buf[pos+5];
+      case 6: utmp = (utmp << 8) | buf[pos+4];
+      case 5: utmp = (utmp << 8) | buf[pos+3];
+      case 4: utmp = (utmp << 8) | buf[pos+2];
+      case 3: utmp = (utmp << 8) | buf[pos+1];
+      case 2: utmp = (utmp << 8) | buf[pos+0];
+      }
 
 #else
-        unsigned long utmp = buf[pos+nb-1];
-
-        {
-
-        // This is gcc non-standard. Works also on clang and icc.
-        
-        static void *dispatch_table[] =
-           { &&L0, &&L1, &&L2, &&L3, &&L4, &&L5, &&L6, &&L7, &&L8 };
-
-        goto *dispatch_table[nb];
-   
-
-        L8: utmp = (utmp << 8) | buf[pos+6];
-        L7: utmp = (utmp << 8) | buf[pos+5];
-        L6: utmp = (utmp << 8) | buf[pos+4];
-        L5: utmp = (utmp << 8) | buf[pos+3];
-        L4: utmp = (utmp << 8) | buf[pos+2];
-        L3: utmp = (utmp << 8) | buf[pos+1];
-        L2: utmp = (utmp << 8) | buf[pos+0];
-        L1: ;
-        L0: ;
-        }
+      unsigned long utmp = buf[pos+nb-1];
+
+      {
+
+      // This is gcc non-standard. Works also on clang and icc.
+      
+      static void *dispatch_table[] =
+         { &&L0, &&L1, &&L2, &&L3, &&L4, &&L5, &&L6, &&L7, &&L8 };
+
+      goto *dispatch_table[nb];
+ 
+
+      L8: utmp = (utmp << 8) | buf[pos+6];
+      L7: utmp = (utmp << 8) | buf[pos+5];
+      L6: utmp = (utmp << 8) | buf[pos+4];
+      L5: utmp = (utmp << 8) | buf[pos+3];
+      L4: utmp = (utmp << 8) | buf[pos+2];
+      L3: utmp = (utmp << 8) | buf[pos+1];
+      L2: utmp = (utmp << 8) | buf[pos+0];
+      L1: ;
+      L0: ;
+      }
 
 #endif
 
-        utmp = (utmp & mask);
-        
-        long tmp = utmp;
+      utmp = (utmp & mask);
+      
+      long tmp = utmp;
 
-        row[j] = tmp;
-        j += (tmp < pi);
-        if (j >= phim) break;
-      }
+      row[j] = tmp;
+      j += (tmp < pi);
       if (j >= phim) break;
     }
+    if (j >= phim) break;
   }
 }
 
+// fills each row i with random integers mod pi
+void DoubleCRT::randomize(const ZZ* seed) 
+{
+  FHE_TIMER_START;
+
+  if (isDryRun()) return;
+
+  if (seed != NULL) SetSeed(*seed);
+
+  // Takes a fresh seed from NTL's PRG, so that subsequent calls with the
+  // same initial state give the same sequence of objects
+  ZZ rowSeed;
+  RandomBits(rowSeed, 256);
+  randomize(rowSeed, 0);
+}
+
+// Row i is generated by a ChaCha stream, keyed by a hash of (seed,index,i)
+void DoubleCRT::randomize(const ZZ& seed, long index)
+{
+  FHE_TIMER_START;
+  assert(index >= 0);
+
+  if (isDryRun()) return;
+
+  const IndexSet& s = map.getIndexSet();
+  long phim = context.zMStar.getPhiM();
+
+  Vec<long> ivec;
+  long icard = MakeIndexVector(s, ivec);
+
+  long nSeed = NumBytes(seed);
+  Vec<unsigned char> data(INIT_SIZE, nSeed + 16);
+  BytesFromZZ(data.elts(), seed, nSeed);
+  for (long b = 0; b < 8; b++)
+    data[nSeed+b] = (unsigned long)(index) >> (8*b);
+
+  FHE_EXEC_RANGE(icard, first, last)
+      Vec<unsigned char> rowData(data);
+      unsigned char key[NTL_PRG_KEYLEN];
+      for (long j = first; j < last; j++) {
+        long i = ivec[j];
+        for (long b = 0; b < 8; b++)
+          rowData[nSeed+8+b] = (unsigned long)(i) >> (8*b);
+        DeriveKey(key, NTL_PRG_KEYLEN, rowData.elts(), rowData.length());
+        RandomStream stream(key);
+        randomRow(map[i], context.ithPrime(i), phim, stream);
+      }
+  FHE_EXEC_RANGE_END
+}
 
 void DoubleCRT::scaleDownToSet(const IndexSet& s, long ptxtSpace)
 {
@@ -990,6 +1254,9 @@ void DoubleCRT::scaleDownToSet(const IndexSet& s, long ptxtSpace)
 
   if (isDryRun()) {
     removePrimes(diff);// remove the primes from consideration
+    countDryRunNTTs(context, diff, true); // the toPoly, -= and /= below
+    countDryRunNTTs(context, getIndexSet(), false);
+    FHE_COUNT(FHE_CNT_DCRT_ADD, 2*card(getIndexSet()));
     return;
   }
 
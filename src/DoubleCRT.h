@@ -20,6 +20,7 @@
 #include "IndexMap.h"
 #include "FHEContext.h"
 #include "timing.h"
+#include "counters.h"
 
 /**
 * @class DoubleCRTHelper
@@ -30,6 +31,7 @@
 class DoubleCRTHelper : public IndexMapInit<vec_long> {
 private: 
   long val;
+  IndexSet tracked; // the rows that are counted by trackDCRTrows
 
 public:
   DoubleCRTHelper(const FHEcontext& context) { 
@@ -39,11 +41,30 @@ public:
   /** @brief the init method ensures that all rows have the same size */
   virtual void init(vec_long& v) { 
     v.FixLength(val); 
+    FHE_COUNT(FHE_CNT_DCRT_ROWS, 1);
+    FHE_COUNT(FHE_CNT_DCRT_ALLOC_BYTES, val*sizeof(long));
+  }
+
+  // only the rows that were allocated while the counters were on are
+  // tracked, and only their release is subtracted from the gauge
+  virtual void inserted(vec_long&, long j) {
+    if (areCountersOn()) { tracked.insert(j); trackDCRTrows(1); }
+  }
+
+  virtual void release(vec_long&, long j) {
+    if (tracked.contains(j)) { tracked.remove(j); trackDCRTrows(-1); }
   }
 
   /** @brief clone allocates a new object and copies the content */
   virtual IndexMapInit<vec_long> * clone() const { 
-    return new DoubleCRTHelper(*this); 
+    DoubleCRTHelper *h = new DoubleCRTHelper(*this); 
+    if (areCountersOn()) trackDCRTrows(card(tracked)); // copied rows too
+    else                 h->tracked.clear();
+    return h;
+  }
+
+  virtual ~DoubleCRTHelper() {
+    if (!empty(tracked)) trackDCRTrows(-card(tracked));
   }
 private:
   DoubleCRTHelper(); // disable default constructor
@@ -88,16 +109,19 @@ class DoubleCRT {
   class AddFun {
   public:
     long apply(long a, long b, long n) { return AddMod(a, b, n); }
+    static FHEcounterId counter() { return FHE_CNT_DCRT_ADD; } // counts the rows
   };
 
   class SubFun {
   public:
     long apply(long a, long b, long n) { return SubMod(a, b, n); }
+    static FHEcounterId counter() { return FHE_CNT_DCRT_ADD; } // counts the rows
   };
 
   class MulFun {
   public:
     long apply(long a, long b, long n) { return MulMod(a, b, n); }
+    static FHEcounterId counter() { return FHE_CNT_DCRT_MUL; } // counts the rows
   };
 
 
@@ -123,7 +147,13 @@ public:
   // the context. If the coefficients of poly are larger than the product of
   // the used primes, they are effectively reduced modulo that product
 
-  // copy constructor: default
+  //! @brief Copy constructor, same as the default one but also counted
+  DoubleCRT(const DoubleCRT& other) : context(other.context), map(other.map)
+  {
+    FHE_COUNT(FHE_CNT_DCRT_COPY, 1);
+    FHE_COUNT(FHE_CNT_DCRT_COPY_BYTES,
+      card(map.getIndexSet())*context.zMStar.getPhiM()*sizeof(long));
+  }
 
   //! @brief Initializing DoubleCRT from a ZZX polynomial
   //! @param poly The ring element itself, zero if not specified
@@ -160,6 +190,7 @@ public:
   //  void partialCopy(const DoubleCRT& other, const IndexSet& s);
 
   DoubleCRT& operator=(const ZZX& poly);
+  DoubleCRT& operator=(const zzX& poly);
   DoubleCRT& operator=(const ZZ& num);
   DoubleCRT& operator=(const long num) { *this = to_ZZ(num); return *this; }
 
@@ -330,19 +361,28 @@ public:
   // Choose random DoubleCRT's, either at random or with small/Gaussian
   // coefficients. 
 
-  //! @brief Fills each row i with random ints mod pi, uses NTL's PRG
+  //! @brief Fills each row i with random ints mod pi, seeded by NTL's PRG
   void randomize(const ZZ* seed=NULL);
 
+  //! @brief Fills each row i with random ints mod pi, from a PRG stream
+  //! that depends only on (seed, index, i). The rows are generated in
+  //! parallel, and the result does not depend on the number of threads or
+  //! on which other primes are in the index set. NTL's PRG is not used.
+  void randomize(const ZZ& seed, long index);
+
+  // The samplers below draw the coefficients into a zzX, which is
+  // reduced mod each prime with a conditional add and then FFTed
+
   //! @brief Coefficients are -1/0/1, Prob[0]=1/2
   void sampleSmall() {
-    ZZX poly; 
+    zzX poly;
     ::sampleSmall(poly,context.zMStar.getPhiM()); // degree-(phi(m)-1) polynomial
     *this = poly; // convert to DoubleCRT
   }
 
   //! @brief Coefficients are -1/0/1 with pre-specified number of nonzeros
   void sampleHWt(long Hwt) {
-    ZZX poly; 
+    zzX poly;
     ::sampleHWt(poly,Hwt,context.zMStar.getPhiM());
     *this = poly; // convert to DoubleCRT
   }
@@ -350,16 +390,23 @@ public:
   //! @brief Coefficients are Gaussians
   void sampleGaussian(double stdev=0.0) {
     if (stdev==0.0) stdev=to_double(context.stdev); 
-    ZZX poly; 
+    zzX poly;
     ::sampleGaussian(poly, context.zMStar.getPhiM(), stdev);
     *this = poly; // convert to DoubleCRT
   }
 
   //! @brief Coefficients are uniform in [-B..B]
   void sampleUniform(const ZZ& B) {
-    ZZX poly;
-    ::sampleUniform(poly, B, context.zMStar.getPhiM());
-    *this = poly;
+    if (B < NTL_SP_BOUND) {
+      zzX poly;
+      ::sampleUniform(poly, conv<long>(B), context.zMStar.getPhiM());
+      *this = poly;
+    }
+    else { // too large for a zzX
+      ZZX poly;
+      ::sampleUniform(poly, B, context.zMStar.getPhiM());
+      *this = poly;
+    }
   }
 
 
@@ -15,8 +15,11 @@
 #include "EncryptedArray.h"
 
 #include <algorithm>
+#include <NTL/BasicThreadPool.h>
+#include "multicore.h"
 #include "timing.h"
 #include "cloned_ptr.h"
+#include "matmul.h"
 
 
 
@@ -530,12 +533,12 @@ void runningSums(const EncryptedArray& ea, Ctxt& ctxt)
   }
 }
 
-void totalSums(const EncryptedArray& ea, Ctxt& ctxt)
+// The usual totalSums, using O(log n) rotations where each rotation
+// depends on the result of the previous one
+static void totalSumsByDoubling(const EncryptedArray& ea, Ctxt& ctxt)
 {
   long n = ea.size();
 
-  if (n == 1) return;
-
   Ctxt orig = ctxt;
 
   long k = NumBits(n);
@@ -559,6 +562,133 @@ void totalSums(const EncryptedArray& ea, Ctxt& ctxt)
   }
 }
 
+// Set ctxt = ctxt + sum_j rho_{autos[j]}(ctxt), where precon was built
+// for ctxt. The automorphisms are key-switched in parallel and summed while
+// still defined relative to the special primes, then the sum is
+// mod-switched down once. On input, sum may already hold some terms
+// computed from precon (or be empty).
+static void hoistedSum(Ctxt& ctxt, const BasicAutomorphPrecon& precon,
+                       const vector<long>& autos, Ctxt& sum)
+{
+  if (!autos.empty()) {
+    PartitionInfo pinfo(lsize(autos), numFHEthreads());
+    long cnt = pinfo.NumIntervals();
+    vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
+
+    // parallel for loop: j in [0..autos.size())
+    FHE_EXEC_INDEX(cnt, index)
+      long first, last;
+      pinfo.interval(first, last, index);
+      for (long j = first; j < last; j++)
+        acc[index] += *precon.automorph(autos[j]);
+    FHE_EXEC_INDEX_END
+
+    for (long i = 0; i < cnt; i++) sum += acc[i];
+  }
+  if (sum.isEmpty()) return;
+  sum.cleanUp();
+  ctxt += sum;
+}
+
+// Summing all the rotations along a native dimension of order n=A*B is
+// done in baby steps and giant steps:
+//     sum_{j<n} rho^j(c) = sum_{a<A} rho^{aB}( sum_{b<B} rho^b(c) ),
+// where each of the two sums is hoisted. Here B is the largest divisor of
+// n which is at most sqrt(n). The non-trivial automorphisms of each step
+// are added to steps, but only if the key has a key-switching matrix for
+// each of them, else returns false.
+static bool bsgsSumSteps(vector< vector<long> >& steps, const PAlgebra& al,
+                         long dim, const FHEPubKey& pk, long keyID)
+{
+  long n = al.OrderOf(dim);
+  long B = 1;
+  for (long b = 2; b*b <= n; b++)
+    if (n % b == 0) B = b;
+  long A = n / B;
+
+  vector<long> baby, giant;
+  for (long b = 1; b < B; b++) baby.push_back(al.genToPow(dim, b));
+  for (long a = 1; a < A; a++) giant.push_back(al.genToPow(dim, a*B));
+
+  for (long k : baby)
+    if (!pk.haveKeySWmatrix(1, k, keyID, keyID)) return false;
+  for (long k : giant)
+    if (!pk.haveKeySWmatrix(1, k, keyID, keyID)) return false;
+
+  if (!baby.empty()) steps.push_back(baby);
+  if (!giant.empty()) steps.push_back(giant);
+  return true;
+}
+
+// If all the dimensions are native and the key has all the matrices for
+// the baby steps and giant steps, then totalSums may be computed one
+// dimension at a time using hoisted rotations. Whether that is faster than
+// the O(log n) dependent rotations depends on the ratio between the cost
+// of decomposing a ciphertext into digits and that of key-switching the
+// digits. Both are estimated from the shape of the ciphertext, in units of
+// one element-wise operation on a row: the decomposition does an inverse
+// NTT of each row of the ciphertext and an NTT of each row of each digit
+// (about log(phi(m)) operations per row), while the key-switching of an
+// automorphism permutes each row of each digit and multiplies it by the
+// two rows of the key-switching matrix. The estimate does not depend on
+// the machine or on the load, so the same input always takes the same path.
+void totalSums(const EncryptedArray& ea, Ctxt& ctxt, TotalSumsMethod method)
+{
+  FHE_TIMER_START;
+  long n = ea.size();
+
+  if (n == 1) return;
+
+  const PAlgebra& al = ea.getPAlgebra();
+  long nDims = al.numOfGens();
+  vector< vector<long> > steps;
+  bool hoisted = (method != TOTALSUMS_DOUBLING) && !ctxt.isEmpty();
+  for (long i = 0; i < nDims && hoisted; i++)
+    hoisted = al.SameOrd(i)
+      && bsgsSumSteps(steps, al, i, ctxt.getPubKey(), ctxt.getKeyID());
+
+  if (method == TOTALSUMS_HOISTED && !ctxt.isEmpty() && !hoisted)
+    Error("totalSums: the hoisted method needs native dimensions and the "
+          "key-switching matrices of the baby steps and giant steps");
+
+  if (!hoisted || steps.empty()) {
+    totalSumsByDoubling(ea, ctxt);
+    return;
+  }
+
+  if (method == TOTALSUMS_AUTO) {
+    // Predict the cost of both methods. Each of the rotations of the
+    // doubling method is a full automorphism, and a rotation in a cube
+    // with d dimensions takes about 2d-1 automorphisms.
+    const FHEcontext& context = ctxt.getContext();
+    long nRows = card(ctxt.getPrimeSet());
+    long nDigitRows = nRows + card(context.specialPrimes);
+    long nDigits = 0;
+    for (long i = 0; i < lsize(context.digits); i++)
+      if (!empty(context.digits[i] & ctxt.getPrimeSet())) nDigits++;
+    long logPhim = NumBits(al.getPhiM());
+    double decomposeCost = double(nRows + nDigits*nDigitRows)*logPhim;
+    double keySwitchCost = 3.0*nDigits*nDigitRows;
+
+    long nAutos = 0;
+    for (long i = 0; i < lsize(steps); i++) nAutos += lsize(steps[i]);
+    long nRotations = (NumBits(n)-1) + (weight(n)-1);
+    double doublingCost
+      = nRotations*(2*nDims-1)*(decomposeCost+keySwitchCost);
+    double hoistedCost = lsize(steps)*decomposeCost + nAutos*keySwitchCost;
+    if (hoistedCost >= doublingCost) {
+      totalSumsByDoubling(ea, ctxt);
+      return;
+    }
+  }
+
+  for (long i = 0; i < lsize(steps); i++) {
+    BasicAutomorphPrecon precon(ctxt);
+    Ctxt sum(ZeroCtxtLike, ctxt);
+    hoistedSum(ctxt, precon, steps[i], sum);
+  }
+}
+
 
 
 
@@ -662,24 +792,64 @@ void applyLinPolyMany(const EncryptedArray& ea, Ctxt& ctxt,
   applyLinPolyLL(ctxt, encodedC, ea.getDegree());
 }
 
+// Can the constant multiply a ciphertext that is defined relative to the
+// primes in s? Polynomials are always converted to the primes as needed.
+static inline bool coversPrimes(const zzX&, const IndexSet&) { return true; }
+static inline bool coversPrimes(const ZZX&, const IndexSet&) { return true; }
+static inline bool coversPrimes(const DoubleCRT& c, const IndexSet& s)
+{ return c.getIndexSet().contains(s); }
+
 // A low-level variant: encodedCoeffs has all the linPoly coeffs encoded
 // in slots; different transformations can be encoded in different slots
+//
+// The d Frobenius maps are all of the same ciphertext, so they share one
+// decomposition into digits. The automorphed ciphertexts are multiplied by
+// their constants and summed while they are still defined relative to the
+// special primes, and the sum is mod-switched down only once. (If some
+// DoubleCRT constant is not defined relative to the special primes, then
+// each term is mod-switched down before it is multiplied.)
 template<class P>
 void applyLinPolyLL(Ctxt& ctxt, const vector<P>& encodedC, long d)
 {
+  FHE_TIMER_START;
   assert(d == lsize(encodedC));
 
   ctxt.cleanUp();  // not sure, but this may be a good idea
 
-  Ctxt tmp(ctxt);
+  if (d > 1 && !ctxt.isEmpty()) {
+    const FHEcontext& context = ctxt.getContext();
+    long m = context.zMStar.getM();
+    long p = context.zMStar.getP();
+
+    IndexSet s = ctxt.getPrimeSet() | context.specialPrimes;
+    bool lazy = true;
+    for (long j = 1; j < d; j++)
+      if (!coversPrimes(encodedC[j], s)) lazy = false;
+
+    BasicAutomorphPrecon precon(ctxt);
+    PartitionInfo pinfo(d-1, numFHEthreads());
+    long cnt = pinfo.NumIntervals();
+    vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
+
+    // parallel for loop: j in [1..d)
+    FHE_EXEC_INDEX(cnt, index)
+      long first, last;
+      pinfo.interval(first, last, index);
+      for (long j = first+1; j <= last; j++) {
+        shared_ptr<Ctxt> tmp = precon.automorph(PowerMod(p, j, m));
+        if (!lazy) tmp->cleanUp();
+        tmp->multByConstant(encodedC[j]);
+        acc[index] += *tmp;
+      }
+    FHE_EXEC_INDEX_END
+
+    for (long i = 1; i < cnt; i++) acc[0] += acc[i];
+    acc[0].cleanUp();
 
-  ctxt.multByConstant(encodedC[0]);
-  for (long j = 1; j < d; j++) {
-    Ctxt tmp1(tmp);
-    tmp1.frobeniusAutomorph(j);
-    tmp1.multByConstant(encodedC[j]);
-    ctxt += tmp1;
+    ctxt.multByConstant(encodedC[0]);
+    ctxt += acc[0];
   }
+  else ctxt.multByConstant(encodedC[0]);
 }
 template void applyLinPolyLL(Ctxt& ctxt, const vector<zzX>& encodedC, long d);
 template void applyLinPolyLL(Ctxt& ctxt, const vector<ZZX>& encodedC, long d);
@@ -594,11 +594,17 @@ EncryptedArrayBase* buildEncryptedArray(const FHEcontext& context,
 //! @class EncryptedArray
 //! @brief A simple wrapper for a smart pointer to an EncryptedArrayBase.
 //! This is the interface that higher-level code should use
+class IntraSlotConsts; // defined in intraSlot.cpp
+
 class EncryptedArray {
 private:
   const PAlgebraMod& alMod;
   cloned_ptr<EncryptedArrayBase> rep;
 
+  // The constants of unpack/repack as DoubleCRT objects, shared by copies
+  mutable std::shared_ptr<IntraSlotConsts> intraSlotConsts;
+  friend class IntraSlotConsts;
+
 public:
 
   //! constructor: G defaults to the monomial X, PAlgebraMod from context
@@ -617,6 +623,7 @@ public:
     if (this == &other) return *this;
     assert(&alMod== &other.alMod);
     rep = other.rep;
+    intraSlotConsts = other.intraSlotConsts;
     return *this;
   }
 
@@ -863,7 +870,16 @@ void runningSums(const EncryptedArray& ea, Ctxt& ctxt);
 
 //! @brief A ctxt that encrypts \f$(x_1, ..., x_n)\f$ is replaced by an
 //! encryption of \f$(y, ..., y)\$, where \f$y = sum_{j=1}^n x_j.\f$
-void totalSums(const EncryptedArray& ea, Ctxt& ctxt);
+//! When all the dimensions are native and the key-switching matrices are
+//! available, this may use hoisted baby-step/giant-step rotations along
+//! each dimension instead of O(log n) dependent rotations. With
+//! TOTALSUMS_AUTO the method that is predicted to be faster is used, the
+//! prediction only depends on the number of slots, the dimensions and the
+//! primes and digits of ctxt. The other two values force one method,
+//! forcing TOTALSUMS_HOISTED raises an error if it is not available.
+enum TotalSumsMethod { TOTALSUMS_AUTO, TOTALSUMS_DOUBLING, TOTALSUMS_HOISTED };
+void totalSums(const EncryptedArray& ea, Ctxt& ctxt,
+               TotalSumsMethod method=TOTALSUMS_AUTO);
 
 
 //! @brief Map all non-zero slots to 1, leaving zero slots as zero.
@@ -884,6 +900,40 @@ void incrementalZeroTest(Ctxt* res[], const EncryptedArray& ea,
 // Complexity: O(d + n log d) smart automorphisms
 //             O(n d) 
 
+/**
+ * @class ZeroTestPlan
+ * @brief A reusable incrementalZeroTest for a fixed number of prefixes
+ *
+ * The constructor computes the coefficients of the linearized polynomials
+ * that mask bits 0..i of every slot, for all i<n, and keeps them encoded
+ * as DoubleCRT objects. Applying the plan then only performs the
+ * homomorphic operations: the d Frobenius images of each input share a
+ * single decomposition into digits, and the inputs and prefixes are
+ * processed in parallel.
+ **/
+class ZeroTestPlan {
+  const EncryptedArray& ea;
+  long n;
+  vector< vector< shared_ptr<DoubleCRT> > > coeffs; // coeffs[i][j]
+
+  // Compute res[i] for i<n from the Frobenius images conj[j]=ctxt^{2^j}
+  void prefixTest(Ctxt& res, const vector<Ctxt>& conj, long i) const;
+
+public:
+  //! @param ea the EncryptedArray, must have p=2 and r=1
+  //! @param n  the number of prefixes to test, 0<n<=ea.getDegree()
+  ZeroTestPlan(const EncryptedArray& ea, long n);
+
+  long getNumPrefixes() const { return n; }
+
+  //! @brief Same as incrementalZeroTest(res, ea, ctxt, n)
+  void apply(Ctxt* res[], const Ctxt& ctxt) const;
+
+  //! @brief res[k][i] is the test of bits 0..i of ctxts[k], for all k
+  //! and all i<n. The output is resized as needed.
+  void apply(vector< vector<Ctxt> >& res, const vector<Ctxt>& ctxts) const;
+};
+
 /*************** End linear transformation functions ****************/
 /********************************************************************/
 
@@ -917,6 +967,10 @@ void applyLinPolyMany(const EncryptedArray& ea, Ctxt& ctxt,
 //! @brief a low-level variant:
 //! @param encodedCoeffs has all the linPoly coeffs encoded  in slots;
 //!        different transformations can be encoded in different slots
+//! The Frobenius maps share one decomposition of ctxt into digits, and are
+//! mod-switched down once after the products are summed. For that, DoubleCRT
+//! constants should be defined relative to all the primes, including the
+//! special ones (else each term is mod-switched down separately).
 template<class P>  // P can be ZZX or DoubleCRT
 void applyLinPolyLL(Ctxt& ctxt, const vector<P>& encodedC, long d);
 ///@}
@@ -14,6 +14,7 @@
 
 #include <queue> // used in the breadth-first search in setKeySwitchMap
 #include "timing.h"
+#include "counters.h"
 
 /******** Utility function to generate RLWE instances *********/
 
@@ -133,13 +134,8 @@ void KeySwitch::verify(FHESecKey& sk)
   vector<DoubleCRT> a;
   a.resize(n, DoubleCRT(context, allPrimes)); // defined modulo all primes
 
-  { RandomState state;
-
-    SetSeed(prgSeed);
-    for (long i = 0; i < n; i++)
-      a[i].randomize();
-
-  } // the RandomState destructor "restores the state" (see NumbTh.h)
+  for (long i = 0; i < n; i++)
+    a[i].randomize(prgSeed, i);
 
   vector<ZZX> A, B;
 
@@ -183,9 +179,15 @@ const KeySwitch& KeySwitch::dummy()
   return dummy;
 }
 
+// The format of serialized key-switching matrices. Version 2 streams
+// regenerate the a_i as DoubleCRT::randomize(prgSeed, i), which gives
+// different a_i than the single stream of the older format for the same
+// seed, so older streams (with no marker) cannot be read.
+static const char KS_FORMAT_MARKER[] = "KSv2";
+
 ostream& operator<<(ostream& str, const KeySwitch& matrix)
 {
-  str << "["<<matrix.fromKey  <<" "<<matrix.toKeyID
+  str << "["<<KS_FORMAT_MARKER<<" "<<matrix.fromKey  <<" "<<matrix.toKeyID
       << " "<<matrix.ptxtSpace<<" "<<matrix.b.size() << endl;
   for (long i=0; i<(long)matrix.b.size(); i++)
     str << matrix.b[i] << endl;
@@ -198,6 +200,14 @@ void KeySwitch::readMatrix(istream& str, const FHEcontext& context)
 {
   //  cerr << "KeySwitch[";
   seekPastChar(str,'['); // defined in NumbTh.cpp
+  str >> ws;
+  if (str.peek() == '[') // the old format starts with the handle
+    Error("KeySwitch::readMatrix: matrix was written in an older format, "
+          "the keys must be generated again");
+  string marker;
+  str >> marker;
+  if (marker != KS_FORMAT_MARKER)
+    Error("KeySwitch::readMatrix: unknown format");
   str >> fromKey;
   str >> toKeyID;
   str >> ptxtSpace;
@@ -263,9 +273,23 @@ void FHEPubKey::setKeySwitchMap(long keyId)
   }
 }
 
+const KeySwitch& FHEPubKey::localKSW(const KeySwitch& W, bool* isLocal) const
+{
+  // find the index of W in keySwitching, the dummy matrix is not there
+  std::less<const KeySwitch*> before;
+  const KeySwitch* first = keySwitching.data();
+  if (keySwitching.empty() || before(&W, first)
+      || !before(&W, first + keySwitching.size())) {
+    if (isLocal) *isLocal = true;
+    return W;
+  }
+  return ksReplicas.local(W, &W - first, isLocal);
+}
+
 const KeySwitch& FHEPubKey::getKeySWmatrix(const SKHandle& from, 
 					   long toIdx) const
 {
+  FHE_COUNT(FHE_CNT_KS_LOOKUP, 1);
   // First try to use the keySwitchMap
   if (from.getPowerOfS()==1 && from.getSecretKeyID()==toIdx 
                             && toIdx < (long)keySwitchMap.size()) {
@@ -286,6 +310,7 @@ const KeySwitch& FHEPubKey::getKeySWmatrix(const SKHandle& from,
 
 const KeySwitch& FHEPubKey::getAnyKeySWmatrix(const SKHandle& from) const
 {
+  FHE_COUNT(FHE_CNT_KS_LOOKUP, 1);
   // First try to use the keySwitchMap
   if (from.getPowerOfS()==1 && 
       from.getSecretKeyID() < (long)keySwitchMap.size()) {
@@ -502,6 +527,7 @@ istream& operator>>(istream& str, FHEPubKey& pk)
   pk.keySwitching.resize(nMatrices);
   for (long i=0; i<nMatrices; i++)  // read the matrix from input str
     pk.keySwitching[i].readMatrix(str, pk.getContext());
+  pk.ksReplicas.clear();
 
   // Get the key-switching map
   Vec< Vec<long> > vvl;
@@ -614,11 +640,8 @@ void FHESecKey::GenKeySWmatrix(long fromSPower, long fromXPower,
   vector<DoubleCRT> a; 
   a.resize(n, DoubleCRT(context));
 
-  { RandomState state;
-    SetSeed(ksMatrix.prgSeed);
-    for (long i = 0; i < n; i++) 
-      a[i].randomize();
-  } // restore state upon destruction of state
+  for (long i = 0; i < n; i++) // the same ai's as in Ctxt::keySwitchDigits
+    a[i].randomize(ksMatrix.prgSeed, i);
 
   // Record the plaintext space for this key-switching matrix
   if (p<2) {
@@ -648,6 +671,7 @@ void FHESecKey::GenKeySWmatrix(long fromSPower, long fromXPower,
 
   // Push the new matrix onto our list
   keySwitching.push_back(ksMatrix);
+  ksReplicas.clear();
 }
 
 // Decryption
@@ -20,6 +20,7 @@
 #include "DoubleCRT.h"
 #include "FHEContext.h"
 #include "Ctxt.h"
+#include "numa.h"
 
 /**
  * @class KeySwitch
@@ -105,7 +106,9 @@ public:
   //! A debugging method
   void verify(FHESecKey& sk);
 
-  //! @brief Read a key-switching matrix from input
+  //! @brief Read a key-switching matrix from input. The stream must have
+  //! been written by operator<< of this version, matrices written before
+  //! the a_i were derived per index from prgSeed raise an error.
   void readMatrix(istream& str, const FHEcontext& context);
 };
 ostream& operator<<(ostream& str, const KeySwitch& matrix);
@@ -148,6 +151,9 @@ class FHEPubKey { // The public key
   // use when re-linearizing s_i(X^n). 
   std::vector< std::vector<long> > keySwitchMap;
 
+  // Copies of the matrices in keySwitching on other NUMA nodes, see numa.h
+  NumaReplicas<KeySwitch> ksReplicas;
+
   NTL::Vec<int> KS_strategy; // NTL Vec's support I/O, which is
                              // more convenient
 
@@ -176,7 +182,7 @@ public:
 
   void clear() { // clear all public-key data
     pubEncrKey.clear(); skHwts.clear(); 
-    keySwitching.clear(); keySwitchMap.clear();
+    keySwitching.clear(); keySwitchMap.clear(); ksReplicas.clear();
     recryptKeyID=-1; recryptEkey.clear();
   }
 
@@ -213,6 +219,12 @@ public:
   bool haveAnyKeySWmatrix(const SKHandle& from) const
   { return getAnyKeySWmatrix(from).toKeyID >= 0; }
 
+  //! @brief The copy of W, one of the matrices above, on the NUMA node of
+  //! the calling thread (see numa.h). The lookups above return the master
+  //! copy, this is called where the matrix is used. If isLocal is not
+  //! NULL, it is set to whether that copy is on this node.
+  const KeySwitch& localKSW(const KeySwitch& W, bool* isLocal=NULL) const;
+
   //!@brief Get the next matrix to use for multi-hop automorphism
   //! See Section 3.2.2 in the design document
   const KeySwitch& getNextKSWmatrix(long fromXPower, long fromID=0) const
@@ -26,6 +26,12 @@ public:
   //! @brief Initialization function, override with initialization code
   virtual void init(T&) = 0;
 
+  //! @brief Called after init, with the index of the new element
+  virtual void inserted(T&, long) {}
+
+  //! @brief Called before the element of index j is removed from the map
+  virtual void release(T&, long) {}
+
   //! @brief Cloning a pointer, override with code to create a fresh copy
   virtual IndexMapInit<T> * clone() const = 0; 
   virtual ~IndexMapInit() {} // ensure that derived destructor is called
@@ -91,7 +97,7 @@ public:
   void insert(long j) { 
     if (!indexSet.contains(j)) {
       indexSet.insert(j);
-      if (!init.null()) init->init(map[j]);
+      if (!init.null()) { init->init(map[j]); init->inserted(map[j], j); }
     }
   }
   void insert(const IndexSet& s) { 
@@ -100,14 +106,22 @@ public:
   }
 
   //! @brief Delete indexes from IndexSet, may cause objects to be destroyed.
-  void remove(long j) { indexSet.remove(j); map.erase(j); }
+  void remove(long j) {
+    if (indexSet.contains(j) && !init.null()) init->release(map[j], j);
+    indexSet.remove(j); map.erase(j);
+  }
   void remove(const IndexSet& s) { 
-    for (long i = s.first(); i <= s.last(); i = s.next(i))
+    for (long i = s.first(); i <= s.last(); i = s.next(i)) {
+      if (indexSet.contains(i) && !init.null()) init->release(map[i], i);
       map.erase(i);
+    }
     indexSet.remove(s);
   }
 
   void clear() { 
+    if (!init.null())
+      for (long i = indexSet.first(); i <= indexSet.last(); i = indexSet.next(i))
+        init->release(map[i], i);
     map.clear();
     indexSet.clear();
   }  
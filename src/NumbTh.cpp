@@ -745,6 +745,104 @@ void sampleUniform(ZZX& poly, const ZZ& B, long n)
 
 
 
+// The zzX samplers read the random bytes from NTL's current stream, a
+// buffer at a time
+namespace {
+class RandomBytes {
+  RandomStream& stream;
+  unsigned char buf[1024];
+  long pos;
+public:
+  RandomBytes(): stream(GetCurrentRandomStream()), pos(sizeof(buf)) {}
+
+  unsigned long get(long nBytes) // little-endian, nBytes<=sizeof(long)
+  {
+    if (pos + nBytes > long(sizeof(buf))) {
+      stream.get(buf, sizeof(buf));
+      pos = 0;
+    }
+    unsigned long u = 0;
+    for (long i = nBytes-1; i >= 0; i--) u = (u << 8) | buf[pos+i];
+    pos += nBytes;
+    return u;
+  }
+};
+}
+
+void sampleHWt(zzX &poly, long Hwt, long n)
+{
+  if (n<=0) n=poly.length(); if (n<=0) return;
+  poly.SetLength(n);
+  for (long i=0; i<n; i++) poly[i] = 0;
+
+  if (Hwt>n) Hwt=n;
+  for (long i=0; i<Hwt; ) { // continue until exactly Hwt nonzero coefficients
+    long u = RandomBnd(n);  // The next coefficient to choose
+    if (poly[u]==0) {       // if we didn't choose it already
+      poly[u] = 2*RandomBits_long(1) -1; // random in {-1,1}
+      i++;
+    }
+  }
+}
+
+void sampleSmall(zzX &poly, long n)
+{
+  if (n<=0) n=poly.length(); if (n<=0) return;
+  poly.SetLength(n);
+
+  // two bits per coefficient: one for zero/nonzero and one for the sign
+  RandomBytes rnd;
+  long *p = poly.elts();
+  for (long i=0; i<n; i+=4) {
+    unsigned long u = rnd.get(1);
+    for (long j=i; j<i+4 && j<n; j++, u >>= 2)
+      p[j] = (u&1)? long(u&2)-1 : 0;
+  }
+}
+
+void sampleGaussian(zzX &poly, long n, double stdev)
+{
+  static double const Pi=4.0*atan(1.0); // Pi=3.1415..
+  static double const scale = 1.0/4294967296.0; // 2^{-32}
+
+  if (n<=0) n=poly.length(); if (n<=0) return;
+  poly.SetLength(n);
+
+  // Uses the Box-Muller method to get two Normal(0,stdev^2) variables
+  RandomBytes rnd;
+  for (long i=0; i<n; i+=2) {
+    double r1 = (1+double(rnd.get(4)))*scale; // in (0,1]
+    double r2 = (1+double(rnd.get(4)))*scale;
+    double theta=2*Pi*r1;
+    double rr= sqrt(-2.0*log(r2))*stdev;
+
+    assert(rr < 8*stdev); // sanity-check, no more than 8 standard deviations
+
+    // Generate two Gaussians RV's, rounded to integers
+    poly[i] = (long) floor(rr*cos(theta) +0.5);
+    if (i+1 < n)
+      poly[i+1] = (long) floor(rr*sin(theta) +0.5);
+  }
+}
+
+void sampleUniform(zzX& poly, long B, long n)
+{
+  if (n<=0) n=poly.length(); if (n<=0) return;
+  assert(B >= 0 && B < NTL_SP_BOUND);
+  poly.SetLength(n);
+
+  // rejection sampling of u in [0..2B], with the bits of 2B
+  long k = NumBits(2*B);
+  long nb = divc(k, 8);
+  unsigned long mask = (k==0)? 0 : ((1UL << k) - 1UL);
+  RandomBytes rnd;
+  for (long i=0; i<n; i++) {
+    unsigned long u;
+    do { u = rnd.get(nb) & mask; } while (u > (unsigned long)(2*B));
+    poly[i] = long(u) - B;
+  }
+}
+
 // ModComp: a pretty lame implementation
 
 void ModComp(ZZX& res, const ZZX& g, const ZZX& h, const ZZX& f)
@@ -587,6 +587,16 @@ void sampleGaussian(ZZX &poly, long n=0, double stdev=1.0);
 //! over [-B..B]
 void sampleUniform(ZZX& poly, const ZZ& B, long n=0);
 
+//! @brief The same samplers, with the coefficients in a zzX.
+//!
+//! These avoid the allocation of a ZZ per coefficient, and draw their
+//! randomness in bulk from NTL's current RandomStream. If n=0 then
+//! n=poly.length() is used. Here sampleUniform requires 0<=B<NTL_SP_BOUND.
+void sampleSmall(zzX &poly, long n=0);
+void sampleHWt(zzX &poly, long Hwt, long n=0);
+void sampleGaussian(zzX &poly, long n=0, double stdev=1.0);
+void sampleUniform(zzX& poly, long B, long n=0);
+
 
 /**
  * @brief Facility for "restoring" the NTL PRG state.
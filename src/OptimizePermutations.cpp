@@ -16,6 +16,8 @@
 #include <cstdlib>
 #include <cassert>
 #include <list>
+#include <map>
+#include <limits>
 #include <sstream>
 using namespace std;
 #if (__cplusplus>199711L)
@@ -27,10 +29,13 @@ using namespace tr1;
 #endif
 
 #include <NTL/vector.h>
+#include <NTL/BasicThreadPool.h>
 NTL_CLIENT
 #include "NumbTh.h"
+#include "multicore.h"
 #include "EncryptedArray.h"
 #include "permutations.h"
+#include "matmul.h"
 
 
 //! \cond FALSE (make doxygen ignore these classes)
@@ -328,30 +333,96 @@ BenesMemoEntry optimalBenesAux(long i, long budget, long nlev,
 }
 
 
+// The level-collapsing data for all the Benes networks of one size: the
+// cost table, weighted by the cost model, and the memoization table of
+// optimalBenesAux. The entries of the memoization table do not depend on
+// the overall budget, so one table serves all the calls for this size.
+//! \cond FALSE (make doxygen ignore these classes)
+class BenesTable {
+public:
+  long nlev;                // number of levels before collapsing
+  Vec< Vec<long> > costTab; // costTab[i][j] is the cost of levels i..i+j
+  BenesMemoTable memoTab;
+
+  BenesTable(long n, bool good, const PermCostModel& model) {
+    long k = GeneralBenesNetwork::depth(n); // k = ceiling(log_2 n)
+    nlev = 2*k - 1;  // before collapsing, we have 2k-1 levels
+
+    buildBenesCostTable(n, k, good, costTab);
+    // Compute the cost for all (n choose 2) possible ways to collapse levels.
+
+    for (long i = 0; i < costTab.length(); i++)
+      for (long j = 0; j < costTab[i].length(); j++)
+        costTab[i][j] = model.layerCost + model.shiftCost*costTab[i][j];
+  }
+};
+
+// The tables for all the sizes that come up when optimizing one set of
+// generators. Building the cost tables is the expensive part of the
+// search, so precompute() builds the tables for all the candidate
+// sub-dimensions in parallel before the search starts.
+class BenesTables {
+  const PermCostModel& model;
+  map< pair<long,bool>, shared_ptr<BenesTable> > tabs;
+
+public:
+  explicit BenesTables(const PermCostModel& _model): model(_model) {}
+
+  // Build the tables for every factor of the generator orders (any
+  // sub-tree of a generator tree has such an order), and solve them for
+  // all the budgets up to budget.
+  void precompute(const Vec<GenDescriptor>& gens, long budget) {
+    for (long i = 0; i < gens.length(); i++)
+      for (long d = 2; d <= gens[i].order; d++) {
+        if (gens[i].order % d != 0) continue;
+        tabs[make_pair(d, false)] = shared_ptr<BenesTable>();
+        if (gens[i].good) tabs[make_pair(d, true)] = shared_ptr<BenesTable>();
+      }
+
+    vector< pair<long,bool> > shapes;
+    for (auto& t : tabs) if (!t.second) shapes.push_back(t.first);
+    vector< shared_ptr<BenesTable> > built(shapes.size());
+
+    FHE_EXEC_RANGE(lsize(shapes), first, last)
+    for (long i = first; i < last; i++) {
+      built[i] = make_shared<BenesTable>(shapes[i].first, shapes[i].second,
+                                         model);
+      for (long b = 1; b <= budget; b++)
+        optimalBenesAux(0, b, built[i]->nlev,
+                        built[i]->costTab, built[i]->memoTab);
+    }
+    FHE_EXEC_RANGE_END
+
+    for (long i = 0; i < lsize(shapes); i++) tabs[shapes[i]] = built[i];
+  }
+
+  BenesTable& get(long n, bool good) {
+    shared_ptr<BenesTable>& tab = tabs[make_pair(n, good)];
+    if (!tab) tab = make_shared<BenesTable>(n, good, model);
+    return *tab;
+  }
+};
+//! \endcond
+
 // Computes an optimal level-collapsing strategy for a Benes network
 //   n = the size of the network
 //   budget = an upper bound on the number of levels in the collapsed network
 //   good = flag indicating whether this is with respect to a "good" generator,
 //     for which shifts by i and i-n correspond to the same rotation
-//   cost = total number of shifts needed by the collapsed network
+//   tabs = the cost and memoization tables
+//   cost = total cost of the collapsed network (with the default cost
+//      model, the number of shifts that it needs)
 //   solution = list indicating how levels in a standard benes network
 //      are collapsed: if solution = [s_1 s_2 ... s_k], then k <= budget,
 //      and the first s_1 levels are collapsed, the next s_2 levels 
 //      are collapsed, etc.
-void optimalBenes(long n, long budget, bool good, 
-                     long& cost, LongNodePtr& solution)
+void optimalBenes(long n, long budget, bool good, BenesTables& tabs,
+                  long& cost, LongNodePtr& solution)
 {
-  long k = GeneralBenesNetwork::depth(n); // k = ceiling(log_2 n)
-  long nlev = 2*k - 1;  // before collapsing, we have 2k-1 levels
-
-  Vec< Vec<long> > costTab;
-  // costTab[i][j] to holds the cost of collapsing levels i..i+j
-
-  buildBenesCostTable(n, k, good, costTab);
-  // Compute the cost for all (n choose 2) possible ways to collapse levels.
+  BenesTable& tab = tabs.get(n, good);
 
-  BenesMemoTable memoTab;
-  BenesMemoEntry t = optimalBenesAux(0, budget, nlev, costTab, memoTab);
+  BenesMemoEntry t
+    = optimalBenesAux(0, budget, tab.nlev, tab.costTab, tab.memoTab);
   // Compute the optimal collapsing of layers in a width-n Benes network
 
   cost = t.cost;
@@ -573,7 +644,7 @@ typedef unordered_map< UpperMemoKey, UpperMemoEntry,
 // order1*order2 (and also the solution of not splitting at all). For every
 // possible split, try all budget allocations and allocations of good and mid.
 LowerMemoEntry optimalLower(long order, bool good, long budget, long mid, 
-                            LowerMemoTable& lowerMemoTable)
+                            LowerMemoTable& lowerMemoTable, BenesTables& tabs)
 {
   assert(order > 1);
   assert(mid == 0 || mid == 1);
@@ -603,7 +674,7 @@ LowerMemoEntry optimalLower(long order, bool good, long budget, long mid,
     if (mid == 1) { 
       // this is the middle node, so just one Benes network
 
-      optimalBenes(order, budget, good, cost, benesSolution1);
+      optimalBenes(order, budget, good, tabs, cost, benesSolution1);
       benesSolution2 = LongNodePtr();
     }
     else {
@@ -611,13 +682,14 @@ LowerMemoEntry optimalLower(long order, bool good, long budget, long mid,
       // if budget is odd, we split it unevenly
 
       long cost1, cost2;
-      optimalBenes(order, budget/2, good, cost1, benesSolution1);
+      optimalBenes(order, budget/2, good, tabs, cost1, benesSolution1);
       if (budget % 2 == 0) { // both networks have the same budget
         cost2 = cost1;
         benesSolution2 = benesSolution1;
       }
       else { // one network has bugdet larger by one than the other
-        optimalBenes(order, budget - budget/2, good, cost2, benesSolution2);
+        optimalBenes(order, budget - budget/2, good, tabs,
+                     cost2, benesSolution2);
       }
 
       cost = cost1 + cost2;
@@ -660,11 +732,11 @@ LowerMemoEntry optimalLower(long order, bool good, long budget, long mid,
 	// nodes if we have it, and to none of the nodes if we don't
         for (long mid1 = 0; mid1 <= mid; mid1++) {
           LowerMemoEntry s1 = optimalLower(order1, good1, budget1, mid1, 
-                                           lowerMemoTable);
+                                           lowerMemoTable, tabs);
 	  // FIXME: If s1.cost==NTL_MAX_LONG we do not need to compute
 	  //        the cost of s2
           LowerMemoEntry s2 = optimalLower(order/order1, good2, budget-budget1, 
-                                           mid-mid1, lowerMemoTable);
+                                           mid-mid1, lowerMemoTable, tabs);
           if (s1.cost != NTL_MAX_LONG && s2.cost != NTL_MAX_LONG &&
               s1.cost + s2.cost < cost) {
             cost = s1.cost + s2.cost;
@@ -687,7 +759,8 @@ LowerMemoEntry optimalLower(long order, bool good, long budget, long mid,
 // remaining budget" between trees i through vec.length()-1.
 UpperMemoEntry 
 optimalUpperAux(const Vec<GenDescriptor>& vec, long i, long budget, long mid,
-		UpperMemoTable& upperMemoTable, LowerMemoTable& lowerMemoTable)
+		UpperMemoTable& upperMemoTable, LowerMemoTable& lowerMemoTable,
+		BenesTables& tabs)
 {
   assert(i >= 0 && i <= vec.length());
   assert(budget >= 0);
@@ -725,13 +798,14 @@ optimalUpperAux(const Vec<GenDescriptor>& vec, long i, long budget, long mid,
       for (long mid1 = 0; mid1 <= mid; mid1++) {
 	// Optimize the first tree (index i) with the alloted budget1, mid1
         LowerMemoEntry s = optimalLower(vec[i].order, vec[i].good,
-					budget1, mid1, lowerMemoTable);
+					budget1, mid1, lowerMemoTable, tabs);
 	// FIXME: If s.cost==NTL_MAX_LONG we do not need to compute
 	//        the cost of t
 
 	// Optimize the rest of the list with the remaining budget and mid
         UpperMemoEntry t = optimalUpperAux(vec, i+1, budget-budget1, mid-mid1,
-                                           upperMemoTable, lowerMemoTable);
+                                           upperMemoTable, lowerMemoTable,
+                                           tabs);
         if (s.cost != NTL_MAX_LONG && t.cost != NTL_MAX_LONG &&
             s.cost + t.cost < bestCost) {
           bestCost = s.cost + t.cost;
@@ -870,10 +944,181 @@ static long copyToGenTree(OneGeneratorTree& gTree, SplitNodePtr& solution)
   return len;
 }
 
+/********************************************************************/
+/***** A process-wide cache of the results of optimalUpperAux *******/
+/********************************************************************/
+
+// The cache is keyed by a string that describes the search problem: the
+// orders and good flags of the generators (but not their indexes, which
+// only label the trees), the depth bound and the cost model. The solutions
+// are never modified once they are computed, so they are shared between
+// the cache and all the callers.
+
+static FHE_MUTEX_TYPE treeCacheMx;
+static map<string, UpperMemoEntry> treeCache;
+
+static string treeCacheKey(const Vec<GenDescriptor>& gens, long depthBound,
+                           const PermCostModel& model)
+{
+  stringstream s;
+  s << gens.length();
+  for (long i = 0; i < gens.length(); i++)
+    s << " " << gens[i].order << " " << gens[i].good;
+  s << " " << depthBound << " " << model.layerCost << " " << model.shiftCost;
+  return s.str();
+}
+
+static void writeBenesSolution(ostream& s, const LongNodePtr& sol)
+{
+  s << " " << length(sol);
+  for (LongNodePtr p = sol; p != NULL; p = p->next) s << " " << p->count;
+}
+
+// Write a solution tree in pre-order, every node as "order mid good"
+// followed by "L benes1 benes2" for a leaf or by "N left right" for an
+// internal node, where a Benes solution is written as its length followed
+// by the counts.
+static void writeSplitTree(ostream& s, const SplitNodePtr& p)
+{
+  s << " " << p->order << " " << p->mid << " " << p->good;
+  if (p->isLeaf()) {
+    s << " L";
+    writeBenesSolution(s, p->solution1);
+    writeBenesSolution(s, p->solution2);
+  }
+  else {
+    s << " N";
+    writeSplitTree(s, p->left);
+    writeSplitTree(s, p->right);
+  }
+}
+
+static LongNodePtr readBenesSolution(istream& s)
+{
+  long len;
+  s >> len;
+  if (!s || len < 0) Error("GeneratorTrees::readCache: bad input");
+  vector<long> counts(len);
+  for (long i = 0; i < len; i++) s >> counts[i];
+
+  LongNodePtr sol;
+  for (long i = len-1; i >= 0; i--)
+    sol = LongNodePtr(new LongNode(counts[i], sol));
+  return sol;
+}
+
+static SplitNodePtr readSplitTree(istream& s)
+{
+  long order, mid;
+  bool good;
+  string type;
+  s >> order >> mid >> good >> type;
+  if (!s) Error("GeneratorTrees::readCache: bad input");
+
+  if (type == "L") {
+    LongNodePtr sol1 = readBenesSolution(s);
+    LongNodePtr sol2 = readBenesSolution(s);
+    return SplitNodePtr(new SplitNode(order, mid, good, sol1, sol2));
+  }
+  if (type != "N") Error("GeneratorTrees::readCache: bad input");
+  SplitNodePtr left = readSplitTree(s);
+  SplitNodePtr right = readSplitTree(s);
+  return SplitNodePtr(new SplitNode(order, mid, good, left, right));
+}
+
+// Every entry takes two lines: the key, then the cost, the number of trees
+// and the trees themselves.
+void GeneratorTrees::writeCache(ostream& s)
+{
+  FHE_MUTEX_GUARD(treeCacheMx);
+  for (auto& entry : treeCache) {
+    s << entry.first << "\n" << entry.second.cost << " "
+      << length(entry.second.solution);
+    for (GenNodePtr p = entry.second.solution; p != NULL; p = p->next)
+      writeSplitTree(s, p->solution);
+    s << "\n";
+  }
+}
+
+void GeneratorTrees::readCache(istream& s)
+{
+  string key;
+  while (getline(s, key)) {
+    if (key.empty()) continue;
+
+    long cost, nTrees;
+    s >> cost >> nTrees;
+    if (!s || nTrees < 0) Error("GeneratorTrees::readCache: bad input");
+    vector<SplitNodePtr> trees(nTrees);
+    for (long i = 0; i < nTrees; i++) trees[i] = readSplitTree(s);
+    s.ignore(numeric_limits<streamsize>::max(), '\n'); // skip to next line
+
+    GenNodePtr solution;
+    for (long i = nTrees-1; i >= 0; i--)
+      solution = GenNodePtr(new GenNode(trees[i], solution));
+
+    FHE_MUTEX_GUARD(treeCacheMx);
+    treeCache[key] = UpperMemoEntry(cost, solution);
+  }
+}
+
+void GeneratorTrees::clearCache()
+{
+  FHE_MUTEX_GUARD(treeCacheMx);
+  treeCache.clear();
+}
+
+// Measure the costs of a layer in a permutation network
+PermCostModel PermCostModel::measure(const FHEPubKey& pk, long nLevels)
+{
+  // Find an automorphism with a key-switching matrix
+  long k = 0;
+  for (const KeySwitch& W : pk.keySWlist()) {
+    const SKHandle& from = W.fromKey;
+    if (from.getPowerOfS()==1 && from.getPowerOfX()!=1
+        && from.getSecretKeyID()==0 && W.toKeyID==0) {
+      k = from.getPowerOfX();
+      break;
+    }
+  }
+  if (k == 0)
+    throw std::logic_error("PermCostModel::measure: no key-switching matrices");
+
+  Ctxt c(pk);
+  pk.Encrypt(c, ZZX(INIT_MONO, 0)); // an encryption of 1
+  long top = c.findBaseLevel();
+  if (nLevels <= 0 || nLevels > top) nLevels = top;
+
+  // A layer decomposes the ciphertext once, key-switches it once for each
+  // shift, and mod-switches the sum down. Time all of that with one shift,
+  // then the time of a second shift alone.
+  double layerTime = 0.0, shiftTime = 0.0;
+  for (long l = 0; l < nLevels; l++) {
+    c.modDownToLevel(top-l);
+    double t = GetTime();
+    BasicAutomorphPrecon precon(c);
+    shared_ptr<Ctxt> rot = precon.automorph(k);
+    rot->cleanUp();
+    t = GetTime() - t;
+
+    double t2 = GetTime();
+    rot = precon.automorph(k);
+    t2 = GetTime() - t2;
+
+    layerTime += max(t - t2, 0.0);
+    shiftTime += t2;
+  }
+
+  long lc = (long) (layerTime*1e6/nLevels + 0.5);  // in microseconds
+  long sc = (long) (shiftTime*1e6/nLevels + 0.5);
+  return PermCostModel(lc, max(sc, 1L));
+}
+
 // Compute the trees corresponding to the "optimal" way of breaking
 // a permutation into dimensions, subject to some constraints
 long GeneratorTrees::buildOptimalTrees(const Vec<GenDescriptor>& gens, 
-				       long depthBound)
+				       long depthBound,
+				       const PermCostModel& model)
 {
   assert(gens.length() >= 0);
   trees.SetLength(gens.length());    // allocate space if needed
@@ -891,12 +1136,28 @@ long GeneratorTrees::buildOptimalTrees(const Vec<GenDescriptor>& gens,
       trees[i].collapseToRoot();
   }
 
-  UpperMemoTable upperMemoTable;
-  LowerMemoTable lowerMemoTable;
+  // Look for a solution in the cache, else compute it in { t.cost, t.solution }
+  string key = treeCacheKey(gens, depthBound, model);
+  UpperMemoEntry t;
+  bool found;
+  {
+    FHE_MUTEX_GUARD(treeCacheMx);
+    map<string, UpperMemoEntry>::iterator it = treeCache.find(key);
+    found = (it != treeCache.end());
+    if (found) t = it->second;
+  }
+  if (!found) {
+    UpperMemoTable upperMemoTable;
+    LowerMemoTable lowerMemoTable;
+    BenesTables tabs(model);
+    tabs.precompute(gens, depthBound);
+
+    t = optimalUpperAux(gens, 0, depthBound, 1,
+                        upperMemoTable, lowerMemoTable, tabs);
 
-  // Compute a solution in { t.cost, t.solution }
-  UpperMemoEntry t = 
-    optimalUpperAux(gens, 0, depthBound, 1, upperMemoTable, lowerMemoTable);
+    FHE_MUTEX_GUARD(treeCacheMx);
+    treeCache[key] = t;
+  }
 
   // Copy the solution into the trees
   GenNodePtr midPtr;
@@ -10,10 +10,13 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 #include <NTL/ZZ.h>
+#include <NTL/BasicThreadPool.h>
+#include "multicore.h"
 NTL_CLIENT
 #include "Ctxt.h"
 #include "permutations.h"
 #include "EncryptedArray.h"
+#include "matmul.h"
 
 ostream& operator<< (ostream &s, const PermNetwork &net)
 {
@@ -203,7 +206,10 @@ makeMask(vector<long>& mask, Vec<long>& haystack, long needle)
   return std::make_pair(fstNonZeroIdx,found);
 }
 
-// Apply a permutation network to a ciphertext
+// Apply a permutation network to a ciphertext. Each mask is encoded and
+// used once, which is cheaper than preparing a PermNetworkExec when the
+// network is only applied once: callers that apply the same network to
+// many ciphertexts should keep a PermNetworkExec and use it instead.
 void PermNetwork::applyToCtxt(Ctxt& c, const EncryptedArray& ea) const
 {
   const PAlgebra& al = ea.getPAlgebra();
@@ -246,3 +252,102 @@ void PermNetwork::applyToCtxt(Ctxt& c, const EncryptedArray& ea) const
     c = sum; // update the cipehrtext c before the next layer
   }
 }
+
+PermNetworkExec::PermNetworkExec(const PermNetwork& net,
+                                 const EncryptedArray& _ea): ea(_ea)
+{
+  FHE_TIMER_START;
+  const PAlgebra& al = ea.getPAlgebra();
+  const FHEcontext& context = ea.getContext();
+
+  layers.resize(net.depth());
+  for (long i=0; i<net.depth(); i++) {
+    const PermNetLayer& lyr = net.getLayer(i);
+    if (lyr.isIdentity()) continue; // this layer is the identity permutation
+
+    // This layer is shifted via powers of g^e mod m
+    long g2e = PowerMod(al.ZmStarGen(lyr.getGenIdx()), lyr.getE(), al.getM());
+
+    // Collect the masks and the shift amounts
+    Vec<long> unused = lyr.getShifts(); // copy to a new vector
+    vector<long> mask(unused.length());  // buffer to hold masks
+    vector< vector<long> > maskArrays;
+    Layer& layer = layers[i];
+
+    long shamt = 0;
+    while (true) {
+      pair<long,bool> ret=makeMask(mask, unused, shamt); // compute mask
+      if (ret.second) { // non-empty mask
+        maskArrays.push_back(mask);
+        layer.autos.push_back(PowerMod(g2e, shamt, al.getM()));
+      }
+      if (ret.first >= 0)
+        shamt = unused[ret.first]; // next shift amount to use
+
+      else break; // unused is all-zero, done with this layer
+    }
+
+    // Encode the masks, and rotate each one by the same automorphism as
+    // the ciphertext that it multiplies: rot(c*mask) = rot(c)*rot(mask)
+    layer.masks.resize(maskArrays.size());
+    FHE_EXEC_RANGE(lsize(maskArrays), first, last)
+    for (long j = first; j < last; j++) {
+      ZZX maskPoly;
+      ea.encode(maskPoly, maskArrays[j]);    // encode mask as polynomial
+      layer.masks[j] = make_shared<DoubleCRT>(maskPoly, context);
+      if (layer.autos[j] != 1)
+        layer.masks[j]->automorph(layer.autos[j]);
+    }
+    FHE_EXEC_RANGE_END
+  }
+}
+
+void PermNetworkExec::applyToCtxt(Ctxt& c, vector<double>* layerTimes) const
+{
+  FHE_TIMER_START;
+  if (layerTimes != NULL) layerTimes->resize(layers.size(), 0.0);
+
+  // Apply the layers, one at a time
+  for (long i=0; i<lsize(layers); i++) {
+    const Layer& layer = layers[i];
+    if (layer.masks.empty()) continue; // an identity layer
+    double t = GetTime();
+
+    // All the rotations in this layer are of c, so they share the same
+    // decomposition. The rotated ciphertexts still include the special
+    // primes, they are multiplied by the masks and summed, and the sum
+    // is mod-switched down only once at the end.
+    BasicAutomorphPrecon precon(c);
+    long nTerms = lsize(layer.masks);
+    PartitionInfo pinfo(nTerms, numFHEthreads());
+    long cnt = pinfo.NumIntervals();
+    vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, c));
+
+    // parallel for loop: j in [0..nTerms)
+    FHE_EXEC_INDEX(cnt, index)
+      long first, last;
+      pinfo.interval(first, last, index);
+
+      for (long j = first; j < last; j++) {
+        if (layer.autos[j] == 1) continue; // no shift, handled below
+        shared_ptr<Ctxt> tmp = precon.automorph(layer.autos[j]);
+        tmp->multByConstant(*layer.masks[j]); // multiply by (rotated) mask
+        acc[index] += *tmp;
+      }
+    FHE_EXEC_INDEX_END
+
+    Ctxt sum(ZeroCtxtLike, c);
+    for (long j = 0; j < cnt; j++) sum += acc[j];
+    sum.cleanUp();
+
+    for (long j = 0; j < nTerms; j++) // the slots that do not move
+      if (layer.autos[j] == 1) {
+        Ctxt tmp = c;
+        tmp.multByConstant(*layer.masks[j]);
+        sum += tmp;
+      }
+    c = sum; // update the cipehrtext c before the next layer
+
+    if (layerTimes != NULL) (*layerTimes)[i] += GetTime() - t;
+  }
+}
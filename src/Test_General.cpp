@@ -16,11 +16,20 @@
 #include <NTL/BasicThreadPool.h>
 #include "FHE.h"
 #include "timing.h"
+#include "counters.h"
+#include "costModel.h"
+#include "asyncCtxt.h"
+#include "multicore.h"
+#include "circuit.h"
+#include "rnsDecrypt.h"
 #include "EncryptedArray.h"
 #include <NTL/lzz_pXFactoring.h>
 
 #include <cassert>
 #include <cstdio>
+#ifdef FHE_THREADS
+#include <thread>
+#endif
 
 #ifdef DEBUG_PRINTOUT
 #define debugCompare(ea,sk,p,c) {\
@@ -51,6 +60,12 @@
 **************/
 
 static bool noPrint = false;
+static bool checkAsync = false; // also check the asynchronous API
+static bool checkCircuit = false; // also check the circuit compiler
+static bool checkRNSDecrypt = false; // also check RNS-native decryption
+static bool checkTotalSums = false; // also check both totalSums methods
+static CostTable costTable;
+static bool plan = false; // predict the cost of the test using costTable
 
 void  TestIt(long R, long p, long r, long d, long c, long k, long w, 
                long L, long m, const Vec<long>& gens, const Vec<long>& ords)
@@ -98,6 +113,12 @@ void  TestIt(long R, long p, long r, long d, long c, long k, long w,
     std::cout << "G = " << G << "\n";
   }
 
+  std::unique_ptr<CircuitPlanner> planner;
+  if (plan) {
+    planner.reset(new CircuitPlanner(costTable, m));
+    planner->beginStage("keyGen");
+  }
+
   FHESecKey secretKey(context);
   const FHEPubKey& publicKey = secretKey;
   secretKey.GenSecKey(w); // A Hamming-weight-w secret key
@@ -116,6 +137,7 @@ void  TestIt(long R, long p, long r, long d, long c, long k, long w,
   random(ea, p2);
   random(ea, p3);
 
+  if (planner) planner->beginStage("encrypt");
   Ctxt c0(publicKey), c1(publicKey), c2(publicKey), c3(publicKey);
   ea.encrypt(c0, publicKey, p0);
   // {ZZX ppp0; ea.encode(ppp0, p0); c0.DummyEncrypt(ppp0);} // dummy encryption
@@ -124,7 +146,9 @@ void  TestIt(long R, long p, long r, long d, long c, long k, long w,
   ea.encrypt(c3, publicKey, p3); // real encryption
 
   resetAllTimers();
+  FHEcounterSnapshot counters = getCounterSnapshot();
 
+  if (planner) planner->beginStage("circuit");
   FHE_NTIMER_START(Circuit);
 
   for (long i = 0; i < R; i++) {
@@ -203,11 +227,19 @@ void  TestIt(long R, long p, long r, long d, long c, long k, long w,
   c3.cleanUp();
 
   FHE_NTIMER_STOP(Circuit);
+  if (planner) planner->endStage();
 
   if (!noPrint) {
     std::cout << endl;
     printAllTimers();
     std::cout << endl;
+    (getCounterSnapshot() - counters).print(std::cout);
+    std::cout << endl;
+    if (planner) {
+      std::cout << "predicted costs:\n";
+      planner->print(std::cout);
+      std::cout << endl;
+    }
   }
   resetAllTimers();
   FHE_NTIMER_START(Check);
@@ -228,6 +260,153 @@ void  TestIt(long R, long p, long r, long d, long c, long k, long w,
   else std::cout << "BAD\n";
 
   FHE_NTIMER_STOP(Check);
+
+  if (checkAsync) { // c0*c1 + rot(c2) - c3*c3, directly and asynchronously
+    long rotamt = RandomBnd(nslots);
+    Ctxt t0(c0), t2(c2), t3(c3);
+    t0.multiplyBy(c1);
+    ea.rotate(t2, rotamt);
+    t3.multiplyBy(c3);
+    t0 += t2;
+    t0 -= t3;
+
+    AsyncCtxt a0(c0), a1(c1), a2(c2), a3(c3);
+    AsyncCtxt res = a0*a1 + asyncRotate(ea, a2, rotamt) - a3*a3;
+    AsyncCtxt dropped = asyncRotate(ea, res, 1);
+    dropped.cancel();
+
+    NewPlaintextArray q0(ea), q1(ea);
+    ea.decrypt(t0, secretKey, q0);
+    ea.decrypt(res.get(), secretKey, q1);
+    if (equals(ea, q0, q1)) std::cout << "async GOOD\n";
+    else std::cout << "async BAD\n";
+
+    // Cancel an operation while it runs: it runs to completion, but its
+    // result and that of its dependent are cancelled. With one thread it
+    // runs as soon as it is created, so the cancel comes too late.
+    bool threaded = (numFHEthreads() > 1);
+    FHE_atomic_long started(0), cancelIssued(0);
+    AsyncCtxt running(a0, [&started, &cancelIssued, threaded](Ctxt& x) {
+        started = 1;
+#ifdef FHE_THREADS
+        while (threaded && !cancelIssued) std::this_thread::yield();
+#endif
+        x.multiplyBy(x);
+      });
+    AsyncCtxt dependent = running + a1;
+#ifdef FHE_THREADS
+    while (threaded && !started) std::this_thread::yield();
+#endif
+    running.cancel();
+    cancelIssued = 1;
+    running.wait();
+    dependent.wait();
+    bool cancelOK = threaded?
+      (running.cancelled() && dependent.cancelled()) : !running.cancelled();
+    if (cancelOK) std::cout << "async cancel GOOD\n";
+    else std::cout << "async cancel BAD\n";
+  }
+
+  if (checkCircuit) { // (2*rot(t) - t)^2 for t = c0*c1 + c2*c3, on fresh ctxts
+    long rotamt = RandomBnd(nslots);
+    Circuit circ(ea);
+    TracedCtxt x0 = circ.input(), x1 = circ.input();
+    TracedCtxt x2 = circ.input(), x3 = circ.input();
+    TracedCtxt t = x0, u = x2;
+    t.multiplyBy(x1);
+    u.multiplyBy(x3);
+    t += u;
+    TracedCtxt r1 = t, r2 = t, r3 = t;
+    r1.rotate(rotamt);
+    r2.rotate(rotamt);  // the same as r1
+    r3.rotate(1);
+    r3.rotate(-1);      // the same as t
+    r1 += r2;
+    r1 -= r3;
+    r1.square();
+    circ.output(r1);
+
+    NewPlaintextArray q0(pp0), q2(pp2), q(ea);
+    mul(ea, q0, pp1);
+    mul(ea, q2, pp3);
+    add(ea, q0, q2);
+    q = q0;
+    rotate(ea, q, rotamt);
+    add(ea, q, NewPlaintextArray(q));
+    sub(ea, q, q0);
+    mul(ea, q, NewPlaintextArray(q));
+
+    Circuit compiled = compileCircuit(circ);
+    vector<Ctxt> in(4, Ctxt(publicKey)), out1, out2;
+    ea.encrypt(in[0], publicKey, pp0);
+    ea.encrypt(in[1], publicKey, pp1);
+    ea.encrypt(in[2], publicKey, pp2);
+    ea.encrypt(in[3], publicKey, pp3);
+    circ.execute(out1, in);
+    compiled.execute(out2, in);
+    if (!noPrint) printCircuitReport(std::cout, circ, compiled);
+
+    NewPlaintextArray d1(ea), d2(ea);
+    ea.decrypt(out1[0], secretKey, d1);
+    ea.decrypt(out2[0], secretKey, d2);
+    if (equals(ea, d1, q) && equals(ea, d2, q)) std::cout << "circuit GOOD\n";
+    else std::cout << "circuit BAD\n";
+  }
+
+  if (checkRNSDecrypt) { // RNSDecryptor vs. FHESecKey::Decrypt
+    RNSDecryptor dec(secretKey);
+    vector<Ctxt> cs;
+    cs.push_back(c0); cs.push_back(c1); cs.push_back(c2); cs.push_back(c3);
+    Ctxt aut(c0);
+    aut.automorph(ea.getPAlgebra().ZmStarGen(0)); // a part for s(X^g)
+    cs.push_back(aut);
+
+    vector<ZZX> ps;
+    dec.decrypt(ps, cs);
+    bool ok = true;
+    for (long i=0; i<lsize(cs); i++) {
+      ZZX expected;
+      secretKey.Decrypt(expected, cs[i]);
+      if (ps[i] != expected) ok = false;
+    }
+    if (ok) std::cout << "rnsDecrypt GOOD\n";
+    else std::cout << "rnsDecrypt BAD\n";
+  }
+
+  if (checkTotalSums) { // both totalSums methods vs. the plaintext sums
+    add1DMatrices(secretKey); // all the baby steps and giant steps
+    const PAlgebra& al = ea.getPAlgebra();
+    bool native = true;
+    for (long i = 0; i < al.numOfGens(); i++)
+      if (!al.SameOrd(i)) native = false;
+
+    NewPlaintextArray pt(ea), expected(ea);
+    random(ea, pt);
+    for (long k = 0; k < nslots; k++) {
+      NewPlaintextArray tmp(pt);
+      rotate(ea, tmp, k);
+      add(ea, expected, tmp);
+    }
+    Ctxt ct(publicKey);
+    ea.encrypt(ct, publicKey, pt);
+
+    vector<TotalSumsMethod> methods;
+    methods.push_back(TOTALSUMS_AUTO);
+    methods.push_back(TOTALSUMS_DOUBLING);
+    if (native) methods.push_back(TOTALSUMS_HOISTED);
+    bool ok = true;
+    for (TotalSumsMethod method : methods) {
+      Ctxt sums(ct);
+      totalSums(ea, sums, method);
+      NewPlaintextArray res(ea);
+      ea.decrypt(sums, secretKey, res);
+      if (!equals(ea, res, expected)) ok = false;
+    }
+    if (!native) std::cout << "(not all dimensions are native, "
+                           << "hoisted totalSums not checked)\n";
+    if (ok) std::cout << "totalSums GOOD\n";
+    else std::cout << "totalSums BAD\n";
+  }
    
   std::cout << endl;
   if (!noPrint) {
@@ -278,10 +457,15 @@ void  TestIt(long R, long p, long r, long d, long c, long k, long w,
  *              e.g., gens='[562 1871 751]'
  *   ords    use specified vector of orders
  *              e.g., ords='[4 2 -4]', negative means 'bad'
+ *   profile write a JSON profile of the timers to this file
+ *   trace   write a Chrome trace of the timers to this file
+ *   costs   predict the time and memory of the test using the cost table
+ *              in this file, calibrating it first if it has no entry for m
  */
 int main(int argc, char **argv) 
 {
   setTimersOn();
+  setCountersOn();
 
   ArgMapping amap;
 
@@ -340,8 +524,30 @@ int main(int argc, char **argv)
 
   amap.arg("noPrint", noPrint, "suppress printouts");
 
+  amap.arg("async", checkAsync, "also check the asynchronous Ctxt API");
+
+  amap.arg("circuit", checkCircuit, "also check the circuit compiler");
+
+  amap.arg("rnsDecrypt", checkRNSDecrypt, "also check RNS-native decryption");
+
+  amap.arg("totalSums", checkTotalSums, "also check both totalSums methods");
+
+  string profile;
+  amap.arg("profile", profile, "write a JSON profile to this file", NULL);
+
+  string trace;
+  amap.arg("trace", trace, "write a Chrome trace to this file", NULL);
+
+  string costs;
+  amap.arg("costs", costs, "predict the costs using the table in this file",
+           NULL);
+  amap.note("the table is calibrated first if it has no entry for m");
+
   amap.parse(argc, argv);
 
+  if (!profile.empty() || !trace.empty())
+    setProfilingOn(/*traceEvents=*/!trace.empty());
+
   SetSeed(ZZ(seed));
   SetNumThreads(nt);
   
@@ -361,10 +567,35 @@ int main(int argc, char **argv)
   std::cout << argv[0] << ": ";
   long m = FindM(k, L, c, p, d, s, chosen_m, !noPrint);
 
+  if (!costs.empty()) {
+    ifstream in(costs.c_str());
+    if (in) costTable.read(in);
+    if (!costTable.has(m)) { // calibrate, before switching to dry-run
+      vector<long> gens1, ords1;
+      convert(gens1, gens);
+      convert(ords1, ords);
+      FHEcontext context(m, p, r, gens1, ords1);
+      buildModChain(context, L, c);
+      costTable.calibrate(context);
+      ofstream out(costs.c_str());
+      costTable.write(out);
+    }
+    plan = true;
+  }
+
   setDryRun(dry);
   for (long repeat_cnt = 0; repeat_cnt < repeat; repeat_cnt++) {
     TestIt(R, p, r, d, c, k, w, L, m, gens, ords);
   }
+
+  if (!profile.empty()) {
+    ofstream out(profile.c_str());
+    printProfileJSON(out);
+  }
+  if (!trace.empty()) {
+    ofstream out(trace.c_str());
+    writeChromeTrace(out);
+  }
 }
 
 // call to get our running test case:
@@ -12,6 +12,7 @@
 
 /* Test_Permutations.cpp - Applying plaintext permutation to encrypted vector
  */
+#include <sstream>
 #include <NTL/ZZ.h>
 NTL_CLIENT
 
@@ -51,6 +52,17 @@ void testCube(Vec<GenDescriptor>& vec, long widthBound)
     cout << "@TestCube: trees=" << trees << endl;
     cout << " cost =" << cost << endl;
   }
+
+  // Check that the memoized trees survive a round trip through a stream
+  stringstream cache;
+  GeneratorTrees::writeCache(cache);
+  GeneratorTrees::clearCache();
+  GeneratorTrees::readCache(cache);
+  GeneratorTrees trees2;
+  long cost2 = trees2.buildOptimalTrees(vec, widthBound);
+  if (cost2 != cost || trees2.numLayers() != trees.numLayers()
+      || trees2.getSize() != trees.getSize())
+    cout << "BAD trees from cache\n";
   Vec<long> dims;
   trees.getCubeDims(dims);
   CubeSignature sig(dims);
@@ -152,12 +164,39 @@ void testCtxt(long m, long p, long widthBound, long L, long r)
       cout << "done in " << t << " seconds" << endl;
     ea.decrypt(ctxt, secretKey, out2);
 
+    if (out1==out2) cout << "GOOD\n";
+    else {
+      cout << "************ BAD\n";
+    }
+
+    // Apply again using the pre-computed masks
+    PermNetworkExec exec(net, ea);
+    vector<double> layerTimes;
+    ea.encrypt(ctxt, publicKey, in);
+    exec.applyToCtxt(ctxt, &layerTimes);
+    ea.decrypt(ctxt, secretKey, out2);
+    if (!noPrint) {
+      cout << "  ** PermNetworkExec layer times:";
+      for (long j=0; j<lsize(layerTimes); j++) cout << " " << layerTimes[j];
+      cout << endl;
+    }
     if (out1==out2) cout << "GOOD\n";
     else {
       cout << "************ BAD\n";
     }
     // printAllTimers();
   }
+
+  // Search again, weighing the layers by their measured cost
+  PermCostModel model = PermCostModel::measure(publicKey, trees.numLayers());
+  GeneratorTrees trees2;
+  long cost2 = trees2.buildOptimalTrees(vec, widthBound, model);
+  if (!noPrint) {
+    cout << " measured model: layer=" << model.layerCost
+         << "us, shift=" << model.shiftCost << "us\n";
+    cout << " trees=" << trees2 << endl;
+    cout << " cost =" << cost2 << endl;
+  }
 }
 
 
@@ -65,6 +65,57 @@ bool testEncrypted(long d, const EncryptedArray& ea,
   return success;
 }
 
+// Evaluate a polynomial with n encrypted coefficients at an encrypted point,
+// slot by slot, and compare with evaluating it on the plaintext slots
+bool testEncryptedSlots(long n, const EncryptedArray& ea,
+                        const FHESecKey& secretKey)
+{
+  const FHEPubKey& publicKey = secretKey;
+  long p2r = publicKey.getPtxtSpace();
+
+  vector<long> x;
+  vector< vector<long> > coeffs(n);
+  ea.random(x);
+  for (long i=0; i<n; i++) ea.random(coeffs[i]);
+
+  Ctxt cX(publicKey);
+  Vec<Ctxt> cpoly(INIT_SIZE, n, cX);
+  ea.encrypt(cX, publicKey, x);
+  for (long i=0; i<n; i++) ea.encrypt(cpoly[i], publicKey, coeffs[i]);
+
+  Ctxt cres(publicKey);
+  polyEval(cres, cpoly, cX);
+
+  vector<long> y;
+  ea.decrypt(cres, secretKey, y);
+  for (long j=0; j<ea.size(); j++) {
+    long ret = 0; // Horner's rule on the plaintext slots
+    for (long i=n-1; i>=0; i--)
+      ret = AddMod(MulMod(ret, x[j], p2r), coeffs[i][j], p2r);
+    if (ret != y[j]) {
+      std::cout << " encrypted coefficients MISMATCH (n="<<n<<")\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// The levels that the evaluation took must be within the bounds that are
+// documented for PolyEvalPlan::levelsConsumed(): each multiplication on
+// the critical path takes at least one level, and the scalar products and
+// additions at most one more
+static bool checkLevels(const PolyEvalPlan& plan, const Ctxt& in,
+                        const Ctxt& out)
+{
+  long used = in.findBaseLevel() - out.findBaseLevel();
+  bool ok = (used >= plan.levelsConsumed()
+             && used <= plan.levelsConsumed()+1);
+  if (!ok && !noPrint)
+    std::cout << "\n  predicted "<<plan.levelsConsumed()
+              << " levels, used "<<used<<endl;
+  return ok;
+}
+
 void testIt(long d, long k, long p, long r, long m, long L,
 	    bool isMonic=false)
 {
@@ -89,6 +140,11 @@ void testIt(long d, long k, long p, long r, long m, long L,
   // evaluate encrypted poly at encrypted point
   if (!testEncrypted(d, ea, secretKey)) exit(0);
 
+  // evaluate encrypted coefficients at an encrypted point, in the slots
+  if (!testEncryptedSlots(d+1, ea, secretKey)
+      || !testEncryptedSlots(2*d+1, ea, secretKey)) exit(0);
+  std::cout << "encrypted coefficients match, " << std::flush;
+
   // evaluate at random points (at least one co-prime with p)
   vector<long> x;
   ea.random(x);
@@ -114,7 +170,53 @@ void testIt(long d, long k, long p, long r, long m, long L,
       exit(0);
     }
   }
-  std::cout << "plaintext poly match\n" << std::flush;
+  std::cout << "plaintext poly match, " << std::flush;
+
+  // Evaluate several polynomials at once, sharing the powers of x
+  vector<ZZX> polys(3);
+  polys[0] = poly;
+  for (long i=d/2; i>=0; i--)
+    SetCoeff(polys[1], i, RandomBnd(p2r));
+  SetCoeff(polys[2], 0, RandomBnd(p2r));  // a constant
+  vector<Ctxt> outs;
+  polyEvalMany(outs, polys, inCtxt, k);
+
+  for (long j=0; j<lsize(polys); j++) {
+    ea.decrypt(outs[j], secretKey, y);
+    for (long i=0; i<ea.size(); i++) {
+      long ret = polyEvalMod(polys[j], x[i], p2r);
+      if (ret != y[i]) {
+        std::cout << "polyEvalMany MISMATCH\n";
+        exit(0);
+      }
+    }
+    if (!checkLevels(PolyEvalPlan(polys[j], p2r, k), inCtxt, outs[j])) {
+      std::cout << "polyEvalMany levels MISMATCH\n";
+      exit(0);
+    }
+  }
+  std::cout << "polyEvalMany match, " << std::flush;
+
+  // Apply a precomputed plan to several ciphertexts
+  PolyEvalPlan plan(poly, p2r, k);
+  vector<Ctxt> cts(2, inCtxt);
+  plan.apply(cts);
+  for (long j=0; j<lsize(cts); j++) {
+    ea.decrypt(cts[j], secretKey, y);
+    for (long i=0; i<ea.size(); i++) {
+      long ret = polyEvalMod(poly, x[i], p2r);
+      if (ret != y[i]) {
+        std::cout << "PolyEvalPlan MISMATCH\n";
+        exit(0);
+      }
+    }
+    if (!checkLevels(plan, inCtxt, cts[j])) {
+      std::cout << "PolyEvalPlan levels MISMATCH\n";
+      exit(0);
+    }
+  }
+  std::cout << "PolyEvalPlan match (depth "<<plan.levelsConsumed()<<")\n"
+            << std::flush;
 }
 
 void usage(char *prog) 
@@ -177,6 +177,17 @@ void  TestIt(long m, long p, long r, long d, long L, long bnd, long B)
 	    << ((B>0)? B : ea.size())
 	    << " vectors)\n";
   delete handler;
+
+  // The explicit version, whose handler is called concurrently
+  if (B <= 0) {
+    vector<Ctxt> v;
+    replicateAll(v, ea, xc0, bnd);
+    error = false;
+    for (long i = 0; i < lsize(v); i++)
+      if (!check_replicate(v[i], xc0, i, secretKey, ea)) error = true;
+    std::cout << "  replicateAll(vector) "
+              << (error? "failed :(\n" : "succeeded :)\n");
+  }
 }
 
 int main(int argc, char *argv[]) 
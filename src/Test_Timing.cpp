@@ -10,155 +10,33 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 
-/* Test_Timing.cpp - A program that tests the timing of various operations, outputs the results in a comma-separate-value (csv) format.
+/* Test_Timing.cpp - A benchmark suite for the library. Runs named
+ * benchmarks for the various primitives over a sweep of parameters
+ * (m, L, threads), and outputs the results in JSON format. Optionally
+ * compares the results against a stored baseline and flags regressions.
  */
 #include <cassert>
 #include <cstdio>
 #include <memory>
+#include <thread>
 #include <NTL/ZZ.h>
+#include <NTL/BasicThreadPool.h>
 NTL_CLIENT
 
 #include "FHE.h"
 #include "timing.h"
+#include "benchmark.h"
 #include "EncryptedArray.h"
 #include "matmul.h"
 #include "replicate.h"
 #include "permutations.h"
+#include "intraSlot.h"
+#include "binaryArith.h"
+#include "tableLookup.h"
+#include "counters.h"
+#include "numa.h"
 
-// We measure low-level timing at all levels
-class LowLvlTimingData {
-public:
-  long lvl;
-  double addConst;
-  double add;
-  double multConst;
-  double mult;
-  double multBy2;
-  double autoNative;
-  double autoTypical;
-  double innerProd;
-
-  explicit LowLvlTimingData(long _lvl=-1) {lvl=_lvl;}
-};
-
-// We only measure high-level timing at one level (lvl=8 or lower)
-class HighLvlTimingData {
-public:
-  long lvl;
-  double rotate;
-  double shift;
-  double permute;
-  double matmul;
-  double replicate;
-  double replAll;
-
-  explicit HighLvlTimingData(long _lvl=-1) {lvl=_lvl;}
-};
-
-class OtherTimingData {
-public:
-  double init2;
-  double init4;
-  double keyGen;
-  double encode2;
-  double encode2d;
-  double encode4;
-  double encode4d;
-  double encrypt;
-  double decode2;
-  double decode4;
-  double decrypt;
-};
-
-class TimingData {
-public:
-  long m;
-  long phim;
-  long nSlots;
-  long p;
-  vector<LowLvlTimingData> lowLvl;
-  HighLvlTimingData highLvl;
-  OtherTimingData other;
-
-  explicit TimingData(long _m=-1) {m=_m;}
-};
-
-static FHEtimer _init_timer_2("init2", "--");
-static FHEtimer _init_timer_4("init4", "--");
-
-void timeInit(long m, long p, long r, long d, long L, long nTests)
-{
-  for (long i=0; i<nTests; i++) {
-    cerr << "." << std::flush;
-
-    // Complicated mumbo-jumbo to get one of two timers, depending on r
-    auto_timer _init_timer((r>1)? &_init_timer_4 : &_init_timer_2);
-
-    FHEcontext context(m, p, r);
-
-    ZZX G;
-    if (d==1) SetX(G); // set G(X)=X
-    else G = context.alMod.getFactorsOverZZ()[0];
-
-    buildModChain(context, L, /*c=*/3);
-    EncryptedArray ea(context, G);
-    _init_timer.stop();
-
-    FHE_NTIMER_START(keyGen);
-    FHESecKey secretKey(context);
-    const FHEPubKey& publicKey = secretKey;
-    secretKey.GenSecKey(64); // A Hamming-weight-64 secret key
-    addSome1DMatrices(secretKey); // compute key-switching matrices
-    addSomeFrbMatrices(secretKey);
-    FHE_NTIMER_STOP(keyGen);
-
-    ZZX poly;
-    NewPlaintextArray pp(ea);
-    random(ea, pp);
-
-    Ctxt cc(publicKey);
-
-    if (r==1 && d==1) {
-      FHE_NTIMER_START(encode2);
-      ea.encode(poly, pp);
-      FHE_NTIMER_STOP(encode2);
-    }
-    else if (r==1 && d!=1) {
-      FHE_NTIMER_START(encode2d);
-      ea.encode(poly, pp);
-      FHE_NTIMER_STOP(encode2d);
-    }
-    else if (r!=1 && d==1) {
-      FHE_NTIMER_START(encode4);
-      ea.encode(poly, pp);
-      FHE_NTIMER_STOP(encode4);
-    }
-    else {
-      FHE_NTIMER_START(encode4d);
-      ea.encode(poly, pp);
-      FHE_NTIMER_STOP(encode4d);
-    }
-
-    FHE_NTIMER_START(encrypt);
-    publicKey.Encrypt(cc, poly);
-    FHE_NTIMER_STOP(encrypt);
-
-    FHE_NTIMER_START(decrypt);
-    secretKey.Decrypt(poly, cc);
-    FHE_NTIMER_STOP(decrypt);
-
-    if (r>1) {
-      FHE_NTIMER_START(decode4);
-      ea.decode(pp, poly);
-      FHE_NTIMER_STOP(decode4);
-    } else {
-      FHE_NTIMER_START(decode2);
-      ea.decode(pp, poly);
-      FHE_NTIMER_STOP(decode2);
-    }
-  }
-}
-
+static BenchmarkRunner runner;
 
 // Returns either a random automorphism amount or an amount
 // for which we have a key-switching matrix s^k -> s.
@@ -176,132 +54,6 @@ long rotationAmount(const EncryptedArray& ea, const FHEPubKey& publicKey,
   return k;
 }
 
-void timeOps(const EncryptedArray& ea, const FHEPubKey& publicKey, Ctxt& ret,
-	     const vector<Ctxt>& c, ZZX& p, long nTests, LowLvlTimingData& td)
-{
-  assert(c.size()>=3);
-  vector<Ctxt> cc = c;
-  // perform operations at a lower level
-  long level = td.lvl;
-  if (level>0) for (long i=0; i<(long)cc.size(); i++)
-    cc[i].modDownToLevel(level);
-  else {
-    level = cc[0].findBaseLevel();
-    td.lvl = level;
-  }
-
-  // inner-product of vectors
-  cerr << "." << std::flush;
-  FHE_NTIMER_START(innerProduct);
-  innerProduct(ret,cc,cc);
-  ret.modDownToLevel(ret.findBaseLevel());
-  FHE_NTIMER_STOP(innerProduct);
-
-  // Multiplication with 2,3 arguments
-  cerr << "." << std::flush;
-  for (long i=0; i<nTests; i++) {
-    Ctxt c0 = cc[0];
-    FHE_NTIMER_START(multiplyBy);
-    c0.multiplyBy(cc[1]);
-    c0.modDownToLevel(c0.findBaseLevel());
-    FHE_NTIMER_STOP(multiplyBy);
-    ret += c0; // Just so the compiler doesn't optimize it away
-  }
-
-  if (level > 2) {
-    cerr << "." << std::flush;
-    for (long i=0; i<nTests; i++) {
-      Ctxt c0 = cc[0];
-      FHE_NTIMER_START(multiplyBy2);
-      c0.multiplyBy2(cc[1],cc[2]);
-      c0.modDownToLevel(c0.findBaseLevel()); // mod-down if needed
-      FHE_NTIMER_STOP(multiplyBy2);
-      ret += c0; // Just so the compiler doesn't optimize it away
-    }
-  }
-
-  // Multiply by constant
-  cerr << "." << std::flush;
-  for (long i=0; i<4*nTests; i++) {
-    Ctxt c0 = cc[0];
-    FHE_NTIMER_START(multByConstant);
-    c0.multByConstant(p);
-    FHE_NTIMER_STOP(multByConstant);
-    ret -= c0; // Just so the compiler doesn't optimize it away
-  }
-
-  // Add constant
-  cerr << "." << std::flush;
-  for (long i=0; i<10*nTests; i++) {
-    Ctxt c0 = cc[0];
-    FHE_NTIMER_START(addConstant);
-    c0.addConstant(p);
-    FHE_NTIMER_STOP(addConstant);
-    ret += c0; // Just so the compiler doesn't optimize it away
-  }
-
-  // Addition
-  cerr << "." << std::flush;
-  for (long i=0; i<10*nTests; i++) {
-    FHE_NTIMER_START(add);
-    ret += cc[0];
-    FHE_NTIMER_STOP(add);
-  }
-
-  // Rotation by an amount k for which we have a key-switching matrix
-  cerr << "." << std::flush;
-  for (long i=0; i<nTests; i++) {
-    Ctxt c0 = cc[0];
-    long k = rotationAmount(ea,publicKey,/*withMatrix=*/true);
-    FHE_NTIMER_START(nativeAutomorph);
-    c0.smartAutomorph(k);
-    c0.modDownToLevel(c0.findBaseLevel());
-    FHE_NTIMER_STOP(nativeAutomorph);    
-    ret += c0; // Just so the compiler doesn't optimize it away
-  }
-  // Rotation by a random amount k
-  cerr << "." << std::flush;
-  for (long i=0; i<nTests; i++) {
-    Ctxt c0 = cc[0];
-    long k = rotationAmount(ea,publicKey,/*withMatrix=*/false);
-    FHE_NTIMER_START(automorph);
-    c0.smartAutomorph(k);
-    c0.modDownToLevel(c0.findBaseLevel()); // mod-down if needed
-    FHE_NTIMER_STOP(automorph);
-    ret += c0; // Just so the compiler doesn't optimize it away
-  }
-
-  // record the results
-  const FHEtimer *tp;
-
-  tp = getTimerByName("addConstant");
-  td.addConst = tp->getTime() / tp->getNumCalls();
-
-  tp = getTimerByName("add");
-  td.add = tp->getTime() / tp->getNumCalls();
-
-  tp = getTimerByName("multByConstant");
-  td.multConst = tp->getTime() / tp->getNumCalls();
-
-  tp = getTimerByName("multiplyBy");
-  td.mult = tp->getTime() / tp->getNumCalls();
-
-  tp = getTimerByName("multiplyBy2");
-  if (tp && tp->getNumCalls() > 0)
-    td.multBy2 = tp->getTime() / tp->getNumCalls();
-  else td.multBy2 = 0;
-
-  tp = getTimerByName("nativeAutomorph");
-  td.autoNative = tp->getTime() / tp->getNumCalls();
-
-  tp = getTimerByName("automorph");
-  td.autoTypical = tp->getTime() / tp->getNumCalls();
-
-  tp = getTimerByName("innerProduct");
-  td.innerProd = tp->getTime() / tp->getNumCalls();
-  resetAllTimers();
-}
-
 // Implementation of the various random matrices is found here
 #include "randomMatrices.h"
 /*
@@ -331,310 +83,461 @@ public:
   virtual void handle(const Ctxt& ctxt) {}
 };
 
-void timeHighLvl(const EncryptedArray& ea, const FHEPubKey& publicKey,
-		 Ctxt& ret, const vector<Ctxt>& c, GeneratorTrees& trees,
-		 long nTests, HighLvlTimingData& td)
+
+// Benchmark the primitives for one point (m,L,threads) of the sweep
+void benchPrimitives(long m, long p, long L, long nThreads, bool high)
 {
-  Ctxt tmp = c[0];
-  tmp.modDownToLevel(td.lvl);
-  cerr << "." << std::flush;
-  std::unique_ptr< MatMulFull > ptr(buildRandomFullMatrix(ea));
-  if (ea.getTag()==PA_GF2_tag) {
-    RandomFullMatrix<PA_GF2>::ExecType mat_exec(*ptr);
-    mat_exec.upgrade();
-    FHE_NTIMER_START(MatMul);
-    mat_exec.mul(tmp);
-    FHE_NTIMER_STOP(MatMul);
-  } else {
-    RandomFullMatrix<PA_zz_p>::ExecType mat_exec(*ptr);
-    mat_exec.upgrade();
-    FHE_NTIMER_START(MatMul);
-    mat_exec.mul(tmp);
-    FHE_NTIMER_STOP(MatMul);
-  }
-  ret = tmp;
-
-  for (long i=0; i<nTests; i++) {
-    cerr << "." << std::flush;
-    long nSlots = ea.size();
-    long r = RandomBnd(nSlots);
-    tmp = c[i % c.size()];
-    tmp.modDownToLevel(td.lvl);
-    // time rotation
-    FHE_NTIMER_START(rotate);
-    ea.rotate(tmp, r);
-    FHE_NTIMER_STOP(rotate);
-    // time shift, amount between -nSlots/2 and +nSlots/2
-    if (r>nSlots/2) r -= nSlots;
-    FHE_NTIMER_START(shift);
-    ea.shift(tmp, r);
-    FHE_NTIMER_STOP(shift);
-    ret += tmp; // just so the compiler will not optimize it out
+  SetNumThreads(nThreads);
+  BenchParams prm = { {"m", m}, {"L", L}, {"threads", nThreads} };
+  cerr << "\nm="<<m<<", L="<<L<<", threads="<<nThreads << std::flush;
+
+  runner.run("context", prm, [&]() {
+      FHEcontext context(m, p, /*r=*/1);
+      buildModChain(context, L, /*c=*/3);
+    });
+
+  FHEcontext context(m, p, /*r=*/1);
+  buildModChain(context, L, /*c=*/3);
+  ZZX G; SetX(G); // G(X) = X
+  EncryptedArray ea(context, G);
+
+  runner.run("keyGen", prm, [&]() {
+      FHESecKey secretKey(context);
+      secretKey.GenSecKey(64);
+      addSome1DMatrices(secretKey);
+    });
+
+  FHESecKey secretKey(context);
+  const FHEPubKey& publicKey = secretKey;
+  secretKey.GenSecKey(64); // A Hamming-weight-64 secret key
+  addSome1DMatrices(secretKey); // compute key-switching matrices
+  addSomeFrbMatrices(secretKey);
+
+  NewPlaintextArray pp(ea);
+  random(ea, pp);
+  ZZX poly;
+  ea.encode(poly, pp);
+
+  vector<Ctxt> c(3, Ctxt(publicKey));
+  for (long i=0; i<lsize(c); i++) {
+    random(ea, pp);
+    ea.encrypt(c[i], publicKey, pp);
   }
+  Ctxt tmp(publicKey), ret(publicKey);
+  long level = c[0].findBaseLevel();
 
+  // NTT modulo a single prime
   cerr << "." << std::flush;
-  for (long i=0; i<nTests && i<ea.size(); i++) {
-    tmp = c[i % c.size()];
-    tmp.modDownToLevel(td.lvl);
-    FHE_NTIMER_START(replicate);
-    replicate(ea, tmp, i);
-    FHE_NTIMER_STOP(replicate);    
-    ret += tmp; // just so the compiler will not optimize it out
+  {
+    const Cmodulus& cm = context.ithModulus(0);
+    vec_long y;
+    zz_pX x;
+    runner.run("NTT", prm, [&]() { cm.FFT(y, poly); });
+    runner.run("iNTT", prm, [&]() { cm.iFFT(x, y); });
   }
 
+  // DoubleCRT operations
   cerr << "." << std::flush;
-  ReplicateDummy handler;
-  tmp = c[1];
-  tmp.modDownToLevel(td.lvl);
-  FHE_NTIMER_START(replicateAll);
-  replicateAll(ea, tmp, &handler);
-  FHE_NTIMER_STOP(replicateAll);
-  ret += tmp;
+  {
+    DoubleCRT d1(poly, context, context.ctxtPrimes);
+    DoubleCRT d2(d1), d3(d1);
+    ZZX out;
+    long k = context.zMStar.ZmStarGen(0);
+    runner.run("DoubleCRT/fromPoly", prm,
+               [&]() { DoubleCRT d(poly, context, context.ctxtPrimes); });
+    runner.run("DoubleCRT/toPoly", prm, [&]() { d1.toPoly(out); });
+    runner.run("DoubleCRT/add", prm, [&]() { d3 += d2; });
+    runner.run("DoubleCRT/mul", prm, [&]() { d3 *= d2; });
+    runner.run("DoubleCRT/automorph", prm, [&]() { d3.automorph(k); },
+               [&]() { d3 = d1; });
+  }
 
+  // encoding and encryption
   cerr << "." << std::flush;
-  Permut pi;
-  randomPerm(pi, trees.getSize());
-  tmp = c[2];
-  tmp.modDownToLevel(td.lvl);
+  runner.run("encode", prm, [&]() { ea.encode(poly, pp); });
+  runner.run("decode", prm, [&]() { ea.decode(pp, poly); });
+  runner.run("encrypt", prm, [&]() { publicKey.Encrypt(tmp, poly); });
+  runner.run("decrypt", prm, [&]() { secretKey.Decrypt(poly, c[0]); });
 
-  PermNetwork net;
-  FHE_NTIMER_START(permutation);
-  net.buildNetwork(pi, trees);  // Build a permutation network for pi
-  net.applyToCtxt(tmp, ea);         // Apply permutation netwrok
-  FHE_NTIMER_STOP(permutation);
-  ret +=tmp; // just so the compiler will not optimize it out
-
-  // record the timing data
-  const FHEtimer *tp;
+  // low-level ciphertext operations
+  cerr << "." << std::flush;
+  auto copy0 = [&]() { tmp = c[0]; };
+  runner.run("addConstant", prm, [&]() { tmp.addConstant(poly); }, copy0);
+  runner.run("add", prm, [&]() { tmp += c[1]; }, copy0);
+  runner.run("multByConstant", prm,
+             [&]() { tmp.multByConstant(poly); }, copy0);
+  runner.run("multiplyBy", prm, [&]() {
+      tmp.multiplyBy(c[1]);
+      tmp.modDownToLevel(tmp.findBaseLevel());
+    }, copy0);
+  if (level > 2)
+    runner.run("multiplyBy2", prm, [&]() {
+        tmp.multiplyBy2(c[1], c[2]);
+        tmp.modDownToLevel(tmp.findBaseLevel());
+      }, copy0);
+  runner.run("modSwitch", prm,
+             [&]() { tmp.modDownToLevel(level-1); }, copy0);
+
+  // Key switching of a ciphertext after an automorphism
+  long kNative = rotationAmount(ea, publicKey, /*withMatrix=*/true);
+  runner.run("keySwitch", prm, [&]() { tmp.reLinearize(); },
+             [&]() { tmp = c[0]; tmp.automorph(kNative); });
+
+  runner.run("automorph/native", prm, [&]() {
+      tmp.smartAutomorph(kNative);
+      tmp.modDownToLevel(tmp.findBaseLevel());
+    }, copy0);
+  long kAny = rotationAmount(ea, publicKey, /*withMatrix=*/false);
+  runner.run("automorph/typical", prm, [&]() {
+      tmp.smartAutomorph(kAny);
+      tmp.modDownToLevel(tmp.findBaseLevel());
+    }, copy0);
+  runner.run("innerProduct", prm, [&]() {
+      innerProduct(ret, c, c);
+      ret.modDownToLevel(ret.findBaseLevel());
+    });
+
+  // high-level operations
+  cerr << "." << std::flush;
+  long nSlots = ea.size();
+  long r = 1 + RandomBnd(nSlots-1);
+  runner.run("rotate", prm, [&]() { ea.rotate(tmp, r); }, copy0);
+  runner.run("shift", prm,
+             [&]() { ea.shift(tmp, (r>nSlots/2)? r-nSlots : r); }, copy0);
+
+  // matrix multiplication, the constants are encoded once up front
+  if (runner.enabled("matmul/1D")) {
+    std::unique_ptr<MatMul1D> mat(buildRandomMatrix(ea, 0));
+    MatMul1DExec exec(*mat);
+    exec.upgrade();
+    runner.run("matmul/1D", prm, [&]() { exec.mul(tmp); }, copy0);
+  }
+  if (runner.enabled("matmul/block1D")) {
+    std::unique_ptr<BlockMatMul1D> mat(buildRandomBlockMatrix(ea, 0));
+    BlockMatMul1DExec exec(*mat);
+    exec.upgrade();
+    runner.run("matmul/block1D", prm, [&]() { exec.mul(tmp); }, copy0);
+  }
+  if (runner.enabled("matmul/full")) {
+    std::unique_ptr<MatMulFull> mat(buildRandomFullMatrix(ea));
+    MatMulFullExec exec(*mat);
+    exec.upgrade();
+    runner.run("matmul/full", prm, [&]() { exec.mul(tmp); }, copy0);
+  }
+  if (runner.enabled("matmul/blockFull")) {
+    std::unique_ptr<BlockMatMulFull> mat(buildRandomFullBlockMatrix(ea));
+    BlockMatMulFullExec exec(*mat);
+    exec.upgrade();
+    runner.run("matmul/blockFull", prm, [&]() { exec.mul(tmp); }, copy0);
+  }
 
-  tp = getTimerByName("rotate");
-  td.rotate = tp->getTime() / tp->getNumCalls();
+  cerr << "." << std::flush;
+  runner.run("replicate", prm, [&]() { replicate(ea, tmp, r); }, copy0);
 
-  tp = getTimerByName("shift");
-  td.shift = tp->getTime() / tp->getNumCalls();
+  if (high) {
+    ReplicateDummy handler;
+    runner.run("replicateAll", prm,
+               [&]() { replicateAll(ea, c[0], &handler); });
 
-  tp = getTimerByName("permutation");
-  td.permute = tp->getTime() / tp->getNumCalls();
+    // Setup generator-descriptors for the PAlgebra generators
+    Vec<GenDescriptor> vec(INIT_SIZE, ea.dimension());
+    for (long i=0; i<ea.dimension(); i++)
+      vec[i] = GenDescriptor(/*order=*/ea.sizeOfDimension(i),
+			     /*good=*/ ea.nativeDimension(i), /*genIdx=*/i);
 
-  tp = getTimerByName("MatMul");
-  td.matmul = tp->getTime() / tp->getNumCalls();
+    // Get the generator-tree structures and the corresponding hypercube
+    GeneratorTrees trees;
+    trees.buildOptimalTrees(vec, /*widthBound=*/7);
 
-  tp = getTimerByName("replicate");
-  td.replicate = tp->getTime() / tp->getNumCalls();
+    // build network for a random permutation, also to add
+    // the key-switching matrices that it needs
+    Permut pi;
+    randomPerm(pi, trees.getSize());
+    PermNetwork net;
+    net.buildNetwork(pi, trees);
+    addMatrices4Network(secretKey, net);
 
-  tp = getTimerByName("replicateAll");
-  td.replAll = tp->getTime() / tp->getNumCalls();
-  resetAllTimers();
+    runner.run("permutation", prm, [&]() { net.applyToCtxt(tmp, ea); },
+               copy0);
+  }
+  cerr << "!" << std::flush;
 }
 
 
-void  TimeIt(long m, long p, TimingData& data, bool high=false)
+// Benchmark key switching and matrix multiplication from all the threads at
+// once, with the workers pinned to the NUMA nodes, without and then with
+// per-node copies of the keys and constants. The counters estimate the
+// cross-node traffic, as the bytes of keys and constants that were read
+// from another node.
+void benchNuma(long m, long p, long L, long nThreads)
 {
-  setTimersOn();
-  resetAllTimers();
-  long phim = phi_N(m);
-  long L = floor((7.2*phim)/(FHE_pSize* /*cc*/1.33* (110+/*k*/80)));
-  if (L<5) L=5; // Make sure we have at least a few primes
-
+  SetNumThreads(nThreads);
+  cerr << "\nnuma: m="<<m<<", L="<<L<<", threads="<<nThreads
+       << ", nodes="<<numaNodes() << std::flush;
 
-  // Initialize a context with r=2,d=1
-  auto_timer _init_timer(&_init_timer_4);
-  FHEcontext context(m, 2, 2);
+  FHEcontext context(m, p, /*r=*/1);
   buildModChain(context, L, /*c=*/3);
-
   ZZX G; SetX(G); // G(X) = X
   EncryptedArray ea(context, G);
-  _init_timer.stop();
 
-  FHE_NTIMER_START(keyGen);
   FHESecKey secretKey(context);
   const FHEPubKey& publicKey = secretKey;
-  secretKey.GenSecKey(64); // A Hamming-weight-64 secret key
-  addSome1DMatrices(secretKey); // compute key-switching matrices
-  FHE_NTIMER_STOP(keyGen);
+  secretKey.GenSecKey(64);
+  addSome1DMatrices(secretKey);
 
-  // record timing results for init/geygen, etc.
-  data.m = m;
-  data.phim = phim;
-  data.nSlots = ea.size();
-  data.p = p;
+  NewPlaintextArray pp(ea);
+  random(ea, pp);
+  Ctxt c(publicKey);
+  ea.encrypt(c, publicKey, pp);
+
+  std::unique_ptr<MatMul1D> mat(buildRandomMatrix(ea, 0));
+  MatMul1DExec exec(*mat);
+  exec.upgrade();
+
+  long kNative = rotationAmount(ea, publicKey, /*withMatrix=*/true);
+  long nTasks = 4*nThreads;
+  vector<Ctxt> tmp(nTasks, c);
+  auto reset = [&]() { for (long i: range(nTasks)) tmp[i] = c; };
+  auto keySwitch = [&]() {
+    parallelIndex(nTasks, [&](long i) {
+        tmp[i].smartAutomorph(kNative);
+        tmp[i].modDownToLevel(tmp[i].findBaseLevel());
+      });
+  };
+  auto matmul = [&]() {
+    parallelIndex(nTasks, [&](long i) { exec.mul(tmp[i]); });
+  };
+
+  bool countersWereOn = areCountersOn();
+  setNumaPinning(true);
+  for (long rep = 0; rep <= 1; rep++) {
+    setNumaReplication(rep);
+    BenchParams prm = { {"m", m}, {"L", L}, {"threads", nThreads},
+                        {"replicate", rep} };
+    runner.run("numa/keySwitch", prm, keySwitch, reset);
+    runner.run("numa/matmul1D", prm, matmul, reset);
+
+    // one more run of each, to count the bytes
+    setCountersOn();
+    reset();
+    FHEcounterSnapshot before = getCounterSnapshot();
+    keySwitch();
+    matmul();
+    FHEcounterSnapshot diff = getCounterSnapshot() - before;
+    if (!countersWereOn) setCountersOff();
+
+    unsigned long local = diff[FHE_CNT_NUMA_LOCAL_BYTES];
+    unsigned long remote = diff[FHE_CNT_NUMA_REMOTE_BYTES];
+    cerr << "\n  replicate="<<rep<<": "<<remote<<" of "<<(local+remote)
+         << " bytes of keys and constants read from another node";
+  }
+  setNumaReplication(false);
+  setNumaPinning(false);
+  cerr << endl;
+}
 
-  timeInit(m, p, /*r=*/1, /*d=*/1, L, /*nTests=*/4);
-  timeInit(m, p, /*r=*/1, /*d=*/0, L, /*nTests=*/4);
-  timeInit(m, p, /*r=*/2, /*d=*/1, L, /*nTests=*/4);
-  timeInit(m, p, /*r=*/2, /*d=*/0, L, /*nTests=*/4);
 
-  //  printAllTimers();
-  const FHEtimer *tp;
+// Parameters for bootstrapping, binary arithmetic and table lookup,
+// with m=1023=11*93, p=2
+static const long bootM = 1023;
+static const long bootMvec[] = { 11, 93 };
+static const long bootGens[] = { 838, 584 };
+static const long bootOrds[] = { 10, 6 };
 
-  tp = getTimerByName("init2");
-  data.other.init2 = tp? tp->getTime() / tp->getNumCalls() : 0;
+// Benchmark bootstrapping and the binary circuits
+void benchBootstrap(long nThreads)
+{
+  SetNumThreads(nThreads);
+  BenchParams prm = { {"m", bootM}, {"threads", nThreads} };
+  cerr << "\nbootstrapping m="<<bootM<<", threads="<<nThreads << std::flush;
+
+  Vec<long> mvec(INIT_SIZE, 2);
+  mvec[0] = bootMvec[0]; mvec[1] = bootMvec[1];
+  vector<long> gens(bootGens, bootGens+2);
+  vector<long> ords(bootOrds, bootOrds+2);
+
+  FHEcontext context(bootM, /*p=*/2, /*r=*/1, gens, ords);
+  context.bitsPerLevel = 25;
+  buildModChain(context, /*L=*/30, /*c=*/2, /*extraBits=*/8);
+  context.makeBootstrappable(mvec, /*t=*/0,
+                             /*flag=*/false, /*cacheType=DCRT*/2);
+  const EncryptedArray& ea = *context.ea;
+  std::vector<zzX> unpackSlotEncoding;
+  buildUnpackSlotEncoding(unpackSlotEncoding, ea);
 
-  tp = getTimerByName("init4");
-  data.other.init4 = tp? tp->getTime() / tp->getNumCalls() : 0;
+  FHESecKey secretKey(context);
+  const FHEPubKey& publicKey = secretKey;
+  secretKey.GenSecKey(/*Hweight=*/128);
+  addSome1DMatrices(secretKey);
+  addFrbMatrices(secretKey);
+  secretKey.genRecryptData();
 
-  tp = getTimerByName("keyGen");
-  data.other.keyGen = tp->getTime() / tp->getNumCalls();
+  cerr << "." << std::flush;
+  Ctxt ctxt(publicKey), tmp(publicKey);
+  {
+    NewPlaintextArray pp(ea);
+    random(ea, pp);
+    ea.encrypt(ctxt, publicKey, pp);
+  }
+  ctxt.modDownToLevel(5);
+  vector<string> stages = { "preProcess", "LinearTransform1",
+                            "extractDigitsPacked", "LinearTransform2" };
+  runner.run("bootstrap", prm, [&]() { secretKey.reCrypt(tmp); },
+             [&]() { tmp = ctxt; }, stages);
 
-  tp = getTimerByName("encode2");
-  data.other.encode2 = tp->getTime() / tp->getNumCalls();
+  // binary arithmetic on 8-bit and 4-bit numbers
+  cerr << "." << std::flush;
+  const long nBits = 8;
+  vector<Ctxt> a(nBits, Ctxt(publicKey)), b(nBits, Ctxt(publicKey));
+  for (long i=0; i<nBits; i++) {
+    secretKey.Encrypt(a[i], ZZX(RandomBnd(2)));
+    secretKey.Encrypt(b[i], ZZX(RandomBnd(2)));
+  }
+  runner.run("binaryArith/add", prm, [&]() {
+      vector<Ctxt> sum;
+      CtPtrs_vectorCt out(sum);
+      addTwoNumbers(out, CtPtrs_vectorCt(a), CtPtrs_vectorCt(b),
+                    /*sizeLimit=*/0, &unpackSlotEncoding);
+    });
+  vector<Ctxt> a4(a.begin(), a.begin()+4), b4(b.begin(), b.begin()+4);
+  runner.run("binaryArith/mult", prm, [&]() {
+      vector<Ctxt> prod;
+      CtPtrs_vectorCt out(prod);
+      multTwoNumbers(out, CtPtrs_vectorCt(a4), CtPtrs_vectorCt(b4),
+                     /*negative=*/false, /*sizeLimit=*/0,
+                     &unpackSlotEncoding);
+    });
+
+  // table lookup with a 4-bit index
+  cerr << "." << std::flush;
+  std::vector<zzX> T;
+  buildLookupTable(T, [](double x){ return 1/(x+1.0);},
+                   /*nbits_in=*/4, /*scale_in=*/0, /*sign_in=*/0,
+                   /*nbits_out=*/4, /*scale_out=*/-3, /*sign_out=*/0, ea);
+  runner.run("tableLookup", prm, [&]() {
+      tableLookup(tmp, T, CtPtrs_vectorCt(a4), &unpackSlotEncoding);
+    });
+  cerr << "!" << std::flush;
+}
 
-  tp = getTimerByName("encode2d");
-  data.other.encode2d = tp->getTime() / tp->getNumCalls();
 
-  tp = getTimerByName("encode4");
-  data.other.encode4 = tp->getTime() / tp->getNumCalls();
+/* Usage: Test_Timing_x [ name=value ]...
+ *   m         the values of m to sweep  [ default='[4051 4369 10261]' ]
+ *   L         the values of L to sweep  [ default='[0]', 0 means heuristic ]
+ *   threads   the numbers of threads to sweep  [ default='[1]' ]
+ *   scaling   sweep 1,2,4,...,128 threads (up to the number of cores)
+ *               and print the speedups  [ default=0 ]
+ *   p         plaintext base  [ default=2 ]
+ *   high      also benchmark replicateAll and permutations  [ default=0 ]
+ *   boot      also benchmark bootstrapping and binary circuits [ default=0 ]
+ *   numa      also benchmark NUMA pinning and replication  [ default=0 ]
+ *   filter    only run benchmarks whose name contains this string
+ *   warmup    number of runs before measuring  [ default=1 ]
+ *   runs      minimum number of measured runs  [ default=3 ]
+ *   time      minimum measured time per benchmark  [ default=0.5 ]
+ *   out       write the JSON results to this file  [ default=stdout ]
+ *   baseline  compare against the JSON results in this file
+ *   tolerance slowdown that counts as a regression  [ default=0.1 ]
+ */
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
 
-  tp = getTimerByName("encode4d");
-  data.other.encode4d = tp->getTime() / tp->getNumCalls();
+  Vec<long> ms(INIT_SIZE, 3);
+  ms[0] = 4051; ms[1] = 4369; ms[2] = 10261;
+  amap.arg("m", ms, "the values of m to sweep");
+  amap.note("e.g., m='[4051 10261]'");
 
-  tp = getTimerByName("encrypt");
-  data.other.encrypt = tp->getTime() / tp->getNumCalls();
+  Vec<long> Ls(INIT_SIZE, 1, 0L);
+  amap.arg("L", Ls, "the values of L to sweep, 0 means heuristic");
 
-  tp = getTimerByName("decrypt");
-  data.other.decrypt = tp->getTime() / tp->getNumCalls();
+  Vec<long> threads(INIT_SIZE, 1, 1L);
+  amap.arg("threads", threads, "the numbers of threads to sweep");
 
-  tp = getTimerByName("decode2");
-  data.other.decode2 = tp->getTime() / tp->getNumCalls();
+  bool scaling=false;
+  amap.arg("scaling", scaling, "sweep 1,2,4,...,128 threads, print speedups");
 
-  tp = getTimerByName("decode4");
-  data.other.decode4 = tp->getTime() / tp->getNumCalls();
-  resetAllTimers();
+  long p=2;
+  amap.arg("p", p, "plaintext base");
 
-  // time low-level operations
-  cerr << "#" << std::flush;
+  bool high=false;
+  amap.arg("high", high, "also benchmark replicateAll and permutations");
 
-  ZZX poly;
-  NewPlaintextArray pp(ea);
-  random(ea, pp);
-  ea.encode(poly, pp);
+  bool boot=false;
+  amap.arg("boot", boot, "also benchmark bootstrapping and binary circuits");
 
-  Ctxt cc(publicKey);
-  long nTests = 10;
-  vector<Ctxt> vc(nTests,cc);
-  for (long i=0; i<nTests; i++) {
-    random(ea, pp);
-    ea.encrypt(vc[i], publicKey, pp);
-  }
+  bool numa=false;
+  amap.arg("numa", numa, "also benchmark NUMA pinning and replication");
 
-  LowLvlTimingData td;
-  data.lowLvl.clear();
-  for (long i=2; i<2*L-1; i*=2) {
-    td.lvl=i;
-    timeOps(ea, publicKey, cc,vc, poly, nTests, td);
-    data.lowLvl.push_back(td);
-  }
-  td.lvl = 2*L -1;
-  timeOps(ea, publicKey, cc,vc, poly, nTests, td);
-  data.lowLvl.push_back(td);
+  amap.arg("filter", runner.filter,
+           "only run benchmarks whose name contains this string", NULL);
+  amap.arg("warmup", runner.warmup, "number of runs before measuring");
+  amap.arg("runs", runner.minRuns, "minimum number of measured runs");
+  amap.arg("time", runner.minTime, "minimum measured time per benchmark");
+  amap.arg("verbose", runner.verbose, "print the results as they come");
 
-  if (high && L > 4) { /// cannot test high-level routines at level <8
-    cerr << "#" << std::flush;
-    // Setup generator-descriptors for the PAlgebra generators
-    Vec<GenDescriptor> vec(INIT_SIZE, ea.dimension());
-    for (long i=0; i<ea.dimension(); i++)
-      vec[i] = GenDescriptor(/*order=*/ea.sizeOfDimension(i),
-			     /*good=*/ ea.nativeDimension(i), /*genIdx=*/i);
+  string out;
+  amap.arg("out", out, "write the JSON results to this file", "stdout");
 
-    // Some default for the width-bound, if not provided
-    //  long widthBound = log2((double)ea.size()) -1;
+  string baseline;
+  amap.arg("baseline", baseline, "compare against the results in this file",
+           NULL);
 
-    // Get the generator-tree structures and the corresponding hypercube
-    GeneratorTrees trees;
-    trees.buildOptimalTrees(vec, /*widthBound=*/7);
-    //  cout << " cost =" << cost << endl;
+  double tolerance=0.1;
+  amap.arg("tolerance", tolerance, "slowdown that counts as a regression");
 
-    // build network for a random permutation, for the sole purpose
-    // of adding key-switching matrices
-    Permut pi;
-    randomPerm(pi, trees.getSize());
-    PermNetwork net;
-    net.buildNetwork(pi, trees);
-    addMatrices4Network(secretKey, net);
+  amap.parse(argc, argv);
+  if (runner.maxRuns < runner.minRuns) runner.maxRuns = runner.minRuns;
 
-    data.highLvl.lvl = 8;
-    timeHighLvl(ea, publicKey, cc, vc, trees, nTests, data.highLvl);
+  if (scaling) {
+    long nCores = std::max(1L, long(std::thread::hardware_concurrency()));
+    threads.SetLength(0);
+    for (long t = 1; t <= 128; t *= 2) {
+      threads.append(std::min(t, nCores));
+      if (t >= nCores) break;
+    }
   }
-  cerr << "!" << std::flush;
-}
 
-void printTimeData(TimingData& td)
-{
-  if (td.m <=0) return;
-
-  OtherTimingData& otd = td.other;
-  HighLvlTimingData& hl = td.highLvl;
-  for (long i=0; i<(long)td.lowLvl.size(); i++) {
-    LowLvlTimingData& ll = td.lowLvl[i];
-    long lvl = ll.lvl;
-    cout <<td.p<<","<<td.m<<","<<td.phim<<","<<td.nSlots<<","
-	 <<otd.init2<<","<<otd.init4<<","<<otd.keyGen<<","
-	 <<otd.encode2<<","<<otd.encode2d<<","
-	 <<otd.encode4<<","<<otd.encode4d<<","
-	 <<otd.encrypt<<","<<otd.decrypt<<","
-	 <<otd.decode2<<","<<otd.decode4<<","
-	 <<lvl<<","<<ll.addConst<<","<<ll.add<<","<<ll.multConst<<","
-	 <<ll.mult<<",";
-    if (ll.multBy2>0.0) cout << ll.multBy2;
-    cout <<","<<ll.autoNative<<","
-	 <<ll.autoTypical<<","<<ll.innerProd;
-    if (lvl==hl.lvl)
-      cout <<","<<hl.rotate<<","<<hl.shift<<","<<hl.permute<<","
-	   <<hl.matmul<<","<<hl.replicate<<","<<hl.replAll;
-    cout << endl;
+  for (long t=0; t<threads.length(); t++) {
+    for (long i=0; i<ms.length(); i++)
+      for (long j=0; j<Ls.length(); j++) {
+        long L = Ls[j];
+        if (L<=0) { // the number of primes for about 80 bits of security
+          L = floor((7.2*phi_N(ms[i]))/(FHE_pSize* 1.33* (110+80)));
+          if (L<5) L=5; // Make sure we have at least a few primes
+        }
+        benchPrimitives(ms[i], p, L, threads[t], high);
+        if (numa) benchNuma(ms[i], p, L, threads[t]);
+      }
+    if (boot) benchBootstrap(threads[t]);
   }
-}
+  cerr << endl;
 
-void usage(char *prog) 
-{
-  cerr << "A program that tests the timing of various operations,\n";
-  cerr << "  outputs the results in a comma-separate-value (csv) format.\n";
-  cerr << "Usage: "<<prog<<" [ optional parameters ]... 2> logfile > results-file\n";
-  cerr << "results on stdout in comma-separated-value format, ";
-  cerr << "progress printed on stderr\n";
-  cerr << "  optional parameters have the form 'attr1=val1 attr2=val2 ...'\n";
-  cerr << "  e.g, 'm=11441 p=2 high=1'\n\n";
-  cerr << "  m determines the cyclotomic ring, defaults to all the set\n";
-  cerr << "    m in { 4051, 4369, 4859, 10261,11023,11441,\n";
-  cerr << "          18631,20485,21845, 49981,53261       }\n";
-  cerr << "  p is the plaintext base [default=2]" << endl;
-  cerr << "  high=1 will time also high-level procedures [default==0]\n";
-  exit(0);
-}
+  if (scaling) {
+    cerr << "\nspeedups:\n";
+    printScaling(cerr, runner.getResults());
+  }
 
-int main(int argc, char *argv[]) 
-{
-  argmap_t argmap;
-  argmap["p"] = "2";
-  argmap["m"] = "0";
-  argmap["high"] = "0";
-
-  // get parameters from the command line
-  if (!parseArgs(argc, argv, argmap)) usage(argv[0]);
-
-  long p = atoi(argmap["p"]);
-  long m = atoi(argmap["m"]);
-  long high = atoi(argmap["high"]);
-
-#define numTests 11
-  long ms[numTests] = { 4051, 4369, 4859, 10261,11023,11441,
-		 18631,20485,21845, 49981,53261};
-
-  cout << "p,m,phim,nSlots,init(p),init(p^2),keyGen,encode(F_p),encode(F_p^d),encode(Z_p^r),encode(R_(p^r)^d),encrypt,decrypt,decode(p),decode(p^2),level,addConst,add,multConst,mult,mult2,autoNative,autoTypical,inProd10";
-  if (high) cout << ",rotate,shift,permute,matmul,replicate,replAll\n";
-  else cout << endl;
-
-  TimingData td;
-  if (m>0) {
-    cerr << "\nTesting m="<<m; 
-    if (high) cerr << " (including high-level)";
-    TimeIt(m, p, td, high);
-    printTimeData(td);
+  if (out.empty()) runner.printJSON(cout);
+  else {
+    ofstream f(out.c_str());
+    runner.printJSON(f);
   }
-  else for (long i=0; i<numTests; i++) {
-      cerr << "\nTesting m="<<ms[i];
-      if (high) cout << " (including high-level)";
-      TimeIt(ms[i], p, td, /*timeHighLvl=*/high);
-      printTimeData(td);
+
+  if (!baseline.empty()) {
+    ifstream f(baseline.c_str());
+    if (!f) {
+      cerr << "cannot open baseline file "<<baseline<<endl;
+      return 1;
     }
+    vector<BenchResult> base;
+    readBenchResults(base, f);
+    long regressions =
+      compareBenchResults(cerr, runner.getResults(), base, tolerance);
+    if (regressions > 0) {
+      cerr << regressions << " regression(s)\n";
+      return 1;
+    }
+  }
+  return 0;
 }
@@ -124,7 +124,7 @@ int main(int argc, char *argv[])
     cout <<"input bitSizes="<<bitSize<<','<<bitSize2
          <<", output size bound="<<outSize
          <<", running "<<nTests<<" tests for each function\n";
-    if (nthreads>1) cout << "  using "<<NTL::AvailableThreads()<<" threads\n";
+    if (nthreads>1) cout << "  using "<<numFHEthreads()<<" threads\n";
     cout << "computing key-independent tables..." << std::flush;
   }
   FHEcontext context(m, p, /*r=*/1, gens, ords);
@@ -101,7 +101,7 @@ int main(int argc, char *argv[])
   if (verbose) {
     cout <<"input bitSize="<<bitSize
          <<", running "<<nTests<<" tests for each function\n";
-    if (nthreads>1) cout << "  using "<<NTL::AvailableThreads()<<" threads\n";
+    if (nthreads>1) cout << "  using "<<numFHEthreads()<<" threads\n";
     cout << "computing key-independent tables..." << std::flush;
   }
   FHEcontext context(m, p, /*r=*/1, gens, ords);
@@ -12,38 +12,12 @@
 // testPacking.cxx - testing uppack/repack functionality
 #include "intraSlot.h"
 
-int main(int argc, char **argv)
+// Pack (almost) d*n ciphertexts into n and unpack them back, returns true
+// if the unpacked ciphertexts decrypt to the original plaintexts
+static bool testPacking(const EncryptedArray& ea, const FHESecKey& secretKey,
+                        long n)
 {
-  ArgMapping amap;
-  long p=2;
-  amap.arg("p", p, "plaintext base");
-  long n=2;
-  amap.arg("n", n, "number of packed ciphertexts");
-  long r=1;
-  amap.arg("r", r,  "lifting");
-  long L=10;
-  amap.arg("L", L, "# of levels in the modulus chain");
-  long m=91;
-  amap.arg("m", m, "use specified value as modulus", NULL);
-  long seed=0;
-  amap.arg("seed", seed, "PRG seed");
-  amap.parse(argc, argv);
-
-  SetSeed(ZZ(seed));
-
-  FHEcontext context(m, p, r);
-  context.zMStar.printout();
-  buildModChain(context, L, 3);
-
-  ZZX G = context.alMod.getFactorsOverZZ()[0];
-  EncryptedArray ea(context, G);
-
-  FHESecKey secretKey(context);
   const FHEPubKey& publicKey = secretKey;
-  secretKey.GenSecKey(100); // A Hamming-weight-w secret key
-  addSome1DMatrices(secretKey); // compute key-switching matrices that we need
-  addFrbMatrices(secretKey);
-
   long d = ea.getDegree(); // size of each slot
   cout << "packing/unpaking "<<n<<"<-->"<<(n*d -1)<<" ciphertexts\n";
 
@@ -75,8 +49,52 @@ int main(int argc, char **argv)
     if (!equals(ea, p1[i], p2)) {
       cout << "BAD, ";
       cout << "p2["<<i<<"]="<<p2 << endl;
-      exit(0);
+      return false;
     }
   }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  ArgMapping amap;
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long n=2;
+  amap.arg("n", n, "number of packed ciphertexts");
+  long r=1;
+  amap.arg("r", r,  "lifting");
+  long L=10;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long m=91;
+  amap.arg("m", m, "use specified value as modulus", NULL);
+  long seed=0;
+  amap.arg("seed", seed, "PRG seed");
+  amap.parse(argc, argv);
+
+  SetSeed(ZZ(seed));
+
+  FHEcontext context(m, p, r);
+  context.zMStar.printout();
+  buildModChain(context, L, 3);
+
+  ZZX G = context.alMod.getFactorsOverZZ()[0];
+  EncryptedArray ea(context, G);
+
+  FHESecKey secretKey(context);
+  secretKey.GenSecKey(100); // A Hamming-weight-w secret key
+  addSome1DMatrices(secretKey); // compute key-switching matrices that we need
+  addFrbMatrices(secretKey);
+
+  // Two arrays with different G on the same context, used alternately so
+  // that the constants of one are never used for the other
+  ZZX G2 = makeIrredPoly(p, ea.getDegree());
+  if (G2 == G && context.alMod.getFactorsOverZZ().size() > 1)
+    G2 = context.alMod.getFactorsOverZZ()[1];
+  EncryptedArray ea2(context, G2);
+
+  if (!testPacking(ea, secretKey, n) || !testPacking(ea2, secretKey, n)
+      || !testPacking(ea, secretKey, n))
+    exit(0);
   cout << "Good\n";
 }
@@ -122,7 +122,7 @@ void TestIt(FHEcontext& context, long dim, bool verbose, long full, long block)
     ss << publicKey;
     cout << "\n  |pubKey|="<<ss.tellp()<<" bytes";}
     cout << ", security=" << context.securityLevel()<<endl;
-    cout << "  #threads="<<NTL::AvailableThreads();
+    cout << "  #threads="<<numFHEthreads();
     if (block)
       cout << "block-size="<<(ea.getPAlgebra().getOrdP());
     cout << ", vector-dimension="
@@ -9,6 +9,7 @@ namespace std {} using namespace std;
 namespace NTL {} using namespace NTL;
 #include <cstring>
 #include "homAES.h"
+#include "transcipher.h"
 #include "Ctxt.h"
 
 static long mValues[][14] = { 
@@ -59,6 +60,15 @@ int main(int argc, char **argv)
   bool packed=true;
   amap.arg("packed", packed, "use packed bootstrapping");
 
+  long batch=0;
+  amap.arg("batch", batch, "also encrypt this many states concurrently");
+
+  Vec<long> threads(INIT_SIZE, 1, 1L);
+  amap.arg("threads", threads, "the numbers of threads for the batch");
+
+  long ctrBytes=0;
+  amap.arg("ctr", ctrBytes, "also transcipher this many AES-CTR bytes");
+
   amap.parse(argc, argv);
   if (idx>5) idx = 5;
 
@@ -259,6 +269,80 @@ int main(int argc, char **argv)
     printNamedTimer(cout, "batchRecrypt");
     printNamedTimer(cout, "recryption");
   }
+
+  // Throughput of batch AES, with the pool running many states at once
+  if (batch>0) {
+    long ctxtsPerState = (boot && packed)? e : 1;
+    long nBatchBlocks = batch*nBlocks;
+    cout << "batch AES encryption of "<<batch<<" states, "
+         << nBatchBlocks<<" blocks\n";
+
+    Vec<uint8_t> batchPtxt(INIT_SIZE, nBatchBlocks*16);
+    Vec<uint8_t> expected(INIT_SIZE, nBatchBlocks*16);
+    {GF2X rnd;
+    random(rnd, 8*batchPtxt.length());
+    BytesFromGF2X(batchPtxt.data(), rnd, batchPtxt.length());}
+    for (long i=0; i<nBatchBlocks; i++)
+      Cipher(&expected[16*i], &batchPtxt[16*i], keySchedule, /*numRounds=*/10);
+
+    for (long t=0; t<threads.length(); t++) {
+      SetNumThreads(threads[t]);
+      vector< vector<Ctxt> > states;
+      tm = -GetTime();
+      hAES.batchAESenc(states, encryptedAESkey, batchPtxt, ctxtsPerState);
+      tm += GetTime();
+
+      Vec<ZZX> polys;
+      for (long i=0; i<(long)states.size(); i++)
+        for (long j=0; j<(long)states[i].size(); j++) {
+          polys.SetLength(polys.length()+1);
+          secretKey.Decrypt(polys[polys.length()-1], states[i][j]);
+        }
+      Vec<uint8_t> batchOut(INIT_SIZE, expected.length());
+      decode4AES(batchOut, polys, hAES.getEA());
+
+      cout << "  threads="<<threads[t]<<": "<<(nBatchBlocks/tm)
+           << " blocks/second ("<<tm<<" seconds)";
+      if (batchOut != expected) cout << " @ encryption error";
+      cout << endl;
+    }
+  }
+
+  // Transcipher AES-CTR data, fed in pieces as if it was read from a file
+  if (ctrBytes>0) {
+    cout << "AES-CTR transciphering of "<<ctrBytes<<" bytes "<< std::flush;
+    Vec<uint8_t> iv(INIT_SIZE, 16), data(INIT_SIZE, ctrBytes), uploaded;
+    {GF2X rnd;
+    random(rnd, 8*iv.length());
+    BytesFromGF2X(iv.data(), rnd, iv.length());
+    random(rnd, 8*data.length());
+    BytesFromGF2X(data.data(), rnd, data.length());}
+    aesCTR(uploaded, data, aesKey, iv); // what the client sends
+
+    vector<Ctxt> transciphered;
+    tm = -GetTime();
+    {HomAESctr ctr(hAES, encryptedAESkey, iv);
+    for (long i=0; i<ctrBytes; ) {
+      long len = min(ctrBytes-i, 1+RandomBnd(ctr.getBytesPerChunk()));
+      Vec<uint8_t> piece(INIT_SIZE, len);
+      memcpy(piece.data(), &uploaded[i], len);
+      ctr.process(transciphered, piece);
+      i += len;
+    }
+    ctr.finish(transciphered);}
+    tm += GetTime();
+
+    Vec<ZZX> polys(INIT_SIZE, transciphered.size());
+    for (long i=0; i<polys.length(); i++)
+      secretKey.Decrypt(polys[i], transciphered[i]);
+    Vec<uint8_t> back(INIT_SIZE, ctrBytes);
+    decode4AES(back, polys, hAES.getEA());
+    if (back != data)
+      cerr << "@ transciphering error\n";
+    else
+      cout << "in "<<tm<<" seconds ("<<(ctrBytes/tm)<<" bytes/second)\n";
+  }
+
 #if (defined(__unix__) || defined(__unix) || defined(unix))
   struct rusage rusage;
   getrusage( RUSAGE_SELF, &rusage );
@@ -84,13 +84,23 @@ static void invert(vector<Ctxt>& data); // Z -> Z^{-1} in GF(2^8)
 
 // Pack the ciphertexts in c in as few "fully packed" cipehrtext as possible.
 static void packCtxt(vector<Ctxt>& to, const vector<Ctxt>& from,
-		     const GF2X& XinSlots);
+		     const vector<PolyType>& packConsts);
 
 // Unpack the fully-packed ciphertext in from into the vector to. If to.size()>0
 // then do not unpack into more than to.size() ciphertexts. If 'from' does not
 // have enough ciphertexts to fill all of 'to' then pad with zeros.
 static void unackCtxt(vector<Ctxt>& to, const vector<Ctxt>& from,
-		      const Mat<GF2X>& unpackConsts);
+		      const vector< vector<PolyType> >& unpackConsts);
+
+// An empty constant, in the representation of the AES constants
+static inline PolyType emptyConst(const FHEcontext& context)
+{
+#ifdef USE_ZZX_POLY
+  return ZZX();
+#else
+  return PolyType(context);
+#endif
+}
 
 // Implementation of the class HomAES
 
@@ -191,6 +201,18 @@ void HomAES::setPackingConstants()
     ZZX tmp; ea.encode(tmp, slots);
     conv(unpacking[i][j], tmp);
   }
+
+  // Convert the packing/unpacking constants once, rather than on every use
+  const GF2XModulus& PhimX = ea.getTab().getPhimXMod();
+  packConsts.assign(e, emptyConst(context));
+  GF2X Xj(0,1); // X^j in all the slots, initially j=0
+  for (long j=0; j<e; j++) {
+    packConsts[j] = conv<ZZX>(Xj);
+    MulMod(Xj, Xj, XinSlots, PhimX);
+  }
+  unpackConsts.assign(e, packConsts);
+  for (long i=0; i<e; i++) for (long j=0; j<e; j++)
+    unpackConsts[i][j] = conv<ZZX>(unpacking[i][j]);
 }
 
 
@@ -206,8 +228,10 @@ void HomAES::homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
   if (1>(long)eData.size() || 1>(long)aesKey.size()) return; // no data/key
   //  long lvlBits = eData[0].getContext().bitsPerLevel;
 
-  for (long j=0; j<(long)eData.size(); j++)
+  long n = eData.size();
+  FHE_EXEC_INDEX(n, j)
     eData[j] += aesKey[0];  // initial key addition
+  FHE_EXEC_INDEX_END
 
   for (long i=1; i<(long)aesKey.size(); i++) { // apply the AES rounds
 
@@ -220,10 +244,10 @@ void HomAES::homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
     //    decryptAndPrint(cerr, eData[0], *dbgKey, *dbgEa);
 #endif
     if (eData[0].findBaseLevel() < 2) batchRecrypt(eData);
-    for (long j=0; j<(long)eData.size(); j++) { // GF2 affine transformation
+    FHE_EXEC_INDEX(n, j) // GF2 affine transformation
       applyLinPolyLL(eData[j], encAffMat, ea2.getDegree());
       eData[j].addConstant(affVec);
-    }
+    FHE_EXEC_INDEX_END
 #ifdef DEBUG_PRINTOUT
     CheckCtxt(eData[0], "+ After affine");
     //    cerr << " + After affine ";
@@ -232,14 +256,13 @@ void HomAES::homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
 
     // Apply RowShift/ColMix to each ciphertext
     if (eData[0].findBaseLevel() < 2) batchRecrypt(eData);
-    if (i<(long)aesKey.size()-1) {
-      for (long j=0; j<(long)eData.size(); j++)
+    bool last = (i==(long)aesKey.size()-1);
+    FHE_EXEC_INDEX(n, j)
+      if (!last)
 	encRowColTran(eData[j], encLinTran, ea2);
-    }
-    else { // For the last round apply only RowShift, not ColMix
-      for (long j=0; j<(long)eData.size(); j++)
+      else // For the last round apply only RowShift, not ColMix
 	encRowShift(eData[j], encLinTran, ea2);
-    }
+    FHE_EXEC_INDEX_END
 #ifdef DEBUG_PRINTOUT
     CheckCtxt(eData[0], "+ After rowShift/colMix");
     //    cerr << " + After rowShift/colMix ";
@@ -247,7 +270,9 @@ void HomAES::homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
 #endif
 
     // Key addition
-    for (long j=0; j<(long)eData.size(); j++) eData[j] += aesKey[i];
+    FHE_EXEC_INDEX(n, j)
+      eData[j] += aesKey[i];
+    FHE_EXEC_INDEX_END
   }
 }
 
@@ -284,20 +309,23 @@ void HomAES::homAESdec(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
   if (1>(long)eData.size() || 1>(long)aesKey.size()) return; // no data/key
   //  long lvlBits = eData[0].getContext().bitsPerLevel;
 
+  long n = eData.size();
   for (long i=aesKey.size()-1; i>0; i--) { // apply the AES rounds
     // Key addition
-    for (long j=0; j<(long)eData.size(); j++) eData[j] -= aesKey[i];
+    FHE_EXEC_INDEX(n, j)
+      eData[j] -= aesKey[i];
+    FHE_EXEC_INDEX_END
 
     // Apply RowShift/ColMix to each ciphertext
     if (eData[0].findBaseLevel() < 2) batchRecrypt(eData);
     //    if (eData[0].log_of_ratio() > (-lvlBits)) batchRecrypt(eData);
-    if (i<(long)aesKey.size()-1)
-      for (long j=0; j<(long)eData.size(); j++)
+    bool first = (i==(long)aesKey.size()-1);
+    FHE_EXEC_INDEX(n, j)
+      if (!first)
 	decRowColTran(eData[j], decLinTran, ea2);
-
-    else // For the first round apply only RowShift, not ColMix
-      for (long j=0; j<(long)eData.size(); j++)
+      else // For the first round apply only RowShift, not ColMix
 	decRowShift(eData[j], decLinTran, ea2);
+    FHE_EXEC_INDEX_END
 #ifdef DEBUG_PRINTOUT
     CheckCtxt(eData[0], "+ After rowShift/colMix");
     //    cerr << " + After rowShift/colMix ";
@@ -306,10 +334,10 @@ void HomAES::homAESdec(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
 
     // ByteSub
     if (eData[0].findBaseLevel() < 2) batchRecrypt(eData);
-    for (long j=0; j<(long)eData.size(); j++) { // GF2 affine transformation
+    FHE_EXEC_INDEX(n, j) // GF2 affine transformation
       eData[j].addConstant(affVec);
       applyLinPolyLL(eData[j], decAffMat, ea2.getDegree());
-    }
+    FHE_EXEC_INDEX_END
 #ifdef DEBUG_PRINTOUT
     CheckCtxt(eData[0], "+ After affine");
     //    cerr << " + After affine ";
@@ -324,8 +352,9 @@ void HomAES::homAESdec(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
 #endif
   }
 
-  for (long j=0; j<(long)eData.size(); j++)
+  FHE_EXEC_INDEX(n, j)
     eData[j] -= aesKey[0];  // final key addition
+  FHE_EXEC_INDEX_END
 }
 
 // Perform AES decryption on AES ciphertext bytes (ECB mode). The input
@@ -347,6 +376,79 @@ void HomAES::homAESdec(vector<Ctxt>& eData, const vector<Ctxt>& aesKey,
   homAESdec(eData, aesKey); // do the real work
 }
 
+// Recryption packs e ciphertexts into one, where GF(2^d)=GF(2^8)^e
+long HomAES::ctxtsPerRecrypt() const
+{
+  const FHEcontext& context = ea2.getContext();
+  if (!context.isBootstrappable()) return 1;
+  return context.ea->getDegree()/8;
+}
+
+// AES on many states concurrently. Each state runs through all the rounds
+// as a task of its own, and the per-ciphertext loops within it are nested
+// parallel loops, so the pool balances the work across the states: while
+// a few of them wait for their recryption others evaluate the S-box.
+void HomAES::batchAESenc(vector< vector<Ctxt> >& states,
+			 const vector<Ctxt>& aesKey) const
+{
+  FHE_TIMER_START;
+  TaskGroup group;
+  for (long i=0; i<(long)states.size(); i++) {
+    vector<Ctxt>& st = states[i];
+    group.run([&st, &aesKey, this]() { homAESenc(st, aesKey); });
+  }
+  group.wait();
+}
+
+void HomAES::batchAESdec(vector< vector<Ctxt> >& states,
+			 const vector<Ctxt>& aesKey) const
+{
+  FHE_TIMER_START;
+  TaskGroup group;
+  for (long i=0; i<(long)states.size(); i++) {
+    vector<Ctxt>& st = states[i];
+    group.run([&st, &aesKey, this]() { homAESdec(st, aesKey); });
+  }
+  group.wait();
+}
+
+// Encode raw bytes as dummy-encrypted states of ctxtsPerState ciphertexts
+static void bytesToStates(vector< vector<Ctxt> >& states, const Ctxt& like,
+			  const Vec<uint8_t>& inBytes, long ctxtsPerState,
+			  const EncryptedArrayDerived<PA_GF2>& ea2)
+{
+  Vec<ZZX> encodedBytes;
+  encode4AES(encodedBytes, inBytes, ea2); // encode as HE plaintext
+
+  long nCtxts = encodedBytes.length();
+  states.resize(divc(nCtxts, ctxtsPerState));
+  for (long i=0; i<(long)states.size(); i++) {
+    long first = i*ctxtsPerState;
+    long last = min(first+ctxtsPerState, nCtxts);
+    states[i].assign(last-first, Ctxt(ZeroCtxtLike, like));
+    for (long j=first; j<last; j++) // encode ptxt as HE ctxt
+      states[i][j-first].DummyEncrypt(encodedBytes[j]);
+  }
+}
+
+void HomAES::batchAESenc(vector< vector<Ctxt> >& states,
+			 const vector<Ctxt>& aesKey,
+			 const Vec<uint8_t>& inBytes, long ctxtsPerState) const
+{
+  if (ctxtsPerState<=0) ctxtsPerState = ctxtsPerRecrypt();
+  bytesToStates(states, aesKey[0], inBytes, ctxtsPerState, ea2);
+  batchAESenc(states, aesKey);
+}
+
+void HomAES::batchAESdec(vector< vector<Ctxt> >& states,
+			 const vector<Ctxt>& aesKey,
+			 const Vec<uint8_t>& inBytes, long ctxtsPerState) const
+{
+  if (ctxtsPerState<=0) ctxtsPerState = ctxtsPerRecrypt();
+  bytesToStates(states, aesKey[0], inBytes, ctxtsPerState, ea2);
+  batchAESdec(states, aesKey);
+}
+
 // Implementation of local functions
 
 
@@ -362,7 +464,7 @@ void HomAES::batchRecrypt(vector<Ctxt>& data) const
   vector<Ctxt>* pData = &data;
   vector<Ctxt> fullyPacked; // empty at first
   if (data.size()>1) {      // pack to save on recryption operations
-    packCtxt(fullyPacked, data, XinSlots);
+    packCtxt(fullyPacked, data, packConsts);
     pData = &fullyPacked;
   }
 
@@ -378,13 +480,15 @@ void HomAES::batchRecrypt(vector<Ctxt>& data) const
 
   // recrypt each ciphertext in the vector
   FHE_NTIMER_START(recryption);
-  for (long i=0; i<(long)pData->size(); i++)
+  long n = pData->size();
+  FHE_EXEC_INDEX(n, i)
     pk.reCrypt((*pData)[i]);
+  FHE_EXEC_INDEX_END
   FHE_NTIMER_STOP(recryption);
 
   // unpack back to the original vector, if needed
   if (fullyPacked.size()>0) {
-    unackCtxt(data, fullyPacked, unpacking);
+    unackCtxt(data, fullyPacked, unpackConsts);
   }
 
 #ifdef DEBUG_PRINTOUT
@@ -770,7 +874,8 @@ void decode4AES(Vec<uint8_t>& data, const Vec<ZZX>& encData,
 // the transformation X -> X^{-1} in GF(2^8)
 static void invert(vector<Ctxt>& data)
 {
-  for (long i=0; i<(long)data.size(); i++){ // compute X -> X^{254} on i'th ctxt
+  long n = data.size();
+  FHE_EXEC_INDEX(n, i) // compute X -> X^{254} on i'th ctxt
     Ctxt tmp1(data[i]);           // tmp1   = data[i] = X
     tmp1.frobeniusAutomorph(1);   // tmp1   = X^2   after Z -> Z^2
     data[i].multiplyBy(tmp1);     // data[i]= X^3
@@ -780,59 +885,43 @@ static void invert(vector<Ctxt>& data)
     data[i].multiplyBy(tmp2);     // data[i]= X^15
     data[i].frobeniusAutomorph(4);// data[i]= X^240 after Z -> Z^16
     data[i].multiplyBy(tmp1);     // data[i]= X^254
-  }
+  FHE_EXEC_INDEX_END
 }
 
 // Pack the ciphertexts in c in as few "fully packed" cipehrtext as possible.
 static void packCtxt(vector<Ctxt>& to, const vector<Ctxt>& from,
-		     const GF2X& XinSlots)
+		     const vector<PolyType>& packConsts)
 {
   FHE_TIMER_START;
   if (from.size() <= 1) { // nothing to do here
     to = from; return;
   }
 
-  // Get the context and the ea for "fully packed" polynomials
-  const FHEcontext& context = from[0].getContext();
-  const EncryptedArrayDerived<PA_GF2>& ea = context.ea->getDerived(PA_GF2());
-  const GF2XModulus& PhimX = ea.getTab().getPhimXMod();
-  long e = ea.getDegree() / 8; // the extension degree
+  long e = packConsts.size(); // the extension degree
   long nPacked = divc(from.size(), e); // How many fully-packed ciphertexts
 
   // Initialize the vector 'to' with empty cipehrtexts
   to.assign(nPacked, Ctxt(ZeroCtxtLike, from[0]));
 
-  // Each ctxt in 'to' is the result of packing <= e ctxts from 'from'
-  for (long i=0; i<(long) to.size(); i++) {
+  // Each ctxt in 'to' is the sum of X^j * from[e*i +j] for j<e
+  FHE_EXEC_INDEX(nPacked, i)
     to[i] = from[e*i];
-    if (e*i == (long)from.size()-1) break; // check if we are done packing
-
-    Ctxt tmp = from[e*i +1];
-    tmp.multByConstant(conv<ZZX>(XinSlots));
-    to[i] += tmp;
-    if (e*i == (long)from.size()-2) break; // check if we are done packing
-
-    GF2X X2i = XinSlots; // X^i, initially i=1
-    for (long j= e*i +2; j<e*(i+1) && j<(long)from.size(); j++) {
-      MulMod(X2i, X2i, XinSlots, PhimX);  // X^i
-      tmp = from[j];
-      tmp.multByConstant(conv<ZZX>(X2i));
+    for (long j=1; j<e && e*i +j<(long)from.size(); j++) {
+      Ctxt tmp = from[e*i +j];
+      tmp.multByConstant(packConsts[j]);
       to[i] += tmp;
     }
-  }
+  FHE_EXEC_INDEX_END
 }
 
 // Unpack the fully-packed ciphertext in from into the vector to. If to.size()>0
 // then do not unpack into more than to.size() ciphertexts. If 'from' does not
 // have enough ciphertexts to fill all of 'to' then pad with zeros.
 static void unackCtxt(vector<Ctxt>& to, const vector<Ctxt>& from,
-		      const Mat<GF2X>& unpackConsts)
+		      const vector< vector<PolyType> >& unpackConsts)
 {
   FHE_TIMER_START;
-  // Get the context and the ea for "fully packed" polynomials
-  const FHEcontext& context = from[0].getContext();
-  const EncryptedArrayDerived<PA_GF2>& ea = context.ea->getDerived(PA_GF2());
-  long e = ea.getDegree() / 8; // the extension degree
+  long e = unpackConsts.size(); // the extension degree
   long nUnpacked = from.size()*e; // How many lightly-packed ciphertexts
   if (to.size()==0) to.resize(nUnpacked, Ctxt(ZeroCtxtLike, from[0]));
   else {
@@ -841,8 +930,8 @@ static void unackCtxt(vector<Ctxt>& to, const vector<Ctxt>& from,
   }
   // At this point 'to' contains empty (zero) ciphertexts
 
-  long nPacked = divc(nUnpacked, 8);
-  for (long idx=0; idx<nPacked; idx++) {
+  long nPacked = divc(nUnpacked, e);
+  FHE_EXEC_INDEX(nPacked, idx)
     vector<Ctxt> conjugates(e, from[idx]); // Compute the conjugates, Z^{2^{8j}}
     for (long j=1; j<e; j++)
       conjugates[j].frobeniusAutomorph(8*j);
@@ -851,9 +940,9 @@ static void unackCtxt(vector<Ctxt>& to, const vector<Ctxt>& from,
       // Recall that to[idx*e +i] was initialize to zero
       for (long j=0; j<e; j++) {
 	Ctxt tmp = conjugates[j];
-	tmp.multByConstant(conv<ZZX>(unpackConsts[i][j]));
+	tmp.multByConstant(unpackConsts[i][j]);
 	to[idx*e +i] += tmp;
       }
     }
-  }
+  FHE_EXEC_INDEX_END
 }
@@ -1,10 +1,14 @@
 /** homAES.h - homomorphic AES using HElib
  */
+#ifndef _HOMAES_H_
+#define _HOMAES_H_
+
 #include <stdint.h>
 #include <NTL/ZZX.h>
 #include <NTL/GF2X.h>
 #include "EncryptedArray.h"
 #include "hypercube.h"
+#include "multicore.h"
 
 #ifdef USE_ZZX_POLY
 #define PolyType ZZX
@@ -27,6 +31,11 @@ class HomAES {
   GF2X XinSlots; // "Fully packed" poly with X in all the slots, for packing
   Mat<GF2X> unpacking; // constants for unpacking after recryption
 
+  // The same constants, converted once: packConsts[j] has X^j in all the
+  // slots, and unpackConsts[i][j] = unpacking[i][j]
+  vector<PolyType> packConsts;
+  vector< vector<PolyType> > unpackConsts;
+
   void batchRecrypt(vector<Ctxt>& data) const; // recryption during AES computation
 
 public:
@@ -54,8 +63,30 @@ public:
   void homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& eKey) const;
   void homAESdec(vector<Ctxt>& eData, const vector<Ctxt>& eKey) const;
 
+  //! In-place AES encryption/decryption of many independent states, each
+  //! one a vector of ciphertexts as for homAESenc/homAESdec. The states are
+  //! processed concurrently on the thread pool, so while some of them are
+  //! recrypted others go through the S-box, and threads that have nothing
+  //! to do help with the ciphertexts of either.
+  void batchAESenc(vector< vector<Ctxt> >& states,
+                   const vector<Ctxt>& eKey) const;
+  void batchAESdec(vector< vector<Ctxt> >& states,
+                   const vector<Ctxt>& eKey) const;
+
+  //! The same on "raw bytes", which are split into states of ctxtsPerState
+  //! ciphertexts each, ctxtsPerRecrypt() by default. Concatenating the states gives the output of
+  //! homAESenc/homAESdec on all the bytes.
+  void batchAESenc(vector< vector<Ctxt> >& states, const vector<Ctxt>& eKey,
+                   const Vec<uint8_t>& inBytes, long ctxtsPerState=0) const;
+  void batchAESdec(vector< vector<Ctxt> >& states, const vector<Ctxt>& eKey,
+                   const Vec<uint8_t>& inBytes, long ctxtsPerState=0) const;
+
   // utility functions
   const EncryptedArrayDerived<PA_GF2>& getEA() const { return ea2; }
+
+  //! The number of ciphertexts that are packed into one for recryption,
+  //! one if the context is not bootstrappable
+  long ctxtsPerRecrypt() const;
 };
 
 
@@ -64,3 +95,5 @@ void encode4AES(Vec<ZZX>& encData, const Vec<uint8_t>& data,
 		const EncryptedArrayDerived<PA_GF2>& ea2);
 void decode4AES(Vec<uint8_t>& data, const Vec<ZZX>& encData,
 		const EncryptedArrayDerived<PA_GF2>& ea2);
+
+#endif // _HOMAES_H_
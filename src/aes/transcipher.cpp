@@ -0,0 +1,172 @@
+/** transcipher.cpp - streaming AES-CTR transciphering using HomAES
+ */
+namespace std {} using namespace std;
+namespace NTL {} using namespace NTL;
+#include <cstring>
+#include "transcipher.h"
+
+// The counter block T_j = IV+j, as a 128-bit big-endian integer
+static void counterBlock(uint8_t out[16], const uint8_t iv[16], long j)
+{
+  unsigned long carry = j;
+  for (long i=15; i>=0; i--) {
+    carry += iv[i];
+    out[i] = carry & 0xff;
+    carry >>= 8;
+  }
+}
+
+// The keystream for one chunk, computed by a task of its own group. Waiting
+// for the group runs that task (or its parallel loops) on the calling
+// thread if no worker took it yet, and blocks until it completes otherwise.
+class HomAESctrChunk {
+public:
+  long index;
+  vector<Ctxt> keystream;
+  TaskGroup task;
+
+  HomAESctrChunk(long _index) : index(_index) {}
+};
+
+
+HomAESctr::HomAESctr(const HomAES& _hAES, const vector<Ctxt>& _eKey,
+		     const Vec<uint8_t>& _iv, long _lookahead,
+		     long _ctxtsPerChunk)
+  : hAES(_hAES), eKey(_eKey), lookahead(_lookahead), nextChunk(0)
+{
+  assert(_iv.length()==16 && !eKey.empty());
+  memcpy(iv, _iv.data(), 16);
+
+  ctxtsPerChunk = (_ctxtsPerChunk>0)? _ctxtsPerChunk : hAES.ctxtsPerRecrypt();
+  bytesPerChunk = ctxtsPerChunk * (hAES.getEA().size()/16) * 16;
+  if (lookahead<1) lookahead = 1;
+  schedule(); // start on the keystream before any data arrives
+}
+
+HomAESctr::~HomAESctr()
+{
+  // the tasks refer to the key and to hAES, wait for them to complete
+  for (long i=0; i<(long)inFlight.size(); i++)
+    try { inFlight[i]->task.wait(); } catch (...) {}
+}
+
+void HomAESctr::schedule()
+{
+  long blocksPerChunk = bytesPerChunk/16;
+  while ((long)inFlight.size() < lookahead) {
+    shared_ptr<HomAESctrChunk> chunk = make_shared<HomAESctrChunk>(nextChunk);
+    Vec<uint8_t> counters(INIT_SIZE, bytesPerChunk);
+    for (long j=0; j<blocksPerChunk; j++)
+      counterBlock(&counters[16*j], iv, nextChunk*blocksPerChunk +j);
+
+    const HomAES& aes = hAES;
+    const vector<Ctxt>& key = eKey;
+    // the chunk outlives its task, as it is waited for before it is
+    // dropped. Idle workers take the oldest tasks first, so the earlier
+    // chunks, which are needed first, start first.
+    HomAESctrChunk *c = chunk.get();
+    chunk->task.run([c, counters, &aes, &key]() {
+	aes.homAESenc(c->keystream, key, counters);
+      });
+
+    inFlight.push_back(chunk);
+    nextChunk++;
+  }
+}
+
+// Add nBytes<=bytesPerChunk of data to the keystream of the next chunk
+void HomAESctr::emit(vector<Ctxt>& out, const uint8_t* bytes, long nBytes)
+{
+  FHE_TIMER_START;
+  shared_ptr<HomAESctrChunk> chunk = inFlight.front();
+  inFlight.pop_front();
+  schedule(); // keep the pipeline full while we wait for this one
+  chunk->task.wait(); // rethrows what homAESenc threw, if anything
+
+  Vec<uint8_t> chunkBytes(INIT_SIZE, nBytes);
+  memcpy(chunkBytes.data(), bytes, nBytes);
+  Vec<ZZX> encoded;
+  encode4AES(encoded, chunkBytes, hAES.getEA());
+
+  // the encoding of the data lines up with that of the counter blocks, and
+  // adding in GF(2^8) is XOR
+  vector<Ctxt>& ks = chunk->keystream;
+  long n = encoded.length();
+  FHE_EXEC_INDEX(n, i)
+    ks[i].addConstant(encoded[i]);
+  FHE_EXEC_INDEX_END
+  for (long i=0; i<n; i++)
+    out.push_back(ks[i]);
+}
+
+long HomAESctr::process(vector<Ctxt>& out, const Vec<uint8_t>& bytes)
+{
+  long before = out.size();
+  long have = data.length();
+  data.SetLength(have + bytes.length());
+  if (bytes.length()>0)
+    memcpy(&data[have], bytes.data(), bytes.length());
+
+  long used = 0;
+  while (data.length() - used >= bytesPerChunk) {
+    emit(out, &data[used], bytesPerChunk);
+    used += bytesPerChunk;
+  }
+  if (used>0) { // drop the bytes that were transciphered
+    long rest = data.length() - used;
+    if (rest>0) memmove(data.data(), &data[used], rest);
+    data.SetLength(rest);
+  }
+  return out.size() - before;
+}
+
+long HomAESctr::finish(vector<Ctxt>& out)
+{
+  long before = out.size();
+  if (data.length()>0) {
+    emit(out, data.data(), data.length());
+    data.SetLength(0);
+  }
+  return out.size() - before;
+}
+
+long HomAESctr::process(vector<Ctxt>& out, istream& in)
+{
+  long before = out.size();
+  Vec<uint8_t> buf(INIT_SIZE, bytesPerChunk);
+  while (in) {
+    in.read((char*) buf.data(), bytesPerChunk);
+    long got = in.gcount();
+    if (got<=0) break;
+    Vec<uint8_t> piece(INIT_SIZE, got);
+    memcpy(piece.data(), buf.data(), got);
+    process(out, piece);
+  }
+  finish(out);
+  return out.size() - before;
+}
+
+
+void aesCTR(Vec<uint8_t>& out, const Vec<uint8_t>& data,
+	    const Vec<uint8_t>& aesKey, const Vec<uint8_t>& iv)
+{
+  extern long AESKeyExpansion(unsigned char roundKeySchedule[],
+			      unsigned char key[], int keyBits);
+  extern void Cipher(unsigned char out[16], unsigned char in[16],
+		     unsigned char roundKeySchedule[], int Nr);
+  assert(iv.length()==16);
+
+  uint8_t roundKeySchedule[240];
+  Vec<uint8_t> key(aesKey); // AESKeyExpansion takes a non-const pointer
+  long nRoundKeys =
+    AESKeyExpansion(roundKeySchedule, key.data(), key.length()*8);
+
+  out.SetLength(data.length());
+  uint8_t ctr[16], ks[16];
+  for (long j=0; 16*j < data.length(); j++) {
+    counterBlock(ctr, iv.data(), j);
+    Cipher(ks, ctr, roundKeySchedule, nRoundKeys-1);
+    for (long i=0; i<16 && 16*j+i < data.length(); i++)
+      out[16*j+i] = data[16*j+i] ^ ks[i];
+  }
+}
@@ -0,0 +1,79 @@
+/** transcipher.h - streaming AES-CTR transciphering using HomAES
+ *
+ * A client encrypts its data with AES in counter mode, C_j = P_j + AES_K(T_j)
+ * where T_j = IV+j (as a 128-bit big-endian integer), and sends C together
+ * with an HE encryption of the expanded key K. The counter blocks T_j do not
+ * depend on the data, so the server can encrypt them homomorphically ahead
+ * of time, getting an HE encryption of the keystream AES_K(T_j). Adding the
+ * AES ciphertext bytes to it as a constant yields HE ciphertexts that
+ * encrypt the plaintext P, packed as by encode4AES.
+ *
+ * The keystream is computed in chunks of ctxtsPerChunk ciphertexts, as
+ * background tasks of the thread pool (see TaskGroup), and up to lookahead
+ * chunks are kept in flight ahead of the data. The data can be fed in
+ * pieces of any size, as it is read, and the HE ciphertexts are output
+ * whenever a chunk of data is complete:
+ *
+ *   HomAESctr ctr(hAES, eKey, iv);
+ *   while (more data)
+ *     ctr.process(out, nextBytes);  // appends to out
+ *   ctr.finish(out);                // the rest, if any
+ */
+#ifndef _TRANSCIPHER_H_
+#define _TRANSCIPHER_H_
+
+#include <deque>
+#include <memory>
+#include "homAES.h"
+
+class HomAESctrChunk; // the keystream for one chunk, see transcipher.cpp
+
+class HomAESctr {
+  const HomAES& hAES;
+  const vector<Ctxt>& eKey;
+  uint8_t iv[16];
+
+  long ctxtsPerChunk;
+  long bytesPerChunk;
+  long lookahead;
+
+  long nextChunk;     // the number of the next chunk to schedule
+  Vec<uint8_t> data;  // bytes that were not transciphered yet
+  std::deque< std::shared_ptr<HomAESctrChunk> > inFlight;
+
+  HomAESctr(const HomAESctr&); // disable copying
+  HomAESctr& operator=(const HomAESctr&);
+
+  void schedule();  // keep lookahead chunks in flight
+  void emit(vector<Ctxt>& out, const uint8_t* bytes, long nBytes);
+
+public:
+  //! eKey is the HE-encrypted expanded AES key, as from encryptAESkey, and
+  //! iv is the initial 16-byte counter block. ctxtsPerChunk=0 means
+  //! hAES.ctxtsPerRecrypt(), so that each recryption is fully packed.
+  HomAESctr(const HomAES& hAES, const vector<Ctxt>& eKey,
+	    const Vec<uint8_t>& iv, long lookahead=2, long ctxtsPerChunk=0);
+
+  //! Waits for the keystream chunks that are still being computed
+  ~HomAESctr();
+
+  //! Feed the next AES-CTR ciphertext bytes, and append to out the HE
+  //! ciphertexts of all the chunks that are now complete. Returns the
+  //! number of ciphertexts that were appended.
+  long process(vector<Ctxt>& out, const Vec<uint8_t>& bytes);
+
+  //! Transcipher the remaining bytes, if any, and start over at the next
+  //! chunk. The slots past the end of the data are filled with keystream.
+  long finish(vector<Ctxt>& out);
+
+  //! Read in until the end and transcipher all of it, in chunks
+  long process(vector<Ctxt>& out, istream& in);
+
+  long getBytesPerChunk() const { return bytesPerChunk; }
+};
+
+//! The AES-CTR encryption (equivalently decryption) of data in the clear
+void aesCTR(Vec<uint8_t>& out, const Vec<uint8_t>& data,
+	    const Vec<uint8_t>& aesKey, const Vec<uint8_t>& iv);
+
+#endif // _TRANSCIPHER_H_
@@ -0,0 +1,243 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include "asyncCtxt.h"
+#include "EncryptedArray.h"
+#include "multicore.h"
+
+#ifdef FHE_THREADS
+#include <thread>
+#endif
+
+// A node of the graph of operations. A node keeps its inputs until it ran,
+// and its dependents until it finished, so the graph is freed as it runs.
+// The state only moves forward: PENDING -> RUNNING -> DONE/FAILED/CANCELLED,
+// or PENDING -> FAILED/CANCELLED when an input fails or is cancelled.
+// Each transition is made under mx by a single thread, and only that thread
+// releases the inputs: once a node is RUNNING, only run() can finish it.
+class AsyncCtxtNode : public std::enable_shared_from_this<AsyncCtxtNode> {
+public:
+  enum State { PENDING, RUNNING, DONE, FAILED, CANCELLED };
+
+  FHE_MUTEX_TYPE mx;
+  FHE_atomic_long state;
+  FHE_atomic_long cancelRequested;
+  long unresolved; // inputs that are not done yet, guarded by mx
+  long priority;
+
+  AsyncCtxt::UnaryOp unary;
+  AsyncCtxt::BinaryOp binary;
+  vector< shared_ptr<AsyncCtxtNode> > inputs;
+  vector< shared_ptr<AsyncCtxtNode> > dependents; // guarded by mx
+
+  unique_ptr<Ctxt> value;
+  std::exception_ptr error;
+
+  AsyncCtxtNode(long _priority)
+    : state(PENDING), cancelRequested(0), unresolved(0), priority(_priority) {}
+
+  bool finished() const { return state >= DONE; }
+
+  // Register with the inputs, and schedule the node if they are all done
+  void start()
+  {
+    // a failed input may finish this node, and clear inputs, in the loop
+    vector< shared_ptr<AsyncCtxtNode> > ins(inputs);
+    unresolved = lsize(ins) + 1; // +1 until we registered with all
+    for (long i = 0; i < lsize(ins); i++) {
+      AsyncCtxtNode& in = *ins[i];
+      {
+        FHE_MUTEX_GUARD(in.mx);
+        if (!in.finished()) {
+          in.dependents.push_back(shared_from_this());
+          continue;
+        }
+      }
+      inputFinished(in);
+    }
+    resolve();
+  }
+
+  void inputFinished(const AsyncCtxtNode& in)
+  {
+    if (in.state == DONE) resolve();
+    else finish(PENDING, State(long(in.state)), in.error);
+  }
+
+  void resolve()
+  {
+    {
+      FHE_MUTEX_GUARD(mx);
+      if (--unresolved > 0 || state != PENDING) return;
+    }
+    shared_ptr<AsyncCtxtNode> self = shared_from_this();
+    spawnTask([self]() { self->run(); }, priority);
+  }
+
+  void run()
+  {
+    {
+      FHE_MUTEX_GUARD(mx);
+      if (state != PENDING) return; // cancelled while waiting to start
+      state = RUNNING;
+    }
+
+    // the inputs are DONE, and no other thread modifies them from now on
+    try {
+      unique_ptr<Ctxt> out(new Ctxt(*inputs[0]->value));
+      if (binary) binary(*out, *inputs[1]->value);
+      else unary(*out);
+      value = std::move(out);
+    }
+    catch (...) {
+      finish(RUNNING, FAILED, std::current_exception());
+      return;
+    }
+    if (cancelRequested) {
+      value.reset();
+      finish(RUNNING, CANCELLED, nullptr);
+    }
+    else finish(RUNNING, DONE, nullptr);
+  }
+
+  // Move from state from to newState and notify the dependents, or do
+  // nothing if the node is not in state from
+  void finish(State from, State newState, std::exception_ptr err)
+  {
+    vector< shared_ptr<AsyncCtxtNode> > deps, ins;
+    {
+      FHE_MUTEX_GUARD(mx);
+      if (state != from) return;
+      error = err;
+      state = newState;
+      deps.swap(dependents);
+      ins.swap(inputs);
+    }
+    ins.clear();
+    for (long i = 0; i < lsize(deps); i++)
+      deps[i]->inputFinished(*this);
+  }
+
+  void cancel()
+  {
+    cancelRequested = 1; // a running operation checks the flag
+    finish(PENDING, CANCELLED, nullptr);
+  }
+};
+
+
+AsyncCtxt::AsyncCtxt(const Ctxt& ctxt)
+  : node(make_shared<AsyncCtxtNode>(0))
+{
+  node->value.reset(new Ctxt(ctxt));
+  node->state = AsyncCtxtNode::DONE;
+}
+
+AsyncCtxt::AsyncCtxt(const AsyncCtxt& in, const UnaryOp& fn, long priority)
+  : node(make_shared<AsyncCtxtNode>(priority))
+{
+  assert(!in.null());
+  node->unary = fn;
+  node->inputs.push_back(in.node);
+  node->start();
+}
+
+AsyncCtxt::AsyncCtxt(const AsyncCtxt& a, const AsyncCtxt& b,
+                     const BinaryOp& fn, long priority)
+  : node(make_shared<AsyncCtxtNode>(priority))
+{
+  assert(!a.null() && !b.null());
+  node->binary = fn;
+  node->inputs.push_back(a.node);
+  node->inputs.push_back(b.node);
+  node->start();
+}
+
+bool AsyncCtxt::ready() const
+{
+  return node && node->finished();
+}
+
+bool AsyncCtxt::cancelled() const
+{
+  return node && node->state == AsyncCtxtNode::CANCELLED;
+}
+
+void AsyncCtxt::wait() const
+{
+  assert(!null());
+  while (!node->finished()) {
+    if (runSpawnedTask()) continue; // help with pending operations
+#ifdef FHE_THREADS
+    std::this_thread::yield();
+#endif
+  }
+}
+
+const Ctxt& AsyncCtxt::get() const
+{
+  wait();
+  if (node->state == AsyncCtxtNode::FAILED)
+    std::rethrow_exception(node->error);
+  if (node->state == AsyncCtxtNode::CANCELLED)
+    throw AsyncCancelled();
+  return *node->value;
+}
+
+void AsyncCtxt::cancel() const
+{
+  if (node) node->cancel();
+}
+
+
+AsyncCtxt operator+(const AsyncCtxt& a, const AsyncCtxt& b)
+{
+  return AsyncCtxt(a, b, [](Ctxt& x, const Ctxt& y) { x += y; });
+}
+
+AsyncCtxt operator-(const AsyncCtxt& a, const AsyncCtxt& b)
+{
+  return AsyncCtxt(a, b, [](Ctxt& x, const Ctxt& y) { x -= y; });
+}
+
+AsyncCtxt operator*(const AsyncCtxt& a, const AsyncCtxt& b)
+{
+  return AsyncCtxt(a, b, [](Ctxt& x, const Ctxt& y) { x.multiplyBy(y); });
+}
+
+AsyncCtxt asyncRotate(const EncryptedArray& ea, const AsyncCtxt& a, long k,
+                      long priority)
+{
+  return AsyncCtxt(a, [&ea, k](Ctxt& x) { ea.rotate(x, k); }, priority);
+}
+
+AsyncCtxt asyncShift(const EncryptedArray& ea, const AsyncCtxt& a, long k,
+                     long priority)
+{
+  return AsyncCtxt(a, [&ea, k](Ctxt& x) { ea.shift(x, k); }, priority);
+}
+
+AsyncCtxt asyncAutomorph(const AsyncCtxt& a, long k, long priority)
+{
+  return AsyncCtxt(a, [k](Ctxt& x) { x.smartAutomorph(k); }, priority);
+}
+
+AsyncCtxt asyncMultByConstant(const AsyncCtxt& a, const ZZX& poly,
+                              long priority)
+{
+  return AsyncCtxt(a, [poly](Ctxt& x) { x.multByConstant(poly); }, priority);
+}
+
+AsyncCtxt asyncAddConstant(const AsyncCtxt& a, const ZZX& poly,
+                           long priority)
+{
+  return AsyncCtxt(a, [poly](Ctxt& x) { x.addConstant(poly); }, priority);
+}
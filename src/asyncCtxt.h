@@ -0,0 +1,114 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _ASYNC_CTXT_H_
+#define _ASYNC_CTXT_H_
+/**
+ * @file asyncCtxt.h
+ * @brief Asynchronous evaluation of ciphertext operations
+ *
+ * An AsyncCtxt is a handle to a ciphertext that may not have been computed
+ * yet. Operations on handles return new handles immediately, and record
+ * the operation together with the handles of its inputs. An operation is
+ * handed to the thread pool of multicore.h (see spawnTask) as soon as all
+ * its inputs are ready, so independent operations run concurrently without
+ * any explicit threading, e.g.
+ *
+ *   AsyncCtxt a(c0), b(c1);
+ *   AsyncCtxt x = a * b;                  // these two run concurrently
+ *   AsyncCtxt y = asyncRotate(ea, a, 3);
+ *   AsyncCtxt z = x + y;                  // this one waits for both
+ *   Ctxt result = z.get();
+ *
+ * Each operation copies its first input and modifies the copy, so the
+ * inputs are never modified. Operations that are waiting to start are
+ * started in order of their priority. Cancelling a handle cancels its
+ * operation if it did not start yet, and all the operations that depend
+ * on it. An operation that already started runs to completion, but its
+ * result is discarded. An exception thrown by an operation is rethrown by
+ * get(), of that handle and of all the handles that depend on it.
+ *
+ * The handles are cheap to copy, all copies refer to the same operation.
+ * With a single thread, every operation runs as soon as it is created.
+ **/
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include "Ctxt.h"
+
+class EncryptedArray;
+class AsyncCtxtNode;
+
+//! Thrown by AsyncCtxt::get() if the operation was cancelled
+class AsyncCancelled : public std::runtime_error {
+public:
+  AsyncCancelled() : std::runtime_error("AsyncCtxt: operation cancelled") {}
+};
+
+/**
+ * @class AsyncCtxt
+ * @brief A handle to the result of an asynchronous ciphertext operation
+ **/
+class AsyncCtxt {
+  std::shared_ptr<AsyncCtxtNode> node;
+
+public:
+  //! The operations, applied to a copy of the first input
+  typedef std::function<void(Ctxt&)> UnaryOp;
+  typedef std::function<void(Ctxt&, const Ctxt&)> BinaryOp;
+
+  //! An empty handle
+  AsyncCtxt() {}
+
+  //! A handle that is ready, with a copy of ctxt
+  explicit AsyncCtxt(const Ctxt& ctxt);
+
+  //! Apply fn to a copy of the result of in
+  AsyncCtxt(const AsyncCtxt& in, const UnaryOp& fn, long priority=0);
+
+  //! Apply fn to a copy of the result of a, with the result of b
+  AsyncCtxt(const AsyncCtxt& a, const AsyncCtxt& b, const BinaryOp& fn,
+            long priority=0);
+
+  bool null() const { return !node; }
+
+  //! Whether the operation completed, failed or was cancelled
+  bool ready() const;
+  bool cancelled() const;
+
+  //! Wait for the operation to complete. The calling thread runs pending
+  //! operations in the meantime, so it should not be called from within
+  //! a parallel loop.
+  void wait() const;
+
+  //! Wait for the result. Throws AsyncCancelled if the operation was
+  //! cancelled, and rethrows the exception of a failed operation.
+  const Ctxt& get() const;
+
+  //! Cancel the operation and the ones that depend on it
+  void cancel() const;
+};
+
+AsyncCtxt operator+(const AsyncCtxt& a, const AsyncCtxt& b);
+AsyncCtxt operator-(const AsyncCtxt& a, const AsyncCtxt& b);
+AsyncCtxt operator*(const AsyncCtxt& a, const AsyncCtxt& b); // multiplyBy
+
+AsyncCtxt asyncRotate(const EncryptedArray& ea, const AsyncCtxt& a, long k,
+                      long priority=0);
+AsyncCtxt asyncShift(const EncryptedArray& ea, const AsyncCtxt& a, long k,
+                     long priority=0);
+AsyncCtxt asyncAutomorph(const AsyncCtxt& a, long k, long priority=0);
+AsyncCtxt asyncMultByConstant(const AsyncCtxt& a, const ZZX& poly,
+                              long priority=0);
+AsyncCtxt asyncAddConstant(const AsyncCtxt& a, const ZZX& poly,
+                           long priority=0);
+
+#endif // _ASYNC_CTXT_H_
@@ -0,0 +1,248 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <algorithm>
+#include <map>
+#include <NTL/tools.h>
+#include "benchmark.h"
+#include "timing.h"
+
+BenchStats::BenchStats(const vector<double>& samples)
+{
+  runs = lsize(samples);
+  mean = median = stddev = min = max = 0.0;
+  if (runs == 0) return;
+
+  vector<double> v = samples;
+  sort(v.begin(), v.end());
+  min = v[0];
+  max = v[runs-1];
+  median = (runs % 2)? v[runs/2] : (v[runs/2 -1] + v[runs/2])/2;
+
+  for (long i = 0; i < runs; i++) mean += v[i];
+  mean /= runs;
+  if (runs > 1) {
+    for (long i = 0; i < runs; i++) stddev += (v[i]-mean)*(v[i]-mean);
+    stddev = sqrt(stddev/(runs-1));
+  }
+}
+
+string BenchResult::id() const
+{
+  stringstream ss;
+  ss << name << "[";
+  for (long i = 0; i < lsize(params); i++)
+    ss << (i? "," : "") << params[i].first << "=" << params[i].second;
+  ss << "]";
+  return ss.str();
+}
+
+// The time that was spent so far in the timers with this name
+static double timerTime(const string& name)
+{
+  return getTimeByName(name.c_str());
+}
+
+void BenchmarkRunner::run(const string& name, const BenchParams& params,
+                          std::function<void()> fn,
+                          std::function<void()> setup,
+                          const vector<string>& stages)
+{
+  if (!enabled(name)) return;
+
+  for (long i = 0; i < warmup; i++) {
+    if (setup) setup();
+    fn();
+  }
+
+  vector<double> samples;
+  vector< vector<double> > stageSamples(stages.size());
+  vector<double> stageStart(stages.size());
+  double total = 0.0;
+  while (lsize(samples) < maxRuns
+         && (lsize(samples) < minRuns || total < minTime)) {
+    if (setup) setup();
+    for (long j = 0; j < lsize(stages); j++)
+      stageStart[j] = timerTime(stages[j]);
+
+    double t = GetWallTime();
+    fn();
+    t = GetWallTime() - t;
+
+    samples.push_back(t);
+    total += t;
+    for (long j = 0; j < lsize(stages); j++)
+      stageSamples[j].push_back(timerTime(stages[j]) - stageStart[j]);
+  }
+
+  long first = lsize(results);
+  BenchResult res;
+  res.name = name;
+  res.params = params;
+  res.stats = BenchStats(samples);
+  results.push_back(res);
+  for (long j = 0; j < lsize(stages); j++) {
+    res.name = name + "/" + stages[j];
+    res.stats = BenchStats(stageSamples[j]);
+    results.push_back(res);
+  }
+
+  if (verbose)
+    for (long i = first; i < lsize(results); i++)
+      cerr << "  " << results[i].id() << ": median "
+           << results[i].stats.median << " over "
+           << results[i].stats.runs << " runs\n";
+}
+
+void BenchmarkRunner::printJSON(ostream& str) const
+{
+  str << "{\"benchmarks\": [";
+  for (long i = 0; i < lsize(results); i++) {
+    const BenchResult& res = results[i];
+    str << (i? ",\n" : "\n") << "{\"id\": \"" << res.id()
+        << "\", \"name\": \"" << res.name << "\", \"params\": {";
+    for (long j = 0; j < lsize(res.params); j++)
+      str << (j? ", \"" : "\"") << res.params[j].first << "\": "
+          << res.params[j].second;
+    str << "}, \"runs\": " << res.stats.runs
+        << ", \"mean\": " << res.stats.mean
+        << ", \"median\": " << res.stats.median
+        << ", \"stddev\": " << res.stats.stddev
+        << ", \"min\": " << res.stats.min
+        << ", \"max\": " << res.stats.max << "}";
+  }
+  str << "\n]}\n";
+}
+
+
+// A minimal reader for the output of printJSON, which has one result
+// per line. It is not a general JSON parser.
+
+// Returns the position right after "key": in line, or npos
+static size_t findKey(const string& line, const string& key, size_t pos=0)
+{
+  size_t i = line.find("\"" + key + "\":", pos);
+  return (i == string::npos)? i : i + key.size() + 3;
+}
+
+static bool readString(const string& line, size_t pos, string& val)
+{
+  size_t b = line.find('"', pos);
+  if (b == string::npos) return false;
+  size_t e = line.find('"', b+1);
+  if (e == string::npos) return false;
+  val = line.substr(b+1, e-b-1);
+  return true;
+}
+
+template<class T>
+static bool readNumber(const string& line, const string& key, T& val)
+{
+  size_t pos = findKey(line, key);
+  if (pos == string::npos) return false;
+  stringstream ss(line.substr(pos));
+  return bool(ss >> val);
+}
+
+void readBenchResults(vector<BenchResult>& results, istream& str)
+{
+  results.clear();
+  string line;
+  while (getline(str, line)) {
+    BenchResult res;
+    size_t pos = findKey(line, "name");
+    if (pos == string::npos || !readString(line, pos, res.name)) continue;
+
+    // the parameters: "params": {"m": 4051, "L": 10}
+    pos = findKey(line, "params");
+    size_t end = (pos == string::npos)? pos : line.find('}', pos);
+    if (end == string::npos) continue;
+    for (pos = line.find('"', pos); pos < end; pos = line.find('"', pos)) {
+      string key;
+      readString(line, pos, key);
+      pos = line.find(':', pos) + 1;
+      stringstream ss(line.substr(pos, end-pos));
+      long val;
+      if (!(ss >> val)) break;
+      res.params.push_back(make_pair(key, val));
+      pos = line.find_first_of(",}", pos);
+    }
+
+    if (!readNumber(line, "median", res.stats.median)) continue;
+    readNumber(line, "runs", res.stats.runs);
+    readNumber(line, "mean", res.stats.mean);
+    readNumber(line, "stddev", res.stats.stddev);
+    readNumber(line, "min", res.stats.min);
+    readNumber(line, "max", res.stats.max);
+    results.push_back(res);
+  }
+}
+
+long compareBenchResults(ostream& str, const vector<BenchResult>& current,
+                         const vector<BenchResult>& baseline,
+                         double tolerance)
+{
+  std::map<string, const BenchResult*> base;
+  for (long i = 0; i < lsize(baseline); i++)
+    base[baseline[i].id()] = &baseline[i];
+
+  long regressions = 0;
+  for (long i = 0; i < lsize(current); i++) {
+    const BenchResult& cur = current[i];
+    auto it = base.find(cur.id());
+    if (it == base.end() || it->second->stats.median <= 0.0) continue;
+
+    const BenchStats& old = it->second->stats;
+    double ratio = cur.stats.median / old.median;
+    bool slower = (ratio > 1.0 + tolerance && cur.stats.min > old.median);
+    bool faster = (ratio < 1.0 - tolerance && cur.stats.max < old.median);
+    if (slower) regressions++;
+
+    str << (slower? "REGRESSION " : (faster? "improvement " : "  ok       "))
+        << cur.id() << ": " << old.median << " -> " << cur.stats.median
+        << " (x" << ratio << ")\n";
+  }
+  return regressions;
+}
+
+void printScaling(ostream& str, const vector<BenchResult>& results,
+                  const string& param)
+{
+  // group the results by their id without param, keeping the order
+  vector<string> ids;
+  std::map< string, std::map<long, double> > curves;
+  for (long i = 0; i < lsize(results); i++) {
+    BenchResult res = results[i];
+    long val = -1;
+    for (long j = 0; j < lsize(res.params); j++)
+      if (res.params[j].first == param) {
+        val = res.params[j].second;
+        res.params.erase(res.params.begin() + j);
+        break;
+      }
+    if (val < 0) continue;
+
+    string id = res.id();
+    if (curves.count(id) == 0) ids.push_back(id);
+    curves[id][val] = res.stats.median;
+  }
+
+  for (long i = 0; i < lsize(ids); i++) {
+    const std::map<long, double>& curve = curves[ids[i]];
+    double base = curve.begin()->second;
+    str << ids[i] << ":";
+    for (auto it = curve.begin(); it != curve.end(); ++it) {
+      str << (it == curve.begin()? " " : ", ") << param << "=" << it->first
+          << " x" << ((it->second > 0.0)? base/it->second : 0.0);
+    }
+    str << "\n";
+  }
+}
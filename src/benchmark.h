@@ -0,0 +1,109 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _BENCHMARK_H_
+#define _BENCHMARK_H_
+/**
+ * @file benchmark.h
+ * @brief A harness for named benchmarks with JSON output
+ *
+ * A benchmark is a named function together with the parameters that it
+ * runs with (e.g., m=4051 L=10 threads=4). The BenchmarkRunner runs each
+ * benchmark a few times without measuring it, then repeatedly until both a
+ * minimum number of runs and a minimum total time are reached, and records
+ * summary statistics of the wall-clock times of these runs. The results
+ * are written as JSON, and can be read back and compared against a stored
+ * baseline to flag regressions.
+ **/
+#include <functional>
+#include "NumbTh.h"
+
+//! The parameters of a benchmark, as an ordered list of (name,value) pairs
+typedef vector< pair<string,long> > BenchParams;
+
+//! Summary statistics of the running times of a benchmark, in seconds
+class BenchStats {
+public:
+  long runs;
+  double mean, median, stddev, min, max;
+
+  BenchStats() : runs(0), mean(0), median(0), stddev(0), min(0), max(0) {}
+  explicit BenchStats(const vector<double>& samples);
+};
+
+class BenchResult {
+public:
+  string name;
+  BenchParams params;
+  BenchStats stats;
+
+  //! A string that identifies the benchmark and its parameters,
+  //! e.g. "rotate[m=4051,L=10,threads=1]"
+  string id() const;
+};
+
+/**
+ * @class BenchmarkRunner
+ * @brief Runs benchmarks and collects their results
+ **/
+class BenchmarkRunner {
+  vector<BenchResult> results;
+
+public:
+  long warmup;    // number of runs before measuring
+  long minRuns;   // run at least that many times,
+  double minTime; //   and until the runs take at least minTime seconds,
+  long maxRuns;   //   but no more than maxRuns times
+  string filter;  // only run benchmarks whose name contains filter
+  bool verbose;   // print each result to cerr as it is obtained
+
+  BenchmarkRunner() : warmup(1), minRuns(3), minTime(0.5), maxRuns(100),
+                      verbose(false) {}
+
+  //! Whether the filter selects the named benchmark
+  bool enabled(const string& name) const
+  { return filter.empty() || name.find(filter) != string::npos; }
+
+  //! Run and measure fn. If setup is given then it is called before each
+  //! run of fn, outside the measured time. Each name in stages is the name
+  //! of FHEtimers that fn runs through, the time that each run spends in
+  //! all the timers with that name is recorded as a separate result,
+  //! called name/stage.
+  void run(const string& name, const BenchParams& params,
+           std::function<void()> fn, std::function<void()> setup=nullptr,
+           const vector<string>& stages=vector<string>());
+
+  const vector<BenchResult>& getResults() const { return results; }
+
+  //! Write all the results as a JSON object
+  void printJSON(ostream& str) const;
+};
+
+//! Read results that were written by BenchmarkRunner::printJSON
+void readBenchResults(vector<BenchResult>& results, istream& str);
+
+//! Compare results to a baseline, printing one line for every benchmark
+//! that appears in both. A benchmark regressed if its median time exceeds
+//! the median of the baseline by more than the given fraction, and even
+//! its fastest run is slower than the baseline median (so that a few noisy
+//! runs do not count as a regression). Returns the number of regressions.
+long compareBenchResults(ostream& str, const vector<BenchResult>& current,
+                         const vector<BenchResult>& baseline,
+                         double tolerance=0.1);
+
+//! Print the speedup of every benchmark as a function of one parameter,
+//! relative to the smallest value of that parameter, one line for each
+//! setting of the other parameters, e.g.
+//!   rotate[m=4051,L=10]: threads=1 x1, threads=2 x1.9, threads=4 x3.5
+void printScaling(ostream& str, const vector<BenchResult>& results,
+                  const string& param="threads");
+
+#endif // _BENCHMARK_H_
@@ -22,7 +22,7 @@
 #include <atomic>
 #include <mutex>          // std::mutex, std::unique_lock
 
-#include <NTL/BasicThreadPool.h>
+#include "multicore.h"
 #include "binaryArith.h"
 
 #ifdef DEBUG_PRINTOUT
@@ -287,7 +287,7 @@ void AddDAG::apply(CtPtrs& sum,
     sum[i]->clear();
 
   // Allow multi-threading in this loop
-  NTL_EXEC_RANGE(sizeLimit, first, last)
+  FHE_EXEC_RANGE(sizeLimit, first, last)
   for (long i=first; i<last; i++) { //  for (long i=0; i<sizeLimit; i++) {
     if (i<bSize)
       addCtxtFromNode(*(sum[i]), this->findP(i,i), a, b);
@@ -296,7 +296,7 @@ void AddDAG::apply(CtPtrs& sum,
       if (node!=nullptr) addCtxtFromNode(*(sum[i]), node, a, b);
     }
   }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
 }
 
 //! Get the ciphertext for a node, compiuting it as needed
@@ -580,7 +580,7 @@ static void three4Two(CtPtrs& lsb, CtPtrs& msb,
   resize(tmpLsb, lsbSize, Ctxt(ZeroCtxtLike,*ctptr));
   resize(tmpMsb, msbSize, Ctxt(ZeroCtxtLike,*ctptr));
 
-  NTL_EXEC_RANGE(msbSize-1, first, last)
+  FHE_EXEC_RANGE(msbSize-1, first, last)
   for (long i=first; i<last; i++) {
     if (i<lsize(*p1))
       three4Two(&tmpLsb[i], &tmpMsb[i+1], (*p1)[i], (*p2)[i], (*p3)[i]);
@@ -589,7 +589,7 @@ static void three4Two(CtPtrs& lsb, CtPtrs& msb,
     }
     else if (p3->isSet(i)) tmpLsb[i] = *((*p3)[i]);
   }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
 
   if (msbSize==lsbSize) { // we only computed upto lsbSize-1, do the last LSB
     if (p1->isSet(lsbSize-1)) tmpLsb[lsbSize-1] =  *((*p1)[lsbSize-1]);
@@ -653,7 +653,7 @@ void addManyNumbers(CtPtrs& sum, CtPtrMat& numbers, long sizeLimit,
       if (leftOver>1) numPtrs2[1] = numPtrs[3*nTriples +1];
     }
     // Allow multi-threading in this loop
-    //    NTL_EXEC_RANGE(nTriples, first, last)
+    //    FHE_EXEC_RANGE(nTriples, first, last)
     //    for (long i=first; i<last; i++) {   // call the three-for-two procedure
     for (long i=0; i<nTriples; i++) {   // call the three-for-two procedure
       three4Two(*numPtrs[3*i], *numPtrs[3*i+1], // three4Two works in-place
@@ -662,7 +662,7 @@ void addManyNumbers(CtPtrs& sum, CtPtrMat& numbers, long sizeLimit,
       numPtrs2[leftOver +2*i]    = numPtrs[3*i]; // copy the output pointers
       numPtrs2[leftOver +2*i +1] = numPtrs[3*i +1];
     }
-    //    NTL_EXEC_RANGE_END
+    //    FHE_EXEC_RANGE_END
     numPtrs.swap(numPtrs2);   // swap input/output vectors
     leftInQ = lsize(numPtrs); // update the size
   }
@@ -692,13 +692,13 @@ static void multByNegative(CtPtrs& product, const CtPtrs& a, const CtPtrs& b,
     }
   long nPairs = lsize(pairs);
 
-  NTL_EXEC_RANGE(nPairs, first, last)
+  FHE_EXEC_RANGE(nPairs, first, last)
   for (long idx=first; idx<last; idx++) {
     long i,j; std::tie(i,j) = pairs[idx];
     numbers[i][j] = *(b[j-i]);
     numbers[i][j].multiplyBy(*(a[i]));   // multiply by the bit of a
   }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
 
   // sign extension
   for (long i=0; i<nNums; i++) for (long j=i+lsize(b); j<resSize; j++) {
@@ -784,13 +784,13 @@ void multTwoNumbers(CtPtrs& product, const CtPtrs& a, const CtPtrs& b,
       pairs.push_back(std::pair<long,long>(i,j));
   }
   long nPairs = lsize(pairs);
-  NTL_EXEC_RANGE(nPairs, first, last)
+  FHE_EXEC_RANGE(nPairs, first, last)
   for (long idx=first; idx<last; idx++) {
     long i,j; std::tie(i,j) = pairs[idx];
     numbers[i][j] = *(a[j-i]);
     numbers[i][j].multiplyBy(*(b[i])); // multiply by the bit of b
   }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
 
   CtPtrMat_VecCt nums(numbers); // A wrapper aroune numbers
 #ifdef DEBUG_PRINTOUT
@@ -893,51 +893,49 @@ static void fifteen4Four(const CtPtrs& out, const CtPtrs& in, long sizeLimit)
   Ctxt& d2=b7;  Ctxt& d3=b9;  Ctxt& d4=f2;
   Ctxt& e2=c1;  Ctxt& e3=c2;  Ctxt& e4=f2;
 
-  long nThreads = std::min(NTL::AvailableThreads(), 3L);
-  NTL_EXEC_INDEX(nThreads, index)     // run these three lines in parallel
+  FHE_EXEC_INDEX(3, index)            // run these three lines in parallel
   switch (index) {
   case 0: three4Two(&b1,&b2,in[0],in[1],in[2]); // b2 b1 = 3for2(in[0..2])
-    if (nThreads>1) break;
+    break;
   case 1: three4Two(&b3,&b4,in[3],in[4],in[5]); // b4 b3 = 3for2(in[3..5])
-    if (nThreads>2) break;
+    break;
   default: three4Two(&b5,&b6,in[6],in[7],in[8]);// b6 b5 = 3for2(in[6..8])
   }
-  NTL_EXEC_INDEX_END
+  FHE_EXEC_INDEX_END
 
   three4Two(c1,c2, b1, b3, b5);         // c2 c1 = 3for2(b1,b3,b5)
 
   three4Two(c3,c4, b2, b4, b6);         // c4 c3 = 3for2(b2,b4,b6)
 
-  nThreads = std::min(NTL::AvailableThreads(), 2L);
-  NTL_EXEC_INDEX(nThreads, index)       // run these two lines in parallel
+  FHE_EXEC_INDEX(2, index)              // run these two lines in parallel
   switch (index) {
   case 0: three4Two(&b7,&b8,in[9],in[10],in[11]);   // b8 b7 = 3for2(in[9..11])
-    if (nThreads>1) break;
+    break;
   default: three4Two(&b9,&b10,in[12],in[13],in[14]);// b10 b9 = 3for2(in[12..14])
   }
-  NTL_EXEC_INDEX_END
+  FHE_EXEC_INDEX_END
 
-  NTL_EXEC_INDEX(nThreads, index)       // run these two lines in parallel
+  FHE_EXEC_INDEX(2, index)              // run these two lines in parallel
   switch (index) {
   case 0: three4Two(d1,d2, b7, b9, c1); // d2 d1 = 3for2(b7,b9,c1)
-    if (nThreads>1) break;
+    break;
   default: if (sizeLimit >= 2)
       three4Two(d3,d4, b8, b10, c2);    // d4 d3 = 3for2(b8,b10,c2)
   }
-  NTL_EXEC_INDEX_END
+  FHE_EXEC_INDEX_END
   if (sizeLimit < 2) return;
 
-  NTL_EXEC_INDEX(nThreads, index)       // run these two blocks in parallel
+  FHE_EXEC_INDEX(2, index)              // run these two blocks in parallel
   switch (index) {
   case 0: three4Two(e1,e2, c3, d2, d3); // e2 e1 = 3for2(c3,d2,d3)
-    if (nThreads>1) break;
+    break;
   default: if (sizeLimit >= 3) {
       e3 = c4;
       e3 += d4;                         // e3 = c4 ^ d4
       e4.multiplyBy(c4);                // e4 = c4 * d4 (e4 alias d4)
     }
   }
-  NTL_EXEC_INDEX_END
+  FHE_EXEC_INDEX_END
   if (sizeLimit < 3) return;
 
   f1 = e2;
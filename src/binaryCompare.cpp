@@ -23,6 +23,7 @@
 // #include <mutex>          // std::mutex, std::unique_lock
 
 #include <NTL/BasicThreadPool.h>
+#include "multicore.h"
 #include "binaryArith.h"
 
 #ifdef DEBUG_PRINTOUT
@@ -62,12 +63,12 @@ static void compProducts(const CtPtrs_slice& e, const CtPtrs_slice& g)
   compProducts(CtPtrs_slice(e,n1,n-n1), CtPtrs_slice(g,n1,n-n1));// second half
 
   // Multiply the first product in the 2nd part into every product in the 1st
-  NTL_EXEC_RANGE(1+n1, first, last)
+  FHE_EXEC_RANGE(1+n1, first, last)
   for (long i=first; i<last; i++) {
     if (i==0)               e[0]->multiplyBy(*e[n1]);
     else if (i-1<g.size()) g[i-1]->multiplyBy(*e[n1]);
   }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
 #ifdef DEBUG_PRINTOUT
   cout << " g["<<g.start<<".."<<(g.start+g.sz-1)<<"], "
        << " e["<<e.start<<".."<<(e.start+e.sz-1)<<"]:\n";
@@ -97,7 +98,7 @@ compEqGt(CtPtrs& aeqb, CtPtrs& agtb, const CtPtrs& a, const CtPtrs& b)
   // First compute the local bits e[i]=(a[i]==b[i]), gt[i]=(a[i]>b[i])
   FHE_NTIMER_START(compEqGt1);
   long aSize = lsize(a);
-  NTL_EXEC_RANGE(aSize, first, last)
+  FHE_EXEC_RANGE(aSize, first, last)
   for (long i=first; i<last; i++) {
     *aeqb[i] = *b[i];               // b
     aeqb[i]->addConstant(one, 1.0); // b+1
@@ -105,19 +106,19 @@ compEqGt(CtPtrs& aeqb, CtPtrs& agtb, const CtPtrs& a, const CtPtrs& b)
     *aeqb[i] += *a[i];              // a+b+1
     agtb[i]->multiplyBy(*a[i]);     // a(b+1)
   }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
   FHE_NTIMER_STOP(compEqGt1);
 
   // NOTE: Usually there isn't much gain in multi-threading the loop below,
   //    but computing b[i] can be expensive in some implementations of CtPtrs
   FHE_NTIMER_START(compEqGt2);
   if (lsize(b)-aSize >1) {
-    NTL_EXEC_RANGE(lsize(b)-aSize, first, last)
+    FHE_EXEC_RANGE(lsize(b)-aSize, first, last)
     for (long i=first; i<last; i++) {
       *aeqb[i+aSize] = *b[i+aSize];         // b
       aeqb[i+aSize]->addConstant(one, 1.0); // b+1
     }
-    NTL_EXEC_RANGE_END
+    FHE_EXEC_RANGE_END
   }
   else if (lsize(b)-aSize == 1) {
     *aeqb[aSize] = *b[aSize];         // b
@@ -190,7 +191,7 @@ void compareTwoNumbers(CtPtrs& max, CtPtrs& min, Ctxt& mu, Ctxt& ni,
   ni.addConstant(ZZ(1L));  // a <= b
   ni += *e[0];             // a < b
 
-  NTL_EXEC_RANGE(aSize, first, last)
+  FHE_EXEC_RANGE(aSize, first, last)
   for (long i=first; i<last; i++) {
     *max[i] = *a[i];
     *max[i] -= *b[i];
@@ -200,7 +201,7 @@ void compareTwoNumbers(CtPtrs& max, CtPtrs& min, Ctxt& mu, Ctxt& ni,
     *max[i] += *b[i];
     *min[i] -= *a[i];
   }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
   for (long i=aSize; i<bSize; i++)
     *max[i] = *b[i];
   FHE_NTIMER_STOP(compResults);
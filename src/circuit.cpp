@@ -0,0 +1,432 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <iomanip>
+#include <map>
+#include <tuple>
+#include "circuit.h"
+#include "asyncCtxt.h"
+
+static const char *opNames[CIRC_NUM_OPS] = {
+  "input", "add", "sub", "negate", "mul", "relin", "rotate", "addConst",
+  "mulConst", "modDown", "recrypt"
+};
+
+// A rough relative cost of the operations, to prioritize the critical path
+static const long opWeights[CIRC_NUM_OPS] = {
+  0, 1, 1, 1, 4, 8, 10, 2, 2, 2, 1000
+};
+
+const char *circuitOpName(long op) { return opNames[op]; }
+
+TracedCtxt Circuit::input()
+{
+  return TracedCtxt(*this, addNode(CIRC_INPUT, -1, -1, nInputs));
+}
+
+void Circuit::output(const TracedCtxt& t)
+{
+  addOutput(t.getNode());
+}
+
+long Circuit::addNode(CircuitOp op, long a, long b, long param)
+{
+  long n = lsize(nodes);
+  assert(a < n && b < n);
+  if (op == CIRC_INPUT) nInputs = max(nInputs, param+1);
+
+  CircuitNode node;
+  node.op = op;
+  node.in[0] = a;
+  node.in[1] = b;
+  node.param = param;
+  nodes.push_back(node);
+  return n;
+}
+
+long Circuit::addConstant(const ZZX& poly)
+{
+  for (long i = 0; i < lsize(constants); i++)
+    if (constants[i] == poly) return i;
+  constants.push_back(poly);
+  return lsize(constants)-1;
+}
+
+void Circuit::countOps(vector<long>& counts) const
+{
+  counts.assign(CIRC_NUM_OPS, 0);
+  for (long i = 0; i < lsize(nodes); i++)
+    counts[nodes[i].op]++;
+}
+
+long Circuit::depth() const
+{
+  vector<long> d(nodes.size(), 0);
+  for (long i = 0; i < lsize(nodes); i++) {
+    const CircuitNode& node = nodes[i];
+    for (long j = 0; j < 2; j++)
+      if (node.in[j] >= 0) d[i] = max(d[i], d[node.in[j]]);
+    if (node.op == CIRC_MUL) d[i]++;
+    else if (node.op == CIRC_RECRYPT) d[i] = 0;
+  }
+  long maxDepth = 0;
+  for (long i = 0; i < lsize(outputs); i++)
+    maxDepth = max(maxDepth, d[outputs[i]]);
+  return maxDepth;
+}
+
+void Circuit::print(ostream& str) const
+{
+  for (long i = 0; i < lsize(nodes); i++) {
+    const CircuitNode& node = nodes[i];
+    str << "  n" << i << " = " << opNames[node.op];
+    for (long j = 0; j < 2; j++)
+      if (node.in[j] >= 0) str << " n" << node.in[j];
+    if (node.op == CIRC_INPUT || node.op == CIRC_ROTATE
+        || node.op == CIRC_ADD_CONST || node.op == CIRC_MUL_CONST)
+      str << " " << node.param;
+    str << "\n";
+  }
+  str << "  outputs:";
+  for (long i = 0; i < lsize(outputs); i++)
+    str << " n" << outputs[i];
+  str << "\n";
+}
+
+
+// Add or subtract y, mod-switching the one with more primes down to the
+// primes of the other, rather than the one with fewer primes up
+static void addDown(Ctxt& x, const Ctxt& y, bool negative)
+{
+  if (x.getPrimeSet() == y.getPrimeSet()) {
+    x.addCtxt(y, negative);
+    return;
+  }
+  const FHEcontext& context = x.getContext();
+  if (context.logOfProduct(x.getPrimeSet())
+      > context.logOfProduct(y.getPrimeSet())) {
+    x.modDownToSet(y.getPrimeSet());
+    x.addCtxt(y, negative);
+  }
+  else {
+    Ctxt tmp(y);
+    tmp.modDownToSet(x.getPrimeSet());
+    x.addCtxt(tmp, negative);
+  }
+}
+
+void Circuit::execute(vector<Ctxt>& out, const vector<Ctxt>& in) const
+{
+  assert(lsize(in) >= nInputs);
+  long n = lsize(nodes);
+
+  // The priority of a node is the cost of the longest path to an output
+  vector<long> priority(n, 0);
+  for (long i = n-1; i >= 0; i--)
+    for (long j = 0; j < 2; j++) {
+      long k = nodes[i].in[j];
+      if (k >= 0)
+        priority[k] = max(priority[k], priority[i] + opWeights[nodes[i].op]);
+    }
+
+  const EncryptedArray& ea = this->ea;
+  vector<AsyncCtxt> vals(n);
+  for (long i = 0; i < n; i++) {
+    const CircuitNode& node = nodes[i];
+    long prio = priority[i];
+    long k = node.param;
+    AsyncCtxt a, b;
+    if (node.in[0] >= 0) a = vals[node.in[0]];
+    if (node.in[1] >= 0) b = vals[node.in[1]];
+
+    switch (node.op) {
+    case CIRC_INPUT:
+      vals[i] = AsyncCtxt(in[k]);
+      break;
+    case CIRC_ADD:
+      vals[i] = AsyncCtxt(a, b,
+        [](Ctxt& x, const Ctxt& y) { addDown(x, y, false); }, prio);
+      break;
+    case CIRC_SUB:
+      vals[i] = AsyncCtxt(a, b,
+        [](Ctxt& x, const Ctxt& y) { addDown(x, y, true); }, prio);
+      break;
+    case CIRC_NEGATE:
+      vals[i] = AsyncCtxt(a, [](Ctxt& x) { x.negate(); }, prio);
+      break;
+    case CIRC_MUL:
+      if (node.in[0] == node.in[1]) // Ctxt::operator*= handles squaring
+        vals[i] = AsyncCtxt(a, [](Ctxt& x) { x *= x; }, prio);
+      else
+        vals[i] = AsyncCtxt(a, b, [](Ctxt& x, const Ctxt& y) { x *= y; },
+                            prio);
+      break;
+    case CIRC_RELIN:
+      vals[i] = AsyncCtxt(a, [](Ctxt& x) { x.reLinearize(); }, prio);
+      break;
+    case CIRC_ROTATE:
+      vals[i] = AsyncCtxt(a, [&ea, k](Ctxt& x) { ea.rotate(x, k); }, prio);
+      break;
+    case CIRC_ADD_CONST: {
+      const ZZX& poly = constants[k];
+      vals[i] = AsyncCtxt(a, [&poly](Ctxt& x) { x.addConstant(poly); }, prio);
+      break;
+    }
+    case CIRC_MUL_CONST: {
+      const ZZX& poly = constants[k];
+      vals[i] = AsyncCtxt(a, [&poly](Ctxt& x) { x.multByConstant(poly); },
+                          prio);
+      break;
+    }
+    case CIRC_MODDOWN:
+      vals[i] = AsyncCtxt(a,
+        [](Ctxt& x) { x.modDownToLevel(x.findBaseLevel()); }, prio);
+      break;
+    case CIRC_RECRYPT:
+      vals[i] = AsyncCtxt(a, [](Ctxt& x) {
+          FHEPubKey& pKey = (FHEPubKey&) x.getPubKey();
+          pKey.reCrypt(x);
+        }, prio);
+      break;
+    default:
+      Error("Circuit::execute: bad op");
+    }
+  }
+
+  // Keep only the outputs, so intermediate results are freed once used
+  vector<AsyncCtxt> results(outputs.size());
+  for (long i = 0; i < lsize(outputs); i++)
+    results[i] = vals[outputs[i]];
+  vals.clear();
+
+  out.clear();
+  for (long i = 0; i < lsize(results); i++)
+    out.push_back(results[i].get());
+}
+
+
+// Rebuilds a circuit node by node. The first pass copies the operations of
+// the input circuit, simplifying and merging them, and the second pass
+// places the re-linearization, mod-switching and recryption nodes on the
+// live nodes of the first.
+class CircuitCompiler {
+  const CircuitOptions& opts;
+  long nSlots;
+
+  // For the nodes of the second pass
+  vector<bool> canonical; // at most two parts, relative to (1,s)
+  vector<bool> lowered;   // at its natural level, without special primes
+  vector<long> depth;     // multiplications since the inputs or recryption
+  std::map<long,long> relinOf, preparedOf, recryptOf;
+
+  std::map< std::tuple<long,long,long,long>, long > seen;
+
+public:
+  CircuitCompiler(const CircuitOptions& _opts, long _nSlots)
+    : opts(_opts), nSlots(_nSlots) {}
+
+  // Add a node to circ, or return an identical node added before
+  long emitShared(Circuit& circ, CircuitOp op, long a, long b, long param)
+  {
+    if ((op == CIRC_ADD || op == CIRC_MUL) && a > b) std::swap(a, b);
+    if (!opts.cse || op == CIRC_INPUT) return circ.addNode(op, a, b, param);
+
+    std::tuple<long,long,long,long> key(op, a, b, param);
+    auto it = seen.find(key);
+    if (it != seen.end()) return it->second;
+    long id = circ.addNode(op, a, b, param);
+    seen[key] = id;
+    return id;
+  }
+
+  long simplify(Circuit& out, const Circuit& in, long i, vector<long>& map)
+  {
+    const CircuitNode& node = in.getNode(i);
+    long a = (node.in[0] >= 0)? map[node.in[0]] : -1;
+    long b = (node.in[1] >= 0)? map[node.in[1]] : -1;
+    long param = node.param;
+
+    switch (node.op) {
+    case CIRC_RELIN:
+      if (opts.lazyRelin) return a;
+      break;
+    case CIRC_MODDOWN:
+      if (opts.modSwitch) return a;
+      break;
+    case CIRC_RECRYPT:
+      if (opts.bootstrapDepth > 0) return a;
+      break;
+    case CIRC_ROTATE:
+      param = mcMod(param, nSlots);
+      if (opts.foldRotations) {
+        const CircuitNode& src = out.getNode(a);
+        if (src.op == CIRC_ROTATE) {
+          param = mcMod(param + src.param, nSlots);
+          a = src.in[0];
+        }
+        if (param == 0) return a;
+      }
+      break;
+    case CIRC_ADD_CONST:
+    case CIRC_MUL_CONST:
+      param = out.addConstant(in.getConstant(param));
+      break;
+    default:
+      break;
+    }
+    return emitShared(out, node.op, a, b, param);
+  }
+
+  // Add a node in the second pass, and record its properties
+  long emit(Circuit& circ, CircuitOp op, long a, long b=-1, long param=0)
+  {
+    long id = circ.addNode(op, a, b, param);
+    bool canon = true, low = false;
+    long d = 0;
+    for (long j = 0; j < 2; j++) {
+      long k = (j == 0)? a : b;
+      if (k < 0) continue;
+      canon = canon && canonical[k];
+      d = max(d, depth[k]);
+    }
+    switch (op) {
+    case CIRC_MUL:     canon = false; d++; break;
+    case CIRC_RELIN:   canon = true; break;
+    case CIRC_ROTATE:  canon = true; break;
+    case CIRC_MODDOWN: low = true; break;
+    case CIRC_RECRYPT: canon = true; d = 0; break;
+    default: break;
+    }
+    canonical.push_back(canon);
+    lowered.push_back(low);
+    depth.push_back(d);
+    return id;
+  }
+
+  // Mod-switch down after the operations that add noise or special primes
+  long lower(Circuit& circ, long v)
+  {
+    if (!opts.modSwitch || lowered[v]) return v;
+    return emit(circ, CIRC_MODDOWN, v);
+  }
+
+  long relin(Circuit& circ, long v)
+  {
+    if (canonical[v]) return v;
+    auto it = relinOf.find(v);
+    if (it != relinOf.end()) return it->second;
+    return relinOf[v] = lower(circ, emit(circ, CIRC_RELIN, v));
+  }
+
+  // The source of a rotation, shared by all the rotations of v if hoisting
+  long prepare(Circuit& circ, long v)
+  {
+    if (!opts.hoist) {
+      if (!canonical[v]) v = lower(circ, emit(circ, CIRC_RELIN, v));
+      return lower(circ, v);
+    }
+    auto it = preparedOf.find(v);
+    if (it != preparedOf.end()) return it->second;
+    return preparedOf[v] = lower(circ, relin(circ, v));
+  }
+
+  long refresh(Circuit& circ, long v)
+  {
+    if (opts.bootstrapDepth <= 0 || depth[v] < opts.bootstrapDepth) return v;
+    auto it = recryptOf.find(v);
+    if (it != recryptOf.end()) return it->second;
+    return recryptOf[v] = emit(circ, CIRC_RECRYPT, relin(circ, v));
+  }
+
+  long place(Circuit& out, const CircuitNode& node, const vector<long>& map)
+  {
+    long a = (node.in[0] >= 0)? map[node.in[0]] : -1;
+    long b = (node.in[1] >= 0)? map[node.in[1]] : -1;
+
+    switch (node.op) {
+    case CIRC_MUL:
+      a = refresh(out, relin(out, a));
+      b = (node.in[1] == node.in[0])? a : refresh(out, relin(out, b));
+      return lower(out, emit(out, CIRC_MUL, a, b));
+    case CIRC_ROTATE:
+      return lower(out, emit(out, CIRC_ROTATE, prepare(out, a), -1,
+                             node.param));
+    case CIRC_RELIN:
+      return relin(out, a);
+    case CIRC_RECRYPT:
+      return emit(out, CIRC_RECRYPT, relin(out, a));
+    default:
+      return emit(out, node.op, a, b, node.param);
+    }
+  }
+
+  long output(Circuit& out, long v) { return relin(out, v); }
+};
+
+Circuit compileCircuit(const Circuit& circ, const CircuitOptions& opts)
+{
+  CircuitCompiler compiler(opts, circ.getEA().size());
+
+  // Pass 1: simplify and merge
+  Circuit simple(circ.getEA());
+  vector<long> map(circ.numNodes());
+  for (long i = 0; i < circ.numNodes(); i++)
+    map[i] = compiler.simplify(simple, circ, i, map);
+
+  // Liveness, from the outputs back
+  vector<bool> live(simple.numNodes(), false);
+  for (long i = 0; i < lsize(circ.getOutputs()); i++)
+    live[map[circ.getOutputs()[i]]] = true;
+  for (long i = simple.numNodes()-1; i >= 0; i--) {
+    const CircuitNode& node = simple.getNode(i);
+    if (node.op == CIRC_INPUT) live[i] = true; // keep the numbering
+    if (!live[i]) continue;
+    for (long j = 0; j < 2; j++)
+      if (node.in[j] >= 0) live[node.in[j]] = true;
+  }
+
+  // Pass 2: place the maintenance operations
+  Circuit out(circ.getEA());
+  vector<long> map2(simple.numNodes(), -1);
+  for (long i = 0; i < simple.numNodes(); i++) {
+    if (!live[i]) continue;
+    CircuitNode node = simple.getNode(i);
+    if (node.op == CIRC_ADD_CONST || node.op == CIRC_MUL_CONST)
+      node.param = out.addConstant(simple.getConstant(node.param));
+    map2[i] = compiler.place(out, node, map2);
+  }
+  for (long i = 0; i < lsize(circ.getOutputs()); i++)
+    out.addOutput(compiler.output(out, map2[map[circ.getOutputs()[i]]]));
+
+  return out;
+}
+
+void printCircuitReport(ostream& str, const Circuit& naive,
+                        const Circuit& compiled)
+{
+  vector<long> c1, c2;
+  naive.countOps(c1);
+  compiled.countOps(c2);
+
+  str << "  op          recorded  compiled\n";
+  str << "  nodes       " << setw(8) << naive.numNodes()
+      << "  " << setw(8) << compiled.numNodes() << "\n";
+  for (long op = 0; op < CIRC_NUM_OPS; op++) {
+    if (c1[op] == 0 && c2[op] == 0) continue;
+    str << "  " << left << setw(12) << opNames[op] << right
+        << setw(8) << c1[op] << "  " << setw(8) << c2[op] << "\n";
+  }
+  // re-linearizations and rotations are the ones that key-switch
+  str << "  keySwitch   " << setw(8) << (c1[CIRC_RELIN] + c1[CIRC_ROTATE])
+      << "  " << setw(8) << (c2[CIRC_RELIN] + c2[CIRC_ROTATE]) << "\n";
+  str << "  depth       " << setw(8) << naive.depth()
+      << "  " << setw(8) << compiled.depth() << "\n";
+}
@@ -0,0 +1,199 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _CIRCUIT_H_
+#define _CIRCUIT_H_
+/**
+ * @file circuit.h
+ * @brief Recording homomorphic circuits, optimizing and executing them
+ *
+ * A circuit is recorded by running it on TracedCtxt objects instead of Ctxt
+ * objects, e.g.
+ *
+ *   Circuit circ(ea);
+ *   TracedCtxt x = circ.input(), y = circ.input();
+ *   TracedCtxt z = x;
+ *   z.multiplyBy(y);
+ *   z.rotate(3);            // as in ea.rotate(z, 3)
+ *   z += x;
+ *   circ.output(z);
+ *
+ * The recorded circuit performs the same operations that the Ctxt code
+ * would, e.g. multiplyBy is recorded as a multiplication followed by a
+ * re-linearization. compileCircuit returns an equivalent circuit with:
+ *  - common subexpressions merged, so identical rotations run once;
+ *  - chains of rotations folded, rot(rot(x,a),b) = rot(x,a+b);
+ *  - rotations of the same source hoisted, so that the source is
+ *    re-linearized and mod-switched once for all of them;
+ *  - re-linearization deferred until a value is multiplied, rotated or
+ *    output, so e.g. a sum of products is re-linearized once;
+ *  - mod-switching down right after the operations that increase the noise
+ *    or add the special primes, so the later operations carry fewer primes;
+ *  - recryption inserted before multiplications whose inputs would exceed
+ *    a given multiplicative depth.
+ *
+ * Circuit::execute evaluates a circuit on ciphertexts with AsyncCtxt, so each
+ * operation runs on the thread pool as soon as its inputs are ready, and the
+ * operations on the critical path start first. printCircuitReport compares
+ * the operation counts of the recorded and the compiled circuits.
+ **/
+#include "EncryptedArray.h"
+
+//! The operations of a circuit
+enum CircuitOp {
+  CIRC_INPUT,      // input number param
+  CIRC_ADD, CIRC_SUB, CIRC_NEGATE,
+  CIRC_MUL,        // Ctxt::operator*=, without re-linearization
+  CIRC_RELIN,      // Ctxt::reLinearize
+  CIRC_ROTATE,     // EncryptedArray::rotate by param
+  CIRC_ADD_CONST,  // Ctxt::addConstant of constant number param
+  CIRC_MUL_CONST,  // Ctxt::multByConstant of constant number param
+  CIRC_MODDOWN,    // mod-switch down to the natural level (findBaseLevel)
+  CIRC_RECRYPT,    // FHEPubKey::reCrypt
+  CIRC_NUM_OPS
+};
+
+//! The name of an operation, e.g. "mul"
+const char *circuitOpName(long op);
+
+class CircuitNode {
+public:
+  CircuitOp op;
+  long in[2];  // the input nodes, -1 if unused
+  long param;
+};
+
+class TracedCtxt;
+
+/**
+ * @class Circuit
+ * @brief A homomorphic circuit, as a list of nodes in topological order
+ **/
+class Circuit {
+  const EncryptedArray& ea;
+  vector<CircuitNode> nodes;
+  vector<ZZX> constants;
+  vector<long> outputs;
+  long nInputs;
+
+public:
+  explicit Circuit(const EncryptedArray& _ea) : ea(_ea), nInputs(0) {}
+
+  const EncryptedArray& getEA() const { return ea; }
+
+  //! Start recording with a new input
+  TracedCtxt input();
+
+  //! Mark the result of t as the next output
+  void output(const TracedCtxt& t);
+
+  //! Add a node, and return its index. The inputs are indexes of nodes that
+  //! were already added. A node CIRC_INPUT with param=i is input number i.
+  long addNode(CircuitOp op, long a=-1, long b=-1, long param=0);
+
+  //! Add a constant for CIRC_ADD_CONST/CIRC_MUL_CONST, and return its index
+  long addConstant(const ZZX& poly);
+
+  void addOutput(long node) { outputs.push_back(node); }
+
+  long numNodes() const { return lsize(nodes); }
+  long numInputs() const { return nInputs; }
+  const CircuitNode& getNode(long i) const { return nodes[i]; }
+  const ZZX& getConstant(long i) const { return constants[i]; }
+  const vector<long>& getOutputs() const { return outputs; }
+
+  //! counts[op] = the number of nodes with this op
+  void countOps(vector<long>& counts) const;
+
+  //! The multiplicative depth, recryption resets the depth of its result
+  long depth() const;
+
+  //! Evaluate the circuit, in is indexed by the input numbers and out by the
+  //! output numbers. The operations run in parallel on the thread pool,
+  //! independent ones concurrently. If an operation throws then execute
+  //! throws the same exception.
+  void execute(vector<Ctxt>& out, const vector<Ctxt>& in) const;
+
+  //! Print one line per node
+  void print(ostream& str) const;
+};
+
+/**
+ * @class TracedCtxt
+ * @brief A stand-in for Ctxt that records the operations on it in a circuit
+ *
+ * Copies refer to the same node, and modifying a copy records a new node
+ * without affecting the other copies, as with Ctxt.
+ **/
+class TracedCtxt {
+  Circuit *circ;
+  long id; // the node that holds the current value
+
+  void record(CircuitOp op, long b=-1, long param=0)
+  { id = circ->addNode(op, id, b, param); }
+
+public:
+  TracedCtxt(Circuit& _circ, long _id) : circ(&_circ), id(_id) {}
+
+  long getNode() const { return id; }
+
+  TracedCtxt& operator+=(const TracedCtxt& other)
+  { record(CIRC_ADD, other.id); return *this; }
+  TracedCtxt& operator-=(const TracedCtxt& other)
+  { record(CIRC_SUB, other.id); return *this; }
+  TracedCtxt& operator*=(const TracedCtxt& other)
+  { record(CIRC_MUL, other.id); return *this; }
+
+  void negate() { record(CIRC_NEGATE); }
+  void multiplyBy(const TracedCtxt& other)
+  { record(CIRC_MUL, other.id); reLinearize(); }
+  void square() { multiplyBy(*this); }
+  void reLinearize() { record(CIRC_RELIN); }
+
+  void addConstant(const ZZX& poly)
+  { record(CIRC_ADD_CONST, -1, circ->addConstant(poly)); }
+  void multByConstant(const ZZX& poly)
+  { record(CIRC_MUL_CONST, -1, circ->addConstant(poly)); }
+
+  //! Rotate by k, with the EncryptedArray of the circuit
+  void rotate(long k) { record(CIRC_ROTATE, -1, k); }
+
+  void modDownToBaseLevel() { record(CIRC_MODDOWN); }
+  void reCrypt() { record(CIRC_RECRYPT); }
+};
+
+/**
+ * @class CircuitOptions
+ * @brief The optimizations that compileCircuit performs
+ **/
+class CircuitOptions {
+public:
+  bool cse;            // merge identical operations
+  bool foldRotations;  // rot(rot(x,a),b) -> rot(x,a+b), rot(x,0) -> x
+  bool hoist;          // prepare the source of several rotations once
+  bool lazyRelin;      // re-linearize only when needed
+  bool modSwitch;      // mod-switch down as early as possible
+  long bootstrapDepth; // recrypt to keep the depth at most this, 0=never
+
+  CircuitOptions() : cse(true), foldRotations(true), hoist(true),
+    lazyRelin(true), modSwitch(true), bootstrapDepth(0) {}
+};
+
+//! Optimize a circuit. The recryption nodes and mod-switching nodes of circ
+//! are removed and placed anew if the corresponding option is on.
+Circuit compileCircuit(const Circuit& circ,
+                       const CircuitOptions& opts=CircuitOptions());
+
+//! Print the operation counts of a recorded circuit and its compiled form
+void printCircuitReport(ostream& str, const Circuit& naive,
+                        const Circuit& compiled);
+
+#endif // _CIRCUIT_H_
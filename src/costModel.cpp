@@ -0,0 +1,249 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <algorithm>
+#include <NTL/ZZ.h>
+#include <NTL/tools.h>
+#include "costModel.h"
+#include "DoubleCRT.h"
+#include "multicore.h"
+
+NTL_CLIENT
+
+static const char *primitiveNames[FHE_NUM_PRIMITIVES] = {
+  "NTT", "iNTT", "mul", "add", "automorph", "CRT", "reduce"
+};
+
+static const long primitiveCounters[FHE_NUM_PRIMITIVES] = {
+  FHE_CNT_FFT, FHE_CNT_IFFT, FHE_CNT_DCRT_MUL, FHE_CNT_DCRT_ADD,
+  FHE_CNT_DCRT_AUTOMORPH, FHE_CNT_CRT_ROWS, FHE_CNT_ZZX_REDUCE_WORDS
+};
+
+const char *primitiveName(long op) { return primitiveNames[op]; }
+long primitiveCounter(long op) { return primitiveCounters[op]; }
+
+static double median(vector<double>& v)
+{
+  sort(v.begin(), v.end());
+  long n = lsize(v);
+  return (n % 2)? v[n/2] : (v[n/2 -1] + v[n/2])/2;
+}
+
+void CostTable::calibrate(const FHEcontext& context, long nTrials)
+{
+  if (isDryRun())
+    Error("CostTable::calibrate: cannot calibrate in dry-run mode");
+  assert(nTrials > 0);
+
+  const PAlgebra& zMStar = context.zMStar;
+  const IndexSet& s = context.ctxtPrimes;
+  long rows = card(s);
+  long phim = zMStar.getPhiM();
+  long k = (zMStar.numOfGens() > 0)? zMStar.ZmStarGen(0) : 1;
+
+  // For the NTTs, a row for each prime that is already reduced mod that
+  // prime, so that only the transforms themselves are measured. They are
+  // run in parallel over the primes, as in DoubleCRT.
+  Vec<long> ivec(INIT_SIZE, rows);
+  vector<zzX> residues(rows);
+  vector<vec_long> evals(rows);
+  for (long i = s.first(), j = 0; i <= s.last(); i = s.next(i), j++) {
+    ivec[j] = i;
+    residues[j].SetLength(phim);
+    for (long h = 0; h < phim; h++)
+      residues[j][h] = RandomBnd(context.ithPrime(i));
+  }
+
+  // A polynomial with coefficients as large as those of a ciphertext part,
+  // and the number of words that converting it to a DoubleCRT reduces
+  ZZX poly;
+  ZZ prod = context.productOfPrimes(s);
+  double words = 0;
+  for (long i = 0; i < phim; i++) {
+    SetCoeff(poly, i, RandomBnd(prod));
+    words += (NumBits(poly.rep[i]) + NTL_BITS_PER_LONG-1) / NTL_BITS_PER_LONG;
+  }
+  words *= rows;
+
+  DoubleCRT d(poly, context, s), d2(d);
+  vector<double> t[FHE_NUM_PRIMITIVES];
+  for (long trial = 0; trial < nTrials; trial++) {
+    double start = GetWallTime();
+    FHE_EXEC_INDEX(rows, j)
+      context.ithModulus(ivec[j]).FFT(evals[j], residues[j]);
+    FHE_EXEC_INDEX_END
+    double nttTime = GetWallTime() - start;
+    t[FHE_PRIM_NTT].push_back(nttTime);
+
+    // converting poly is the reductions followed by the NTTs
+    start = GetWallTime();
+    { DoubleCRT tmp(poly, context, s); }
+    t[FHE_PRIM_REDUCE].push_back(max(GetWallTime() - start - nttTime, 0.0));
+
+    start = GetWallTime();
+    FHE_EXEC_INDEX(rows, j)
+      zz_pX x;
+      context.ithModulus(ivec[j]).iFFT(x, evals[j]);
+    FHE_EXEC_INDEX_END
+    double inttTime = GetWallTime() - start;
+    t[FHE_PRIM_INTT].push_back(inttTime);
+
+    // toPoly is the iNTTs followed by the CRT, charge the rest to the CRT
+    start = GetWallTime();
+    d2.toPoly(poly);
+    t[FHE_PRIM_CRT].push_back(max(GetWallTime() - start - inttTime, 0.0));
+
+    start = GetWallTime();
+    d *= d2;
+    t[FHE_PRIM_MUL].push_back(GetWallTime() - start);
+
+    start = GetWallTime();
+    d += d2;
+    t[FHE_PRIM_ADD].push_back(GetWallTime() - start);
+
+    start = GetWallTime();
+    d.automorph(k);
+    t[FHE_PRIM_AUTOMORPH].push_back(GetWallTime() - start);
+  }
+
+  Entry e;
+  e.phim = phim;
+  for (long op = 0; op < FHE_NUM_PRIMITIVES; op++)
+    e.secs[op] = median(t[op]) / ((op == FHE_PRIM_REDUCE)? words : rows);
+  entries[zMStar.getM()] = e;
+}
+
+const CostTable::Entry& CostTable::get(long m) const
+{
+  auto it = entries.find(m);
+  if (it == entries.end())
+    Error("CostTable: no entry for this m, calibrate first");
+  return it->second;
+}
+
+double CostTable::predictTime(long m, const FHEcounterSnapshot& counts) const
+{
+  const Entry& e = get(m);
+  double time = 0.0;
+  for (long op = 0; op < FHE_NUM_PRIMITIVES; op++)
+    time += counts[primitiveCounters[op]] * e.secs[op];
+  return time;
+}
+
+void CostTable::write(ostream& str) const
+{
+  str << "# m phim";
+  for (long op = 0; op < FHE_NUM_PRIMITIVES; op++)
+    str << " " << primitiveNames[op];
+  str << "\n";
+  for (auto it = entries.begin(); it != entries.end(); ++it) {
+    str << it->first << " " << it->second.phim;
+    for (long op = 0; op < FHE_NUM_PRIMITIVES; op++)
+      str << " " << it->second.secs[op];
+    str << "\n";
+  }
+}
+
+void CostTable::read(istream& str)
+{
+  string line;
+  while (getline(str, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    stringstream ss(line);
+    long m;
+    Entry e;
+    ss >> m >> e.phim;
+    for (long op = 0; op < FHE_NUM_PRIMITIVES; op++)
+      ss >> e.secs[op];
+    if (!ss)
+      Error("CostTable::read: bad line");
+    entries[m] = e;
+  }
+}
+
+
+CircuitPlanner::CircuitPlanner(const CostTable& _table, long _m)
+  : table(_table), m(_m), inStage(false)
+{
+  table.get(m); // raise an error now if m is not in the table
+  setCountersOn();
+}
+
+void CircuitPlanner::beginStage(const string& name)
+{
+  if (inStage) endStage();
+  Stage stage;
+  stage.name = name;
+  stages.push_back(stage);
+  inStage = true;
+
+  resetPeakDCRTrows();
+  startCounts = getCounterSnapshot();
+}
+
+void CircuitPlanner::endStage()
+{
+  if (!inStage) return;
+  inStage = false;
+
+  Stage& stage = stages.back();
+  stage.counts = getCounterSnapshot() - startCounts;
+  stage.time = table.predictTime(m, stage.counts);
+  stage.peakRows = getPeakDCRTrows();
+  stage.peakBytes = table.predictBytes(m, stage.peakRows);
+}
+
+double CircuitPlanner::totalTime() const
+{
+  double time = 0.0;
+  for (long i = 0; i < lsize(stages); i++)
+    time += stages[i].time;
+  return time;
+}
+
+double CircuitPlanner::peakBytes() const
+{
+  double bytes = 0.0;
+  for (long i = 0; i < lsize(stages); i++)
+    bytes = max(bytes, stages[i].peakBytes);
+  return bytes;
+}
+
+void CircuitPlanner::print(ostream& str) const
+{
+  for (long i = 0; i < lsize(stages); i++) {
+    const Stage& stage = stages[i];
+    str << "  " << stage.name << ": " << stage.time << " sec, peak "
+        << stage.peakBytes/(1L<<20) << " MB (" << stage.peakRows << " rows)";
+    for (long op = 0; op < FHE_NUM_PRIMITIVES; op++)
+      str << ", " << primitiveNames[op] << "="
+          << stage.counts[primitiveCounters[op]];
+    str << "\n";
+  }
+  str << "  total: " << totalTime() << " sec, peak "
+      << peakBytes()/(1L<<20) << " MB\n";
+}
+
+void CircuitPlanner::printJSON(ostream& str) const
+{
+  str << "{\"m\": " << m << ", \"stages\": [";
+  for (long i = 0; i < lsize(stages); i++) {
+    const Stage& stage = stages[i];
+    str << (i? ",\n" : "\n") << "{\"name\": \"" << stage.name
+        << "\", \"time\": " << stage.time
+        << ", \"peakRows\": " << stage.peakRows
+        << ", \"peakBytes\": " << stage.peakBytes << ", \"counters\": ";
+    stage.counts.printJSON(str);
+    str << "}";
+  }
+  str << "\n], \"totalTime\": " << totalTime()
+      << ", \"peakBytes\": " << peakBytes() << "}\n";
+}
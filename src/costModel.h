@@ -0,0 +1,171 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _COST_MODEL_H_
+#define _COST_MODEL_H_
+/**
+ * @file costModel.h
+ * @brief Predicting the running time and memory of a circuit
+ *
+ * The cost of homomorphic operations is dominated by a few primitives on
+ * the rows of DoubleCRT objects: NTTs and inverse NTTs, element-wise
+ * multiplications, additions and automorphisms, the CRT reconstruction
+ * of integer coefficients (per row combined), and the reduction of integer
+ * coefficients mod the primes when a ZZX is converted to a DoubleCRT (per
+ * word of a coefficient and prime, as their size varies). The counters of
+ * counters.h record how many rows (or words) each of these primitives
+ * processed, and a CostTable records how long one takes on this machine,
+ * so a circuit can be planned by running it (for real or in dry-run mode)
+ * with the counters on and multiplying the two. Key-switching is not a
+ * primitive of its own, its cost is the cost of the NTTs, multiplications,
+ * additions and reductions that it does.
+ *
+ * Memory is predicted from the peak number of DoubleCRT rows that are
+ * allocated, which is tracked even in dry-run mode, times the size of a row.
+ * The model is linear in the number of rows, it ignores the cost of the
+ * other operations on polynomials in coefficient representation (e.g., the
+ * arithmetic on a ZZX before it is converted) and of memory that is not
+ * held in DoubleCRT objects. In dry-run mode the size of the coefficients
+ * that addPrimes reduces is taken to be that of the product of the primes
+ * they are reconstructed from. A table written before the CRT and reduce
+ * primitives were added cannot be read, it has to be calibrated again.
+ *
+ * A typical use is to calibrate the table once per machine and parameter
+ * set and save it, then plan the circuit:
+ *
+ *   CostTable table;
+ *   table.calibrate(context);          // real mode, with the same m
+ *   ...
+ *   setDryRun();                       // optional
+ *   CircuitPlanner planner(table, m);  // before generating the keys
+ *   planner.beginStage("keyGen"); ... planner.endStage();
+ *   planner.beginStage("mult");   ... planner.endStage();
+ *   planner.print(cout);
+ **/
+#include <map>
+#include "FHEContext.h"
+#include "counters.h"
+
+//! The primitives whose cost is measured, each one on a single row. The
+//! NTTs are of a single row that is already reduced mod its prime, the
+//! cost of reconstructing the integer coefficients is charged to CRT and
+//! the cost of reducing them is charged to REDUCE, per word and prime.
+enum FHEprimitive {
+  FHE_PRIM_NTT, FHE_PRIM_INTT, FHE_PRIM_MUL, FHE_PRIM_ADD, FHE_PRIM_AUTOMORPH,
+  FHE_PRIM_CRT, FHE_PRIM_REDUCE,
+  FHE_NUM_PRIMITIVES
+};
+
+//! The name of a primitive, e.g. "NTT"
+const char *primitiveName(long op);
+
+//! The counter that counts the rows processed by a primitive
+long primitiveCounter(long op);
+
+/**
+ * @class CostTable
+ * @brief The cost of the DoubleCRT primitives on this machine, per value of m
+ **/
+class CostTable {
+public:
+  class Entry {
+  public:
+    long phim;
+    double secs[FHE_NUM_PRIMITIVES]; // seconds per row
+
+    Entry() : phim(0) { for (long i = 0; i < FHE_NUM_PRIMITIVES; i++) secs[i] = 0; }
+  };
+
+private:
+  std::map<long, Entry> entries; // indexed by m
+
+public:
+  //! Measure the primitives with the m and the ciphertext primes of context,
+  //! replacing any previous entry for that m. The cost of each primitive is
+  //! the median over nTrials runs. Cannot be called in dry-run mode. The
+  //! time is wall-clock time, so it accounts for the threads in use.
+  void calibrate(const FHEcontext& context, long nTrials=5);
+
+  bool has(long m) const { return entries.count(m) > 0; }
+
+  //! The entry for m, an error is raised if there is none
+  const Entry& get(long m) const;
+  void set(long m, const Entry& e) { entries[m] = e; }
+
+  //! The predicted time of the work recorded in counts
+  double predictTime(long m, const FHEcounterSnapshot& counts) const;
+
+  //! The predicted memory of nRows DoubleCRT rows, in bytes
+  double predictBytes(long m, long nRows) const
+  { return double(nRows) * get(m).phim * sizeof(long); }
+
+  //! Write the table as text, with one line per value of m
+  void write(ostream& str) const;
+
+  //! Read a table that was written by write, adding its entries to *this
+  void read(istream& str);
+};
+
+/**
+ * @class CircuitPlanner
+ * @brief Collects the predicted time and memory of the stages of a circuit
+ *
+ * Creating a planner turns the counters on. Each stage is delimited by
+ * beginStage/endStage, and records the counts of that interval and the peak
+ * number of rows that were allocated in it. Rows are only tracked while the
+ * counters are on, so the planner should be created before the keys are
+ * generated, else the memory of the key-switching matrices is not included.
+ * In dry-run mode PAlgebra has no slots, so operations whose work depends on
+ * the slot structure (rotations, linear maps) are not planned faithfully;
+ * plan those in a real run with fewer primes, and scale the result.
+ **/
+class CircuitPlanner {
+public:
+  class Stage {
+  public:
+    string name;
+    FHEcounterSnapshot counts;
+    double time;     // predicted seconds
+    long peakRows;   // the peak number of allocated rows during the stage
+    double peakBytes;
+  };
+
+private:
+  const CostTable& table;
+  long m;
+  vector<Stage> stages;
+  FHEcounterSnapshot startCounts;
+  bool inStage;
+
+public:
+  //! m is the m that the circuit will run with, in dry-run mode it is not
+  //! the m of the context
+  CircuitPlanner(const CostTable& _table, long _m);
+
+  void beginStage(const string& name);
+  void endStage();
+
+  const vector<Stage>& getStages() const { return stages; }
+
+  //! The predicted time of all the stages together
+  double totalTime() const;
+
+  //! The peak memory over all the stages
+  double peakBytes() const;
+
+  //! Print one line per stage and the totals
+  void print(ostream& str) const;
+
+  //! Print the stages and the totals as a JSON object
+  void printJSON(ostream& str) const;
+};
+
+#endif // _COST_MODEL_H_
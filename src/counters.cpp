@@ -0,0 +1,295 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <cstring>
+#include <memory>
+#include "counters.h"
+#include "multicore.h"
+
+FHE_atomic_bool fheCountersFlag(false);
+
+static const char *counterNames[FHE_MAX_COUNTERS] = {
+  "FFT", "iFFT", "keySwitch", "keySwitchDigits", "keySwitchLookup",
+  "modSwitch", "primesDropped", "DoubleCRTrows", "DoubleCRTallocBytes",
+  "DoubleCRTcopy", "DoubleCRTcopyBytes", "PRGbytes", "DoubleCRTaddRows",
+  "DoubleCRTmulRows", "DoubleCRTautomorphRows", "numaLocalBytes",
+  "numaRemoteBytes", "CRTrows", "levelsConsumed", "ZZXreduceWords"
+};
+static long numCounters = FHE_NUM_BUILTIN_COUNTERS;
+static FHE_MUTEX_TYPE counterNamesMx;
+
+long registerCounter(const char *name)
+{
+  FHE_MUTEX_GUARD(counterNamesMx);
+  for (long i = 0; i < numCounters; i++)
+    if (strcmp(name, counterNames[i]) == 0) return i;
+  if (numCounters >= FHE_MAX_COUNTERS)
+    Error("registerCounter: too many counters");
+  counterNames[numCounters] = name;
+  return numCounters++;
+}
+
+const char *getCounterName(long id)
+{
+  if (id < 0 || id >= numCounters) return NULL;
+  return counterNames[id];
+}
+
+long getCounterId(const char *name)
+{
+  for (long i = 0; i < numCounters; i++)
+    if (strcmp(name, counterNames[i]) == 0) return i;
+  return -1;
+}
+
+long getNumCounters() { return numCounters; }
+
+void setCountersOn()  { FHE_STORE_RELAXED(fheCountersFlag, true); }
+void setCountersOff() { FHE_STORE_RELAXED(fheCountersFlag, false); }
+
+// The primes whose NTTs are counted separately, indexed by their slot
+static long counterPrimes[FHE_MAX_COUNTER_PRIMES];
+static long numCounterPrimes = 0;
+static FHE_MUTEX_TYPE counterPrimesMx;
+
+long registerCounterPrime(long q)
+{
+  FHE_MUTEX_GUARD(counterPrimesMx);
+  for (long i = 0; i < numCounterPrimes; i++)
+    if (counterPrimes[i] == q) return i;
+  if (numCounterPrimes >= FHE_MAX_COUNTER_PRIMES) return -1;
+  counterPrimes[numCounterPrimes] = q;
+  return numCounterPrimes++;
+}
+
+static long getCounterPrimeSlot(long q)
+{
+  FHE_MUTEX_GUARD(counterPrimesMx);
+  for (long i = 0; i < numCounterPrimes; i++)
+    if (counterPrimes[i] == q) return i;
+  return -1;
+}
+
+
+// Each thread has its own block of counters, allocated on its first count.
+// The blocks are never freed, so the counts of threads that exit are kept.
+// A snapshot reads the blocks of other threads without synchronization,
+// which can make it lag slightly behind counts that are made concurrently.
+// The per-matrix key-switching counts are in a map that grows, so it has a
+// mutex, which is only contended while a snapshot is taken. A key-switch
+// is expensive enough that locking it on every use does not matter.
+struct CounterBlock {
+  unsigned long vals[FHE_MAX_COUNTERS];
+  unsigned long primeNTTs[2][FHE_MAX_COUNTER_PRIMES]; // [inverse][slot]
+  FHE_MUTEX_TYPE ksMx;
+  std::map<FHEkeySwitchId, unsigned long> ksUses;
+
+  CounterBlock() { clear(); }
+
+  void clear()
+  {
+    memset(vals, 0, sizeof(vals));
+    memset(primeNTTs, 0, sizeof(primeNTTs));
+    FHE_MUTEX_GUARD(ksMx);
+    ksUses.clear();
+  }
+};
+
+static vector< shared_ptr<CounterBlock> > counterBlocks;
+static FHE_MUTEX_TYPE counterBlocksMx;
+
+static CounterBlock& getCounterBlock()
+{
+  static NTL_THREAD_LOCAL CounterBlock *myBlock = 0;
+  if (!myBlock) {
+    FHE_MUTEX_GUARD(counterBlocksMx);
+    counterBlocks.push_back(make_shared<CounterBlock>());
+    myBlock = counterBlocks.back().get();
+  }
+  return *myBlock;
+}
+
+void addToCounter(long id, unsigned long amt)
+{
+  getCounterBlock().vals[id] += amt;
+}
+
+void addToPrimeCounter(long slot, bool inverse, unsigned long amt)
+{
+  getCounterBlock().primeNTTs[inverse? 1 : 0][slot] += amt;
+}
+
+void addToKeySwitchCounter(const FHEkeySwitchId& id, unsigned long amt)
+{
+  CounterBlock& blk = getCounterBlock();
+  FHE_MUTEX_GUARD(blk.ksMx);
+  blk.ksUses[id] += amt;
+}
+
+static FHE_atomic_long liveDCRTrows(0);
+static FHE_atomic_long peakDCRTrows(0);
+
+void trackDCRTrows(long delta)
+{
+#ifdef FHE_THREADS
+  long cur = (liveDCRTrows += delta);
+  long peak = peakDCRTrows.load();
+  while (cur > peak && !peakDCRTrows.compare_exchange_weak(peak, cur)) ;
+#else
+  liveDCRTrows += delta;
+  if (liveDCRTrows > peakDCRTrows) peakDCRTrows = liveDCRTrows;
+#endif
+}
+
+long getLiveDCRTrows() { return liveDCRTrows; }
+long getPeakDCRTrows() { return peakDCRTrows; }
+void resetPeakDCRTrows() { peakDCRTrows = long(liveDCRTrows); }
+
+void resetAllCounters()
+{
+  FHE_MUTEX_GUARD(counterBlocksMx);
+  for (long i = 0; i < lsize(counterBlocks); i++)
+    counterBlocks[i]->clear();
+}
+
+// Add the counts of one block to a snapshot
+static void addBlock(vector<unsigned long>& vals,
+                     vector<unsigned long>& primeFFT,
+                     vector<unsigned long>& primeIFFT,
+                     std::map<FHEkeySwitchId, unsigned long>& ksUses,
+                     CounterBlock& blk)
+{
+  for (long j = 0; j < FHE_MAX_COUNTERS; j++)
+    vals[j] += blk.vals[j];
+  for (long j = 0; j < FHE_MAX_COUNTER_PRIMES; j++) {
+    primeFFT[j] += blk.primeNTTs[0][j];
+    primeIFFT[j] += blk.primeNTTs[1][j];
+  }
+  FHE_MUTEX_GUARD(blk.ksMx);
+  for (auto& it : blk.ksUses) ksUses[it.first] += it.second;
+}
+
+FHEcounterSnapshot getCounterSnapshot(bool thisThreadOnly)
+{
+  FHEcounterSnapshot snap;
+  if (thisThreadOnly) {
+    addBlock(snap.vals, snap.primeFFT, snap.primeIFFT, snap.ksUses,
+             getCounterBlock());
+    return snap;
+  }
+
+  FHE_MUTEX_GUARD(counterBlocksMx);
+  for (long i = 0; i < lsize(counterBlocks); i++)
+    addBlock(snap.vals, snap.primeFFT, snap.primeIFFT, snap.ksUses,
+             *counterBlocks[i]);
+  return snap;
+}
+
+
+unsigned long FHEcounterSnapshot::get(const char *name) const
+{
+  long id = getCounterId(name);
+  return (id < 0)? 0 : vals[id];
+}
+
+unsigned long FHEcounterSnapshot::primeFFTs(long q) const
+{
+  long slot = getCounterPrimeSlot(q);
+  return (slot < 0)? 0 : primeFFT[slot];
+}
+
+unsigned long FHEcounterSnapshot::primeIFFTs(long q) const
+{
+  long slot = getCounterPrimeSlot(q);
+  return (slot < 0)? 0 : primeIFFT[slot];
+}
+
+FHEcounterSnapshot& FHEcounterSnapshot::operator+=(const FHEcounterSnapshot& other)
+{
+  for (long j = 0; j < FHE_MAX_COUNTERS; j++)
+    vals[j] += other.vals[j];
+  for (long j = 0; j < FHE_MAX_COUNTER_PRIMES; j++) {
+    primeFFT[j] += other.primeFFT[j];
+    primeIFFT[j] += other.primeIFFT[j];
+  }
+  for (auto& it : other.ksUses) ksUses[it.first] += it.second;
+  return *this;
+}
+
+FHEcounterSnapshot& FHEcounterSnapshot::operator-=(const FHEcounterSnapshot& other)
+{
+  for (long j = 0; j < FHE_MAX_COUNTERS; j++)
+    vals[j] -= other.vals[j];
+  for (long j = 0; j < FHE_MAX_COUNTER_PRIMES; j++) {
+    primeFFT[j] -= other.primeFFT[j];
+    primeIFFT[j] -= other.primeIFFT[j];
+  }
+  for (auto& it : other.ksUses) {
+    unsigned long& v = ksUses[it.first];
+    v -= it.second;
+    if (v == 0) ksUses.erase(it.first);
+  }
+  return *this;
+}
+
+// The primes of the slots, for printing
+static vector<long> getCounterPrimes()
+{
+  FHE_MUTEX_GUARD(counterPrimesMx);
+  return vector<long>(counterPrimes, counterPrimes+numCounterPrimes);
+}
+
+void FHEcounterSnapshot::print(ostream& str) const
+{
+  for (long j = 0; j < numCounters; j++)
+    if (vals[j] != 0)
+      str << "  " << counterNames[j] << ": " << vals[j] << "\n";
+
+  vector<long> primes = getCounterPrimes();
+  for (long j = 0; j < lsize(primes); j++)
+    if (primeFFT[j] != 0 || primeIFFT[j] != 0)
+      str << "  FFT/iFFT mod " << primes[j] << ": " << primeFFT[j]
+          << " / " << primeIFFT[j] << "\n";
+
+  for (auto& it : ksUses)
+    str << "  keySwitch from (key " << std::get<0>(it.first)
+        << ", s^" << std::get<1>(it.first) << ", X^" << std::get<2>(it.first)
+        << ") to key " << std::get<3>(it.first) << ": " << it.second << "\n";
+}
+
+void FHEcounterSnapshot::printJSON(ostream& str) const
+{
+  str << "{";
+  for (long j = 0; j < numCounters; j++) {
+    if (j > 0) str << ", ";
+    str << "\"" << counterNames[j] << "\": " << vals[j];
+  }
+
+  str << ", \"primeNTTs\": {";
+  vector<long> primes = getCounterPrimes();
+  bool first = true;
+  for (long j = 0; j < lsize(primes); j++)
+    if (primeFFT[j] != 0 || primeIFFT[j] != 0) {
+      str << (first? "" : ", ") << "\"" << primes[j] << "\": ["
+          << primeFFT[j] << ", " << primeIFFT[j] << "]";
+      first = false;
+    }
+
+  str << "}, \"keySwitchMatrices\": {";
+  first = true;
+  for (auto& it : ksUses) {
+    str << (first? "" : ", ") << "\"" << std::get<0>(it.first) << ","
+        << std::get<1>(it.first) << "," << std::get<2>(it.first) << ","
+        << std::get<3>(it.first) << "\": " << it.second;
+    first = false;
+  }
+  str << "}}";
+}
@@ -0,0 +1,210 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/**
+ * @file counters.h
+ * @brief Counters for the operations and resources used by the library
+ *
+ * Where the timers of timing.h measure how long things take, the counters
+ * here record how much work was done: the number of NTTs, key-switching
+ * operations, modulus switches, DoubleCRT bytes allocated and copied, etc.
+ * The hot path of the library increments them using the FHE_COUNT macro.
+ *
+ * The counters are off by default, turn them on with setCountersOn(). When
+ * they are off, FHE_COUNT only tests a global flag, and compiling with
+ * -DFHE_NO_COUNTERS removes them altogether. Each thread accumulates its own
+ * counts, which are only summed up when a snapshot is taken. To attribute
+ * the cost of some computation, take a snapshot before and after it and
+ * subtract them, e.g.,
+ *
+ *   FHEcounterSnapshot before = getCounterSnapshot();
+ *   ... // some computation
+ *   (getCounterSnapshot() - before).print(cerr);
+ *
+ * Note that such a difference includes all the work done by all threads in
+ * that interval, also on behalf of other computations that run concurrently.
+ *
+ * Besides the flat counters below, a snapshot has two breakdowns:
+ *  - The NTTs and inverse NTTs of each prime, indexed by the prime itself
+ *    (see primeFFTs/primeIFFTs). They add up to the FFT and iFFT counters,
+ *    except for primes beyond the first FHE_MAX_COUNTER_PRIMES distinct
+ *    primes for which a Cmodulus object was made, which are not broken down.
+ *  - The uses of each key-switching matrix, indexed by the key that it
+ *    switches from, the power of that key and of X, and the key that it
+ *    switches to (see keySwitchUses). A use is a call to keySwitchDigits,
+ *    either from keySwitchPart or from a hoisted automorphism.
+ *
+ * The levels consumed by a computation are counted by levelsConsumed, which
+ * modDownToSet increments by the number of levels of the ciphertext primes
+ * that it drops. This is primesDropped without the special primes, except
+ * that when the context has a half-size prime every other prime counts as
+ * two levels, as in Ctxt::findBaseLevel.
+ **/
+#ifndef _COUNTERS_H_
+#define _COUNTERS_H_
+
+#include <map>
+#include <tuple>
+#include "NumbTh.h"
+#include "multicore.h"
+
+//! The counters of the library, more can be added using registerCounter
+enum FHEcounterId {
+  FHE_CNT_FFT,             // forward NTTs, each one modulo a single prime
+  FHE_CNT_IFFT,            // inverse NTTs, each one modulo a single prime
+  FHE_CNT_KEY_SWITCH,      // ciphertext parts switched by keySwitchPart
+  FHE_CNT_KS_DIGITS,       // digits multiplied by key-switching matrices
+  FHE_CNT_KS_LOOKUP,       // lookups of key-switching matrices
+  FHE_CNT_MOD_SWITCH,      // calls to modDownToSet that drop primes
+  FHE_CNT_PRIMES_DROPPED,  // primes dropped by modDownToSet
+  FHE_CNT_DCRT_ROWS,       // DoubleCRT rows allocated
+  FHE_CNT_DCRT_ALLOC_BYTES,// bytes in these rows
+  FHE_CNT_DCRT_COPY,       // DoubleCRT objects copied
+  FHE_CNT_DCRT_COPY_BYTES, // bytes copied
+  FHE_CNT_PRG_BYTES,       // pseudorandom bytes generated by randomize
+  FHE_CNT_DCRT_ADD,        // DoubleCRT rows added, subtracted or scaled
+  FHE_CNT_DCRT_MUL,        // DoubleCRT rows multiplied
+  FHE_CNT_DCRT_AUTOMORPH,  // DoubleCRT rows permuted by automorphisms
+  FHE_CNT_NUMA_LOCAL_BYTES,  // bytes of keys/constants read on their node
+  FHE_CNT_NUMA_REMOTE_BYTES, // ... and read from another node, see numa.h
+  FHE_CNT_CRT_ROWS,        // rows combined by CRT reconstructions (toPoly)
+  FHE_CNT_LEVELS_CONSUMED, // levels dropped by modDownToSet
+  FHE_CNT_ZZX_REDUCE_WORDS,// words of ZZX coefficients reduced mod a prime
+  FHE_NUM_BUILTIN_COUNTERS
+};
+
+#define FHE_MAX_COUNTERS 64
+
+//! The number of distinct primes whose NTTs are counted separately
+#define FHE_MAX_COUNTER_PRIMES 256
+
+//! A key-switching matrix for the per-matrix counts:
+//! (fromKeyID, powerOfS, powerOfX, toKeyID)
+typedef std::tuple<long,long,long,long> FHEkeySwitchId;
+
+//! Add a new counter with the given name, returns its id. Should be called
+//! before the counters are turned on.
+long registerCounter(const char *name);
+
+//! The name of counter id, or NULL if there is no such counter
+const char *getCounterName(long id);
+
+//! The id of the named counter, or -1 if there is no such counter
+long getCounterId(const char *name);
+
+//! The number of counters (including the registered ones)
+long getNumCounters();
+
+//! Turn on the counters. Should be called before starting any
+//! parallel work.
+void setCountersOn();
+void setCountersOff();
+
+// Set and read by any thread, no ordering with the counts is needed
+extern FHE_atomic_bool fheCountersFlag;
+inline bool areCountersOn() { return FHE_LOAD_RELAXED(fheCountersFlag); }
+
+//! Set all the counters of all the threads to zero. Should not be called
+//! while counted code is running on other threads.
+void resetAllCounters();
+
+//! The slot of the per-prime NTT counts of the prime q, -1 if there are
+//! already FHE_MAX_COUNTER_PRIMES other primes. Called by Cmodulus.
+long registerCounterPrime(long q);
+
+//! \cond FALSE (make doxygen ignore this)
+void addToCounter(long id, unsigned long amt);
+void addToPrimeCounter(long slot, bool inverse, unsigned long amt);
+void addToKeySwitchCounter(const FHEkeySwitchId& id, unsigned long amt);
+//! \endcond
+
+//! A gauge of the number of DoubleCRT rows that are currently allocated.
+//! Only allocations made while the counters are on are tracked (and then
+//! also their release), so turn the counters on before generating keys
+//! to include the key-switching matrices.
+void trackDCRTrows(long delta);
+long getLiveDCRTrows();
+
+//! The peak number of allocated rows since the last call to resetPeak
+long getPeakDCRTrows();
+void resetPeakDCRTrows();
+
+#ifdef FHE_NO_COUNTERS
+#define FHE_COUNT(id, amt) ((void) 0)
+#define FHE_COUNT_PRIME_NTT(slot, inverse, amt) ((void) 0)
+#define FHE_COUNT_KEY_SWITCH(id, amt) ((void) 0)
+#else
+#define FHE_COUNT(id, amt) \
+  do { if (areCountersOn()) addToCounter((id), (amt)); } while (0)
+// count amt NTTs (or inverse NTTs) of the prime with the given slot
+#define FHE_COUNT_PRIME_NTT(slot, inverse, amt) \
+  do { if (areCountersOn() && (slot) >= 0) \
+         addToPrimeCounter((slot), (inverse), (amt)); } while (0)
+// count amt uses of the key-switching matrix id
+#define FHE_COUNT_KEY_SWITCH(id, amt) \
+  do { if (areCountersOn()) addToKeySwitchCounter((id), (amt)); } while (0)
+#endif
+
+/**
+ * @class FHEcounterSnapshot
+ * @brief The values of all the counters at some point in time
+ *
+ * Snapshots can be subtracted to get the counts in an interval, and added
+ * to accumulate such intervals.
+ **/
+class FHEcounterSnapshot {
+  vector<unsigned long> vals; // indexed by the counter id
+  vector<unsigned long> primeFFT, primeIFFT; // indexed by the prime slot
+  std::map<FHEkeySwitchId, unsigned long> ksUses;
+
+public:
+  FHEcounterSnapshot() : vals(FHE_MAX_COUNTERS, 0),
+    primeFFT(FHE_MAX_COUNTER_PRIMES, 0), primeIFFT(FHE_MAX_COUNTER_PRIMES, 0)
+  {}
+
+  unsigned long operator[](long id) const { return vals.at(id); }
+
+  //! The value of the named counter, 0 if there is no such counter
+  unsigned long get(const char *name) const;
+
+  //! The NTTs and the inverse NTTs modulo the prime q
+  unsigned long primeFFTs(long q) const;
+  unsigned long primeIFFTs(long q) const;
+
+  //! The uses of each key-switching matrix (only the ones that were used)
+  const std::map<FHEkeySwitchId, unsigned long>& keySwitchUses() const
+  { return ksUses; }
+
+  FHEcounterSnapshot& operator+=(const FHEcounterSnapshot& other);
+  FHEcounterSnapshot& operator-=(const FHEcounterSnapshot& other);
+  FHEcounterSnapshot operator+(const FHEcounterSnapshot& other) const
+  { FHEcounterSnapshot tmp(*this); tmp += other; return tmp; }
+  FHEcounterSnapshot operator-(const FHEcounterSnapshot& other) const
+  { FHEcounterSnapshot tmp(*this); tmp -= other; return tmp; }
+
+  //! Print the nonzero counters, one per line, then the nonzero counts of
+  //! each prime and of each key-switching matrix
+  void print(ostream& str) const;
+
+  //! Print all the counters as a JSON object, with the breakdowns as the
+  //! objects "primeNTTs" (q: [NTTs, inverse NTTs]) and "keySwitchMatrices"
+  //! ("fromKey,powerOfS,powerOfX,toKey": uses)
+  void printJSON(ostream& str) const;
+
+  friend FHEcounterSnapshot getCounterSnapshot(bool thisThreadOnly);
+};
+
+//! Sum up the counters of all the threads, or only the ones of the
+//! calling thread (which excludes the work that it hands to the thread
+//! pool, but is not affected by other threads that run concurrently)
+FHEcounterSnapshot getCounterSnapshot(bool thisThreadOnly=false);
+
+#endif // _COUNTERS_H_
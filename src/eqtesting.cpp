@@ -14,10 +14,13 @@
  * @brief Useful fucntions for equality testing...
  */
 #include <NTL/lzz_pXFactoring.h>
+#include <NTL/BasicThreadPool.h>
+#include "multicore.h"
 NTL_CLIENT
 #include "FHE.h"
 #include "timing.h"
 #include "EncryptedArray.h"
+#include "matmul.h"
 
 #include <cassert>
 #include <cstdio>
@@ -28,8 +31,13 @@ NTL_CLIENT
 // We compute x^{p^d-1} = x^{(1+p+...+p^{d-1})*(p-1)} by setting y=x^{p-1}
 // and then outputting y * y^p * ... * y^{p^{d-1}}, with exponentiation to
 // powers of p done via Frobenius.
+//
+// All the Frobenius maps are applied to the same y, so they share a single
+// decomposition of y into digits (see BasicAutomorphPrecon), and are then
+// key-switched in parallel.
 void mapTo01(const EncryptedArray& ea, Ctxt& ctxt)
 {
+  FHE_TIMER_START;
   long p = ctxt.getPtxtSpace();
   if (p != ea.getPAlgebra().getP()) // ptxt space is p^r for r>1
     std::logic_error("mapTo01 not implemented for r>1");
@@ -39,9 +47,17 @@ void mapTo01(const EncryptedArray& ea, Ctxt& ctxt)
 
   long d = ea.getDegree();
   if (d>1) { // compute the product of the d automorphisms
+    long m = ea.getPAlgebra().getM();
     std::vector<Ctxt> v(d, ctxt);
-    for (long i=1; i<d; i++)
-      v[i].frobeniusAutomorph(i);
+    BasicAutomorphPrecon precon(ctxt);
+
+    FHE_EXEC_RANGE(d-1, first, last)
+    for (long i=first+1; i<=last; i++) {
+      v[i] = *precon.automorph(PowerMod(p, i, m)); // y^{p^i}
+      v[i].cleanUp();
+    }
+    FHE_EXEC_RANGE_END
+
     totalProduct(ctxt, v);
   }
 }
@@ -49,49 +65,72 @@ void mapTo01(const EncryptedArray& ea, Ctxt& ctxt)
 
 // computes ctxt^{2^d-1} using a method that takes
 // O(log d) automorphisms and multiplications
+//
+// The invariant is ctxt = orig^{2^e-1}. Doubling e computes
+// ctxt * ctxt^{2^e}, and when the next bit of d is set we also need
+// (ctxt * ctxt^{2^e})^2 * orig = ctxt^2 * ctxt^{2^{e+1}} * orig.
+// Either way, the automorphisms in each step are all of the same ctxt,
+// so they share one decomposition into digits.
 void fastPower(Ctxt& ctxt, long d) 
 {
+  FHE_TIMER_START;
   assert(ctxt.getPtxtSpace()==2);
   if (d <= 1) return;
 
   Ctxt orig = ctxt;
+  long m = ctxt.getContext().zMStar.getM();
 
   long k = NumBits(d);
   long e = 1;
 
   for (long i = k-2; i >= 0; i--) {
-    Ctxt tmp1 = ctxt;
-    tmp1.smartAutomorph(1L << e);
-    ctxt.multiplyBy(tmp1);
-    e = 2*e;
+    BasicAutomorphPrecon precon(ctxt);
 
     if (bit(d, i)) {
-      ctxt.smartAutomorph(2);
-      ctxt.multiplyBy(orig);
-      e += 1;
+      Ctxt tmp1(ZeroCtxtLike, ctxt), tmp2(ZeroCtxtLike, ctxt);
+
+      long nThreads = std::min(numFHEthreads(), 2L);
+      FHE_EXEC_INDEX(nThreads, index)
+        switch (index) {
+        case 0:
+          tmp1 = *precon.automorph(2);
+          tmp1.cleanUp();
+          if (nThreads>1) break;
+        default:
+          tmp2 = *precon.automorph(PowerMod(2, e+1, m));
+          tmp2.cleanUp();
+        }
+      FHE_EXEC_INDEX_END
+
+      ctxt = orig;
+      ctxt.multiplyBy2(tmp1, tmp2);
+      e = 2*e + 1;
+    }
+    else {
+      Ctxt tmp1 = *precon.automorph(PowerMod(2, e, m));
+      tmp1.cleanUp();
+      ctxt.multiplyBy(tmp1);
+      e = 2*e;
     }
   }
 }
 
-// ===> This function only works for p=2, r=1 <===
-// Test if prefixes of bits in slots are all zero: Set slot j of res[i] to 0
-// if bits 0..i of j'th slot in ctxt are all zero, else it is set to 1
-// It is assumed that res and the res[i]'s are initialized by the caller.
-// Complexity: O(d + n log d) smart automorphisms
-//             O(n d) 
-void incrementalZeroTest(Ctxt* res[], const EncryptedArray& ea,
-			 const Ctxt& ctxt, long n)
+// ===> ZeroTestPlan only works for p=2, r=1 <===
+
+ZeroTestPlan::ZeroTestPlan(const EncryptedArray& _ea, long _n):
+  ea(_ea), n(_n)
 {
   FHE_TIMER_START;
   long nslots = ea.size();
   long d = ea.getDegree();
+  assert(ea.getPAlgebra().getP() == 2);
+  assert(n >= 0 && n <= d);
 
   // compute linearized polynomial coefficients
 
-  vector< vector<ZZX> > Coeff;
-  Coeff.resize(n);
-
-  for (long i = 0; i < n; i++) {
+  coeffs.resize(n);
+  FHE_EXEC_RANGE(n, first, last)
+  for (long i = first; i < last; i++) {
     // coeffients for mask on bits 0..i
     // L[j] = X^j for j = 0..i, L[j] = 0 for j = i+1..d-1
 
@@ -105,36 +144,100 @@ void incrementalZeroTest(Ctxt* res[], const EncryptedArray& ea,
 
     ea.buildLinPolyCoeffs(C, L);
 
-    Coeff[i].resize(d);
+    coeffs[i].resize(d);
     for (long j = 0; j < d; j++) {
-      // Coeff[i][j] = to the encoding that has C[j] in all slots
-      // FIXME: maybe encrtpted array should have this functionality
-      //        built in
-      vector<ZZX> T;
-      T.resize(nslots);
-      for (long s = 0; s < nslots; s++) T[s] = C[j];
-      ea.encode(Coeff[i][j], T);
+      // coeffs[i][j] = to the encoding that has C[j] in all slots
+      vector<ZZX> T(nslots, C[j]);
+      ZZX poly;
+      ea.encode(poly, T);
+      coeffs[i][j] = make_shared<DoubleCRT>(poly, ea.getContext());
     }
   }
+  FHE_EXEC_RANGE_END
+}
 
-  vector<Ctxt> Conj(d, ctxt);
-  // initialize Cong[j] to ctxt^{2^j}
-  for (long j = 0; j < d; j++) {
-    Conj[j].smartAutomorph(1L << j);
+void ZeroTestPlan::prefixTest(Ctxt& res, const vector<Ctxt>& conj,
+                              long i) const
+{
+  long d = lsize(conj);
+  res = conj[0];
+  res.multByConstant(*coeffs[i][0]);
+  for (long j = 1; j < d; j++) {
+    Ctxt tmp = conj[j];
+    tmp.multByConstant(*coeffs[i][j]);
+    res += tmp;
   }
 
-  for (long i = 0; i < n; i++) {
-    res[i]->clear();
-    for (long j = 0; j < d; j++) {
-      Ctxt tmp = Conj[j];
-      tmp.multByConstant(Coeff[i][j]);
-      *res[i] += tmp;
-    }
+  // res now has 0..i in each slot
+  // next, we raise to the power 2^d-1
 
-    // *res[i] now has 0..i in each slot
-    // next, we raise to the power 2^d-1
+  fastPower(res, d);
+}
 
-    fastPower(*res[i], d);
+void ZeroTestPlan::apply(vector< vector<Ctxt> >& res,
+                         const vector<Ctxt>& ctxts) const
+{
+  FHE_TIMER_START;
+  long d = ea.getDegree();
+  long m = ea.getPAlgebra().getM();
+  long nCtxts = lsize(ctxts);
+  res.resize(nCtxts);
+
+  // The inputs are processed a chunk at a time, to bound the number of
+  // Frobenius images that we keep around
+  long chunk = std::max(numFHEthreads(), 1L);
+  for (long start = 0; start < nCtxts; start += chunk) {
+    long sz = std::min(chunk, nCtxts-start);
+
+    // Decompose each input into digits once
+    vector< shared_ptr<BasicAutomorphPrecon> > precon(sz);
+    FHE_EXEC_RANGE(sz, first, last)
+    for (long k = first; k < last; k++)
+      precon[k] = make_shared<BasicAutomorphPrecon>(ctxts[start+k]);
+    FHE_EXEC_RANGE_END
+
+    // conj[k][j] = ctxts[start+k]^{2^j}, from that decomposition
+    vector< vector<Ctxt> >
+      conj(sz, vector<Ctxt>(d, Ctxt(ZeroCtxtLike, ctxts[start])));
+    FHE_EXEC_RANGE(sz*d, first, last)
+    for (long t = first; t < last; t++) {
+      long k = t / d, j = t % d;
+      conj[k][j] = *precon[k]->automorph(PowerMod(2, j, m));
+      conj[k][j].cleanUp();
+    }
+    FHE_EXEC_RANGE_END
+    precon.clear();
+
+    // Test all the prefixes of all the inputs in this chunk
+    for (long k = 0; k < sz; k++)
+      res[start+k].resize(n, Ctxt(ZeroCtxtLike, ctxts[start+k]));
+    FHE_EXEC_RANGE(sz*n, first, last)
+    for (long t = first; t < last; t++) {
+      long k = t / n, i = t % n;
+      prefixTest(res[start+k][i], conj[k], i);
+    }
+    FHE_EXEC_RANGE_END
   }
+}
+
+void ZeroTestPlan::apply(Ctxt* res[], const Ctxt& ctxt) const
+{
+  vector< vector<Ctxt> > out;
+  apply(out, vector<Ctxt>(1, ctxt));
+  for (long i = 0; i < n; i++)
+    *res[i] = out[0][i];
+}
+
+// ===> This function only works for p=2, r=1 <===
+// Test if prefixes of bits in slots are all zero: Set slot j of res[i] to 0
+// if bits 0..i of j'th slot in ctxt are all zero, else it is set to 1
+// It is assumed that res and the res[i]'s are initialized by the caller.
+// Complexity: O(d + n log d) smart automorphisms
+//             O(n d) 
+void incrementalZeroTest(Ctxt* res[], const EncryptedArray& ea,
+			 const Ctxt& ctxt, long n)
+{
+  FHE_TIMER_START;
+  ZeroTestPlan(ea, n).apply(res, ctxt);
   FHE_TIMER_STOP;
 }
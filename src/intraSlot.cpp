@@ -15,8 +15,11 @@
  * to either ea.getNormalBasisMatrixInverse() or ea.getNormalBasisMatrix().
  */
 #include <memory>
+#include <list>
 #include "replicate.h"
 #include "intraSlot.h"
+#include "matmul.h"
+#include "multicore.h"
 
 // Implementation classes for unpacking:
 // buildUnpackSlotEncoding_pa_impl prepares the constants for the linear
@@ -61,52 +64,183 @@ void buildUnpackSlotEncoding(std::vector<zzX>& unpackSlotEncoding,
   ea.dispatch<buildUnpackSlotEncoding_pa_impl>(unpackSlotEncoding);
 }
 
-template<class type>
-class unpack_pa_impl {
+typedef std::vector< std::shared_ptr<DoubleCRT> > DCRTVec;
+
+// The DoubleCRT form of the constants that unpack and repack multiply by,
+// kept with the EncryptedArray (and shared by its copies) so that they are
+// not converted again on every call. The constants are converted relative
+// to all the primes of the context (including the special primes), so the
+// same objects serve ciphertexts at every level, and also the ciphertexts
+// returned by BasicAutomorphPrecon. They are converted again if primes were
+// added to the context since. The repack constants only depend on the
+// EncryptedArray, so they are only encoded once. The unpack constants are
+// given by the caller, so each one is kept with a copy of the encoding it
+// was converted from, and only reused for the same encoding.
+class IntraSlotConsts {
+  typedef std::pair< std::vector<zzX>, std::shared_ptr<const DCRTVec> >
+    UnpackEntry;
+
+  FHE_MUTEX_TYPE mx;
+  std::vector<long> primes; // the primes that the constants are over
+  std::shared_ptr<const DCRTVec> repack;
+  std::list<UnpackEntry> unpack; // most recently used first
+  static const long maxUnpack = 4;
+
+  // The constants of ea, allocated on first use
+  static IntraSlotConsts& of(const EncryptedArray& ea)
+  {
+    static FHE_MUTEX_TYPE allocMx;
+    FHE_MUTEX_GUARD(allocMx);
+    if (!ea.intraSlotConsts)
+      ea.intraSlotConsts = std::make_shared<IntraSlotConsts>();
+    return *ea.intraSlotConsts;
+  }
+
+  // Drop the constants if the primes of the context changed, should be
+  // called with mx locked
+  void checkPrimes(const FHEcontext& context)
+  {
+    std::vector<long> cur(context.numPrimes());
+    for (long i = 0; i < lsize(cur); i++) cur[i] = context.ithPrime(i);
+    if (cur == primes) return;
+    primes.swap(cur);
+    repack.reset();
+    unpack.clear();
+  }
+
+  static std::shared_ptr<const DCRTVec>
+  convert(const std::vector<zzX>& polys, const FHEcontext& context)
+  {
+    std::shared_ptr<DCRTVec> dcrts = std::make_shared<DCRTVec>(polys.size());
+    FHE_EXEC_RANGE(lsize(polys), first, last)
+    for (long i = first; i < last; i++)
+      (*dcrts)[i] = std::make_shared<DoubleCRT>(polys[i], context);
+    FHE_EXEC_RANGE_END
+    return dcrts;
+  }
+
 public:
-  PA_INJECT(type)
+  // The constants X^{p^i} of repack, encoded by build(polys) on a miss
+  template<class Builder>
+  static std::shared_ptr<const DCRTVec>
+  getRepack(const EncryptedArray& ea, Builder build)
+  {
+    IntraSlotConsts& c = of(ea);
+    {
+      FHE_MUTEX_GUARD(c.mx);
+      c.checkPrimes(ea.getContext());
+      if (c.repack) return c.repack;
+    }
+    std::vector<zzX> polys;
+    build(polys);
+    std::shared_ptr<const DCRTVec> dcrts = convert(polys, ea.getContext());
+
+    FHE_MUTEX_GUARD(c.mx);
+    c.checkPrimes(ea.getContext());
+    if (!c.repack) c.repack = dcrts;
+    return c.repack;
+  }
 
-  static void apply(const EncryptedArrayDerived<type>& ea, const CtPtrs& unpacked,
-                    const Ctxt&ctxt,const std::vector<zzX>& unpackSlotEncoding)
+  // The unpack constants encoded as polys
+  static std::shared_ptr<const DCRTVec>
+  getUnpack(const EncryptedArray& ea, const std::vector<zzX>& polys)
   {
-    long d = ea.getDegree(); // size of each slot
+    IntraSlotConsts& c = of(ea);
+    {
+      FHE_MUTEX_GUARD(c.mx);
+      c.checkPrimes(ea.getContext());
+      for (auto it = c.unpack.begin(); it != c.unpack.end(); ++it)
+        if (it->first == polys) {
+          c.unpack.splice(c.unpack.begin(), c.unpack, it); // move to front
+          return it->second;
+        }
+    }
+    std::shared_ptr<const DCRTVec> dcrts = convert(polys, ea.getContext());
 
-    //ctxt.cleanUp();
+    FHE_MUTEX_GUARD(c.mx);
+    c.checkPrimes(ea.getContext());
+    c.unpack.push_front(UnpackEntry(polys, dcrts));
+    if (lsize(c.unpack) > maxUnpack) c.unpack.pop_back();
+    return dcrts;
+  }
+};
 
-    // Convert the unpack constants to doubleCRT
-    std::vector< std::shared_ptr<DoubleCRT> > coeff_vector(d);
-    for (long i = 0; i < d; i++) {
-      coeff_vector[i] = std::shared_ptr<DoubleCRT>(new
-        DoubleCRT(unpackSlotEncoding[i],ctxt.getContext(),ctxt.getPrimeSet()));
+// Unpack packed[k] into unpacked[k*d],...,unpacked[k*d+d-1], as long as
+// these indexes are less than unpacked.size(). The j'th slot of
+// unpacked[k*d+i] is the i'th coefficient (on the normal basis) of the
+// j'th slot of packed[k], namely
+//    unpacked[k*d+i] = sum_{j<d} frob_j(packed[k]) * C_{i+j mod d}.
+// The d-1 non-trivial Frobenius maps of each packed ciphertext share one
+// decomposition into digits, and the products are summed before they are
+// mod-switched down. The inputs are handled a chunk at a time, and all the
+// Frobenius maps and all the outputs of a chunk are computed in parallel.
+static void unpackAll(const CtPtrs& unpacked,
+                      const std::vector<const Ctxt*>& packed,
+                      const EncryptedArray& ea,
+                      const std::vector<zzX>& unpackSlotEncoding)
+{
+  FHE_TIMER_START;
+  long d = ea.getDegree(); // size of each slot
+  long p = ea.getPAlgebra().getP();
+  long m = ea.getPAlgebra().getM();
+  long num2unpack = unpacked.size();
+  long nPacked = lsize(packed);
+  if (num2unpack == 0 || nPacked == 0) return;
+
+  assert(lsize(unpackSlotEncoding) == d);
+  std::shared_ptr<const DCRTVec> coeffs
+    = IntraSlotConsts::getUnpack(ea, unpackSlotEncoding);
+
+  long chunk = std::max(numFHEthreads(), 1L);
+  for (long start = 0; start < nPacked; start += chunk) {
+    long sz = std::min(chunk, nPacked-start);
+
+    // Decompose each packed ciphertext into digits once
+    std::vector< std::shared_ptr<BasicAutomorphPrecon> > precon(sz);
+    FHE_EXEC_RANGE(sz, first, last)
+    for (long k = first; k < last; k++)
+      precon[k] = std::make_shared<BasicAutomorphPrecon>(*packed[start+k]);
+    FHE_EXEC_RANGE_END
+
+    // frob[k][j] is the j'th Frobenius of packed[start+k], for 0<j<d
+    std::vector< std::vector< std::shared_ptr<Ctxt> > >
+      frob(sz, std::vector< std::shared_ptr<Ctxt> >(d));
+    FHE_EXEC_RANGE(sz*(d-1), first, last)
+    for (long t = first; t < last; t++) {
+      long k = t / (d-1), j = 1 + t % (d-1);
+      frob[k][j] = precon[k]->automorph(PowerMod(p, j, m));
     }
-    // Compute the d Frobenius automorphisms of ctxt (use multi-threading)
-    std::vector<Ctxt> frob(d, Ctxt(ZeroCtxtLike, ctxt));
-    NTL_EXEC_RANGE(d, first, last)
-	for (long j = first; j < last; j++) { // process jth Frobenius 
-	  frob[j] = ctxt;
-	  frob[j].frobeniusAutomorph(j);
-	  frob[j].cleanUp();
-          // NOTE: Why do we apply cleanup after the Frobenus?
-	}
-    NTL_EXEC_RANGE_END
-
-    // compute the unpacked ciphertexts: the j'th slot of unpacked[i]
-    // contains the i'th coefficient from the j'th clot of ctxt
-    Ctxt tmp1(ZeroCtxtLike, ctxt);
-    for (long i = 0; i < unpacked.size(); i++) {
-      *(unpacked[i]) = frob[0];
-      unpacked[i]->multByConstant(*coeff_vector[i]);
+    FHE_EXEC_RANGE_END
+    precon.clear();
+
+    // compute the unpacked ciphertexts
+    FHE_EXEC_RANGE(sz*d, first, last)
+    for (long t = first; t < last; t++) {
+      long k = t / d, i = t % d;
+      long idx = (start+k)*d + i;
+      if (idx >= num2unpack) continue;
+
+      const Ctxt& ctxt = *packed[start+k];
+      Ctxt sum(ZeroCtxtLike, ctxt);
       for (long j = 1; j < d; j++) {
-	tmp1 = frob[j];
-	tmp1.multByConstant(*coeff_vector[mcMod(i+j, d)]);
-	*(unpacked[i]) += tmp1;
+        Ctxt tmp = *frob[k][j];
+        tmp.multByConstant(*(*coeffs)[mcMod(i+j, d)]);
+        sum += tmp;
       }
-    } // NOTE: why aren't we using multi-threading here?
+      sum.cleanUp();
+
+      Ctxt& out = *(unpacked[idx]);
+      out = ctxt;
+      out.cleanUp();
+      out.multByConstant(*(*coeffs)[i]);
+      out += sum;
+    }
+    FHE_EXEC_RANGE_END
   }
-};
+}
 //! \endcond
 
-// A wrapper function, calls the apply method of the class above
+// Low-level unpack of one ciphertext
 void unpack(const CtPtrs& unpacked, const Ctxt& packed, 
             const EncryptedArray& ea,
             const std::vector<zzX>& unpackSlotEncoding)
@@ -115,7 +249,9 @@ void unpack(const CtPtrs& unpacked, const Ctxt& packed,
 // 	    const Ctxt& ctxt, 
 // 	    const std::vector<zzX>& unpackSlotEncoding)
 {
-  ea.dispatch<unpack_pa_impl>(unpacked, packed, unpackSlotEncoding);
+  assert(unpacked.size() <= ea.getDegree());
+  unpackAll(unpacked, std::vector<const Ctxt*>(1, &packed),
+            ea, unpackSlotEncoding);
 }
 
 // unpack many ciphertexts, returns the number of unpacked ciphertexts
@@ -126,74 +262,99 @@ long unpack(const CtPtrs& unpacked, const CtPtrs& packed,
   long d = ea.getDegree(); // size of each slot
   long num2unpack = unpacked.size();
   assert(packed.size()*d >= num2unpack); // we must have enough ciphertexts
-  long offset = 0;
-  long idx = 0;
-  while (num2unpack > 0) {
-    if (num2unpack < d) d = num2unpack;
-    const CtPtrs_slice nextSlice(unpacked, offset, d);
-    ea.dispatch<unpack_pa_impl>(nextSlice,
-                                *(packed[idx++]), unpackSlotEncoding);
-    num2unpack -= d;
-    offset += d;
-  }
-  return idx;
+
+  std::vector<const Ctxt*> packedPtrs(divc(num2unpack, d));
+  for (long k = 0; k < lsize(packedPtrs); k++) packedPtrs[k] = packed[k];
+
+  unpackAll(unpacked, packedPtrs, ea, unpackSlotEncoding);
+  return lsize(packedPtrs);
 }
 
 // An implementation classes for (re)packing.
 
 //! \cond FALSE (make doxygen ignore this code)
 template<class type>
-class repack_pa_impl {
+class repackConsts_pa_impl {
 public:
   PA_INJECT(type)
 
-  static void apply(const EncryptedArrayDerived<type>& ea, Ctxt& ctxt,
-                    const CtPtrs& unpacked)
+  // powInSlots[i] is a constant with X^{p^i} (on the normal basis) in all
+  // the slots
+  static void apply(const EncryptedArrayDerived<type>& ea,
+                    std::vector<zzX>& powInSlots)
   {
     RBak bak; bak.save(); ea.restoreContext();  // the NTL context for mod p^r
     long nslots = ea.size(); // how many slots
+    long d = ea.getDegree(); // size of each slot
 
     const Mat<R>& CB=ea.getNormalBasisMatrix();
     // CB contains a description of the normal-basis transformation
 
     RX pow;
-    zzX powInSlots;
     std::vector<RX> powVec(nslots);
-    ctxt.clear();
-    for (long i=0; i<unpacked.size(); i++) {
+    powInSlots.resize(d);
+    for (long i=0; i<d; i++) {
       conv(pow, CB[i]); // convert CB[i] from Vec<R> to RX
       for (long j=0; j < nslots; j++) powVec[j] = pow;
-      ea.encode(powInSlots, powVec); // a constant with X^{p^i} in all slots
-      Ctxt tmp(*(unpacked[i]));
-      tmp.multByConstant(powInSlots);// accumulate unpacked[i] * X^{p^i}
-      ctxt += tmp;
+      ea.encode(powInSlots[i], powVec); // a constant with X^{p^i} in all slots
     }
   }
 };
+
+// Set packed[k] = sum_{i<d} unpacked[k*d+i] * X^{p^i}, as long as the
+// indexes are less than unpacked.size(). The products are computed in
+// parallel, then the sums are computed in parallel across the packed
+// ciphertexts.
+static long repackAll(const CtPtrs& packed, const CtPtrs& unpacked,
+                      const EncryptedArray& ea)
+{
+  FHE_TIMER_START;
+  long d = ea.getDegree(); // size of each slot
+  long num2pack = unpacked.size();
+  long nPacked = divc(num2pack, d);
+  assert(packed.size() >= nPacked); // we must have enough ciphertexts
+  if (num2pack == 0) return 0;
+
+  // the constants X^{p^i} are only encoded when they are not cached
+  std::shared_ptr<const DCRTVec> consts
+    = IntraSlotConsts::getRepack(ea, [&](std::vector<zzX>& powInSlots) {
+        ea.dispatch<repackConsts_pa_impl>(powInSlots);
+      });
+
+  std::vector<Ctxt> prods(num2pack, Ctxt(ZeroCtxtLike, *unpacked[0]));
+  FHE_EXEC_RANGE(num2pack, first, last)
+  for (long i = first; i < last; i++) {
+    prods[i] = *(unpacked[i]);
+    prods[i].multByConstant(*(*consts)[i % d]); // unpacked[i] * X^{p^i}
+  }
+  FHE_EXEC_RANGE_END
+
+  FHE_EXEC_RANGE(nPacked, first, last)
+  for (long k = first; k < last; k++) {
+    Ctxt& ctxt = *(packed[k]);
+    ctxt.clear();
+    for (long i = k*d; i < std::min((k+1)*d, num2pack); i++)
+      ctxt += prods[i];
+  }
+  FHE_EXEC_RANGE_END
+
+  return nPacked;
+}
 //! \endcond
 
-// A wrapper function, calls the apply method of the class above
+// Low-level (re)pack in slots of one ciphertext
 void repack(Ctxt& packed, const CtPtrs& unpacked, const EncryptedArray& ea)
 {
-  ea.dispatch<repack_pa_impl>(packed, unpacked);
+  assert(unpacked.size() <= ea.getDegree());
+  std::vector<Ctxt*> packedPtrs(1, &packed);
+  if (unpacked.size() == 0) packed.clear();
+  else repackAll(CtPtrs_vectorPt(packedPtrs), unpacked, ea);
 }
 
 // pack many ciphertexts, returns the number of packed ciphertexts
 long repack(const CtPtrs& packed, const CtPtrs& unpacked, const EncryptedArray& ea)
 {
-  long d = ea.getDegree(); // size of each slot
-  long num2pack = unpacked.size();
-  assert(packed.size()*d >= num2pack); // we must have enough ciphertexts
-  long offset = 0;
-  long idx = 0;
-  while (num2pack > 0) {
-    if (num2pack < d) d = num2pack;
-    const CtPtrs_slice nextSlice(unpacked, offset, d);
-    ea.dispatch<repack_pa_impl>(*(packed[idx++]), nextSlice);
-    num2pack -= d;
-    offset += d;
-  }
-  return idx;
+  return repackAll(packed, unpacked, ea);
 }
 
 
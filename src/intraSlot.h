@@ -25,6 +25,12 @@
 void buildUnpackSlotEncoding(std::vector<zzX>& unpackSlotEncoding,
                              const EncryptedArray& ea);
 
+// The unpack and repack constants are converted to DoubleCRT once and
+// cached with ea (the unpack constants together with the encoding that
+// they were converted from), the Frobenius maps of each packed
+// ciphertext share a single decomposition into digits, and the work is
+// done in parallel across the packed ciphertexts and the output bits.
+
 // Low-level unpack of one ciphertext using pre-copmuted constants
 void unpack(const CtPtrs& unpacked, const Ctxt& packed, 
             const EncryptedArray& ea,
@@ -13,6 +13,7 @@
 #include <tuple>
 #include <algorithm>
 #include <NTL/BasicThreadPool.h>
+#include "multicore.h"
 #include "matmul.h"
 
 int fhe_test_force_bsgs=0;
@@ -36,122 +37,96 @@ static bool comp_hoist(bool hoist)
 /********************************************************************/
 /****************** Auxiliary stuff: should go elsewhere   **********/
 
-/**
- * @class BasicAutomorphPrecon
- * @brief Pre-computation to speed many automorphism on the same ciphertext.
- * 
- * The expensive part of homomorphic automorphism is braking the ciphertext
- * parts into digits. The usual setting is we first rotate the ciphertext
- * parts, then break them into digits. But when we apply many automorphisms
- * it is faster to break the original ciphertext into digits, then rotate
- * the digits (as opposed to first rotate, then break).
- * An BasicAutomorphPrecon object breaks the original ciphertext and keeps
- * the digits, then when you call automorph is only needs to apply the
- * native automorphism and key switching to the digits, which is fast(er).
- **/
-class BasicAutomorphPrecon {
-  Ctxt ctxt;
-  NTL::xdouble noise;
-  std::vector<DoubleCRT> polyDigits;
-
-public:
-  BasicAutomorphPrecon(const Ctxt& _ctxt) : ctxt(_ctxt), noise(1.0)
-  {
-    FHE_TIMER_START;
-    if (ctxt.parts.size() >= 1) assert(ctxt.parts[0].skHandle.isOne());
-    if (ctxt.parts.size() <= 1) return; // nothing to do
-
-    ctxt.cleanUp();
-    const FHEcontext& context = ctxt.getContext();
-    const FHEPubKey& pubKey = ctxt.getPubKey();
-    long keyID = ctxt.getKeyID();
+// Break the ciphertext into digits, these are later rotated by automorph
+BasicAutomorphPrecon::BasicAutomorphPrecon(const Ctxt& _ctxt) :
+  ctxt(_ctxt), noise(1.0)
+{
+  FHE_TIMER_START;
+  if (ctxt.parts.size() >= 1) assert(ctxt.parts[0].skHandle.isOne());
+  if (ctxt.parts.size() <= 1) return; // nothing to do
 
-    // The call to cleanUp() should ensure that this assertions passes.
-    assert(ctxt.inCanonicalForm(keyID));
+  ctxt.cleanUp();
+  const FHEcontext& context = ctxt.getContext();
+  const FHEPubKey& pubKey = ctxt.getPubKey();
+  long keyID = ctxt.getKeyID();
 
-    // Compute the number of digits that we need and the esitmated
-    // added noise from switching this ciphertext.
-    long nDigits;
-    std::tie(nDigits, noise)
-      = ctxt.computeKSNoise(1, pubKey.keySWlist().at(0).ptxtSpace);
+  // The call to cleanUp() should ensure that this assertions passes.
+  assert(ctxt.inCanonicalForm(keyID));
 
-    double logProd = context.logOfProduct(context.specialPrimes);
-    noise += ctxt.getNoiseVar() * xexp(2*logProd);
+  // Compute the number of digits that we need and the esitmated
+  // added noise from switching this ciphertext.
+  long nDigits;
+  std::tie(nDigits, noise)
+    = ctxt.computeKSNoise(1, pubKey.keySWlist().at(0).ptxtSpace);
 
-    // Break the ciphertext part into digits, if needed, and scale up these
-    // digits using the special primes.
+  double logProd = context.logOfProduct(context.specialPrimes);
+  noise += ctxt.getNoiseVar() * xexp(2*logProd);
 
-    ctxt.parts[1].breakIntoDigits(polyDigits, nDigits);
-  }
+  // Break the ciphertext part into digits, if needed, and scale up these
+  // digits using the special primes.
 
-  
-  shared_ptr<Ctxt>
-  automorph(long k) const
-  {
-    FHE_TIMER_START;
-
-    // A hack: record this automorphism rather than actually performing it
-    if (isSetAutomorphVals()) { // defined in NumbTh.h
-      recordAutomorphVal(k);
-      return make_shared<Ctxt>(ctxt);
-    }
+  ctxt.parts[1].breakIntoDigits(polyDigits, nDigits);
+}
 
-    if (k==1 || ctxt.isEmpty()) return make_shared<Ctxt>(ctxt);// nothing to do
 
-    const FHEcontext& context = ctxt.getContext();
-    const FHEPubKey& pubKey = ctxt.getPubKey();
-    shared_ptr<Ctxt> result = make_shared<Ctxt>(ZeroCtxtLike, ctxt); // empty ctxt
-    result->noiseVar = noise; // noise estimate
+shared_ptr<Ctxt>
+BasicAutomorphPrecon::automorph(long k) const
+{
+  FHE_TIMER_START;
 
-    if (ctxt.parts.size()==1) { // only constant part, no need to key-switch
-      CtxtPart tmpPart = ctxt.parts[0];
-      tmpPart.automorph(k);
-      tmpPart.addPrimesAndScale(context.specialPrimes);
-      result->addPart(tmpPart, /*matchPrimeSet=*/true);
-      return result;
-    }
+  // A hack: record this automorphism rather than actually performing it
+  if (isSetAutomorphVals()) { // defined in NumbTh.h
+    recordAutomorphVal(k);
+    return make_shared<Ctxt>(ctxt);
+  }
 
-    // Ensure that we have a key-switching matrices for this automorphism
-    long keyID = ctxt.getKeyID();
-    if (!pubKey.isReachable(k,keyID)) {
-      throw std::logic_error("no key-switching matrices for k="+std::to_string(k)
-                             + ", keyID="+std::to_string(keyID));
-    }
+  if (k==1 || ctxt.isEmpty()) return make_shared<Ctxt>(ctxt);// nothing to do
 
-    // Get the first key-switching matrix for this automorphism
-    const KeySwitch& W = pubKey.getNextKSWmatrix(k,keyID);
-    long amt = W.fromKey.getPowerOfX();
+  const FHEcontext& context = ctxt.getContext();
+  const FHEPubKey& pubKey = ctxt.getPubKey();
+  shared_ptr<Ctxt> result = make_shared<Ctxt>(ZeroCtxtLike, ctxt); // empty ctxt
+  result->noiseVar = noise; // noise estimate
 
-    // Start by rotating the constant part, no need to key-switch it
+  if (ctxt.parts.size()==1) { // only constant part, no need to key-switch
     CtxtPart tmpPart = ctxt.parts[0];
-    tmpPart.automorph(amt);
+    tmpPart.automorph(k);
     tmpPart.addPrimesAndScale(context.specialPrimes);
     result->addPart(tmpPart, /*matchPrimeSet=*/true);
+    return result;
+  }
 
-    // Then rotate the digits and key-switch them
-    vector<DoubleCRT> tmpDigits = polyDigits;
-    for (auto&& tmp: tmpDigits) // rotate each of the digits
-      tmp.automorph(amt);
+  // Ensure that we have a key-switching matrices for this automorphism
+  long keyID = ctxt.getKeyID();
+  if (!pubKey.isReachable(k,keyID)) {
+    throw std::logic_error("no key-switching matrices for k="+std::to_string(k)
+                           + ", keyID="+std::to_string(keyID));
+  }
 
-    result->keySwitchDigits(W, tmpDigits); // key-switch the digits
+  // Get the first key-switching matrix for this automorphism
+  const KeySwitch& W = pubKey.getNextKSWmatrix(k,keyID);
+  long amt = W.fromKey.getPowerOfX();
 
-    long m = context.zMStar.getM();
-    if ((amt-k)%m != 0) { // amt != k (mod m), more automorphisms to do
-      k = MulMod(k, InvMod(amt,m), m); // k *= amt^{-1} mod m
-      result->smartAutomorph(k);       // call usual smartAutomorph
-    }
-    return result;
-  }
-};
+  // Start by rotating the constant part, no need to key-switch it
+  CtxtPart tmpPart = ctxt.parts[0];
+  tmpPart.automorph(amt);
+  tmpPart.addPrimesAndScale(context.specialPrimes);
+  result->addPart(tmpPart, /*matchPrimeSet=*/true);
 
+  // Then rotate the digits and key-switch them
+  vector<DoubleCRT> tmpDigits = polyDigits;
+  for (auto&& tmp: tmpDigits) // rotate each of the digits
+    tmp.automorph(amt);
 
-class GeneralAutomorphPrecon {
-public:
-  virtual ~GeneralAutomorphPrecon() {}
+  result->keySwitchDigits(W, tmpDigits); // key-switch the digits
 
-  virtual shared_ptr<Ctxt> automorph(long i) const = 0;
+  long m = context.zMStar.getM();
+  if ((amt-k)%m != 0) { // amt != k (mod m), more automorphisms to do
+    k = MulMod(k, InvMod(amt,m), m); // k *= amt^{-1} mod m
+    result->smartAutomorph(k);       // call usual smartAutomorph
+  }
+  return result;
+}
 
-};
 
 class GeneralAutomorphPrecon_UNKNOWN : public GeneralAutomorphPrecon {
 private:
@@ -220,12 +195,12 @@ public:
     precon.resize(h);
 
     // parallel for k in [0..h)
-    NTL_EXEC_RANGE(h, first, last)
+    FHE_EXEC_RANGE(h, first, last)
       for (long k = first; k < last; k++) {
 	shared_ptr<Ctxt> p = precon0.automorph(zMStar.genToPow(dim, g*k));
 	precon[k] = make_shared<BasicAutomorphPrecon>(*p);
       }
-    NTL_EXEC_RANGE_END
+    FHE_EXEC_RANGE_END
   }
 
   shared_ptr<Ctxt> automorph(long i) const override
@@ -281,6 +256,9 @@ struct ConstMultiplier {
   virtual shared_ptr<ConstMultiplier> upgrade(const FHEcontext& context) const = 0;
   // Upgrade to DCRT. Returns null of no upgrade required
 
+  virtual shared_ptr<ConstMultiplier> clone() const = 0;
+  virtual long bytes() const = 0;
+
 };
 
 struct ConstMultiplier_DoubleCRT : ConstMultiplier {
@@ -296,6 +274,15 @@ struct ConstMultiplier_DoubleCRT : ConstMultiplier {
     return nullptr;
   }
 
+  shared_ptr<ConstMultiplier> clone() const override {
+    return make_shared<ConstMultiplier_DoubleCRT>(data);
+  }
+
+  long bytes() const override {
+    return card(data.getIndexSet())
+           * data.getContext().zMStar.getPhiM() * sizeof(long);
+  }
+
 };
 
 
@@ -313,6 +300,14 @@ struct ConstMultiplier_zzX : ConstMultiplier {
     return make_shared<ConstMultiplier_DoubleCRT>(DoubleCRT(data, context));
   }
 
+  shared_ptr<ConstMultiplier> clone() const override {
+    return make_shared<ConstMultiplier_zzX>(data);
+  }
+
+  long bytes() const override {
+    return data.length() * sizeof(long);
+  }
+
 };
 
 template<class RX>
@@ -360,18 +355,40 @@ void DestMulAdd(Ctxt& x, const shared_ptr<ConstMultiplier>& a, Ctxt& b)
 }
 
 
+// A copy of a constant for another NUMA node, made by a thread of that
+// node so that the copy is allocated there
+static shared_ptr< shared_ptr<ConstMultiplier> >
+cloneMultiplier(const shared_ptr<ConstMultiplier>& m)
+{
+  return make_shared< shared_ptr<ConstMultiplier> >(m->clone());
+}
+
+ConstMultiplierCache::ConstMultiplierCache() : replicas(cloneMultiplier) {}
+
+const shared_ptr<ConstMultiplier>& ConstMultiplierCache::get(long i) const
+{
+  const shared_ptr<ConstMultiplier>& master = multiplier[i];
+  if (!master) return master;
+
+  bool isLocal;
+  const shared_ptr<ConstMultiplier>& m = replicas.local(master, i, &isLocal);
+  FHE_COUNT_NUMA(isLocal, m->bytes());
+  return m;
+}
+
 void ConstMultiplierCache::upgrade(const FHEcontext& context) 
 {
   FHE_TIMER_START;
 
   long n = multiplier.size();
-  NTL_EXEC_RANGE(n, first, last)
+  FHE_EXEC_RANGE(n, first, last)
   for (long i: range(first, last)) {
     if (multiplier[i]) 
       if (auto newptr = multiplier[i]->upgrade(context)) 
 	multiplier[i] = shared_ptr<ConstMultiplier>(newptr); 
   }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
+  replicas.clear();
 }
 
 
@@ -736,24 +753,24 @@ void GenBabySteps(vector<shared_ptr<Ctxt>>& v, const Ctxt& ctxt, long dim,
       ctxt.getPubKey().getKSStrategy(dim) != FHE_KSS_UNKNOWN) {
     BasicAutomorphPrecon precon(ctxt);
 
-    NTL_EXEC_RANGE(n, first, last)
+    FHE_EXEC_RANGE(n, first, last)
       for (long j: range(first, last)) {
 	 v[j] = precon.automorph(zMStar.genToPow(dim, j));
 	 if (clean) v[j]->cleanUp();
       }
-    NTL_EXEC_RANGE_END
+    FHE_EXEC_RANGE_END
   }
   else {
     Ctxt ctxt0(ctxt);
     ctxt0.cleanUp();
  
-    NTL_EXEC_RANGE(n, first, last)
+    FHE_EXEC_RANGE(n, first, last)
       for (long j: range(first, last)) {
 	 v[j] = make_shared<Ctxt>(ctxt0);
 	 v[j]->smartAutomorph(zMStar.genToPow(dim, j));
 	 if (clean) v[j]->cleanUp();
       }
-    NTL_EXEC_RANGE_END
+    FHE_EXEC_RANGE_END
   }
   
 }
@@ -798,7 +815,7 @@ MatMul1DExec::mul(Ctxt& ctxt) const
                for (long j: range(g)) {
 		  long i = j + g*k;
 		  if (i >= D) break;
-		  MulAdd(sum, cache.multiplier[i], baby_steps[j]);
+		  MulAdd(sum, cache.get(i), baby_steps[j]);
                }
             }
 
@@ -811,13 +828,13 @@ MatMul1DExec::mul(Ctxt& ctxt) const
 	    vector<shared_ptr<Ctxt>> baby_steps(g);
 	    GenBabySteps(baby_steps, ctxt, dim, true);
 
-	    PartitionInfo pinfo(h);
+	    PartitionInfo pinfo(h, numFHEthreads());
 	    long cnt = pinfo.NumIntervals();
 
 	    vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
 	    // parallel for loop: k in [0..h)
-	    NTL_EXEC_INDEX(cnt, index)
+	    FHE_EXEC_INDEX(cnt, index)
 	       long first, last;
 	       pinfo.interval(first, last, index);
 
@@ -827,13 +844,13 @@ MatMul1DExec::mul(Ctxt& ctxt) const
 		  for (long j: range(g)) {
 		     long i = j + g*k;
 		     if (i >= D) break;
-		     MulAdd(acc_inner, cache.multiplier[i], *baby_steps[j]); 
+		     MulAdd(acc_inner, cache.get(i), *baby_steps[j]); 
 		  }
 
 		  if (k > 0) acc_inner.smartAutomorph(zMStar.genToPow(dim, g*k));
 		  acc[index] += acc_inner;
 	       }
-	    NTL_EXEC_INDEX_END
+	    FHE_EXEC_INDEX_END
 
 	    ctxt = acc[0];
 	    for (long i: range(1, cnt))
@@ -873,8 +890,8 @@ MatMul1DExec::mul(Ctxt& ctxt) const
                for (long j: range(g)) {
 		  long i = j + g*k;
 		  if (i >= D) break;
-		  MulAdd(sum, cache.multiplier[i], baby_steps[j]);
-		  MulAdd(sum, cache1.multiplier[i], baby_steps1[j]);
+		  MulAdd(sum, cache.get(i), baby_steps[j]);
+		  MulAdd(sum, cache1.get(i), baby_steps1[j]);
                }
             }
             ctxt = sum;
@@ -890,13 +907,13 @@ MatMul1DExec::mul(Ctxt& ctxt) const
 	    ctxt1.smartAutomorph(zMStar.genToPow(dim, -D));
 	    GenBabySteps(baby_steps1, ctxt1, dim, false);
 
-	    PartitionInfo pinfo(h);
+	    PartitionInfo pinfo(h, numFHEthreads());
 	    long cnt = pinfo.NumIntervals();
 
 	    vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
 	    // parallel for loop: k in [0..h)
-	    NTL_EXEC_INDEX(cnt, index)
+	    FHE_EXEC_INDEX(cnt, index)
 
 	       long first, last;
 	       pinfo.interval(first, last, index);
@@ -907,8 +924,8 @@ MatMul1DExec::mul(Ctxt& ctxt) const
 		  for (long j: range(g)) {
 		     long i = j + g*k;
 		     if (i >= D) break;
-		     MulAdd(acc_inner, cache.multiplier[i], *baby_steps[j]);
-		     MulAdd(acc_inner, cache1.multiplier[i], *baby_steps1[j]);
+		     MulAdd(acc_inner, cache.get(i), *baby_steps[j]);
+		     MulAdd(acc_inner, cache1.get(i), *baby_steps1[j]);
 		  }
 
 		  if (k > 0) {
@@ -918,7 +935,7 @@ MatMul1DExec::mul(Ctxt& ctxt) const
 		  acc[index] += acc_inner;
 	       }
 
-	    NTL_EXEC_INDEX_END
+	    FHE_EXEC_INDEX_END
 
 	    for (long i: range(1, cnt)) acc[0] += acc[i];
 	    ctxt = acc[0];
@@ -948,8 +965,8 @@ MatMul1DExec::mul(Ctxt& ctxt) const
                for (long j: range(g)) {
 		  long i = j + g*k;
 		  if (i >= D) break;
-		  MulAdd(sum, cache.multiplier[i], baby_steps[j]);
-		  MulAdd(sum1, cache1.multiplier[i], baby_steps[j]);
+		  MulAdd(sum, cache.get(i), baby_steps[j]);
+		  MulAdd(sum1, cache1.get(i), baby_steps[j]);
                }
             }
 	    sum1.smartAutomorph(zMStar.genToPow(dim, -D));
@@ -961,14 +978,14 @@ MatMul1DExec::mul(Ctxt& ctxt) const
 	    vector<shared_ptr<Ctxt>> baby_steps(g);
 	    GenBabySteps(baby_steps, ctxt, dim, true);
 
-	    PartitionInfo pinfo(h);
+	    PartitionInfo pinfo(h, numFHEthreads());
 	    long cnt = pinfo.NumIntervals();
 
 	    vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
 	    vector<Ctxt> acc1(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
 	    // parallel for loop: k in [0..h)
-	    NTL_EXEC_INDEX(cnt, index)
+	    FHE_EXEC_INDEX(cnt, index)
 
 	       long first, last;
 	       pinfo.interval(first, last, index);
@@ -980,8 +997,8 @@ MatMul1DExec::mul(Ctxt& ctxt) const
 		  for (long j: range(g)) {
 		     long i = j + g*k;
 		     if (i >= D) break;
-		     MulAdd(acc_inner, cache.multiplier[i], *baby_steps[j]);
-		     MulAdd(acc_inner1, cache1.multiplier[i], *baby_steps[j]);
+		     MulAdd(acc_inner, cache.get(i), *baby_steps[j]);
+		     MulAdd(acc_inner1, cache1.get(i), *baby_steps[j]);
 		  }
 
 		  if (k > 0) {
@@ -992,7 +1009,7 @@ MatMul1DExec::mul(Ctxt& ctxt) const
 		  acc[index] += acc_inner;
 		  acc1[index] += acc_inner1;
 	       }
-	    NTL_EXEC_INDEX_END
+	    FHE_EXEC_INDEX_END
 
 	    for (long i: range(1, cnt)) acc[0] += acc[i];
 	    for (long i: range(1, cnt)) acc1[0] += acc1[i];
@@ -1009,23 +1026,23 @@ MatMul1DExec::mul(Ctxt& ctxt) const
          shared_ptr<GeneralAutomorphPrecon> precon =
            buildGeneralAutomorphPrecon(ctxt, dim, ea);
 
-	 PartitionInfo pinfo(D);
+	 PartitionInfo pinfo(D, numFHEthreads());
 	 long cnt = pinfo.NumIntervals();
 
 	 vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
 	 // parallel for loop: i in [0..D)
-	 NTL_EXEC_INDEX(cnt, index)
+	 FHE_EXEC_INDEX(cnt, index)
 	    long first, last;
 	    pinfo.interval(first, last, index);
 
 	    for (long i: range(first, last)) {
 	       if (cache.multiplier[i]) {
 		  shared_ptr<Ctxt> tmp = precon->automorph(i);
-                  DestMulAdd(acc[index], cache.multiplier[i], *tmp);
+                  DestMulAdd(acc[index], cache.get(i), *tmp);
 	       }
 	    }
-	 NTL_EXEC_INDEX_END
+	 FHE_EXEC_INDEX_END
 
 	 ctxt = acc[0];
 	 for (long i: range(1, cnt))
@@ -1035,25 +1052,25 @@ MatMul1DExec::mul(Ctxt& ctxt) const
          shared_ptr<GeneralAutomorphPrecon> precon =
            buildGeneralAutomorphPrecon(ctxt, dim, ea);
 
-	 PartitionInfo pinfo(D);
+	 PartitionInfo pinfo(D, numFHEthreads());
 	 long cnt = pinfo.NumIntervals();
 
 	 vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
 	 vector<Ctxt> acc1(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
 	 // parallel for loop: i in [0..D)
-	 NTL_EXEC_INDEX(cnt, index)
+	 FHE_EXEC_INDEX(cnt, index)
 	    long first, last;
 	    pinfo.interval(first, last, index);
 
 	    for (long i: range(first, last)) {
 	       if (cache.multiplier[i] || cache1.multiplier[i]) {
 		  shared_ptr<Ctxt> tmp = precon->automorph(i);
-                  MulAdd(acc[index], cache.multiplier[i], *tmp);
-                  DestMulAdd(acc1[index], cache1.multiplier[i], *tmp);
+                  MulAdd(acc[index], cache.get(i), *tmp);
+                  DestMulAdd(acc1[index], cache1.get(i), *tmp);
 	       }
 	    }
-	 NTL_EXEC_INDEX_END
+	 FHE_EXEC_INDEX_END
 
 	 for (long i: range(1, cnt)) acc[0] += acc[i];
 	 for (long i: range(1, cnt)) acc1[0] += acc1[i];
@@ -1073,7 +1090,7 @@ MatMul1DExec::mul(Ctxt& ctxt) const
                sh_ctxt.smartAutomorph(zMStar.genToPow(dim, 1));
                sh_ctxt.cleanUp();
             }
-            MulAdd(acc, cache.multiplier[i], sh_ctxt);
+            MulAdd(acc, cache.get(i), sh_ctxt);
          }
 
 	 ctxt = acc;
@@ -1088,8 +1105,8 @@ MatMul1DExec::mul(Ctxt& ctxt) const
                sh_ctxt.smartAutomorph(zMStar.genToPow(dim, 1));
                sh_ctxt.cleanUp();
             }
-            MulAdd(acc, cache.multiplier[i], sh_ctxt);
-            MulAdd(acc1, cache1.multiplier[i], sh_ctxt);
+            MulAdd(acc, cache.get(i), sh_ctxt);
+            MulAdd(acc1, cache1.get(i), sh_ctxt);
          }
 
 	 acc1.smartAutomorph(zMStar.genToPow(dim, -D));
@@ -1474,7 +1491,7 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
 
             for (long j: range(d)) {
 	       if (j > 0) sh_ctxt1.smartAutomorph(zMStar.genToPow(-1, 1));
-               MulAdd(acc, cache.multiplier[i*d+j], sh_ctxt1);
+               MulAdd(acc, cache.get(i*d+j), sh_ctxt1);
             }
          }
 
@@ -1491,8 +1508,8 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
 
             for (long j: range(d)) {
 	       if (j > 0) sh_ctxt1.smartAutomorph(zMStar.genToPow(-1, 1));
-               MulAdd(acc, cache.multiplier[i*d+j], sh_ctxt1);
-               MulAdd(acc1, cache1.multiplier[i*d+j], sh_ctxt1);
+               MulAdd(acc, cache.get(i*d+j), sh_ctxt1);
+               MulAdd(acc1, cache1.get(i*d+j), sh_ctxt1);
             }
          }
 
@@ -1530,7 +1547,7 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
    if (ctxt.getPubKey().getKSStrategy(dim1) == FHE_KSS_MIN)
       iterative1 = true;
    if (ctxt.getPubKey().getKSStrategy(dim1) != FHE_KSS_FULL && 
-       AvailableThreads() == 1)
+       numFHEthreads() == 1)
       iterative1 = true;
 
    if (native) {
@@ -1546,7 +1563,7 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
                sh_ctxt.cleanUp();
             }
 	    for (long j: range(d1)) {
-	       MulAdd(acc[j], cache.multiplier[i*d1+j], sh_ctxt);
+	       MulAdd(acc[j], cache.get(i*d1+j), sh_ctxt);
 	    }
          }
       }
@@ -1556,7 +1573,7 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
 		  buildGeneralAutomorphPrecon(ctxt, dim0, ea);
 
 	 long par_buf_sz = 1;
-	 if (AvailableThreads() > 1) 
+	 if (numFHEthreads() > 1) 
 	    par_buf_sz = min(d0, par_buf_max);
 
 	 vector<shared_ptr<Ctxt>> par_buf(par_buf_sz);
@@ -1567,24 +1584,24 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
 	    // for i in [first_i..last_i), generate automorphosm i and store
 	    // in par_buf[i-first_i]
 
-	    NTL_EXEC_RANGE(last_i-first_i, first, last) 
+	    FHE_EXEC_RANGE(last_i-first_i, first, last) 
      
 	       for (long idx: range(first, last)) {
 		 long i = idx + first_i;
 		 par_buf[idx] = precon->automorph(i);
 	       }
 
-	    NTL_EXEC_RANGE_END
+	    FHE_EXEC_RANGE_END
 
-	    NTL_EXEC_RANGE(d1, first, last)
+	    FHE_EXEC_RANGE(d1, first, last)
 
 	       for (long j: range(first, last)) {
 		  for (long i: range(first_i, last_i)) {
-		     MulAdd(acc[j], cache.multiplier[i*d1+j], *par_buf[i-first_i]);
+		     MulAdd(acc[j], cache.get(i*d1+j), *par_buf[i-first_i]);
 		  }
 	       }
 
-	    NTL_EXEC_RANGE_END
+	    FHE_EXEC_RANGE_END
 	 }
 
       }
@@ -1603,20 +1620,20 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
       }
       else {
 
-	 PartitionInfo pinfo(d1);
+	 PartitionInfo pinfo(d1, numFHEthreads());
 	 long cnt = pinfo.NumIntervals();
 
 	 vector<Ctxt> sum(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
 	 // for j in [0..d1)
-	 NTL_EXEC_INDEX(cnt, index)
+	 FHE_EXEC_INDEX(cnt, index)
 	    long first, last;
 	    pinfo.interval(first, last, index);
 	    for (long j: range(first, last)) {
 	       if (j > 0) acc[j].smartAutomorph(zMStar.genToPow(dim1, j));
 	       sum[index] += acc[j];
 	    }
-	 NTL_EXEC_INDEX_END
+	 FHE_EXEC_INDEX_END
 
 	 ctxt = sum[0];
 	 for (long i: range(1, cnt)) ctxt += sum[i];
@@ -1636,8 +1653,8 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
                sh_ctxt.cleanUp();
             }
 	    for (long j: range(d1)) {
-	       MulAdd(acc[j], cache.multiplier[i*d1+j], sh_ctxt);
-	       MulAdd(acc1[j], cache1.multiplier[i*d1+j], sh_ctxt);
+	       MulAdd(acc[j], cache.get(i*d1+j), sh_ctxt);
+	       MulAdd(acc1[j], cache1.get(i*d1+j), sh_ctxt);
 	    }
          }
       }
@@ -1647,7 +1664,7 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
 		  buildGeneralAutomorphPrecon(ctxt, dim0, ea);
 
 	 long par_buf_sz = 1;
-	 if (AvailableThreads() > 1) 
+	 if (numFHEthreads() > 1) 
 	    par_buf_sz = min(d0, par_buf_max);
 
 	 vector<shared_ptr<Ctxt>> par_buf(par_buf_sz);
@@ -1658,25 +1675,25 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
 	    // for i in [first_i..last_i), generate automorphosm i and store
 	    // in par_buf[i-first_i]
 
-	    NTL_EXEC_RANGE(last_i-first_i, first, last) 
+	    FHE_EXEC_RANGE(last_i-first_i, first, last) 
      
 	       for (long idx: range(first, last)) {
 		 long i = idx + first_i;
 		 par_buf[idx] = precon->automorph(i);
 	       }
 
-	    NTL_EXEC_RANGE_END
+	    FHE_EXEC_RANGE_END
 
-	    NTL_EXEC_RANGE(d1, first, last)
+	    FHE_EXEC_RANGE(d1, first, last)
 
 	       for (long j: range(first, last)) {
 		  for (long i: range(first_i, last_i)) {
-		     MulAdd(acc[j], cache.multiplier[i*d1+j], *par_buf[i-first_i]);
-		     MulAdd(acc1[j], cache1.multiplier[i*d1+j], *par_buf[i-first_i]);
+		     MulAdd(acc[j], cache.get(i*d1+j), *par_buf[i-first_i]);
+		     MulAdd(acc1[j], cache1.get(i*d1+j), *par_buf[i-first_i]);
 		  }
 	       }
 
-	    NTL_EXEC_RANGE_END
+	    FHE_EXEC_RANGE_END
 	 }
       }
 
@@ -1700,14 +1717,14 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
       }
       else {
 
-	 PartitionInfo pinfo(d1);
+	 PartitionInfo pinfo(d1, numFHEthreads());
 	 long cnt = pinfo.NumIntervals();
 
 	 vector<Ctxt> sum(cnt, Ctxt(ZeroCtxtLike, ctxt));
 	 vector<Ctxt> sum1(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
 	 // for j in [0..d1)
-	 NTL_EXEC_INDEX(cnt, index)
+	 FHE_EXEC_INDEX(cnt, index)
 	    long first, last;
 	    pinfo.interval(first, last, index);
 	    for (long j: range(first, last)) {
@@ -1718,7 +1735,7 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
 	       sum[index] += acc[j];
 	       sum1[index] += acc1[j];
 	    }
-	 NTL_EXEC_INDEX_END
+	 FHE_EXEC_INDEX_END
 
 	 for (long i: range(1, cnt)) sum[0] += sum[i];
 	 for (long i: range(1, cnt)) sum1[0] += sum1[i];
@@ -13,6 +13,7 @@
 #define _matmul_H
 
 #include "EncryptedArray.h"
+#include "numa.h"
 
 
 class MatMulFullExec;
@@ -172,12 +173,68 @@ struct ConstMultiplier;
 struct ConstMultiplierCache {
   std::vector<std::shared_ptr<ConstMultiplier>> multiplier;
 
+  // Copies of the constants on other NUMA nodes, see numa.h
+  NumaReplicas< std::shared_ptr<ConstMultiplier> > replicas;
+
+  ConstMultiplierCache();
+
+  // multiplier[i], from the copy on the node of the calling thread. Each
+  // call is a use of the constant, and is counted as such.
+  const std::shared_ptr<ConstMultiplier>& get(long i) const;
+
   // Upgrade zzX constants to DoubleCRT constants.
   void upgrade(const FHEcontext& context);
 };
 
 //====================================
 
+/**
+ * @class BasicAutomorphPrecon
+ * @brief Pre-computation to speed many automorphism on the same ciphertext.
+ * 
+ * The expensive part of homomorphic automorphism is braking the ciphertext
+ * parts into digits. The usual setting is we first rotate the ciphertext
+ * parts, then break them into digits. But when we apply many automorphisms
+ * it is faster to break the original ciphertext into digits, then rotate
+ * the digits (as opposed to first rotate, then break).
+ * An BasicAutomorphPrecon object breaks the original ciphertext and keeps
+ * the digits, then when you call automorph is only needs to apply the
+ * native automorphism and key switching to the digits, which is fast(er).
+ *
+ * The ciphertexts returned by automorph are still defined relative to the
+ * special primes, so that many of them can be accumulated before they are
+ * mod-switched down. Call cleanUp() on them if this is not needed.
+ * Calling automorph concurrently from several threads is safe.
+ **/
+class BasicAutomorphPrecon {
+  Ctxt ctxt;
+  NTL::xdouble noise;
+  std::vector<DoubleCRT> polyDigits;
+
+public:
+  BasicAutomorphPrecon(const Ctxt& _ctxt);
+
+  std::shared_ptr<Ctxt> automorph(long k) const;
+};
+
+// Abstract base class for pre-computation to speed up many rotations of
+// the same ciphertext along one dimension
+class GeneralAutomorphPrecon {
+public:
+  virtual ~GeneralAutomorphPrecon() {}
+
+  // Returns the ciphertext rotated by i along the dimension, 0<=i<D
+  virtual std::shared_ptr<Ctxt> automorph(long i) const = 0;
+};
+
+// Build a GeneralAutomorphPrecon for the dimension dim (dim==-1 for
+// Frobenius), using the strategy that fits the key-switching matrices
+std::shared_ptr<GeneralAutomorphPrecon>
+buildGeneralAutomorphPrecon(const Ctxt& ctxt, long dim,
+                            const EncryptedArray& ea);
+
+//====================================
+
 
 // Abstract base case for multiplying an encrypted vector by a plaintext matrix.
 class MatMulExecBase {
@@ -90,7 +90,61 @@ void  TestIt(long c, long k, long w, long L, long m, long n)
     printBits(v1, n);
   }
 
+  // ZeroTestPlan::apply on several ciphertexts vs. incrementalZeroTest
+  // on each of them, and vs. the bits of the plaintext slots
+  vector< vector<ZZX> > vs(2, v);
+  for (long i = 0; i < nslots; i++) {
+    GF2X f;
+    random(f, n);
+    conv(vs[1][i], f);
+  }
+  vector<Ctxt> ctxts(2, ctxt);
+  ea.encrypt(ctxts[1], publicKey, vs[1]);
+
+  ZeroTestPlan plan(ea, n);
+  vector< vector<Ctxt> > planRes;
+  plan.apply(planRes, ctxts);
+
+  bool planOK = true;
+  for (long t = 0; t < lsize(ctxts); t++) {
+    if (t > 0) incrementalZeroTest(res, ea, ctxts[t], n);
+    for (long j = 0; j < n; j++) {
+      vector<ZZX> v1, v2;
+      ea.decrypt(planRes[t][j], secretKey, v1);
+      ea.decrypt(*res[j], secretKey, v2);
+      for (long i = 0; i < nslots; i++) {
+        bool nonzero = false; // are any of bits 0..j nonzero
+        for (long b = 0; b <= j; b++)
+          if (!IsZero(coeff(vs[t][i], b))) nonzero = true;
+        ZZX expected(nonzero? 1 : 0);
+        if (v1[i] != expected || v2[i] != expected) planOK = false;
+      }
+    }
+  }
+  if (planOK) cout << "ZeroTestPlan GOOD\n";
+  else        cout << "ZeroTestPlan BAD\n";
+
   for (long j = 0; j < n; j++) delete res[j]; // cleanup
+
+  // mapTo01 on a ciphertext with known zero and nonzero slots
+  vector<ZZX> w0(nslots);
+  for (long i = 0; i < nslots; i++) {
+    if (i % 2 == 0) continue; // every other slot is zero
+    GF2X f;
+    do { random(f, d); } while (IsZero(f));
+    conv(w0[i], f);
+  }
+  Ctxt c01(publicKey);
+  ea.encrypt(c01, publicKey, w0);
+  mapTo01(ea, c01);
+
+  vector<ZZX> w1;
+  ea.decrypt(c01, secretKey, w1);
+  bool mapOK = true;
+  for (long i = 0; i < nslots; i++)
+    if (w1[i] != ZZX(IsZero(w0[i])? 0 : 1)) mapOK = false;
+  if (mapOK) cout << "mapTo01 GOOD\n";
+  else       cout << "mapTo01 BAD\n";
 }
 
 void usage(char *prog) 
@@ -0,0 +1,406 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <NTL/BasicThreadPool.h>
+#include "multicore.h"
+#include "numa.h"
+
+#ifdef FHE_THREADS
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <thread>
+#endif
+
+static FHE_atomic_long explicitThreads(0); // as set by setNumFHEthreads
+
+#ifdef FHE_THREADS
+// The queue of the calling thread: worker i of the pool uses queue i, and
+// all the threads that are not in the pool share queue 0
+static NTL_THREAD_LOCAL long myQueue = 0;
+
+// The NUMA node that the calling thread is pinned to, -1 if it is not
+static NTL_THREAD_LOCAL long myNode = -1;
+#endif
+
+// The group of the task that the calling thread is running
+static NTL_THREAD_LOCAL TaskGroup *currentGroup = 0;
+
+void setNumFHEthreads(long n)
+{
+  if (n < 0 || n > FHE_MAX_THREADS)
+    Error("setNumFHEthreads: bad number of threads");
+  explicitThreads = n;
+}
+
+
+TaskGroup::TaskGroup() : pending(0), parent(currentGroup) {}
+
+TaskGroup::~TaskGroup()
+{
+  try { wait(); } catch (...) {} // exceptions were not waited for
+}
+
+bool TaskGroup::within(const TaskGroup* g) const
+{
+  for (const TaskGroup *p = this; p; p = p->parent)
+    if (p == g) return true;
+  return false;
+}
+
+void TaskGroup::execute(const std::function<void()>& fn)
+{
+  TaskGroup *saved = currentGroup;
+  currentGroup = this;
+  try { fn(); }
+  catch (...) {
+    FHE_MUTEX_GUARD(errorMx);
+    if (!error) error = std::current_exception();
+  }
+  currentGroup = saved;
+#ifdef FHE_THREADS
+  // wait() takes doneMx before returning, so *this is not destroyed
+  // until we release it
+  lock_guard<mutex> lock(doneMx);
+  if (--pending == 0) done.notify_all();
+#else
+  pending--;
+#endif
+}
+
+
+#ifdef FHE_THREADS
+
+class FHEtask {
+public:
+  std::function<void()> fn;
+  TaskGroup *group;
+};
+
+class FHEtaskQueue {
+public:
+  mutex mx;
+  std::deque<FHEtask> tasks;
+};
+
+// The pool of workers. Each worker pushes the tasks that it creates to the
+// back of its own queue and takes tasks from there, newest first, and when
+// its queue is empty it steals the oldest task of another queue. A thread
+// that waits for a group only takes tasks of that group or of groups that
+// are nested in it, so the thread-local scratch space of the task that it
+// waits in is not reused under its feet. The tasks of spawnTask belong to
+// no group, they are kept in a separate queue ordered by priority, and are
+// only taken by idle threads. When the workers are pinned to NUMA nodes,
+// they steal from the workers of their own node first.
+class FHEscheduler {
+  FHEtaskQueue queues[FHE_MAX_THREADS+1];
+  std::multimap< long, std::function<void()>, std::greater<long> > spawned;
+  mutex spawnedMx;
+  atomic_long nWorkers;  // workers 1..nWorkers were started
+  atomic_long nActive;   // workers 1..nActive look for new work
+  atomic_long nQueued;   // tasks in all the queues
+  atomic_long nSleeping; // workers waiting on cv
+  mutex mx;
+  std::condition_variable cv;
+
+  FHEscheduler() : nWorkers(0), nActive(0), nQueued(0), nSleeping(0) {}
+
+  // Find a task in queue i that is within g (any task if g is NULL),
+  // from the back or from the front
+  bool takeFrom(long i, FHEtask& t, const TaskGroup* g, bool fromBack)
+  {
+    FHEtaskQueue& q = queues[i];
+    lock_guard<mutex> lock(q.mx);
+    long n = q.tasks.size();
+    for (long k = 0; k < n; k++) {
+      long j = fromBack? n-1-k : k;
+      if (g && !q.tasks[j].group->within(g)) continue;
+      t = std::move(q.tasks[j]);
+      q.tasks.erase(q.tasks.begin() + j);
+      nQueued--;
+      return true;
+    }
+    return false;
+  }
+
+  bool takeSpawned(FHEtask& t)
+  {
+    lock_guard<mutex> lock(spawnedMx);
+    if (spawned.empty()) return false;
+    t.fn = std::move(spawned.begin()->second);
+    t.group = NULL;
+    spawned.erase(spawned.begin());
+    nQueued--;
+    return true;
+  }
+
+  void notify()
+  {
+    nQueued++;
+    if (nSleeping > 0) {
+      lock_guard<mutex> lock(mx);
+      cv.notify_one();
+    }
+  }
+
+  void workerLoop(long id)
+  {
+    myQueue = id;
+    for (long idle = 0; ; ) {
+      if (numaPinning() != (myNode >= 0)) {
+        if (myNode < 0 && pinThreadToNode(numaNodeOfWorker(id)))
+          myNode = numaNodeOfWorker(id);
+        else if (myNode >= 0) {
+          unpinThread();
+          myNode = -1;
+        }
+      }
+
+      FHEtask t;
+      if (id <= nActive && take(t, NULL)) {
+        execute(t);
+        idle = 0;
+      }
+      else if (++idle < 64) // spin a little before going to sleep
+        std::this_thread::yield();
+      else {
+        unique_lock<mutex> lock(mx);
+        nSleeping++;
+        cv.wait(lock, [&]() { return id <= nActive && nQueued > 0; });
+        nSleeping--;
+        idle = 0;
+      }
+    }
+  }
+
+public:
+  // The pool is never destroyed, as detached workers may still use it
+  static FHEscheduler& get()
+  {
+    static FHEscheduler *sched = new FHEscheduler;
+    return *sched;
+  }
+
+  // Let nThreads-1 workers (plus the calling thread) run tasks
+  void resize(long nThreads)
+  {
+    long want = nThreads-1;
+    if (want == nActive) return;
+
+    lock_guard<mutex> lock(mx);
+    while (nWorkers < want) {
+      std::thread(&FHEscheduler::workerLoop, this, nWorkers+1).detach();
+      nWorkers++;
+    }
+    nActive = want;
+    cv.notify_all();
+  }
+
+  void push(const std::function<void()>& fn, TaskGroup* group)
+  {
+    FHEtaskQueue& q = queues[myQueue];
+    {
+      lock_guard<mutex> lock(q.mx);
+      q.tasks.push_back(FHEtask());
+      q.tasks.back().fn = fn;
+      q.tasks.back().group = group;
+    }
+    notify();
+  }
+
+  void spawn(const std::function<void()>& fn, long priority)
+  {
+    {
+      lock_guard<mutex> lock(spawnedMx);
+      spawned.insert(std::make_pair(priority, fn)); // FIFO among equals
+    }
+    notify();
+  }
+
+  bool take(FHEtask& t, const TaskGroup* g)
+  {
+    if (nQueued == 0) return false;
+    if (takeFrom(myQueue, t, g, /*fromBack=*/true)) return true;
+    if (!g && takeSpawned(t)) return true;
+
+    static NTL_THREAD_LOCAL unsigned long victim = 0;
+    long n = nWorkers + 1;
+    if (myNode >= 0 && numaNodes() > 1)
+      for (long k = 0; k < n; k++) {
+        long i = (victim++) % n;
+        if (i != myQueue && numaNodeOfWorker(i) == myNode &&
+            takeFrom(i, t, g, /*fromBack=*/false)) return true;
+      }
+    for (long k = 0; k < n; k++) {
+      long i = (victim++) % n;
+      if (i != myQueue && takeFrom(i, t, g, /*fromBack=*/false)) return true;
+    }
+    return false;
+  }
+
+  void execute(FHEtask& t)
+  {
+    if (t.group) {
+      t.group->execute(t.fn);
+      return;
+    }
+    TaskGroup *saved = currentGroup;
+    currentGroup = NULL;
+    try { t.fn(); } catch (...) {} // spawned tasks handle their own errors
+    currentGroup = saved;
+  }
+
+  bool runSpawned()
+  {
+    FHEtask t;
+    if (nQueued == 0 || !takeSpawned(t)) return false;
+    execute(t);
+    return true;
+  }
+
+  long size() const { return nActive+1; }
+};
+
+long numFHEthreads()
+{
+  long n = explicitThreads;
+  if (n > 0) return n;
+
+  // NTL's pool is only visible to the thread that called SetNumThreads,
+  // the workers of our pool use the size of the pool instead
+  if (myQueue > 0) return FHEscheduler::get().size();
+  return std::min(NTL::AvailableThreads(), long(FHE_MAX_THREADS));
+}
+
+void TaskGroup::run(const std::function<void()>& fn)
+{
+  pending++;
+  long nThreads = numFHEthreads();
+  if (nThreads <= 1) {
+    execute(fn);
+    return;
+  }
+  FHEscheduler& sched = FHEscheduler::get();
+  sched.resize(nThreads);
+  sched.push(fn, this);
+}
+
+void spawnTask(const std::function<void()>& fn, long priority)
+{
+  long nThreads = numFHEthreads();
+  if (nThreads <= 1) {
+    try { fn(); } catch (...) {}
+    return;
+  }
+  FHEscheduler& sched = FHEscheduler::get();
+  sched.resize(nThreads);
+  sched.spawn(fn, priority);
+}
+
+bool runSpawnedTask() { return FHEscheduler::get().runSpawned(); }
+
+void TaskGroup::wait()
+{
+  if (pending > 0) {
+    FHEscheduler& sched = FHEscheduler::get();
+    for (long idle = 0; pending > 0; ) {
+      FHEtask t;
+      if (sched.take(t, this)) {
+        sched.execute(t);
+        idle = 0;
+      }
+      else if (++idle <= 16)
+        std::this_thread::yield();
+      else { // our tasks are running on other threads, sleep until they
+             // complete but wake up now and then to help with any new
+             // tasks that they add to the group
+        long us = std::min(10*(idle-16), 1000L);
+        unique_lock<mutex> lock(doneMx);
+        done.wait_for(lock, std::chrono::microseconds(us),
+                      [this]() { return pending == 0; });
+      }
+    }
+  }
+  { lock_guard<mutex> lock(doneMx); } // the last task is out of execute()
+
+  FHE_MUTEX_GUARD(errorMx);
+  if (error) {
+    std::exception_ptr e = error;
+    error = nullptr;
+    std::rethrow_exception(e);
+  }
+}
+
+#else // without FHE_THREADS the tasks run immediately
+
+long numFHEthreads() { return 1; }
+
+void spawnTask(const std::function<void()>& fn, long)
+{
+  try { fn(); } catch (...) {}
+}
+
+bool runSpawnedTask() { return false; }
+
+void TaskGroup::run(const std::function<void()>& fn)
+{
+  pending++;
+  execute(fn);
+}
+
+void TaskGroup::wait()
+{
+  if (error) {
+    std::exception_ptr e = error;
+    error = nullptr;
+    std::rethrow_exception(e);
+  }
+}
+
+#endif // FHE_THREADS
+
+
+void parallelFor(long n, const std::function<void(long,long)>& fn, long grain)
+{
+  if (n <= 0) return;
+
+  long nThreads = numFHEthreads();
+  if (grain <= 0) // a few ranges per thread, to balance the load
+    grain = std::max(1L, n/(4*nThreads));
+  long nRanges = std::max(1L, n/grain);
+  if (nThreads <= 1 || nRanges == 1) {
+    fn(0, n);
+    return;
+  }
+
+  TaskGroup g;
+  for (long i = 0; i < nRanges; i++) {
+    long first = (i*n)/nRanges;
+    long last = ((i+1)*n)/nRanges;
+    g.run([&fn, first, last]() { fn(first, last); });
+  }
+  g.wait();
+}
+
+void parallelIndex(long n, const std::function<void(long)>& fn)
+{
+  if (n <= 0) return;
+  if (n == 1 || numFHEthreads() <= 1) {
+    for (long i = 0; i < n; i++) fn(i);
+    return;
+  }
+
+  TaskGroup g;
+  for (long i = 0; i < n; i++)
+    g.run([&fn, i]() { fn(i); });
+  g.wait();
+}
@@ -17,31 +17,142 @@
 #ifndef FHE_multicore_H
 #define FHE_multicore_H
 
+#include "NumbTh.h"
+
 #ifdef FHE_THREADS
 
 #include <atomic>
+#include <condition_variable>
 #include <mutex>
 
 
 
 
 
+#define FHE_atomic_bool atomic_bool
 #define FHE_atomic_long atomic_long
 #define FHE_atomic_ulong atomic_ulong
 
 #define FHE_MUTEX_TYPE mutex
 #define FHE_MUTEX_GUARD(mx) lock_guard<mutex> _lock ## __LINE__ (mx)
 
+// Access to an FHE_atomic_* that needs no ordering, e.g. a flag or a
+// counter that only one thread updates. These compile to plain loads and
+// stores.
+#define FHE_LOAD_RELAXED(x) ((x).load(std::memory_order_relaxed))
+#define FHE_STORE_RELAXED(x, v) ((x).store((v), std::memory_order_relaxed))
+
 #else
 
+#define FHE_atomic_bool bool
 #define FHE_atomic_long long
 #define FHE_atomic_ulong unsigned long
 
 #define FHE_MUTEX_TYPE int
 #define FHE_MUTEX_GUARD(mx) ((void) mx)
 
+#define FHE_LOAD_RELAXED(x) (x)
+#define FHE_STORE_RELAXED(x, v) ((void) ((x) = (v)))
+
+#endif
+
+
+/**
+ * The library runs its parallel loops on its own thread pool, which
+ * schedules the work by work-stealing: each thread has a queue of tasks,
+ * and threads that run out of work take tasks from the queues of others.
+ * A thread that waits for its tasks to complete runs pending tasks of the
+ * same computation in the meantime, so parallel loops can be nested
+ * (e.g., a parallel matrix multiplication inside a parallel recryption)
+ * without running out of threads or oversubscribing the machine.
+ *
+ * Without FHE_THREADS all the loops run serially on the calling thread.
+ **/
+
+#include <exception>
+#include <functional>
+
+#define FHE_MAX_THREADS 256
+
+//! Set the number of threads that run parallel loops (including the
+//! calling thread). By default it is NTL's AvailableThreads(), so calling
+//! NTL's SetNumThreads sets both. n=0 returns to this default.
+void setNumFHEthreads(long n);
+long numFHEthreads();
+
+//! Run fn(first, last) on ranges [first,last) that partition [0,n), in
+//! parallel, and return when they are all done. Each range has at least
+//! grain indexes, grain=0 chooses it so that each thread gets a few ranges.
+//! If some of the calls throw then one of these exceptions is rethrown.
+void parallelFor(long n, const std::function<void(long,long)>& fn,
+                 long grain=0);
+
+//! Run fn(index) for index=0,...,n-1 in parallel, each one as its own task
+void parallelIndex(long n, const std::function<void(long)>& fn);
+
+//! Run fn on the pool, without waiting for it to complete. Among the tasks
+//! that are waiting to start, the ones with a higher priority start first.
+//! fn should handle its own exceptions, any that escape are ignored. With a
+//! single thread fn runs immediately on the calling thread.
+void spawnTask(const std::function<void()>& fn, long priority=0);
+
+//! Run one task of spawnTask that did not start yet on the calling thread,
+//! returns false if there is none. Lets a thread that waits for the result
+//! of such tasks help instead of blocking.
+bool runSpawnedTask();
+
+/**
+ * @class TaskGroup
+ * @brief A set of tasks to run in parallel, then wait for
+ *
+ *   TaskGroup g;
+ *   g.run([&]() { ... });
+ *   g.run([&]() { ... });
+ *   g.wait();
+ **/
+class TaskGroup {
+  FHE_atomic_long pending;     // tasks that did not complete yet
+  TaskGroup *parent;           // the group of the task that created this one
+  std::exception_ptr error;    // the first exception thrown by a task
+  FHE_MUTEX_TYPE errorMx;
+#ifdef FHE_THREADS
+  FHE_MUTEX_TYPE doneMx;       // guards the last decrement of pending
+  std::condition_variable done; // notified when pending drops to zero
 #endif
 
+  TaskGroup(const TaskGroup&); // disable copying
+  TaskGroup& operator=(const TaskGroup&);
+
+  friend class FHEscheduler;
+  void execute(const std::function<void()>& fn);
+  bool within(const TaskGroup* g) const; // is this g, or nested in g?
+
+public:
+  TaskGroup();
+  ~TaskGroup(); // waits for the tasks, but does not rethrow
+
+  //! Add a task to the group, it may run on another thread
+  void run(const std::function<void()>& fn);
+
+  //! Wait until all the tasks of the group complete, and rethrow the
+  //! first exception that any of them threw
+  void wait();
+};
+
+// Drop-in replacements for NTL_EXEC_RANGE and NTL_EXEC_INDEX that use
+// the library's pool. FHE_EXEC_RANGE_GRAIN sets the minimal size of a range.
+
+#define FHE_EXEC_RANGE_GRAIN(n, grain, first, last) \
+{ long _fhe_grain = (grain); \
+  parallelFor((n), [&](long first, long last) {
+
+#define FHE_EXEC_RANGE(n, first, last) FHE_EXEC_RANGE_GRAIN(n, 0, first, last)
+
+#define FHE_EXEC_RANGE_END }, _fhe_grain); }
+
+#define FHE_EXEC_INDEX(n, index) \
+{ parallelIndex((n), [&](long index) {
 
+#define FHE_EXEC_INDEX_END }); }
 
 #endif
@@ -0,0 +1,131 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include "numa.h"
+
+#if defined(FHE_NUMA) && !defined(FHE_THREADS)
+#error "FHE_NUMA requires FHE_THREADS"
+#endif
+
+#ifdef FHE_NUMA
+#include <fstream>
+#include <sstream>
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+static FHE_atomic_long pinningFlag(0);
+static FHE_atomic_long replicationFlag(0);
+
+#ifdef FHE_NUMA
+
+// The CPUs of each node, as listed in /sys/devices/system/node
+class NumaTopology {
+public:
+  vector< vector<long> > cpus; // indexed by node
+  vector<long> nodeOfCpu;      // indexed by cpu
+
+  NumaTopology()
+  {
+    for (long node = 0; ; node++) {
+      std::stringstream name;
+      name << "/sys/devices/system/node/node" << node << "/cpulist";
+      std::ifstream f(name.str().c_str());
+      if (!f) break;
+
+      // a list of ranges, e.g. "0-7,16-23"
+      vector<long> list;
+      string range;
+      while (std::getline(f, range, ',')) {
+        long first, last;
+        char dash;
+        std::stringstream r(range);
+        if (!(r >> first)) continue;
+        if (!(r >> dash >> last)) last = first;
+        for (long cpu = first; cpu <= last; cpu++) {
+          list.push_back(cpu);
+          if (lsize(nodeOfCpu) <= cpu) nodeOfCpu.resize(cpu+1, 0);
+          nodeOfCpu[cpu] = node;
+        }
+      }
+      cpus.push_back(list);
+    }
+    if (cpus.empty()) cpus.resize(1); // no NUMA support in the kernel
+  }
+};
+
+// Never destroyed, as detached workers of the pool may still use it
+static const NumaTopology& numaTopology()
+{
+  static NumaTopology *topology = new NumaTopology;
+  return *topology;
+}
+
+long numaNodes()
+{
+  return lsize(numaTopology().cpus);
+}
+
+long currentNumaNode()
+{
+  const NumaTopology& top = numaTopology();
+  long cpu = sched_getcpu();
+  if (cpu < 0 || cpu >= lsize(top.nodeOfCpu)) return 0;
+  return top.nodeOfCpu[cpu];
+}
+
+bool pinThreadToNode(long node)
+{
+  const NumaTopology& top = numaTopology();
+  if (node < 0 || node >= lsize(top.cpus) || top.cpus[node].empty())
+    return false;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (long i = 0; i < lsize(top.cpus[node]); i++)
+    CPU_SET(top.cpus[node][i], &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+void unpinThread()
+{
+  const NumaTopology& top = numaTopology();
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (long node = 0; node < lsize(top.cpus); node++)
+    for (long i = 0; i < lsize(top.cpus[node]); i++)
+      CPU_SET(top.cpus[node][i], &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+void setNumaPinning(bool on) { pinningFlag = on; }
+bool numaPinning() { return pinningFlag; }
+
+#else
+
+long numaNodes() { return 1; }
+long currentNumaNode() { return 0; }
+bool pinThreadToNode(long node) { return false; }
+void unpinThread() {}
+
+void setNumaPinning(bool on) {}
+bool numaPinning() { return false; }
+
+#endif
+
+long numaNodeOfWorker(long id)
+{
+  if (id <= 0) return -1;
+  return (id-1) % numaNodes();
+}
+
+void setNumaReplication(bool on) { replicationFlag = on; }
+bool numaReplication() { return replicationFlag; }
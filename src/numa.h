@@ -0,0 +1,199 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef FHE_NUMA_H
+#define FHE_NUMA_H
+/**
+ * @file numa.h
+ * @brief Placing threads and read-mostly data on NUMA nodes
+ *
+ * On a machine with several NUMA nodes (e.g., sockets), memory is slower
+ * to read from a node other than the one it was allocated on, and such
+ * reads compete for the interconnect. Compiled with -DFHE_NUMA (Linux only,
+ * together with -DFHE_THREADS), the library can:
+ *  - Pin the workers of its thread pool to the nodes, round robin, and have
+ *    idle workers steal tasks from workers of their own node first. The
+ *    scratch space of DoubleCRT and Cmodulus is thread-local, and is first
+ *    touched by its worker, so it is allocated on that worker's node.
+ *  - Replicate read-mostly data on each node: the key-switching matrices of
+ *    FHEPubKey and the constants of the matrix-multiplication caches, which
+ *    include the linear maps of the RecryptData. Each matrix or constant
+ *    is copied to a node by the first thread on that node that uses it.
+ * Both are off by default, see setNumaPinning and setNumaReplication. The
+ * topology is read from /sys/devices/system/node. Without FHE_NUMA the
+ * machine is seen as a single node, and pinning and replication do nothing.
+ *
+ * The counters FHE_CNT_NUMA_LOCAL_BYTES and FHE_CNT_NUMA_REMOTE_BYTES give
+ * an estimate of the cross-node traffic: each time a key-switching matrix or
+ * a matrix constant is used, the bytes that are read from it (the rows of
+ * the matrix that multiply the digits of a ciphertext part, or the whole
+ * constant) are added to one of them, depending on whether the copy that
+ * is used was allocated on the node of the caller. Only looking up a
+ * matrix (e.g., haveKeySWmatrix) is not counted and does not copy it.
+ **/
+#include <memory>
+#include <functional>
+#include <vector>
+#include <algorithm>
+#include "multicore.h"
+#include "counters.h"
+
+//! The number of NUMA nodes, 1 without FHE_NUMA
+long numaNodes();
+
+//! The node of the CPU that the calling thread runs on
+long currentNumaNode();
+
+//! The node that worker id of the thread pool is pinned to (workers are
+//! numbered from 1), or -1 for threads that are not in the pool
+long numaNodeOfWorker(long id);
+
+//! Restrict the calling thread to the CPUs of node, returns false if this
+//! is not supported. unpinThread lets it run on all the CPUs again.
+bool pinThreadToNode(long node);
+void unpinThread();
+
+//! Pin the workers of the thread pool to the nodes
+void setNumaPinning(bool on);
+bool numaPinning();
+
+//! Use a copy of the read-mostly data on each node
+void setNumaReplication(bool on);
+bool numaReplication();
+
+#define FHE_COUNT_NUMA(local, bytes) \
+  FHE_COUNT((local)? FHE_CNT_NUMA_LOCAL_BYTES : FHE_CNT_NUMA_REMOTE_BYTES, \
+            (bytes))
+
+/**
+ * @class NumaReplicas
+ * @brief Copies of some read-mostly data, one per NUMA node
+ *
+ * The data is a sequence of elements held by the owner (e.g., the matrices
+ * of a key), and each element is replicated separately, when it is first
+ * used on a node. The master copy of element i is passed to local. It is
+ * assumed to be on the node of the thread that created the NumaReplicas or
+ * last called clear, which the owner should do whenever it modifies the
+ * master. Copying a NumaReplicas does not copy the replicas.
+ *
+ * Looking up a copy that was already made only loads pointers that were
+ * published atomically, the mutex is only locked to make a copy.
+ **/
+template<class T>
+class NumaReplicas {
+public:
+  //! Makes a deep copy, by default the copy constructor of T
+  typedef std::function<std::shared_ptr<T>(const T&)> CopyFn;
+
+private:
+#ifdef FHE_THREADS
+  typedef std::atomic<const T*> Slot;
+#else
+  typedef const T* Slot;
+#endif
+
+  // The copies on one node: slot[i] points to the copy of element i, or is
+  // NULL if it was not made yet. A table is not resized once it is
+  // published, a larger one replaces it.
+  class Table {
+  public:
+    long size;
+    std::unique_ptr<Slot[]> slot;
+
+    explicit Table(long n) : size(n), slot(new Slot[n])
+    { for (long i = 0; i < n; i++) slot[i] = NULL; }
+  };
+
+#ifdef FHE_THREADS
+  typedef std::atomic<Table*> TablePtr;
+#else
+  typedef Table* TablePtr;
+#endif
+
+  long nNodes;
+  std::unique_ptr<TablePtr[]> tables; // indexed by node
+  mutable std::vector< std::unique_ptr<Table> > allTables; // incl. replaced
+  mutable std::vector< std::shared_ptr<T> > copies;
+  mutable FHE_MUTEX_TYPE mx; // guards the two vectors above
+  long home; // the node of the master copy
+  CopyFn copyFn;
+
+  void init()
+  {
+    nNodes = numaNodes();
+    tables.reset(new TablePtr[nNodes]);
+    for (long k = 0; k < nNodes; k++) tables[k] = NULL;
+  }
+
+  // Make the copy of element i for node, if no other thread made it yet
+  const T& makeLocal(const T& master, long i, long node) const
+  {
+    FHE_MUTEX_GUARD(mx);
+    Table *t = tables[node];
+    if (!t || i >= t->size) {
+      Table *bigger = new Table(std::max(i+1, t? 2*t->size : 0L));
+      allTables.push_back(std::unique_ptr<Table>(bigger));
+      for (long j = 0; t && j < t->size; j++) {
+        const T* p = t->slot[j];
+        bigger->slot[j] = p;
+      }
+      tables[node] = t = bigger;
+    }
+
+    const T* p = t->slot[i];
+    if (!p) {
+      copies.push_back(copyFn? copyFn(master) : std::make_shared<T>(master));
+      p = copies.back().get();
+      t->slot[i] = p;
+    }
+    return *p;
+  }
+
+public:
+  explicit NumaReplicas(const CopyFn& fn=CopyFn())
+    : home(currentNumaNode()), copyFn(fn) { init(); }
+  NumaReplicas(const NumaReplicas& other)
+    : home(currentNumaNode()), copyFn(other.copyFn) { init(); }
+  NumaReplicas& operator=(const NumaReplicas& other)
+  { clear(); copyFn = other.copyFn; return *this; }
+
+  //! Drop the replicas, the master is now on the node of the calling thread
+  void clear()
+  {
+    FHE_MUTEX_GUARD(mx);
+    for (long k = 0; k < nNodes; k++) tables[k] = NULL;
+    allTables.clear();
+    copies.clear();
+    home = currentNumaNode();
+  }
+
+  //! The copy of master, which is element i of the data, to use on the node
+  //! of the calling thread. If isLocal is not NULL, it is set to whether
+  //! that copy is on this node.
+  const T& local(const T& master, long i, bool* isLocal=NULL) const
+  {
+    long node = currentNumaNode();
+    if (node == home || !numaReplication() || node >= nNodes) {
+      if (isLocal) *isLocal = (node == home);
+      return master;
+    }
+    if (isLocal) *isLocal = true;
+
+    const Table *t = tables[node];
+    if (t && i < t->size) {
+      const T* p = t->slot[i];
+      if (p) return *p;
+    }
+    return makeLocal(master, i, node);
+  }
+};
+
+#endif // FHE_NUMA_H
@@ -16,6 +16,7 @@
 #ifndef _PERMUTATIONS_H_
 #define _PERMUTATIONS_H_
 
+#include <memory>
 #include "PAlgebra.h"
 #include "matching.h"
 #include "hypercube.h"
@@ -407,6 +408,37 @@ class SubDimension {
 };
 typedef FullBinaryTree<SubDimension> OneGeneratorTree;// tree for one generator
 
+class FHEPubKey;
+
+/**
+ * @class PermCostModel
+ * @brief The cost that GeneratorTrees::buildOptimalTrees minimizes
+ *
+ * Every layer of the permutation network costs layerCost, plus shiftCost
+ * for every distinct shift amount in that layer. The default model (0,1)
+ * just counts the 1D shifts. A measured model (see measure) is in
+ * microseconds: layerCost is the time to decompose the ciphertext for the
+ * hoisted rotations of a layer and to mod-switch the sum down, shiftCost is
+ * the time of one more key-switching.
+ **/
+class PermCostModel {
+public:
+  long layerCost; // fixed cost of every layer
+  long shiftCost; // cost of every shift amount in a layer
+
+  explicit PermCostModel(long lc=0, long sc=1)
+  { assert(lc>=0 && sc>0); layerCost=lc; shiftCost=sc; }
+
+  //! Time the operations of one layer with the given key, and average over
+  //! the top nLevels levels of the modulus chain (all the levels if
+  //! nLevels<=0). The key must include a key-switching matrix for at least
+  //! one automorphism.
+  static PermCostModel measure(const FHEPubKey& pk, long nLevels=0);
+
+  bool operator==(const PermCostModel& other) const
+  { return layerCost==other.layerCost && shiftCost==other.shiftCost; }
+};
+
 
 //! A vector of generator trees, one per generator in Zm*/(p)
 class GeneratorTrees  {
@@ -456,9 +488,23 @@ class GeneratorTrees  {
 
   //! Compute the trees corresponding to the "optimal" way of breaking
   //! a permutation into dimensions, subject to some constraints. Returns
-  //! the cost (# of 1D shifts) of this colution.
+  //! the cost of this colution under the given model (with the default
+  //! model this is the # of 1D shifts).
   //! Returns NTL_MAX_LONG if no solution
-  long buildOptimalTrees(const Vec<GenDescriptor>& vec, long depthBound);
+  //!
+  //! The result of the search is memoized by the orders and good flags of
+  //! the generators, the depth bound and the cost model, so building the
+  //! trees again for the same structure does not repeat the search.
+  long buildOptimalTrees(const Vec<GenDescriptor>& vec, long depthBound,
+                         const PermCostModel& model = PermCostModel());
+
+  //! Write all the memoized search results to a stream, to be read back
+  //! with readCache (e.g., by another process that builds the same trees)
+  static void writeCache(ostream& s);
+  //! Add the search results from a stream written by writeCache
+  static void readCache(istream& s);
+  //! Forget all the memoized search results
+  static void clearCache();
 
   /**
    * @brief Computes permutations mapping between linear array and the cube.
@@ -486,6 +532,7 @@ class GeneratorTrees  {
 
 class Ctxt;
 class EncryptedArray;
+class DoubleCRT;
 class PermNetwork;
 
 //! @class PermNetLayer
@@ -525,7 +572,8 @@ public:
   //! and prepares the permutation network for this pi
   void buildNetwork(const Permut& pi, const GeneratorTrees& trees);
 
-  //! Apply network to permute a ciphertext
+  //! Apply network to permute a ciphertext. To apply the same network to
+  //! many ciphertexts, keep a PermNetworkExec object and use it instead.
   void applyToCtxt(Ctxt& c, const EncryptedArray& ea) const;
 
   //! Apply network to array, used mostly for debugging
@@ -539,4 +587,33 @@ public:
   friend ostream& operator<< (ostream &s, const PermNetwork &net);
 };
 
+//! @class PermNetworkExec
+//! @brief Pre-computed data for applying a permutation network to many
+//! ciphertexts
+//!
+//! The masks of all the layers are encoded once as DoubleCRT objects, and
+//! pre-rotated so that in each layer the ciphertext is rotated before it is
+//! masked. All the rotations in a layer are then of the same ciphertext and
+//! they share one hoisted key-switching decomposition, and the masked terms
+//! are processed in parallel.
+class PermNetworkExec {
+  const EncryptedArray& ea;
+
+  struct Layer {
+    vector<long> autos;   // the automorphism X -> X^{autos[j]} of term j
+    vector< std::shared_ptr<DoubleCRT> > masks; // masks, pre-rotated
+  };
+  vector<Layer> layers; // identity layers have no terms
+
+public:
+  PermNetworkExec(const PermNetwork& net, const EncryptedArray& _ea);
+
+  long depth() const { return layers.size(); }
+
+  //! Apply the network to permute a ciphertext. If layerTimes is not NULL
+  //! then (*layerTimes)[i] is incremented by the time (in seconds) that
+  //! was spent in layer i.
+  void applyToCtxt(Ctxt& c, vector<double>* layerTimes=NULL) const;
+};
+
 #endif /* ifndef _PERMUTATIONS_H_ */
@@ -9,6 +9,8 @@
  * See the License for the specific language governing permissions and
  * limitations under the License. See accompanying LICENSE file.
  */
+#include <NTL/BasicThreadPool.h>
+#include "multicore.h"
 #include "polyEval.h"
 
 // Returns the e'th power of X, computing it as needed
@@ -25,20 +27,72 @@ Ctxt& DynamicCtxtPowers::getPower(long e)
   return v[e-1];
 }
 
-// Local functions for polynomial evaluation in some special cases
-static void simplePolyEval(Ctxt& ret, const ZZX& poly, DynamicCtxtPowers& babyStep);
-static void PatersonStockmeyer(Ctxt& ret, const ZZX& poly, long k, long t, long delta, DynamicCtxtPowers& babyStep, DynamicCtxtPowers& giantStep);
-static void degPowerOfTwo(Ctxt& ret, const ZZX& poly, long k, DynamicCtxtPowers& babyStep, DynamicCtxtPowers& giantStep);
-static void recursivePolyEval(Ctxt& ret, const ZZX& poly, long k, DynamicCtxtPowers& babyStep, DynamicCtxtPowers& giantStep);
+// Compute the powers in exps, and all the powers that they depend on.
+// As in getPower, X^e is computed as X^{e-k}*X^k with k the largest power
+// of two smaller than e. Hence all the powers X^e with 2^{l-1} < e <= 2^l
+// depend only on powers of smaller depth, so we compute the powers level
+// by level, each level in one parallel loop.
+void DynamicCtxtPowers::computePowers(const vector<long>& exps)
+{
+  FHE_TIMER_START;
+  vector< vector<long> > levels; // levels[l] lists the powers of depth l
+  vector<bool> listed(v.size(), false);
+  vector<long> todo(exps);
+  while (!todo.empty()) {
+    long e = todo.back();
+    todo.pop_back();
+    if (listed.at(e-1) || !v[e-1].isEmpty()) continue; // nothing to do
+    listed[e-1] = true;
+
+    long lvl = NextPowerOfTwo(e);
+    long k = 1L<<(lvl-1); // largest power of two smaller than e
+    if (lsize(levels) <= lvl) levels.resize(lvl+1);
+    levels[lvl].push_back(e);
+    todo.push_back(e-k);
+    todo.push_back(k);
+  }
 
+  for (const vector<long>& level: levels) {
+    FHE_EXEC_RANGE(lsize(level), first, last)
+    for (long i = first; i < last; i++) {
+      long e = level[i];
+      long k = 1L<<(NextPowerOfTwo(e)-1);
+      v[e-1] = v[e-k-1];                  // compute X^e = X^{e-k} * X^k
+      v[e-1].multiplyBy(v[k-1]);
+      v[e-1].modDownToLevel(v[e-1].findBaseLevel());
+    }
+    FHE_EXEC_RANGE_END
+  }
+}
+
+// Local functions for evaluating a polynomial with encrypted coefficients.
+// The products of an encrypted coefficient by a power of X are computed
+// as tensor products without re-linearizing them, and each sum of such
+// products is re-linearized only once.
 static void recursivePolyEval(Ctxt& ret, const Ctxt poly[], long nCoeffs,
-			      const Vec<Ctxt>& powers);
+			      DynamicCtxtPowers& powers, long B);
 
+// acc += a*b, where the product a*b is kept in degree-2 form until the
+// sum is re-linearized. Both summands are first brought to a common
+// level, so the product is never mod-UP'ed. Note: a is modified.
+static void lazyMulAdd(Ctxt& acc, Ctxt& a, const Ctxt& b)
+{
+  if (a.isEmpty()) return;
+  a *= b; // a tensor product, not re-linearized
+  if (!acc.isEmpty()) {
+    long lvl = min(acc.findBaseLevel(), a.findBaseLevel());
+    acc.modDownToLevel(lvl);
+    a.modDownToLevel(lvl);
+  }
+  acc += a;
+  acc.reLinearize();
+}
 
 // Main entry point: Evaluate an encrypted polynomial on an encrypted input
 // return in ret = sum_i poly[i] * x^i
 void polyEval(Ctxt& ret, const Vec<Ctxt>& poly, const Ctxt& x)
 {
+  FHE_TIMER_START;
   if (poly.length()<=1) { // Some special cases
     if (poly.length()==0) ret.clear();   // empty polynomial
     else                  ret = poly[0]; // constant polynomial
@@ -52,184 +106,343 @@ void polyEval(Ctxt& ret, const Vec<Ctxt>& poly, const Ctxt& x)
   // We have d <= deg(poly) < 3d
   assert(d <= deg && deg < 3*d);
 
-  Vec<Ctxt> powers(INIT_SIZE, logD+1, x);
-  if (logD>0) {
-    powers[1].square();
-    for (long i=2; i<=logD; i++) { // powers[i] = x^{2^i}
-      powers[i] = powers[i-1];
-      powers[i].square();
-    }
-  }
-
-  // Compute in three parts p0(X) + ( p1(X) + p2(X)*X^d )*X^d
-  Ctxt tmp(ZeroCtxtLike, ret);
-  recursivePolyEval(ret, &poly[d], min(d,poly.length()-d), powers); // p1(X)
-
-  if (poly.length() > 2*d) {    // p2 is not empty
-    recursivePolyEval(tmp, &poly[2*d], poly.length()-2*d, powers);  // p2(X)
-    tmp.multiplyBy(powers[logD]);
-    ret += tmp;
+  // The coefficients are processed in blocks of B~sqrt(d) consecutive
+  // coefficients, each block uses the baby steps x,x^2,...,x^{B-1} and is
+  // re-linearized once. The blocks are then combined using x^{2^i} for
+  // B <= 2^i <= d, which also have the same depth as the baby steps.
+  long logB = (logD+1)/2;
+  long B = 1L << logB;
+  DynamicCtxtPowers powers(x, d);
+  vector<long> need;
+  for (long i=1; i<B; i++) need.push_back(i);
+  for (long i=logB; i<=logD; i++) need.push_back(1L << i);
+  powers.computePowers(need);
+
+  // Compute in three parts p0(X) + ( p1(X) + p2(X)*X^d )*X^d, the three
+  // parts p0,p1,p2 are evaluated in parallel
+  vector<Ctxt> parts(3, Ctxt(ZeroCtxtLike, x));
+  FHE_EXEC_RANGE(3, first, last)
+  for (long i = first; i < last; i++) {
+    long nCoeffs = min(d, poly.length()-i*d); // p2 may be shorter or empty
+    if (nCoeffs > 0)
+      recursivePolyEval(parts[i], &poly[i*d], nCoeffs, powers, B);
   }
-  ret.multiplyBy(powers[logD]); // ( p1(X) + p2(X)*X^d )*X^d
+  FHE_EXEC_RANGE_END
 
-  recursivePolyEval(tmp, &poly[0], d, powers);                      // p0(X)
-  ret += tmp;
+  const Ctxt& xd = powers.getPower(d);
+  lazyMulAdd(parts[1], parts[2], xd); // p1(X) + p2(X)*X^d
+  lazyMulAdd(parts[0], parts[1], xd); // p0(X) + ( p1(X) + p2(X)*X^d )*X^d
+  ret = parts[0];
 }
 
 static void recursivePolyEval(Ctxt& ret, const Ctxt poly[], long nCoeffs,
-			      const Vec<Ctxt>& powers)
+			      DynamicCtxtPowers& powers, long B)
 {
   if (nCoeffs <= 1) { // edge condition
     if (nCoeffs == 0) ret.clear();   // empty polynomial
     else              ret = poly[0]; // constant polynomial
     return;
   }
+
+  if (nCoeffs <= B) { // a block: sum_i poly[i]*X^i, re-linearized once
+    vector<Ctxt> terms(nCoeffs, Ctxt(ZeroCtxtLike, ret));
+    FHE_EXEC_RANGE(nCoeffs-1, first, last)
+    for (long i = first+1; i <= last; i++) {
+      terms[i] = poly[i];
+      terms[i] *= powers.getPower(i); // a tensor product
+    }
+    FHE_EXEC_RANGE_END
+
+    // Sum everything at a common level, so no term needs to be mod-UP'ed
+    long lvl = poly[0].findBaseLevel();
+    for (long i=1; i<nCoeffs; i++)
+      lvl = min(lvl, terms[i].findBaseLevel());
+    ret = poly[0];
+    ret.modDownToLevel(lvl);
+    for (long i=1; i<nCoeffs; i++) {
+      terms[i].modDownToLevel(lvl);
+      ret += terms[i];
+    }
+    ret.reLinearize();
+    return;
+  }
+
   long logD = NextPowerOfTwo(nCoeffs)-1;
   long d = 1L << logD;
   Ctxt tmp(ZeroCtxtLike, ret);
-  recursivePolyEval(tmp, &(poly[d]), nCoeffs-d, powers);
-  recursivePolyEval(ret, &(poly[0]), d, powers);
-  tmp.multiplyBy(powers[logD]);
-  ret += tmp;
+  long nThreads = std::min(numFHEthreads(), 2L);
+  FHE_EXEC_INDEX(nThreads, index)   // evaluate the two halves in parallel
+  switch (index) {
+  case 0:
+    recursivePolyEval(tmp, &(poly[d]), nCoeffs-d, powers, B);
+    if (nThreads>1) break;
+  default:
+    recursivePolyEval(ret, &(poly[0]), d, powers, B);
+  }
+  FHE_EXEC_INDEX_END
+  lazyMulAdd(ret, tmp, powers.getPower(d));
 }
 
 
-// Main entry point: Evaluate a cleartext polynomial on an encrypted input
-void polyEval(Ctxt& ret, ZZX poly, const Ctxt& x, long k)
-     // Note: poly is passed by value, so caller keeps the original
+
+// How many baby steps: set k~sqrt(n/2), rounded up/down to a power of two
+
+// FIXME: There may be some room for optimization here: it may be possible
+// to choose k as something other than a power of two and still maintain
+// optimal depth, in principle we can try all possible values of k between
+// two consecutive powers of two and choose the one that gives the least
+// number of multiplies, conditioned on minimum depth.
+static long defaultBabySteps(long d)
 {
-  if (deg(poly)<=2) {  // nothing to optimize here
-    if (deg(poly)<1) { // A constant
-      ret.clear();
-      ret.addConstant(coeff(poly, 0));
-    } else {           // A linear or quadratic polynomial
-      DynamicCtxtPowers babyStep(x, deg(poly));
-      simplePolyEval(ret, poly, babyStep);
+  long kk = (long) sqrt(d/2.0);
+  long k = 1L << NextPowerOfTwo(kk);
+
+  // heuristic: if k>>kk then use a smaler power of two
+  if ((k==16 && d>167) || (k>16 && k>(1.44*kk)))
+    k /= 2;
+  return k;
+}
+
+// The depth of the baby step X^e as computed by DynamicCtxtPowers, and
+// the depth of the giant step (X^k)^e
+static long babyStepDepth(long e) { return NextPowerOfTwo(e); }
+static long giantStepDepth(long e, long k)
+{ return NextPowerOfTwo(k) + NextPowerOfTwo(e); }
+
+
+// A node in the tree of the Paterson-Stockmeyer recursion. The tree is
+// built once from the cleartext polynomial (see the build functions below),
+// so evaluating it only involves the homomorphic operations. When par=true
+// the independent parts of the tree are evaluated in parallel, this should
+// only be used when all the needed powers were computed already.
+struct PolyEvalNode {
+  virtual ~PolyEvalNode() {}
+
+  virtual void eval(Ctxt& ret, DynamicCtxtPowers& babyStep,
+                    DynamicCtxtPowers& giantStep, bool par) const = 0;
+
+  // Record the baby steps (powers of X) and the giant steps (powers of X^k)
+  // that are used by eval
+  virtual void powers(vector<long>& baby, vector<long>& giant) const = 0;
+
+  // The multiplicative depth of the result of eval
+  virtual long depth(long k) const = 0;
+};
+
+typedef shared_ptr<PolyEvalNode> PolyEvalNodePtr;
+
+// Simple evaluation sum f_i * X^i. The coefficients are reduced mod p
+// into the range [-p/2,p/2] when the node is built.
+struct PolyEvalSimple : PolyEvalNode {
+  vector<ZZ> coeffs;
+
+  PolyEvalSimple(const ZZX& poly, const ZZ& p)
+  {
+    coeffs.resize(deg(poly)+1); // empty for the zero polynomial
+    for (long i=0; i<lsize(coeffs); i++) {
+      rem(coeffs[i], coeff(poly,i), p);
+      if (coeffs[i] > p/2) coeffs[i] -= p;
     }
-    return;
   }
 
-  // How many baby steps: set k~sqrt(n/2), rounded up/down to a power of two
-
-  // FIXME: There may be some room for optimization here: it may be possible
-  // to choose k as something other than a power of two and still maintain
-  // optimal depth, in principle we can try all possible values of k between
-  // two consecutive powers of two and choose the one that gives the least
-  // number of multiplies, conditioned on minimum depth.
+  void eval(Ctxt& ret, DynamicCtxtPowers& babyStep,
+            DynamicCtxtPowers& giantStep, bool par) const override
+  {
+    ret.clear();
+    if (coeffs.empty()) return; // the zero polynomial always returns zero
 
-  if (k<=0) {
-    long kk = (long) sqrt(deg(poly)/2.0);
-    k = 1L << NextPowerOfTwo(kk);
+    // ensure that we have enough powers
+    assert (lsize(coeffs)-1 <= babyStep.size());
 
-    // heuristic: if k>>kk then use a smaler power of two
-    if ((k==16 && deg(poly)>167) || (k>16 && k>(1.44*kk)))
-      k /= 2;
+    for (long i=1; i<lsize(coeffs); i++) {
+      if (IsZero(coeffs[i])) continue; // nothing to add for this power
+      Ctxt tmp = babyStep.getPower(i); // X^i
+      tmp.multByConstant(coeffs[i]);   // f_i X^i
+      ret += tmp;
+    }
+    ret.addConstant(coeffs[0]);        // Add the free term
   }
-#ifdef DEBUG_PRINTOUT
-  cerr << "  k="<<k;
-#endif
 
-  long n = divc(deg(poly),k);      // n = ceil(deg(p)/k), deg(p) >= k*n
-  DynamicCtxtPowers babyStep(x, k);
-  const Ctxt& x2k = babyStep.getPower(k);
+  void powers(vector<long>& baby, vector<long>& giant) const override
+  {
+    for (long i=1; i<lsize(coeffs); i++)
+      if (!IsZero(coeffs[i])) baby.push_back(i);
+  }
 
-  // Special case when deg(p)>k*(2^e -1)
-  if (n==(1L << NextPowerOfTwo(n))) { // n is a power of two
-    DynamicCtxtPowers giantStep(x2k, n/2);
-    degPowerOfTwo(ret, poly, k, babyStep, giantStep);
-    return;
+  long depth(long k) const override
+  {
+    long d = 0;
+    for (long i=1; i<lsize(coeffs); i++)
+      if (!IsZero(coeffs[i])) d = max(d, babyStepDepth(i));
+    return d;
   }
+};
 
-  // If n is not a power of two, ensure that poly is monic and that
-  // its degree is divisible by k, then call the recursive procedure
+// One step of Paterson-Stockmeyer: poly = (c+X^{kt})*q + s
+struct PolyEvalPS : PolyEvalNode {
+  PolyEvalNodePtr q, s, c;
+  long t;
 
-  const ZZ p = to_ZZ(x.getPtxtSpace());
-  ZZ top = LeadCoeff(poly);
-  ZZ topInv; // the inverse mod p of the top coefficient of poly (if any)
-  bool divisible = (n*k == deg(poly)); // is the degree divisible by k?
-  long nonInvertibe = InvModStatus(topInv, top, p);
-       // 0 if invertible, 1 if not
+  PolyEvalPS(const PolyEvalNodePtr& _q, const PolyEvalNodePtr& _s,
+             const PolyEvalNodePtr& _c, long _t): q(_q), s(_s), c(_c), t(_t)
+  {}
 
-  // FIXME: There may be some room for optimization below: instead of
-  // adding a term X^{n*k} we can add X^{n'*k} for some n'>n, so long
-  // as n' is smaller than the next power of two. We could save a few
-  // multiplications since giantStep[n'] may be easier to compute than
-  // giantStep[n] when n' has fewer 1's than n in its binary expansion.
+  void eval(Ctxt& ret, DynamicCtxtPowers& babyStep,
+            DynamicCtxtPowers& giantStep, bool par) const override
+  {
+    Ctxt tmp(ret.getPubKey(), ret.getPtxtSpace());
+    long nThreads = par? std::min(numFHEthreads(), 2L) : 1;
+    FHE_EXEC_INDEX(nThreads, index)   // evaluate the two halves in parallel
+    switch (index) {
+    case 0: {
+      q->eval(ret, babyStep, giantStep, par);
+
+      Ctxt tmp1(ret.getPubKey(), ret.getPtxtSpace());
+      c->eval(tmp1, babyStep, giantStep, par);
+      tmp1 += giantStep.getPower(t);
+      ret.multiplyBy(tmp1);
+      if (nThreads>1) break;
+    }
+    default:
+      s->eval(tmp, babyStep, giantStep, par);
+    }
+    FHE_EXEC_INDEX_END
+    ret += tmp;
+  }
 
-  ZZ extra = ZZ::zero();    // extra!=0 denotes an added term extra*X^{n*k}
-  if (!divisible || nonInvertibe) {  // need to add a term
-    top = to_ZZ(1);  // new top coefficient is one
-    topInv = top;    // also the new inverse is one
-    // set extra = 1 - current-coeff-of-X^{n*k}
-    extra = SubMod(top, coeff(poly,n*k), p);
-    SetCoeff(poly, n*k); // set the top coefficient of X^{n*k} to one
+  void powers(vector<long>& baby, vector<long>& giant) const override
+  {
+    q->powers(baby, giant);
+    c->powers(baby, giant);
+    giant.push_back(t);
+    s->powers(baby, giant);
   }
 
-  long t = IsZero(extra)? divc(n,2) : n;
-  DynamicCtxtPowers giantStep(x2k, t);
+  long depth(long k) const override
+  {
+    long d = max(c->depth(k), giantStepDepth(t,k)); // depth of c+X^{kt}
+    d = max(d, q->depth(k)) +1;
+    return max(d, s->depth(k));
+  }
+};
 
-  if (!IsOne(top)) {
-    poly *= topInv; // Multiply by topInv to make into a monic polynomial
-    for (long i=0; i<=n*k; i++) rem(poly[i], poly[i], p);
-    poly.normalize();
+// poly = r + q*X^{k(n-1)} with n a power of two, where X^{k(n-1)} is
+// computed as the product of X^k, X^{2k}, ..., X^{k*n/2}
+struct PolyEvalPow2 : PolyEvalNode {
+  PolyEvalNodePtr r, q;
+  long n;
+
+  PolyEvalPow2(const PolyEvalNodePtr& _r, const PolyEvalNodePtr& _q, long _n):
+    r(_r), q(_q), n(_n) {}
+
+  void eval(Ctxt& ret, DynamicCtxtPowers& babyStep,
+            DynamicCtxtPowers& giantStep, bool par) const override
+  {
+    Ctxt tmp(ret.getPubKey(), ret.getPtxtSpace());
+    long nThreads = par? std::min(numFHEthreads(), 2L) : 1;
+    FHE_EXEC_INDEX(nThreads, index)   // evaluate the two parts in parallel
+    switch (index) {
+    case 0:
+      r->eval(ret, babyStep, giantStep, par);
+      if (nThreads>1) break;
+    default:
+      q->eval(tmp, babyStep, giantStep, par); // evaluate q
+
+      // multiply by X^{k(n-1)} with minimum depth
+      for (long i=1; i<n; i*=2) {
+        tmp.multiplyBy(giantStep.getPower(i));
+      }
+    }
+    FHE_EXEC_INDEX_END
+    ret += tmp;
   }
-  recursivePolyEval(ret, poly, k, babyStep, giantStep);
 
-  if (!IsOne(top)) {
-    ret.multByConstant(top);
+  void powers(vector<long>& baby, vector<long>& giant) const override
+  {
+    r->powers(baby, giant);
+    q->powers(baby, giant);
+    for (long i=1; i<n; i*=2) giant.push_back(i);
   }
 
-  if (!IsZero(extra)) { // if we added a term, now is the time to subtract back
-    Ctxt topTerm = giantStep.getPower(n);
-    topTerm.multByConstant(extra);
-    ret -= topTerm;
+  long depth(long k) const override
+  {
+    long d = q->depth(k);
+    for (long i=1; i<n; i*=2) d = max(d, giantStepDepth(i,k)) +1;
+    return max(d, r->depth(k));
   }
-}
+};
 
+// poly = q*X^u + r with u = k*g+delta
+struct PolyEvalRec : PolyEvalNode {
+  PolyEvalNodePtr q, r;
+  long g, delta;
 
-// Simple evaluation sum f_i * X^i, assuming that babyStep has enough powers
-static void 
-simplePolyEval(Ctxt& ret, const ZZX& poly, DynamicCtxtPowers& babyStep)
-{
-  ret.clear();
-  if (deg(poly)<0) return;       // the zero polynomial always returns zero
+  PolyEvalRec(const PolyEvalNodePtr& _q, const PolyEvalNodePtr& _r,
+              long _g, long _delta): q(_q), r(_r), g(_g), delta(_delta) {}
 
-  assert (deg(poly)<=babyStep.size()); // ensure that we have enough powers
+  void eval(Ctxt& ret, DynamicCtxtPowers& babyStep,
+            DynamicCtxtPowers& giantStep, bool par) const override
+  {
+    Ctxt tmp(ret.getPubKey(), ret.getPtxtSpace());
+    long nThreads = par? std::min(numFHEthreads(), 2L) : 1;
+    FHE_EXEC_INDEX(nThreads, index)   // evaluate the two parts in parallel
+    switch (index) {
+    case 0: {
+      q->eval(ret, babyStep, giantStep, par);
+
+      Ctxt xu = giantStep.getPower(g);
+      if (delta!=0) { // if u is not divisible by k then compute it
+        xu.multiplyBy(babyStep.getPower(delta));
+      }
+      ret.multiplyBy(xu);
+      if (nThreads>1) break;
+    }
+    default:
+      r->eval(tmp, babyStep, giantStep, par);
+    }
+    FHE_EXEC_INDEX_END
+    ret += tmp;
+  }
 
-  ZZ coef;
-  ZZ p = to_ZZ(babyStep[0].getPtxtSpace());
-  for (long i=1; i<=deg(poly); i++) {
-    rem(coef, coeff(poly,i),p);
-    if (coef > p/2) coef -= p;
+  void powers(vector<long>& baby, vector<long>& giant) const override
+  {
+    q->powers(baby, giant);
+    giant.push_back(g);
+    if (delta!=0) baby.push_back(delta);
+    r->powers(baby, giant);
+  }
 
-    Ctxt tmp = babyStep.getPower(i); // X^i
-    tmp.multByConstant(coef);        // f_i X^i
-    ret += tmp;
+  long depth(long k) const override
+  {
+    long d = giantStepDepth(g,k);                  // depth of X^u
+    if (delta!=0) d = max(d, babyStepDepth(delta)) +1;
+    d = max(d, q->depth(k)) +1;
+    return max(d, r->depth(k));
   }
-  // Add the free term
-  rem(coef, ConstTerm(poly), p);
-  if (coef > p/2) coef -= p;
-  ret.addConstant(coef);
-  //  if (verbose) checkPolyEval(ret, babyStep[0], poly);
-}
+};
+
+
+// Local functions that build the evaluation tree in some special cases,
+// the coefficients of all the polynomials are reduced modulo p.
+static PolyEvalNodePtr
+PatersonStockmeyer(const ZZX& poly, long k, long t, long delta, const ZZ& p);
+static PolyEvalNodePtr degPowerOfTwo(const ZZX& poly, long k, const ZZ& p);
+static PolyEvalNodePtr recursivePolyEval(const ZZX& poly, long k, const ZZ& p);
 
 
 // The recursive procedure in the Paterson-Stockmeyer
 // polynomial-evaluation algorithm from SIAM J. on Computing, 1973.
 // This procedure assumes that poly is monic, deg(poly)=k*(2t-1)+delta
 // with t=2^e, and that babyStep contains >= k+delta powers
-static void
-PatersonStockmeyer(Ctxt& ret, const ZZX& poly, long k, long t, long delta,
-		   DynamicCtxtPowers& babyStep, DynamicCtxtPowers& giantStep)
+static PolyEvalNodePtr
+PatersonStockmeyer(const ZZX& poly, long k, long t, long delta, const ZZ& p)
 {
-  if (deg(poly)<=babyStep.size()) { // Edge condition, use simple eval
-    simplePolyEval(ret, poly, babyStep);
-    return;
-  }
+  if (deg(poly)<=k) // Edge condition, use simple eval
+    return PolyEvalNodePtr(new PolyEvalSimple(poly, p));
+
   ZZX r = trunc(poly, k*t);      // degree <= k*2^e-1
   ZZX q = RightShift(poly, k*t); // degree == k(2^e-1) +delta
 
-  const ZZ p = to_ZZ(babyStep[0].getPtxtSpace());
   const ZZ& coef = coeff(r,deg(q));
   SetCoeff(r, deg(q), coef-1);  // r' = r - X^{deg(q)}
 
@@ -248,27 +461,19 @@ PatersonStockmeyer(Ctxt& ret, const ZZX& poly, long k, long t, long delta,
   s.normalize();
 
   // Evaluate recursively poly = (c+X^{kt})*q + s'
-  PatersonStockmeyer(ret, q, k, t/2, delta, babyStep, giantStep);
-
-  Ctxt tmp(ret.getPubKey(), ret.getPtxtSpace());
-  simplePolyEval(tmp, c, babyStep);
-  tmp += giantStep.getPower(t);
-  ret.multiplyBy(tmp);
-
-  PatersonStockmeyer(tmp, s, k, t/2, delta, babyStep, giantStep);
-  ret += tmp;
+  PolyEvalNodePtr qNode = PatersonStockmeyer(q, k, t/2, delta, p);
+  PolyEvalNodePtr sNode = PatersonStockmeyer(s, k, t/2, delta, p);
+  PolyEvalNodePtr cNode(new PolyEvalSimple(c, p));
+  return PolyEvalNodePtr(new PolyEvalPS(qNode, sNode, cNode, t));
 }
 
 // This procedure assumes that k*(2^e +1) > deg(poly) > k*(2^e -1),
 // and that babyStep contains >= k + (deg(poly) mod k) powers
-static void
-degPowerOfTwo(Ctxt& ret, const ZZX& poly, long k,
-	      DynamicCtxtPowers& babyStep, DynamicCtxtPowers& giantStep)
+static PolyEvalNodePtr degPowerOfTwo(const ZZX& poly, long k, const ZZ& p)
 {
-  if (deg(poly)<=babyStep.size()) { // Edge condition, use simple eval
-    simplePolyEval(ret, poly, babyStep);
-    return;
-  }
+  if (deg(poly)<=k) // Edge condition, use simple eval
+    return PolyEvalNodePtr(new PolyEvalSimple(poly, p));
+
   long n = deg(poly)/k;        // We assume n=2^e or n=2^e -1
   n = 1L << NextPowerOfTwo(n); // round up to n=2^e
   ZZX r = trunc(poly, (n-1)*k);      // degree <= k(2^e-1)-1
@@ -276,46 +481,31 @@ degPowerOfTwo(Ctxt& ret, const ZZX& poly, long k,
   SetCoeff(r, (n-1)*k);              // monic, degree == k(2^e-1)
   q -= 1;
 
-  PatersonStockmeyer(ret, r, k, n/2, 0,	babyStep, giantStep);
-
-  Ctxt tmp(ret.getPubKey(), ret.getPtxtSpace());
-  simplePolyEval(tmp, q, babyStep); // evaluate q
-
-  // multiply by X^{k(n-1)} with minimum depth
-  for (long i=1; i<n; i*=2) {  
-    tmp.multiplyBy(giantStep.getPower(i));
-  }
-  ret += tmp;
+  PolyEvalNodePtr rNode = PatersonStockmeyer(r, k, n/2, 0, p);
+  PolyEvalNodePtr qNode(new PolyEvalSimple(q, p));
+  return PolyEvalNodePtr(new PolyEvalPow2(rNode, qNode, n));
 }
 
-static void 
-recursivePolyEval(Ctxt& ret, const ZZX& poly, long k,
-		  DynamicCtxtPowers& babyStep, DynamicCtxtPowers& giantStep)
+static PolyEvalNodePtr recursivePolyEval(const ZZX& poly, long k, const ZZ& p)
 {
-  if (deg(poly)<=babyStep.size()) { // Edge condition, use simple eval
-    simplePolyEval(ret, poly, babyStep);
-    return;
-  }
+  if (deg(poly)<=k) // Edge condition, use simple eval
+    return PolyEvalNodePtr(new PolyEvalSimple(poly, p));
 
   long delta = deg(poly) % k; // deg(poly) mod k
   long n = divc(deg(poly),k); // ceil( deg(poly)/k )
   long t = 1L<<(NextPowerOfTwo(n)); // t >= n, so t*k >= deg(poly)
 
   // Special case for deg(poly) = k * 2^e +delta
-  if (n==t) {
-    degPowerOfTwo(ret, poly, k, babyStep, giantStep);
-    return;
-  }
+  if (n==t)
+    return degPowerOfTwo(poly, k, p);
 
   // When deg(poly) = k*(2^e -1) we use the Paterson-Stockmeyer recursion
-  if (n == t-1 && delta==0) {
-    PatersonStockmeyer(ret, poly, k, t/2, delta, babyStep, giantStep);
-    return;
-  }
+  if (n == t-1 && delta==0)
+    return PatersonStockmeyer(poly, k, t/2, delta, p);
 
   t = t/2;
 
-  // In any other case we have kt < deg(poly) < k(2t-1). We then set 
+  // In any other case we have kt < deg(poly) < k(2t-1). We then set
   // u = deg(poly) - k*(t-1) and poly = q*X^u + r with deg(r)<u
   // and recurse on poly = (q-1)*X^u + (X^u+r)
 
@@ -325,20 +515,228 @@ recursivePolyEval(Ctxt& ret, const ZZX& poly, long k,
   q -= 1;
   SetCoeff(r, u);              // degree == u
 
-  PatersonStockmeyer(ret, q, k, t/2, 0, babyStep, giantStep);
+  PolyEvalNodePtr qNode = PatersonStockmeyer(q, k, t/2, 0, p);
+  PolyEvalNodePtr rNode = recursivePolyEval(r, k, p);
+  return PolyEvalNodePtr(new PolyEvalRec(qNode, rNode, u/k, delta));
+}
+
 
-  Ctxt tmp = giantStep.getPower(u/k);
-  if (delta!=0) { // if u is not divisible by k then compute it
-    tmp.multiplyBy(babyStep.getPower(delta));
+PolyEvalPlan::PolyEvalPlan(const ZZX& _poly, long _ptxtSpace, long _k):
+  ptxtSpace(_ptxtSpace), degree(deg(_poly)), k(_k), n(0)
+{
+  FHE_TIMER_START;
+  assert(ptxtSpace > 1);
+  const ZZ p = to_ZZ(ptxtSpace);
+  constTerm = ConstTerm(_poly);
+  top = to_ZZ(1);
+  extra = ZZ::zero();
+
+  if (degree<=2) {  // nothing to optimize here
+    k = max(degree, 1L);
+    root = PolyEvalNodePtr(new PolyEvalSimple(_poly, p));
+  }
+  else {
+    if (k<=0) k = defaultBabySteps(degree);
+    n = divc(degree,k);      // n = ceil(deg(p)/k), deg(p) >= k*n
+
+    // Special case when deg(p)>k*(2^e -1)
+    if (n==(1L << NextPowerOfTwo(n))) // n is a power of two
+      root = degPowerOfTwo(_poly, k, p);
+    else {
+      // If n is not a power of two, ensure that poly is monic and that
+      // its degree is divisible by k, then call the recursive procedure
+
+      ZZX poly = _poly;
+      top = LeadCoeff(poly);
+      ZZ topInv; // the inverse mod p of the top coefficient of poly (if any)
+      bool divisible = (n*k == deg(poly)); // is the degree divisible by k?
+      long nonInvertibe = InvModStatus(topInv, top, p);
+           // 0 if invertible, 1 if not
+
+      // FIXME: There may be some room for optimization below: instead of
+      // adding a term X^{n*k} we can add X^{n'*k} for some n'>n, so long
+      // as n' is smaller than the next power of two. We could save a few
+      // multiplications since giantStep[n'] may be easier to compute than
+      // giantStep[n] when n' has fewer 1's than n in its binary expansion.
+
+      if (!divisible || nonInvertibe) {  // need to add a term
+        top = to_ZZ(1);  // new top coefficient is one
+        topInv = top;    // also the new inverse is one
+        // set extra = 1 - current-coeff-of-X^{n*k}
+        extra = SubMod(top, coeff(poly,n*k), p);
+        SetCoeff(poly, n*k); // set the top coefficient of X^{n*k} to one
+      }
+
+      if (!IsOne(top)) {
+        poly *= topInv; // Multiply by topInv to make into a monic polynomial
+        for (long i=0; i<=n*k; i++) rem(poly[i], poly[i], p);
+        poly.normalize();
+      }
+      root = recursivePolyEval(poly, k, p);
+    }
+  }
+
+  // Record the powers of X that are used, X^k is always needed since
+  // the giant steps are its powers
+  babyNeed.assign(1, k);
+  root->powers(babyNeed, giantNeed);
+  if (!IsZero(extra)) giantNeed.push_back(n);
+  nGiant = 1;
+  for (long e: giantNeed) nGiant = max(nGiant, e);
+
+  nLevels = (degree<1)? 0 : root->depth(k);
+  if (!IsZero(extra)) nLevels = max(nLevels, giantStepDepth(n,k));
+}
+
+// Bring all the baby steps that were computed to a common level. This is
+// never more than the level of X^k anyway, and afterwards the scalar sums
+// in PolyEvalSimple accumulate their terms without having to mod-UP any
+// of them (which is done otherwise on each addition).
+static void matchBabySteps(DynamicCtxtPowers& babyStep)
+{
+  long lvl = babyStep.getPower(1).findBaseLevel();
+  for (long e=2; e<=babyStep.size(); e++)
+    if (babyStep.isPowerComputed(e))
+      lvl = min(lvl, babyStep.getPower(e).findBaseLevel());
+
+  FHE_EXEC_RANGE(babyStep.size(), first, last)
+  for (long e = first+1; e <= last; e++)
+    if (babyStep.isPowerComputed(e))
+      babyStep.getPower(e).modDownToLevel(lvl);
+  FHE_EXEC_RANGE_END
+}
+
+// Evaluate the plan, all the powers that it uses are computed first (in
+// parallel, level by level) and then the blocks of the recursion are
+// evaluated concurrently. Note that ret may alias x.
+void PolyEvalPlan::eval(Ctxt& ret, const Ctxt& x) const
+{
+  FHE_TIMER_START;
+  if (degree<1) { // A constant
+    ret.clear();
+    ret.addConstant(constTerm);
+    return;
+  }
+  assert(x.getPtxtSpace() == ptxtSpace);
+
+  DynamicCtxtPowers babyStep(x, k);
+  babyStep.computePowers(babyNeed);
+  DynamicCtxtPowers giantStep(babyStep.getPower(k), nGiant);
+  giantStep.computePowers(giantNeed);
+  matchBabySteps(babyStep);
+
+  evalPowers(ret, babyStep, giantStep, /*par=*/true);
+}
+
+// Evaluate on powers of x that were provided by the caller
+void PolyEvalPlan::evalPowers(Ctxt& ret, DynamicCtxtPowers& babyStep,
+                              DynamicCtxtPowers& giantStep, bool par) const
+{
+  if (degree<1) { // A constant
+    ret.clear();
+    ret.addConstant(constTerm);
+    return;
+  }
+
+  root->eval(ret, babyStep, giantStep, par);
+
+  if (!IsOne(top)) {
+    ret.multByConstant(top);
+  }
+
+  if (!IsZero(extra)) { // if we added a term, now is the time to subtract back
+    Ctxt topTerm = giantStep.getPower(n);
+    topTerm.multByConstant(extra);
+    ret -= topTerm;
   }
-  ret.multiplyBy(tmp);
+}
+
+void PolyEvalPlan::apply(vector<Ctxt>& v) const
+{
+  FHE_TIMER_START;
+  if (lsize(v) == 1) { // parallelize only within the evaluation
+    eval(v[0], v[0]);
+    return;
+  }
+  FHE_EXEC_RANGE(lsize(v), first, last)
+  for (long i = first; i < last; i++)
+    eval(v[i], v[i]);
+  FHE_EXEC_RANGE_END
+}
+
+
+// Main entry point: Evaluate a cleartext polynomial on an encrypted input
+void polyEval(Ctxt& ret, ZZX poly, const Ctxt& x, long k)
+     // Note: poly is passed by value, so caller keeps the original
+{
+  PolyEvalPlan plan(poly, x.getPtxtSpace(), k);
+#ifdef DEBUG_PRINTOUT
+  cerr << "  k="<<plan.getBabySteps();
+#endif
+  plan.eval(ret, x);
+}
+
+
+// Evaluate many cleartext polynomials on the same encrypted input. All the
+// powers of x that any of them needs are computed up front, so from then on
+// the powers are only read and the polynomials (and the independent blocks
+// within each of them) can be evaluated in parallel.
+void polyEvalMany(vector<Ctxt>& out, const vector<ZZX>& polys, const Ctxt& x,
+                  long k)
+{
+  FHE_TIMER_START;
+  long nPolys = lsize(polys);
+  out.clear();
+  out.resize(nPolys, Ctxt(ZeroCtxtLike, x));
+
+  long maxDeg = 0;
+  for (long i=0; i<nPolys; i++) maxDeg = max(maxDeg, deg(polys[i]));
 
-  recursivePolyEval(tmp, r, k, babyStep, giantStep);
-  ret += tmp;
+  if (maxDeg<=2) { // nothing to share here
+    for (long i=0; i<nPolys; i++) polyEval(out[i], polys[i], x);
+    return;
+  }
+  if (k<=0) k = defaultBabySteps(maxDeg);
+
+  // Build the plans, and collect the powers that any of them uses. The
+  // plans of degree>2 all use k baby steps, so they share the giant steps.
+  vector<PolyEvalPlan> plans;
+  plans.reserve(nPolys);
+  vector<long> babyNeed, giantNeed;
+  long nBaby = k, nGiant = 1;
+  for (long i=0; i<nPolys; i++) {
+    plans.push_back(PolyEvalPlan(polys[i], x.getPtxtSpace(), k));
+    const PolyEvalPlan& plan = plans.back();
+    assert(plan.degree<=2 || plan.k==k);
+    nBaby = max(nBaby, plan.k);
+    nGiant = max(nGiant, plan.nGiant);
+    babyNeed.insert(babyNeed.end(), plan.babyNeed.begin(), plan.babyNeed.end());
+    giantNeed.insert(giantNeed.end(),
+                     plan.giantNeed.begin(), plan.giantNeed.end());
+  }
+  babyNeed.push_back(k);
+
+  // Compute the baby steps and the giant steps, level by level
+  DynamicCtxtPowers babyStep(x, nBaby);
+  babyStep.computePowers(babyNeed);
+  DynamicCtxtPowers giantStep(babyStep.getPower(k), nGiant);
+  giantStep.computePowers(giantNeed);
+  matchBabySteps(babyStep);
+
+  // Evaluate the polynomials, in parallel
+  if (nPolys == 1) // parallelize only the blocks within the recursion
+    plans[0].evalPowers(out[0], babyStep, giantStep, /*par=*/true);
+  else {
+    FHE_EXEC_RANGE(nPolys, first, last)
+    for (long i = first; i < last; i++)
+      plans[i].evalPowers(out[i], babyStep, giantStep, /*par=*/true);
+    FHE_EXEC_RANGE_END
+  }
 }
 
 
 
+
 // raise ciphertext to some power
 void Ctxt::power(long e)
 {
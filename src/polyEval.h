@@ -9,6 +9,8 @@
  * See the License for the specific language governing permissions and
  * limitations under the License. See accompanying LICENSE file.
  */
+#ifndef _POLY_EVAL_H_
+#define _POLY_EVAL_H_
 /**
  * @file polyEval.h
  * @brief Homomorphic Polynomial Evaluation
@@ -29,8 +31,24 @@ void polyEval(Ctxt& ret, ZZX poly, const Ctxt& x, long k=0);
 //! @param[out] res  to hold the return value
 //! @param[in]  poly the degree-d polynomial to evaluate
 //! @param[in]  x    the point on which to evaluate
+//! The coefficients are handled in blocks of about sqrt(d) of them, the
+//! products in each block are summed before re-linearizing, and the
+//! independent blocks are evaluated in parallel.
 void polyEval(Ctxt& ret, const Vec<Ctxt>& poly, const Ctxt& x);
 
+//! @brief Evaluate many cleartext polynomials on the same encrypted input
+//! @param[out] out   out[i] holds the value of polys[i]
+//! @param[in]  polys the polynomials to evaluate
+//! @param[in]  x     the point on which to evaluate
+//! @param[in]  k     optional optimization parameter, as in polyEval above,
+//!                   with the default computed from the largest degree
+//! The baby-step and giant-step powers of x are computed only once (in
+//! parallel, level by level) and shared by all the polynomials, and the
+//! independent blocks of the Paterson-Stockmeyer recursion are evaluated
+//! concurrently.
+void polyEvalMany(vector<Ctxt>& out, const vector<ZZX>& polys, const Ctxt& x,
+                  long k=0);
+
 
 // A useful helper class
 
@@ -55,6 +73,18 @@ public:
   //! @brief Returns the e'th power, computing it as needed
   Ctxt& getPower(long e); // must use e >= 1, else throws an exception
 
+  //! @brief Compute the powers in exps, along with all the powers that they
+  //! depend on. Powers of the same depth are computed in parallel.
+  void computePowers(const vector<long>& exps);
+
+  //! @brief Compute all the powers 1,2,...,size()
+  void computeAllPowers()
+  {
+    vector<long> exps(v.size());
+    for (long i=0; i<lsize(exps); i++) exps[i] = i+1;
+    computePowers(exps);
+  }
+
   //! dp.at(i) and dp[i] both return the i+1st power
   Ctxt& at(long i) { return getPower(i+1); }
   Ctxt& operator[](long i) { return getPower(i+1); }
@@ -64,3 +94,64 @@ public:
   bool isPowerComputed(long i)
   { return (i>0 && i<=(long)v.size() && !v[i-1].isEmpty()); }
 };
+struct PolyEvalNode; // Defined in polyEval.cpp
+
+/**
+ * @class PolyEvalPlan
+ * @brief A reusable plan for evaluating a cleartext polynomial
+ *
+ * The constructor runs the Paterson-Stockmeyer recursion of polyEval on the
+ * cleartext polynomial alone: it splits the polynomial into its blocks,
+ * reduces and centers all the scalar coefficients modulo the plaintext
+ * space, and records which powers of the input are needed. Evaluating the
+ * plan on a ciphertext then only performs the homomorphic operations, so a
+ * plan can be built once and then applied to many ciphertexts.
+ **/
+class PolyEvalPlan {
+  long ptxtSpace;  // the coefficients are reduced modulo ptxtSpace
+  long degree;     // the degree of the polynomial
+  long k;          // the number of baby steps (powers of X)
+  long n;          // ceil(degree/k)
+  long nGiant;     // the number of giant steps (powers of X^k)
+  long nLevels;    // the predicted multiplicative depth
+  ZZ constTerm;    // the free term, used when degree<1
+  ZZ top;          // the result of the recursion is multiplied by top
+  ZZ extra;        // extra!=0 denotes an added term extra*X^{n*k}
+  vector<long> babyNeed, giantNeed; // the powers that are used
+  shared_ptr<PolyEvalNode> root;    // the tree of the recursion
+
+  void evalPowers(Ctxt& ret, DynamicCtxtPowers& babyStep,
+                  DynamicCtxtPowers& giantStep, bool par) const;
+
+  friend void polyEvalMany(vector<Ctxt>& out, const vector<ZZX>& polys,
+                           const Ctxt& x, long k);
+public:
+  //! @param poly      the polynomial to evaluate
+  //! @param ptxtSpace the plaintext space of the inputs
+  //! @param k         optional optimization parameter, as in polyEval
+  PolyEvalPlan(const ZZX& poly, long ptxtSpace, long k=0);
+
+  long getPtxtSpace() const { return ptxtSpace; }
+  long getBabySteps() const { return k; }
+
+  //! @brief The number of levels that evaluating the plan consumes, namely
+  //! the multiplicative depth of the computation. This is known before
+  //! anything is evaluated, so callers can check that the input has
+  //! enough levels (or bootstrap it first). The findBaseLevel() of the
+  //! result is at most that of the input minus levelsConsumed(), and at
+  //! least that minus one more level, which accounts for the noise that
+  //! the multiplications by the scalar coefficients and the additions of
+  //! the blocks add.
+  long levelsConsumed() const { return nLevels; }
+
+  //! @brief ret = poly(x), where ret may alias x. The powers of x are
+  //! computed level by level in parallel, and the blocks of the recursion
+  //! are evaluated concurrently.
+  void eval(Ctxt& ret, const Ctxt& x) const;
+
+  //! @brief Replace each v[i] by poly(v[i]), the ciphertexts are processed
+  //! in parallel
+  void apply(vector<Ctxt>& v) const;
+};
+
+#endif // _POLY_EVAL_H_
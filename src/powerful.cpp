@@ -259,22 +259,45 @@ void PowerfulDCRT::dcrtToPowerful(Vec<ZZ>& out, const DoubleCRT& dcrt) const
     clear(out);
     return;
   }
-  zz_pBak bak; bak.save(); // backup NTL's current modulus
+  Vec< Vec<long> > rows;
+  dcrtToPowerful(rows, dcrt);
 
   ZZ product = conv<ZZ>(1L);
-  for (long i = set.first(); i <= set.last(); i = set.next(i)) {
-    pConvVec[i].restoreModulus();
+  long j = 0;
+  for (long i = set.first(); i <= set.last(); i = set.next(i), j++) {
+    long newPrime = context.ithPrime(i);
+    if (j == 0) // just copy
+      conv(out, rows[j]);
+    else        // CRT
+      intVecCRT(out, product, rows[j], newPrime); // in NumbTh
+    product *= newPrime;
+  }
+}
+
+void PowerfulDCRT::dcrtToPowerful(Vec< Vec<long> >& rows,
+				  const DoubleCRT& dcrt) const
+{
+  const IndexSet& set = dcrt.getIndexSet();
+  long k = card(set);
+  Vec<long> ivec(INIT_SIZE, k);
+  for (long i = set.first(), j = 0; i <= set.last(); i = set.next(i), j++)
+    ivec[j] = i;
+
+  rows.SetLength(k);
+  FHE_EXEC_INDEX(k, j)
+    zz_pBak bak; bak.save(); // backup this thread's NTL modulus
+    long i = ivec[j];
     zz_pX oneRowPoly;
-    long newPrime = dcrt.getOneRow(oneRowPoly,i);
+    dcrt.getOneRow(oneRowPoly, i);
 
+    pConvVec[i].restoreModulus();
     HyperCube<zz_p> oneRowPwrfl(indexes.shortSig);
     pConvVec[i].polyToPowerful(oneRowPwrfl, oneRowPoly);
-    if (i == set.first()) // just copy
-      conv(out, oneRowPwrfl.getData());
-    else                  // CRT
-      intVecCRT(out, product, oneRowPwrfl.getData(), newPrime); // in NumbTh
-    product *= newPrime;
-  }
+
+    const Vec<zz_p>& data = oneRowPwrfl.getData();
+    rows[j].SetLength(data.length());
+    for (long h = 0; h < data.length(); h++) rows[j][h] = rep(data[h]);
+  FHE_EXEC_INDEX_END
 }
 
 void PowerfulDCRT::powerfulToDCRT(DoubleCRT& dcrt, const Vec<ZZ>& in) const
@@ -308,32 +331,54 @@ void PowerfulDCRT::ZZXtoPowerful(Vec<ZZ>& out, const ZZX& poly,
   }
 }
 
-//FIXME: both the reduction from powerful to the individual primes and
-//  the CRT back to poly can be made more efficient
-void PowerfulDCRT::powerfulToZZX(ZZX& poly, const Vec<ZZ>& powerful,
-				 IndexSet set) const
+// The conversion to a polynomial is done for all the primes in parallel,
+// followed by the CRT. FIXME: the CRT back to poly can be made more efficient
+template<class T>
+static void powerfulToZZX(ZZX& poly, const T& powerful,
+			  const Vec<PowerfulConversion>& pConvVec,
+			  const PowerfulTranslationIndexes& indexes,
+			  IndexSet set)
 {
   zz_pBak bak; bak.save(); // backup NTL's current modulus
 
   if (empty(set)) set = IndexSet(0, pConvVec.length()-1);
 
-  clear(poly);
-  //  poly.SetLength(powerful.length());
-  ZZ product = conv<ZZ>(1L);
-  for (long i = set.first(); i <= set.last(); i = set.next(i)) {
-    pConvVec[i].restoreModulus();
-    //    long newPrime = zz_p::modulus();
+  long k = card(set);
+  Vec<long> ivec(INIT_SIZE, k);
+  for (long i = set.first(), j = 0; i <= set.last(); i = set.next(i), j++)
+    ivec[j] = i;
+
+  Vec<zz_pX> rowPolys(INIT_SIZE, k);
+  FHE_EXEC_INDEX(k, j)
+    zz_pBak bak1; bak1.save(); // backup this thread's NTL modulus
+    pConvVec[ivec[j]].restoreModulus();
 
     HyperCube<zz_p> oneRowPwrfl(indexes.shortSig);
     conv(oneRowPwrfl.getData(), powerful); // reduce and convert to Vec<zz_p>
+    pConvVec[ivec[j]].powerfulToPoly(rowPolys[j], oneRowPwrfl);
+  FHE_EXEC_INDEX_END
 
-    zz_pX oneRowPoly;
-    pConvVec[i].powerfulToPoly(oneRowPoly, oneRowPwrfl);
-    CRT(poly, product, oneRowPoly);                   // NTL :-)
+  clear(poly);
+  ZZ product = conv<ZZ>(1L);
+  for (long j = 0; j < k; j++) {
+    pConvVec[ivec[j]].restoreModulus();
+    CRT(poly, product, rowPolys[j]);                   // NTL :-)
   }
   poly.normalize();
 }
 
+void PowerfulDCRT::powerfulToZZX(ZZX& poly, const Vec<ZZ>& powerful,
+				 IndexSet set) const
+{
+  ::powerfulToZZX(poly, powerful, pConvVec, indexes, set);
+}
+
+void PowerfulDCRT::powerfulToZZX(ZZX& poly, const Vec<long>& powerful,
+				 IndexSet set) const
+{
+  ::powerfulToZZX(poly, powerful, pConvVec, indexes, set);
+}
+
 /********************************************************************/
 /****************    UNUSED CODE - COMMENTED OUT   ******************/
 /********************************************************************/
@@ -135,11 +135,18 @@ public:
   void dcrtToPowerful(Vec<ZZ>& powerful, const DoubleCRT& dcrt) const;
   void powerfulToDCRT(DoubleCRT& dcrt, const Vec<ZZ>& powerful) const;
 
+  //! The powerful representation modulo each prime of dcrt, without CRT:
+  //! rows[j] is modulo the j'th prime of dcrt.getIndexSet(), with entries
+  //! in [0,q_j). The primes are converted in parallel.
+  void dcrtToPowerful(Vec< Vec<long> >& rows, const DoubleCRT& dcrt) const;
+
   // If the IndexSet is omitted, default to all the primes in the chain
   void ZZXtoPowerful(Vec<ZZ>& powerful, const ZZX& poly,
 		     IndexSet s=IndexSet::emptySet()    ) const;
   void powerfulToZZX(ZZX& poly, const Vec<ZZ>& powerful,
 		     IndexSet s=IndexSet::emptySet()    ) const;
+  void powerfulToZZX(ZZX& poly, const Vec<long>& powerful,
+		     IndexSet s=IndexSet::emptySet()    ) const;
 };
 
 
@@ -9,7 +9,7 @@
  * See the License for the specific language governing permissions and
  * limitations under the License. See accompanying LICENSE file.
  */
-#include <NTL/BasicThreadPool.h>
+#include "multicore.h"
 
 #include "recryption.h"
 #include "EncryptedArray.h"
@@ -422,7 +422,7 @@ void extractDigitsPacked(Ctxt& ctxt, long botHigh, long r, long ePrime,
     FHE_NTIMER_START(unpack2);
     vector<Ctxt> frob(d, Ctxt(ZeroCtxtLike, ctxt));
 
-    NTL_EXEC_RANGE(d, first, last)
+    FHE_EXEC_RANGE(d, first, last)
     // FIXME: implement using hoisting!
         for (long j = first; j < last; j++) { // process jth Frobenius 
           frob[j] = ctxt;
@@ -430,7 +430,7 @@ void extractDigitsPacked(Ctxt& ctxt, long botHigh, long r, long ePrime,
           frob[j].cleanUp();
           // FIXME: not clear if we should call cleanUp here
         }
-    NTL_EXEC_RANGE_END
+    FHE_EXEC_RANGE_END
 
     FHE_NTIMER_STOP(unpack2);
 
@@ -463,7 +463,7 @@ void extractDigitsPacked(Ctxt& ctxt, long botHigh, long r, long ePrime,
 
   FHE_NTIMER_START(extractDigits);
 
-  NTL_EXEC_RANGE(d, first, last)
+  FHE_EXEC_RANGE(d, first, last)
       for (long i = first; i < last; i++) {
         vector<Ctxt> scratch;
     
@@ -503,7 +503,7 @@ void extractDigitsPacked(Ctxt& ctxt, long botHigh, long r, long ePrime,
         }
         unpacked[i].reducePtxtSpace(p2r); // Our plaintext space is now mod p^r
       }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
 
   FHE_NTIMER_STOP(extractDigits);
 
@@ -10,9 +10,12 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 
+#include <NTL/BasicThreadPool.h>
+#include "multicore.h"
 #include "replicate.h"
 #include "timing.h"
 #include "cloned_ptr.h"
+#include "matmul.h"
 
 
 
@@ -269,16 +272,6 @@ void SelectRangeDim(const EncryptedArray& ea, ZZX& mask, long lo, long hi,
   ea.encode(mask, maskArray);
 }
 
-// selects range of slots [lo..hi)
-static
-void SelectRangeDim(const EncryptedArray& ea, Ctxt& ctxt, long lo, long hi,
-                    long d)
-{
-  ZZX mask;
-  SelectRangeDim(ea, mask, lo, hi, d);
-  ctxt.multByConstant(mask);
-}
-
 // replicateOneBlock: assumes that all slots are zero, except for one
 // "block" whose coordinates in dimension d lie in the interval
 //            [ pos*blockSize .. pos*(blockSize+1) -1 ]
@@ -324,11 +317,141 @@ static void replicateOneBlock(const EncryptedArray& ea, Ctxt& ctxt,
   }
 }
 
+// The size 2^k of the blocks that replicateAllNextDim uses in dimension d,
+// where dimProd is the product of all dimensions up to and including d.
+// The logic below cut the recursion depth by starting from smaller
+// blocks (by default size approx n rather than 2^n).
+// The inital block size is controlled by the recBound parameter:
+//   + recBound>0: blocks of size min(~n, 2^recBound). this ensures
+//     recursion depth <= recBound, and typically much smaller (~log n)
+//   + recBound=0: blocks of size 1 (no recursion)
+//   + recBound<0: blocks of size 2^n (full recursion)
+static
+long replicateBlockBits(const EncryptedArray& ea, long d, long dimProd,
+                        long recBound)
+{
+  long dSize = ea.sizeOfDimension(d);
+  long n = GreatestPowerOfTwo(dSize); // 2^n <= dSize
+  long k = n;
+
+  if (recBound >= 0) { // use heuristic recursion bound
+    k = 0;
+    if (dSize > 2 && dimProd*NumBits(dSize) > ea.size() / 8) {
+      k = NumBits(NumBits(dSize))-1;
+      if (k > n) k = n;
+      if (k > recBound) k = recBound;
+    }
+  }
+  else { // SHAI: I don't understand this else case
+    k = -recBound;
+    if (k > n) k = n;
+  }
+  return k;
+}
+
+// Returns a mask as a DoubleCRT object, rotated by amt along dimension d.
+// The rotation is the same automorphism that rotate1D applies to a
+// ciphertext with the don't-care flag set, hence rot(c*mask)=rot(c)*rot(mask)
+static
+DoubleCRT* rotatedMaskDim(const EncryptedArray& ea, const ZZX& mask,
+                          long d, long amt)
+{
+  DoubleCRT* dcrt = new DoubleCRT(mask, ea.getContext());
+  amt %= ea.sizeOfDimension(d);
+  if (amt != 0) dcrt->automorph(ea.getPAlgebra().genToPow(d, amt));
+  return dcrt;
+}
+
+// Rotate by amt along dimension d (with the don't-care flag), using the
+// pre-computed digits of the ciphertext. The result still includes the
+// special primes, so it should be multiplied by a mask before cleanUp().
+static
+shared_ptr<Ctxt> hoistedRotate1D(const EncryptedArray& ea,
+                                 const BasicAutomorphPrecon& precon,
+                                 long d, long amt)
+{
+  amt %= ea.sizeOfDimension(d);
+  return precon.automorph(ea.getPAlgebra().genToPow(d, amt));
+}
+
+// Generate all the masks that replicateAll may need (those that are not
+// there already), so that the replication itself only reads the tables
+// and can be run by several threads.
+static
+void buildRepMasks(const EncryptedArray& ea, long recBound, RepAuxDim& repAux)
+{
+  FHE_TIMER_START;
+  long nSlots = ea.size();
+  long dimProd = 1;
+  for (long d = 0; d < ea.dimension(); d++) {
+    long dSize = ea.sizeOfDimension(d);
+    dimProd *= dSize;
+
+    long k = replicateBlockBits(ea, d, dimProd, recBound);
+    long blockSize = 1L << k;
+    long numBlocks = dSize/blockSize;
+    long extent = numBlocks * blockSize;
+
+    if (extent < dSize) { // masks for the leftover slots
+      if (repAux.tab1(d, 0).null()) {
+        ZZX mask;
+        SelectRangeDim(ea, mask, 0, extent, d);
+        repAux.tab1(d, 0).set_ptr(new DoubleCRT(mask, ea.getContext()));
+      }
+      if (repAux.tab1(d, 1).null()) {
+        ZZX mask;
+        SelectRangeDim(ea, mask, extent, dSize, d);
+        repAux.tab1(d, 1).set_ptr(new DoubleCRT(mask, ea.getContext()));
+      }
+      if (repAux.tab(d, 0).null()) {
+        ZZX mask;
+        SelectRangeDim(ea, mask, 0, dSize - extent, d);
+        repAux.tab(d, 0).set_ptr(new DoubleCRT(mask, ea.getContext()));
+      }
+    }
+
+    // The masks for the recursion levels j=0..k-1: tab(d, j+1) selects
+    // the slots with bit j of the coordinate equal to zero, tab2(d, 2j)
+    // is the same mask rotated by 2^j, and tab2(d, 2j+1) is its complement
+    // rotated by -2^j
+    for (long j = 0; j < k; j++) {
+      if (!repAux.tab(d, j+1).null() && !repAux.tab2(d, 2*j).null()
+          && !repAux.tab2(d, 2*j+1).null()) continue;
+
+      vector< long > maskArray(nSlots,0);
+      for (long i = 0; i < nSlots; i++) {
+        long c = ea.coordinate(d, i);
+        if (c < extent && bit(c, j) == 0)
+          maskArray[i] = 1;
+      }
+      ZZX mask;
+      ea.encode(mask, maskArray);
+      repAux.tab(d, j+1).set_ptr(new DoubleCRT(mask, ea.getContext()));
+      repAux.tab2(d, 2*j).set_ptr(rotatedMaskDim(ea, mask, d, 1L << j));
+      repAux.tab2(d, 2*j+1).set_ptr(rotatedMaskDim(ea, 1 - mask, d,
+                                                   -(1L << j)));
+    }
+
+    // The masks selecting each block, pre-rotated to position 0 if the
+    // block needs to be moved there
+    if (numBlocks > 1) {
+      bool rotateBlocks = (!ea.nativeDimension(d) || dSize % blockSize != 0);
+      for (long pos = 0; pos < numBlocks; pos++) {
+        if (!repAux.tab3(d, pos).null()) continue;
+        ZZX mask;
+        SelectRangeDim(ea, mask, pos*blockSize, (pos+1)*blockSize, d);
+        long amt = (rotateBlocks)? -pos*blockSize : 0;
+        repAux.tab3(d, pos).set_ptr(rotatedMaskDim(ea, mask, d, amt));
+      }
+    }
+  }
+}
+
 // forward declaration...mutual recursion
 static
 void replicateAllNextDim(const EncryptedArray& ea, const Ctxt& ctxt,
-                         long d, long dimProd, long recBound,
-                         RepAuxDim& repAux, ReplicateHandler *handler);
+                         long d, long dimProd, long recBound, long prefix,
+                         const RepAuxDim& repAux, ReplicateHandler *handler);
 
 
 
@@ -337,17 +460,18 @@ void replicateAllNextDim(const EncryptedArray& ea, const Ctxt& ctxt,
 //   ea.sizeOfDimension(d)/2 <= extent <= ea.sizeOfDimension(d),
 //     only positions [0..extent) are non-zero
 //   1 <= 2^k <= extent: size of current interval
-//   0 <= pos < ea.sizeOfDimension(d): relative position of first vector
+//   0 <= pos < ea.sizeOfDimension(d): coordinate of first vector
 //   0 <= limit < ea.sizeOfDimension(): max # of positions to process
 //   dimProd: product of dimensions 0..d
-//   recBound: recursion bound (controls noise) 
+//   recBound: recursion bound (controls noise)
+//   prefix: the index of the coordinates in dimensions 0..d-1
 //
 // SHAI: limit and extent are always the same, it seems
 static
-void recursiveReplicateDim(const EncryptedArray& ea, const Ctxt& ctxt, 
-                           long d, long extent, long k, long pos, long limit,  
-                           long dimProd, long recBound,
-                           RepAuxDim& repAux,
+void recursiveReplicateDim(const EncryptedArray& ea, const Ctxt& ctxt,
+                           long d, long extent, long k, long pos, long limit,
+                           long dimProd, long recBound, long prefix,
+                           const RepAuxDim& repAux,
                            ReplicateHandler *handler)
 {
   if (pos >= limit) return;
@@ -355,106 +479,98 @@ void recursiveReplicateDim(const EncryptedArray& ea, const Ctxt& ctxt,
   if (replicateVerboseFlag) { // DEBUG code
     cerr << "check: " << k; CheckCtxt(ctxt, "");
   }
-  
+
   long dSize = ea.sizeOfDimension(d);
-  long nSlots = ea.size();
 
   if (k == 0) { // last level in this dimension: blocks of size 2^k=1
 
     if ( extent >= dSize) { // nothing to do in this dimension
-      replicateAllNextDim(ea, ctxt, d+1, dimProd, recBound, repAux, handler);
+      replicateAllNextDim(ea, ctxt, d+1, dimProd, recBound, prefix*dSize+pos,
+                          repAux, handler);
       return;
     } // SHAI: Will we ever have extent > dSize??
 
     // need to replicate to fill positions [ (1L << n) .. dSize-1 ]
-
-    if (repAux.tab(d,0).null()) { // generate mask if not there already
-      ZZX mask;
-      SelectRangeDim(ea, mask, 0, dSize - extent, d);
-      repAux.tab(d, 0).set_ptr(new DoubleCRT(mask, ea.getContext()));
-    }
-
     Ctxt ctxt_tmp = ctxt;
-    ctxt_tmp.multByConstant(*repAux.tab(d, 0));
+    ctxt_tmp.multByConstant(repAux.tab(d, 0));
 
     ea.rotate1D(ctxt_tmp, d, extent, /*don't-care-flag=*/true);
     ctxt_tmp += ctxt;
-    replicateAllNextDim(ea, ctxt_tmp, d+1, dimProd, recBound, repAux, handler);
+    replicateAllNextDim(ea, ctxt_tmp, d+1, dimProd, recBound,
+                        prefix*dSize+pos, repAux, handler);
     return;
   }
 
   // If we need to stop early, call the handler
   if (handler->earlyStop(d, k, dimProd)) {
-    handler->handle(ctxt);
+    handler->handleSlot(ctxt, (prefix*dSize+pos) * (ea.size()/dimProd));
     return;
   }
 
   k--;
+  long shift = 1L << k;
+  bool doRight = (pos + shift < limit);
+
+  // The two halves are left  = ctxt*M     + rot(ctxt*M,      2^k)
+  //               and right = ctxt*(1-M) + rot(ctxt*(1-M), -2^k).
+  // Since rot(ctxt*M) = rot(ctxt)*rot(M), both rotations are applied to
+  // the same ciphertext, so they share one hoisted decomposition of ctxt,
+  // and the rotated masks are pre-computed in repAux.
   Ctxt ctxt_masked = ctxt;
+  ctxt_masked.multByConstant(repAux.tab(d, k+1));
+  BasicAutomorphPrecon precon(ctxt);
 
-  {   // artificial scope to miminize storage in the recursion
-    { // another artificial scope (SHAI: this seems redundant)
+  long nThreads = 1;
+  if (doRight && handler->concurrent())
+    nThreads = std::min(numFHEthreads(), 2L);
 
-      // generate mask at index k+1, if not there yet
-
-      if (repAux.tab(d, k+1).null()) { // need to generate
-        vector< long > maskArray(nSlots,0);
-        for (long i = 0; i < nSlots; i++) {
-          long c = ea.coordinate(d, i);
-          if (c < extent && bit(c, k) == 0)
-            maskArray[i] = 1;
-        }
-	// store this mask in the repAux table
-        ZZX mask;
-        ea.encode(mask, maskArray);
-        repAux.tab(d, k+1).set_ptr(new DoubleCRT(mask, ea.getContext()));
+  FHE_EXEC_INDEX(nThreads, index)   // process the two halves in parallel
+  switch (index) {
+  case 0: {
+    Ctxt ctxt_left = ctxt_masked;
+    {
+      shared_ptr<Ctxt> tmp = hoistedRotate1D(ea, precon, d, shift);
+      tmp->multByConstant(repAux.tab2(d, 2*k));
+      tmp->cleanUp();
+      ctxt_left += *tmp;
+    }
+    recursiveReplicateDim(ea, ctxt_left, d, extent, k, pos, limit,
+                          dimProd, recBound, prefix, repAux, handler);
+    if (nThreads>1) break;
+  }
+  default:
+    if (doRight) {
+      Ctxt ctxt_right = ctxt;
+      ctxt_right -= ctxt_masked;
+      {
+        shared_ptr<Ctxt> tmp = hoistedRotate1D(ea, precon, d, -shift);
+        tmp->multByConstant(repAux.tab2(d, 2*k+1));
+        tmp->cleanUp();
+        ctxt_right += *tmp;
       }
-
-      // Apply mask to zero out slots in ctxt
-      ctxt_masked.multByConstant(*repAux.tab(d, k+1));
+      recursiveReplicateDim(ea, ctxt_right, d, extent, k, pos+shift, limit,
+                            dimProd, recBound, prefix, repAux, handler);
     }
-
-    Ctxt ctxt_left = ctxt_masked;
-    ea.rotate1D(ctxt_left, d, 1L << k, /*don't-care-flag=*/true);
-    ctxt_left += ctxt_masked;
-
-    recursiveReplicateDim(ea, ctxt_left, d, extent, k, pos, limit, 
-                          dimProd, recBound, repAux, handler);
   }
-
-  pos += (1L << k);
-  if (pos >= limit)
-    return;
-
-  Ctxt ctxt_right = ctxt;
-  ctxt_right -= ctxt_masked; 
-  ctxt_masked = ctxt_right; // reuse ctxt_masked as a temp
-  ea.rotate1D(ctxt_masked, d, -(1L << k), /*don't-care-flag=*/true);
-  ctxt_right += ctxt_masked;
-
-  recursiveReplicateDim(ea, ctxt_right, d, extent, k, pos, limit, 
-                        dimProd, recBound, repAux, handler);
+  FHE_EXEC_INDEX_END
 }
 
 void replicateAllNextDim(const EncryptedArray& ea, const Ctxt& ctxt,
-                         long d, long dimProd, long recBound,
-                         RepAuxDim& repAux, ReplicateHandler *handler)
+                         long d, long dimProd, long recBound, long prefix,
+                         const RepAuxDim& repAux, ReplicateHandler *handler)
 
 {
   assert(d >= 0);
 
   // If already fully replicated (or we need to stop early), call the handler
   if (d >= ea.dimension() || handler->earlyStop(d,/*k=*/-1,dimProd)) {
-    handler->handle(ctxt);
+    handler->handleSlot(ctxt, prefix * (ea.size()/dimProd));
     return;
   }
-  
+
   long dSize = ea.sizeOfDimension(d);
   dimProd *= dSize; // product of all dimensions including this one
 
-  long n = GreatestPowerOfTwo(dSize); // 2^n <= dSize
-  long k = n;
-
   // We replicate 2^k-size blocks along this dimension, then call the
   // recursive procedure to handle the smaller subblocks. Consider for
   // example a 2D 5x2 cube, so the original slots are
@@ -472,37 +588,15 @@ void replicateAllNextDim(const EncryptedArray& ea, const Ctxt& ctxt,
   // s0/s1 and s4/s5 to the zero column at the end, then make a recursive
   // call with k=1 that will complete the replication along the current
   // dimension, resulting in the 4 ciphertexts
-  // 
+  //
   //  (s0 s0 s0 s0 s0) (s2 s2 s2 s2 s2) (s4 s4 s4 s4 s4) (s6 s6 s6 s6 s6)
   //  (s1 s1 s1 s1 s1) (s3 s3 s3 s3 s3) (s5 s5 s5 s5 s5) (s7 s7 s7 s7 s7)
   //
   // Then a recursive call for the next dimension will complete the
   // replication of these entries, and a final step will deal with the
   // "leftover" positions s8 s9
-  
-
-
-  // The logic below cut the recursion depth by starting from smaller
-  // blocks (by default size approx n rather than 2^n).
-  // The inital block size is controlled by the recBound parameter:
-  //   + recBound>0: blocks of size min(~n, 2^recBound). this ensures
-  //     recursion depth <= recBound, and typically much smaller (~log n)
-  //   + recBound=0: blocks of size 1 (no recursion)
-  //   + recBound<0: blocks of size 2^n (full recursion)
-
-  if (recBound >= 0) { // use heuristic recursion bound
-    k = 0;
-    if (dSize > 2 && dimProd*NumBits(dSize) > ea.size() / 8) {
-      k = NumBits(NumBits(dSize))-1;
-      if (k > n) k = n;
-      if (k > recBound) k = recBound;
-    }
-  }
-  else { // SHAI: I don't understand this else case
-    k = -recBound;
-    if (k > n) k = n;
-  }
 
+  long k = replicateBlockBits(ea, d, dimProd, recBound);
   long blockSize = 1L << k;        // blocks of size 2^k
   long numBlocks = dSize/blockSize;
   long extent = numBlocks * blockSize;
@@ -513,59 +607,74 @@ void replicateAllNextDim(const EncryptedArray& ea, const Ctxt& ctxt,
 
   Ctxt ctxt1 = ctxt;
 
-  if (extent < dSize) { // select only the slots 0..extent-1 in this dimension
-    if (repAux.tab1(d, 0).null()) { // generate mask if not already there
-      ZZX mask;
-      SelectRangeDim(ea, mask, 0, extent, d);
-      repAux.tab1(d, 0).set_ptr(new DoubleCRT(mask, ea.getContext()));
-      // store mask in 2nd table (tab1)
-    }
-    ctxt1.multByConstant(*repAux.tab1(d, 0)); // mult by mask to zero out slots
-  }
-
-  if (numBlocks == 1) { // just one block, call the recursive replication
-    recursiveReplicateDim(ea, ctxt1, d, extent, k, 0, extent, 
-                          dimProd, recBound, repAux, handler);
-  }
-  else { // replicate the slots in each block separately
-    for (long pos = 0; pos < numBlocks; pos++) {
-      Ctxt ctxt2 = ctxt1;
-      // zero-out all the slots outside the current block
-      SelectRangeDim(ea, ctxt2, pos*blockSize, (pos+1)*blockSize, d);
-
-      // replicate the current block across this dimenssion using a
+  if (extent < dSize) // select only the slots 0..extent-1 in this dimension
+    ctxt1.multByConstant(repAux.tab1(d, 0)); // mult by mask to zero out slots
+
+  // Each block is cut from ctxt1 and moved to position 0 (when needed).
+  // Since rot(ctxt1*mask) = rot(ctxt1)*rot(mask), all these rotations are
+  // applied to ctxt1 itself, so they share one hoisted decomposition.
+  bool rotateBlocks = (numBlocks > 1) &&
+    (!ea.nativeDimension(d) || dSize % blockSize != 0);
+  shared_ptr<BasicAutomorphPrecon> precon;
+  if (rotateBlocks) precon = make_shared<BasicAutomorphPrecon>(ctxt1);
+
+  // The blocks and the leftover slots are processed as independent tasks,
+  // in parallel if the handler allows it and in order otherwise
+  long nTasks = numBlocks + ((extent < dSize)? 1 : 0);
+  long nThreads = handler->concurrent()? numFHEthreads() : 1;
+  PartitionInfo pinfo(nTasks, nThreads);
+  long cnt = pinfo.NumIntervals();
+
+  FHE_EXEC_INDEX(cnt, index)
+  long first, last;
+  pinfo.interval(first, last, index);
+
+  for (long pos = first; pos < last; pos++) {
+    if (pos == numBlocks) {
+      // If dSize is not an integral number of blocks, then we still need
+      // to deal with the leftover slots.
+
+      // zero-out the slots from before, leaving only the leftover slots
+      Ctxt ctxt2 = ctxt;
+      ctxt2.multByConstant(repAux.tab1(d,1)); // mult by mask to zero out slots
+
+      // move relevant slots to the beginning
+      ea.rotate1D(ctxt2, d, -extent, /*don't-care-flag=*/true);
+
+      // replicate the leftover block across this dimenssion using a
       // simple shift-and-add procedure.
-      replicateOneBlock(ea, ctxt2, pos, blockSize, d);
+      replicateOneBlock(ea, ctxt2, 0, blockSize, d);
 
       // now call the recursive replication to do the rest of the work
-      recursiveReplicateDim(ea, ctxt2, d, extent, k, 0, extent, 
-                            dimProd, recBound, repAux, handler);
+      recursiveReplicateDim(ea, ctxt2, d, extent, k, extent, dSize,
+                            dimProd, recBound, prefix, repAux, handler);
     }
-  }
-
-  // If dSize is not an integral number of blocks, then we still need
-  // to deal with the leftover slots.
-  if (extent < dSize) {
-    // zero-out the slots from before, leaving only the leftover slots
-    ctxt1 = ctxt;
-    if (repAux.tab1(d, 1).null()) { // generate mask if not already there
-      ZZX mask;
-      SelectRangeDim(ea, mask, extent, dSize, d);
-      repAux.tab1(d, 1).set_ptr(new DoubleCRT(mask, ea.getContext()));
+    else if (numBlocks == 1) { // just one block, call the recursive replication
+      recursiveReplicateDim(ea, ctxt1, d, extent, k, 0, extent,
+                            dimProd, recBound, prefix, repAux, handler);
     }
-    ctxt1.multByConstant(*repAux.tab1(d,1)); // mult by mask to zero out slots
-
-    // move relevant slots to the beginning
-    ea.rotate1D(ctxt1, d, -extent, /*don't-care-flag=*/true);
+    else { // replicate the slots in each block separately
+      Ctxt ctxt2(ZeroCtxtLike, ctxt1);
+      if (rotateBlocks && pos != 0)
+        ctxt2 = *hoistedRotate1D(ea, *precon, d, -pos*blockSize);
+      else
+        ctxt2 = ctxt1;
+
+      // zero-out all the slots outside the current block, the mask is
+      // pre-rotated to match the rotation above
+      ctxt2.multByConstant(repAux.tab3(d, pos));
+      ctxt2.cleanUp();
 
-    // replicate the leftover block across this dimenssion using a
-    // simple shift-and-add procedure.
-    replicateOneBlock(ea, ctxt1, 0, blockSize, d);
+      // replicate the current block across this dimenssion using a
+      // simple shift-and-add procedure (the block is already in place).
+      replicateOneBlock(ea, ctxt2, 0, blockSize, d);
 
-    // now call the recursive replication to do the rest of the work
-    recursiveReplicateDim(ea, ctxt1, d, extent, k, extent, dSize, 
-                          dimProd, recBound, repAux, handler);
+      // now call the recursive replication to do the rest of the work
+      recursiveReplicateDim(ea, ctxt2, d, extent, k, pos*blockSize, extent,
+                            dimProd, recBound, prefix, repAux, handler);
+    }
   }
+  FHE_EXEC_INDEX_END
 }
 
 // recBound < 0 => pure recursion
@@ -573,13 +682,14 @@ void replicateAllNextDim(const EncryptedArray& ea, const Ctxt& ctxt,
 // otherwise, a recursion depth is chosen heuristically,
 //   but is capped at recBound
 void
-replicateAll(const EncryptedArray& ea, const Ctxt& ctxt, 
+replicateAll(const EncryptedArray& ea, const Ctxt& ctxt,
 	     ReplicateHandler *handler, long recBound, RepAuxDim* repAuxPtr)
 {
   FHE_TIMER_START;
   RepAuxDim repAux;
   if (repAuxPtr==NULL) repAuxPtr = &repAux;
-  replicateAllNextDim(ea, ctxt, 0, 1, recBound, *repAuxPtr, handler);
+  buildRepMasks(ea, recBound, *repAuxPtr);
+  replicateAllNextDim(ea, ctxt, 0, 1, recBound, 0, *repAuxPtr, handler);
 }
 
 
@@ -590,11 +700,11 @@ replicateAll(const EncryptedArray& ea, const Ctxt& ctxt,
 //! it would take a lot of memory.
 class ExplicitReplicator : public ReplicateHandler {
   std::vector<Ctxt>& v; // space to store all cipehrtexts
-  long slot;
 public:
   // _v must already be of the right size (=number-of-slots)
-  ExplicitReplicator(std::vector<Ctxt>& _v): v(_v),slot(0) {}
-  virtual void handle(const Ctxt& ctxt) { v[slot++] = ctxt; }
+  ExplicitReplicator(std::vector<Ctxt>& _v): v(_v) {}
+  void handleSlot(const Ctxt& ctxt, long slot) override { v.at(slot) = ctxt; }
+  bool concurrent() const override { return true; }
 };
 
 // Returns the result as a vector of ciphertexts
@@ -56,6 +56,18 @@ public:
   virtual void handle(const Ctxt& ctxt) {}
   virtual ~ReplicateHandler() {}
 
+  //! @brief Called by replicateAll for every output ciphertext, slot is
+  //! the index of the (first) slot whose content is replicated in ctxt.
+  //! The default implementation ignores the index and calls handle(ctxt).
+  virtual void handleSlot(const Ctxt& ctxt, long slot) { handle(ctxt); }
+
+  //! @brief If this returns true then replicateAll processes independent
+  //! parts of the replication tree in parallel, and handleSlot and
+  //! earlyStop may be called concurrently from several threads and in
+  //! an arbitrary order. Otherwise (the default) they are called one at
+  //! a time, with the slots in order.
+  virtual bool concurrent() const { return false; }
+
   // The earlyStop call can be used to quit the replication mid-way, leaving
   // a ciphertext with (e.g.) two different entries, each replicated n/2 times
   virtual bool earlyStop(long d, long k, long prodDim) { return false; }
@@ -80,6 +92,12 @@ public:
  * based only on the heuristic, which will introduce noise corresponding to
  * O(log log n) levels of recursion, but still gives an algorithm that
  * theoretically runs in time O(n).
+ *
+ * The rotations of the same ciphertext in each step of the recursion share
+ * one hoisted key-switching decomposition (see BasicAutomorphPrecon), with
+ * the masks pre-rotated and cached in the RepAuxDim tables. If the handler
+ * is concurrent() then sibling sub-trees of the recursion are processed
+ * in parallel, otherwise the outputs are handled in order.
  **/
 void replicateAll(const EncryptedArray& ea, const Ctxt& ctxt, 
 		  ReplicateHandler *handler, long recBound = 64,
@@ -118,22 +136,34 @@ public:
   }
 };
 
-class RepAuxDim { // two tables per dimension
+class RepAuxDim { // four tables per dimension
 private:
-  vector< vector< copied_ptr<DoubleCRT> > > _tab, _tab1;
+  vector< vector< copied_ptr<DoubleCRT> > > _tab, _tab1, _tab2, _tab3;
 
-public:
-  copied_ptr<DoubleCRT>& tab(long d, long i) {
-    if (d >= lsize(_tab)) _tab.resize(d+1);
-    if (i >= lsize(_tab[d])) _tab[d].resize(i+1);
-    return _tab[d][i];
+  static copied_ptr<DoubleCRT>&
+  entry(vector< vector< copied_ptr<DoubleCRT> > >& t, long d, long i) {
+    if (d >= lsize(t)) t.resize(d+1);
+    if (i >= lsize(t[d])) t[d].resize(i+1);
+    return t[d][i];
   }
 
-  copied_ptr<DoubleCRT>& tab1(long d, long i) {
-    if (d >= lsize(_tab1)) _tab1.resize(d+1);
-    if (i >= lsize(_tab1[d])) _tab1[d].resize(i+1);
-    return _tab1[d][i];
-  }
+public:
+  // masks for the recursion and the leftover slots
+  copied_ptr<DoubleCRT>& tab(long d, long i) { return entry(_tab, d, i); }
+  copied_ptr<DoubleCRT>& tab1(long d, long i) { return entry(_tab1, d, i); }
+
+  // pre-rotated masks for the hoisted rotations: tab2 for the recursion
+  // and tab3 for the blocks of each dimension
+  copied_ptr<DoubleCRT>& tab2(long d, long i) { return entry(_tab2, d, i); }
+  copied_ptr<DoubleCRT>& tab3(long d, long i) { return entry(_tab3, d, i); }
+
+  // Read-only access, the entries must already be there. These are used
+  // by replicateAll after it generated all the masks, so they can be
+  // called concurrently.
+  const DoubleCRT& tab(long d, long i) const { return *_tab.at(d).at(i); }
+  const DoubleCRT& tab1(long d, long i) const { return *_tab1.at(d).at(i); }
+  const DoubleCRT& tab2(long d, long i) const { return *_tab2.at(d).at(i); }
+  const DoubleCRT& tab3(long d, long i) const { return *_tab3.at(d).at(i); }
 };
 //! @endcond
 
@@ -0,0 +1,173 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <cmath>
+#include "rnsDecrypt.h"
+#include "timing.h"
+#include "counters.h"
+
+// The key s^r(X^t) for this handle, over all the primes of the secret key
+std::shared_ptr<const DoubleCRT>
+RNSDecryptor::keyPower(const SKHandle& handle) const
+{
+  KeyIndex idx(handle.getSecretKeyID(), handle.getPowerOfS(),
+               handle.getPowerOfX());
+
+  FHE_MUTEX_GUARD(cacheMx);
+  std::shared_ptr<const DoubleCRT>& entry = keyCache[idx];
+  if (!entry) {
+    FHE_NTIMER_START(rnsDecrypt_keyPower);
+    std::shared_ptr<DoubleCRT> key =
+      std::make_shared<DoubleCRT>(sKey.sKeys.at(handle.getSecretKeyID()));
+    if (handle.getPowerOfX()>1) key->automorph(handle.getPowerOfX());
+    if (handle.getPowerOfS()>1) key->Exp(handle.getPowerOfS());
+    entry = key;
+  }
+  return entry;
+}
+
+void RNSDecryptor::decrypt(zzX& plaintxt, const Ctxt& ciphertxt) const
+{
+  FHE_TIMER_START;
+  const FHEcontext& context = ciphertxt.getContext();
+  assert(&sKey.getContext() == &context);
+  const IndexSet& ptxtPrimes = ciphertxt.getPrimeSet();
+  long t = ciphertxt.getPtxtSpace();
+  assert(t > 1 && t < NTL_SP_BOUND);
+
+  // compute <c,s> over the primes of the ciphertext. The cached keys are
+  // defined over a superset of these, so they are used in place.
+  DoubleCRT ptxt(context, ptxtPrimes); // Set to zero
+  for (long i = 0; i < lsize(ciphertxt.parts); i++) {
+    const CtxtPart& part = ciphertxt.parts[i];
+    if (part.skHandle.isOne()) {
+      ptxt += part;
+      continue;
+    }
+    DoubleCRT tmp(part);
+    tmp.Mul(*keyPower(part.skHandle), /*matchIndexSets=*/false);
+    ptxt += tmp;
+  }
+
+  if (isDryRun()) {
+    FHE_COUNT(FHE_CNT_IFFT, card(ptxtPrimes));
+    for (long i = ptxtPrimes.first(); i <= ptxtPrimes.last();
+         i = ptxtPrimes.next(i))
+      FHE_COUNT_PRIME_NTT(context.ithModulus(i).getCounterSlot(), true, 1);
+    plaintxt.SetLength(0);
+    return;
+  }
+
+  long phim = context.zMStar.getPhiM();
+  long k = card(ptxtPrimes);
+  if (k == 0) {
+    plaintxt.SetLength(0);
+    return;
+  }
+
+  // For each prime q_j: (Q/q_j)^{-1} mod q_j, and (Q/q_j) mod t.
+  // Both are products of single-precision numbers, no need for ZZ.
+  Vec<long> qvec(INIT_SIZE, k), tvec(INIT_SIZE, k), qhatModT(INIT_SIZE, k);
+  Vec<double> qrecip(INIT_SIZE, k);
+  Vec<mulmod_precon_t> tqinv(INIT_SIZE, k);
+  for (long i = ptxtPrimes.first(), j = 0; i <= ptxtPrimes.last();
+       i = ptxtPrimes.next(i), j++) {
+    qvec[j] = context.ithModulus(i).getQ();
+    qrecip[j] = 1/double(qvec[j]);
+  }
+  long qModT = 1;
+  for (long j = 0; j < k; j++) {
+    long q = qvec[j];
+    long inv = 1, hat = 1;
+    for (long l = 0; l < k; l++) if (l != j) {
+      inv = MulMod(inv, qvec[l] % q, q);
+      hat = MulMod(hat, qvec[l] % t, t);
+    }
+    tvec[j] = InvMod(inv, q);
+    tqinv[j] = PrepMulModPrecon(tvec[j], q);
+    qhatModT[j] = hat;
+    qModT = MulMod(qModT, q % t, t);
+  }
+
+  // if t>2, multiply by Q^{-1} mod t, as in FHESecKey::Decrypt
+  long qInvModT = 1;
+  if (t > 2 && qModT != 1) qInvModT = InvMod(qModT, t);
+
+  // back to coefficient representation, mod each q_j separately
+  Vec< Vec<long> > rows(INIT_SIZE, k);
+  { FHE_NTIMER_START(rnsDecrypt_FFT);
+  const IndexMap<vec_long>& map = ptxt.getMap();
+  Vec<long> ivec(INIT_SIZE, k);
+  for (long i = ptxtPrimes.first(), j = 0; i <= ptxtPrimes.last();
+       i = ptxtPrimes.next(i), j++)
+    ivec[j] = i;
+
+  FHE_EXEC_RANGE(k, first, last)
+      zz_pX tmp;
+      tmp.SetMaxLength(phim);
+      for (long j = first; j < last; j++) {
+        context.ithModulus(ivec[j]).iFFT(tmp, map[ivec[j]]);
+        Vec<long>& row = rows[j];
+        row.SetLength(phim);
+        long d = deg(tmp);
+        for (long h = 0; h <= d; h++) row[h] = rep(tmp.rep[h]);
+        for (long h = d+1; h < phim; h++) row[h] = 0;
+      }
+  FHE_EXEC_RANGE_END
+  }
+
+  // x = sum_j y_j*(Q/q_j) - v*Q, with v the rounding of sum_j y_j/q_j,
+  // is the centered representative of <c,s> mod Q; reduce it mod t
+  { FHE_NTIMER_START(rnsDecrypt_CRT);
+  plaintxt.SetLength(phim);
+  FHE_EXEC_RANGE(phim, first, last)
+      for (long h = first; h < last; h++) {
+        double quotient = 0;
+        long acc = 0;
+        for (long j = 0; j < k; j++) {
+          long q = qvec[j];
+          long y = MulModPrecon(rows[j][h], tvec[j], q, tqinv[j]);
+          quotient += y*qrecip[j];
+          acc = AddMod(acc, MulMod(y % t, qhatModT[j], t), t);
+        }
+        long v = long(std::floor(quotient + 0.5));
+        acc = SubMod(acc, MulMod(v % t, qModT, t), t);
+        if (qInvModT != 1) acc = MulMod(acc, qInvModT, t);
+        plaintxt[h] = acc;
+      }
+  FHE_EXEC_RANGE_END
+  }
+
+  long n = phim;
+  while (n > 0 && plaintxt[n-1] == 0) n--;
+  plaintxt.SetLength(n);
+}
+
+void RNSDecryptor::decrypt(ZZX& plaintxt, const Ctxt& ciphertxt) const
+{
+  zzX coeffs;
+  decrypt(coeffs, ciphertxt);
+  plaintxt.SetLength(coeffs.length());
+  for (long i = 0; i < coeffs.length(); i++)
+    conv(plaintxt[i], coeffs[i]);
+  plaintxt.normalize();
+}
+
+void RNSDecryptor::decrypt(vector<ZZX>& plaintxts,
+                           const vector<Ctxt>& ciphertxts) const
+{
+  FHE_TIMER_START;
+  long n = lsize(ciphertxts);
+  plaintxts.resize(n);
+  FHE_EXEC_INDEX(n, i)
+    decrypt(plaintxts[i], ciphertxts[i]);
+  FHE_EXEC_INDEX_END
+}
@@ -0,0 +1,70 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _RNS_DECRYPT_H_
+#define _RNS_DECRYPT_H_
+/**
+ * @file rnsDecrypt.h
+ * @brief Decryption without big-integer arithmetic
+ *
+ * FHESecKey::Decrypt prepares the key for each ciphertext part anew
+ * (automorphism and power), and then converts <c,s> from DoubleCRT to a ZZX
+ * by a full CRT reconstruction, only to reduce it mod p^r. An RNSDecryptor
+ * keeps the key powers s^r(X^t) that it needs as DoubleCRTs, and computes
+ * [<c,s>]_Q mod p^r directly from the residues mod the q_i, with word-size
+ * arithmetic only: writing x = sum_i y_i*(Q/q_i) with y_i = x_i*(Q/q_i)^{-1}
+ * mod q_i, the centered representative of x mod Q is x - v*Q where v is the
+ * rounding of sum_i y_i/q_i, which is computed in floating point. Hence
+ * x mod t = sum_i y_i*((Q/q_i) mod t) - v*(Q mod t) mod t.
+ *
+ * The result is the same as that of FHESecKey::Decrypt, as long as the
+ * noise is small enough for decryption to succeed at all.
+ **/
+#include <map>
+#include <memory>
+#include <tuple>
+#include "FHE.h"
+#include "multicore.h"
+
+class RNSDecryptor {
+  const FHESecKey& sKey;
+
+  // s^r(X^t) over all the primes, indexed by (keyID, r, t)
+  typedef std::tuple<long,long,long> KeyIndex;
+  mutable std::map< KeyIndex, std::shared_ptr<const DoubleCRT> > keyCache;
+  mutable FHE_MUTEX_TYPE cacheMx;
+
+  RNSDecryptor(const RNSDecryptor&); // disable copying
+  RNSDecryptor& operator=(const RNSDecryptor&);
+
+  std::shared_ptr<const DoubleCRT> keyPower(const SKHandle& handle) const;
+
+public:
+  explicit RNSDecryptor(const FHESecKey& _sKey): sKey(_sKey) {}
+
+  //! The coefficients of the plaintext, in [0, ptxtSpace-1]
+  void decrypt(zzX& plaintxt, const Ctxt& ciphertxt) const;
+
+  //! Same as FHESecKey::Decrypt(plaintxt, ciphertxt)
+  void decrypt(ZZX& plaintxt, const Ctxt& ciphertxt) const;
+
+  //! Decrypt many ciphertexts, in parallel
+  void decrypt(vector<ZZX>& plaintxts, const vector<Ctxt>& ciphertxts) const;
+
+  //! Drop the cached key powers, should be called if sKey is modified
+  void clear()
+  {
+    FHE_MUTEX_GUARD(cacheMx);
+    keyCache.clear();
+  }
+};
+
+#endif // _RNS_DECRYPT_H_
@@ -19,6 +19,7 @@
 #include <cstdlib>
 #include <stdexcept>
 #include <NTL/BasicThreadPool.h>
+#include "multicore.h"
 #include "intraSlot.h"
 #include "tableLookup.h"
 
@@ -83,10 +84,10 @@ void tableLookup(Ctxt& out, const vector<zzX>& table, const CtPtrs& idx,
   computeAllProducts(pWrap, idx, unpackSlotEncoding);
 
   // Compute the sum b_i * T[i]
-  NTL_EXEC_RANGE(lsize(table), first, last)
+  FHE_EXEC_RANGE(lsize(table), first, last)
   for(long i=first; i<last; i++)
     products[i].multByConstant(table[i]); // p[i] = p[i]*T[i]
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
   for(long i=0; i<lsize(table); i++)
     out += products[i];
 }
@@ -108,10 +109,10 @@ void tableWriteIn(const CtPtrs& table, const CtPtrs& idx,
   computeAllProducts(pWrap, idx, unpackSlotEncoding);
 
   // incrememnt each entry of T[i] by products[i]
-  NTL_EXEC_RANGE(lsize(table), first, last)
+  FHE_EXEC_RANGE(lsize(table), first, last)
   for(long i=first; i<last; i++)
     *table[i] += products[i];
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
 }
 
 // The function buildLookupTable is documented in tableLookup.h.
@@ -239,14 +240,14 @@ recursiveProducts(const CtPtrs& products, const CtPtrs_slice& array)
     recursiveProducts(CtPtrs_vectorCt(products2), CtPtrs_slice(array,n1,nBits-n1));
 
     // multiplication to get all subset products
-    NTL_EXEC_RANGE(lsize(products), first, last)
+    FHE_EXEC_RANGE(lsize(products), first, last)
     for(long ii=first; ii<last; ii++) {
       long j = ii / k;
       long i = ii - j*k;
       *products[ii] = products1[i];
       products[ii]->multiplyBy(products2[j]);
     }
-    NTL_EXEC_RANGE_END
+    FHE_EXEC_RANGE_END
   }
 }
 
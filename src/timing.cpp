@@ -13,6 +13,7 @@
 #include <utility>
 #include <cstring>
 #include <ctime>
+#include <memory>
 #include "timing.h"
 
 #ifdef CLOCK_MONOTONIC
@@ -56,38 +57,55 @@ bool timer_compare(const FHEtimer *a, const FHEtimer *b)
 
 static vector<FHEtimer *> timerMap;
 static FHE_MUTEX_TYPE timerMapMx;
+static long numTimers = 0; // the ids that were given so far
+
+// The totals of the flat timers are kept per thread in blocks of
+// FHE_TIMER_BLOCK timers, allocated as they are first used
+#define FHE_TIMER_BLOCK  256
+#define FHE_TIMER_BLOCKS 256
 
 void registerTimer(FHEtimer *timer)
 {
   FHE_MUTEX_GUARD(timerMapMx);
+  if (numTimers >= FHE_TIMER_BLOCK*FHE_TIMER_BLOCKS)
+    Error("registerTimer: too many timers");
+  timer->id = numTimers++;
   timerMap.push_back(timer);
 }
 
+// The totals of all the threads are kept with their profiles below
+static void sumTimerTotals(const FHEtimer *timer,
+                           unsigned long& time, long& calls);
+static void resetTimerTotals(const FHEtimer *timer);
+
 // Reset a timer for some label to zero
 void FHEtimer::reset()
 {
-  numCalls = 0;
-  counter = 0;
+  resetTimerTotals(this);
 }
 
 
 // Read the value of a timer (in seconds)
 double FHEtimer::getTime() const // returns time in seconds
 {
-  // If the counter is currently counting, add the clock() value
-  return ((double)counter)/CLOCK_SCALE;
+  unsigned long time;
+  long calls;
+  sumTimerTotals(this, time, calls);
+  return ((double)time)/CLOCK_SCALE;
 }
 
 // Returns number of calls for that timer
 long FHEtimer::getNumCalls() const
 {
-    return numCalls;
+  unsigned long time;
+  long calls;
+  sumTimerTotals(this, time, calls);
+  return calls;
 }
 
 void resetAllTimers()
 {
-  for (long i = 0; i < long(timerMap.size()); i++) 
-    timerMap[i]->reset();
+  resetTimerTotals(0);
 }
 
 // Print the value of all timers to stream
@@ -123,6 +141,22 @@ const FHEtimer *getTimerByName(const char *name)
   return 0;
 }
 
+double getTimeByName(const char *name)
+{
+  vector<const FHEtimer *> timers;
+  {
+    FHE_MUTEX_GUARD(timerMapMx);
+    for (long i = 0; i < long(timerMap.size()); i++)
+      if (strcmp(name, timerMap[i]->name) == 0)
+        timers.push_back(timerMap[i]);
+  }
+
+  double time = 0.0;
+  for (long i = 0; i < long(timers.size()); i++)
+    time += timers[i]->getTime();
+  return time;
+}
+
 bool printNamedTimer(ostream& str, const char* name)
 {
   for (long i = 0; i < long(timerMap.size()); i++) {
@@ -144,3 +178,433 @@ bool printNamedTimer(ostream& str, const char* name)
   }
   return false;
 }
+
+
+
+/****************** Hierarchical profiling ******************/
+
+FHE_atomic_bool fheProfilingFlag(false);
+static FHE_atomic_bool profileTraceFlag(false);
+static unsigned long profileEpoch = 0; // trace timestamps are relative to it
+
+#define FHE_PROFILE_MAX_SAMPLES 256      // per node, for the percentiles
+#define FHE_PROFILE_MAX_EVENTS (1L<<20)  // per thread, for the trace
+
+// A node in the tree of call paths, node 0 is the root
+struct ProfileNode {
+  const FHEtimer *timer;
+  vector<long> children;
+  long calls;
+  unsigned long incl, excl, minT, maxT;
+  vector<unsigned long> samples; // a uniform sample of the call durations
+
+  explicit ProfileNode(const FHEtimer *t=0) :
+    timer(t), calls(0), incl(0), excl(0), minT(0), maxT(0) {}
+
+  void record(unsigned long dur, unsigned long self, unsigned long& rnd)
+  {
+    if (calls==0 || dur < minT) minT = dur;
+    if (dur > maxT) maxT = dur;
+    incl += dur;
+    excl += self;
+    calls++;
+    // reservoir sampling, so the sample stays uniform and bounded
+    if (lsize(samples) < FHE_PROFILE_MAX_SAMPLES)
+      samples.push_back(dur);
+    else {
+      rnd ^= rnd << 13; rnd ^= rnd >> 7; rnd ^= rnd << 17; // xorshift
+      unsigned long j = rnd % ((unsigned long) calls);
+      if (j < FHE_PROFILE_MAX_SAMPLES) samples[j] = dur;
+    }
+  }
+
+  void merge(const ProfileNode& other)
+  {
+    if (other.calls == 0) return;
+    if (calls==0 || other.minT < minT) minT = other.minT;
+    if (other.maxT > maxT) maxT = other.maxT;
+    incl += other.incl;
+    excl += other.excl;
+    calls += other.calls;
+    samples.insert(samples.end(), other.samples.begin(), other.samples.end());
+  }
+};
+
+struct ProfileFrame {
+  long node, seq;
+  unsigned long start, childTime;
+};
+
+struct TraceEvent {
+  const FHEtimer *timer;
+  unsigned long start, dur;
+};
+
+// The totals of FHE_TIMER_BLOCK flat timers of one thread
+struct TimerBlock {
+  FHE_atomic_ulong time[FHE_TIMER_BLOCK];
+  FHE_atomic_ulong calls[FHE_TIMER_BLOCK];
+
+  TimerBlock()
+  {
+    for (long j = 0; j < FHE_TIMER_BLOCK; j++) { time[j] = 0; calls[j] = 0; }
+  }
+};
+
+#ifdef FHE_THREADS
+typedef atomic<TimerBlock*> TimerBlockPtr;
+#else
+typedef TimerBlock* TimerBlockPtr;
+#endif
+
+// The profile of a single thread, and the totals of the flat timers
+// (indexed by the timer id) for that thread. The mutex guards the profile,
+// it is only ever contended when a report is generated while that thread
+// is running timed code.
+//
+// The flat totals are only updated by their thread, with relaxed loads and
+// stores, so stopping a timer takes no lock. The blocks are published
+// atomically, and are read by the reports under the mutex. Resetting a
+// timer does not write to them, it records the current totals as a base
+// to subtract instead.
+struct ThreadProfile {
+  long tid;
+  FHE_MUTEX_TYPE mx;
+  TimerBlockPtr timerBlocks[FHE_TIMER_BLOCKS];
+  vector<unsigned long> timeBase, callsBase; // guarded by mx
+  vector<ProfileNode> nodes;
+  vector<ProfileFrame> stack;
+  vector<TraceEvent> events;
+  long droppedEvents;
+  long seq;
+  unsigned long rnd;
+
+  explicit ThreadProfile(long _tid) :
+    tid(_tid), nodes(1), droppedEvents(0), seq(0), rnd(0x9E3779B97F4A7C15UL)
+  { for (long k = 0; k < FHE_TIMER_BLOCKS; k++) timerBlocks[k] = NULL; }
+
+  ~ThreadProfile()
+  {
+    for (long k = 0; k < FHE_TIMER_BLOCKS; k++) {
+      TimerBlock *b = timerBlocks[k];
+      delete b;
+    }
+  }
+
+  // Called by the thread itself
+  void accumulate(long id, unsigned long amt)
+  {
+    TimerBlock *b = timerBlocks[id / FHE_TIMER_BLOCK];
+    if (!b) {
+      b = new TimerBlock;
+      timerBlocks[id / FHE_TIMER_BLOCK] = b;
+    }
+    long j = id % FHE_TIMER_BLOCK;
+    FHE_STORE_RELAXED(b->time[j], FHE_LOAD_RELAXED(b->time[j]) + amt);
+    FHE_STORE_RELAXED(b->calls[j], FHE_LOAD_RELAXED(b->calls[j]) + 1);
+  }
+
+  // The totals of timer id since its last reset, called under mx
+  void totals(long id, unsigned long& time, unsigned long& calls) const
+  {
+    time = calls = 0;
+    const TimerBlock *b = timerBlocks[id / FHE_TIMER_BLOCK];
+    if (!b) return;
+    long j = id % FHE_TIMER_BLOCK;
+    time = FHE_LOAD_RELAXED(b->time[j]);
+    calls = FHE_LOAD_RELAXED(b->calls[j]);
+    if (id < lsize(timeBase)) {
+      time -= timeBase[id];
+      calls -= callsBase[id];
+    }
+  }
+
+  // Reset timer id, called under mx
+  void reset(long id)
+  {
+    unsigned long time, calls;
+    totals(id, time, calls);
+    if (id >= lsize(timeBase)) {
+      timeBase.resize(id+1, 0);
+      callsBase.resize(id+1, 0);
+    }
+    timeBase[id] += time;
+    callsBase[id] += calls;
+  }
+
+  // Reset all the timers that this thread used, called under mx
+  void resetAll()
+  {
+    for (long k = 0; k < FHE_TIMER_BLOCKS; k++) {
+      const TimerBlock *b = timerBlocks[k];
+      if (b)
+        for (long j = 0; j < FHE_TIMER_BLOCK; j++) reset(k*FHE_TIMER_BLOCK + j);
+    }
+  }
+
+  // The child of node with the given timer, added if needed
+  long child(long node, const FHEtimer *timer)
+  {
+    const vector<long>& ch = nodes[node].children;
+    for (long i = 0; i < lsize(ch); i++)
+      if (nodes[ch[i]].timer == timer) return ch[i];
+    nodes.push_back(ProfileNode(timer));
+    nodes[node].children.push_back(lsize(nodes)-1);
+    return lsize(nodes)-1;
+  }
+
+  // Close the frame on top of the stack
+  void pop(unsigned long end)
+  {
+    ProfileFrame& f = stack.back();
+    unsigned long dur = end - f.start;
+    unsigned long self = (dur > f.childTime)? (dur - f.childTime) : 0;
+    nodes[f.node].record(dur, self, rnd);
+    if (profileTraceFlag) {
+      if (lsize(events) < FHE_PROFILE_MAX_EVENTS) {
+        TraceEvent e = { nodes[f.node].timer, f.start, dur };
+        events.push_back(e);
+      }
+      else droppedEvents++;
+    }
+    stack.pop_back();
+    if (!stack.empty()) stack.back().childTime += dur;
+  }
+
+  void clear()
+  {
+    nodes.assign(1, ProfileNode());
+    stack.clear();
+    events.clear();
+    droppedEvents = 0;
+  }
+};
+
+static vector< shared_ptr<ThreadProfile> > profileList;
+static FHE_MUTEX_TYPE profileListMx;
+
+static ThreadProfile& getThreadProfile()
+{
+  static NTL_THREAD_LOCAL ThreadProfile *myProfile = 0;
+  if (!myProfile) {
+    FHE_MUTEX_GUARD(profileListMx);
+    profileList.push_back(make_shared<ThreadProfile>(lsize(profileList)));
+    myProfile = profileList.back().get();
+  }
+  return *myProfile;
+}
+
+void timerAccumulate(const FHEtimer *timer, unsigned long amt)
+{
+  getThreadProfile().accumulate(timer->id, amt);
+}
+
+static void sumTimerTotals(const FHEtimer *timer,
+                           unsigned long& time, long& calls)
+{
+  time = 0;
+  calls = 0;
+  FHE_MUTEX_GUARD(profileListMx);
+  for (long i = 0; i < lsize(profileList); i++) {
+    ThreadProfile& tp = *profileList[i];
+    FHE_MUTEX_GUARD(tp.mx);
+    unsigned long t, c;
+    tp.totals(timer->id, t, c);
+    time += t;
+    calls += c;
+  }
+}
+
+// Reset the totals of timer in all threads, or of all timers if it is null
+static void resetTimerTotals(const FHEtimer *timer)
+{
+  FHE_MUTEX_GUARD(profileListMx);
+  for (long i = 0; i < lsize(profileList); i++) {
+    ThreadProfile& tp = *profileList[i];
+    FHE_MUTEX_GUARD(tp.mx);
+    if (timer)
+      tp.reset(timer->id);
+    else
+      tp.resetAll();
+  }
+}
+
+long profileEnter(const FHEtimer *timer, unsigned long start)
+{
+  ThreadProfile& tp = getThreadProfile();
+  FHE_MUTEX_GUARD(tp.mx);
+  long parent = tp.stack.empty()? 0 : tp.stack.back().node;
+  ProfileFrame f = { tp.child(parent, timer), tp.seq++, start, 0 };
+  tp.stack.push_back(f);
+  return f.seq;
+}
+
+void profileExit(long frame, unsigned long start, unsigned long end)
+{
+  ThreadProfile& tp = getThreadProfile();
+  FHE_MUTEX_GUARD(tp.mx);
+
+  // Timers are almost always stopped in LIFO order, but an explicit
+  // FHE_NTIMER_STOP can break this. In that case the frames opened after
+  // this one are closed with it, and their own exit is ignored. A frame
+  // that is not found at all was discarded by resetProfile.
+  long i = lsize(tp.stack)-1;
+  while (i >= 0 && tp.stack[i].seq != frame) i--;
+  if (i < 0) return;
+  while (lsize(tp.stack) > i) tp.pop(end);
+}
+
+void setProfilingOn(bool traceEvents)
+{
+  if (!fheProfilingFlag && profileEpoch == 0)
+    profileEpoch = GetTimerClock();
+  profileTraceFlag = traceEvents;
+  fheProfilingFlag = true;
+}
+
+void setProfilingOff()
+{
+  fheProfilingFlag = false;
+}
+
+void resetProfile()
+{
+  FHE_MUTEX_GUARD(profileListMx);
+  for (long i = 0; i < lsize(profileList); i++) {
+    FHE_MUTEX_GUARD(profileList[i]->mx);
+    profileList[i]->clear();
+  }
+  profileEpoch = GetTimerClock();
+}
+
+static void printJSONString(ostream& str, const char *s)
+{
+  str << '"';
+  for (; s && *s; s++) {
+    if (*s == '"' || *s == '\\') str << '\\' << *s;
+    else if ((unsigned char)(*s) < 0x20) str << ' ';
+    else str << *s;
+  }
+  str << '"';
+}
+
+// The q-quantile of a sample, sorts the sample in place
+static double quantile(vector<unsigned long>& v, double q)
+{
+  if (v.empty()) return 0.0;
+  long idx = long(q*(lsize(v)-1) + 0.5);
+  nth_element(v.begin(), v.begin()+idx, v.end());
+  return double(v[idx]) / CLOCK_SCALE;
+}
+
+// Add the subtree of src rooted at sNode under the node dNode of dst
+static void mergeTree(vector<ProfileNode>& dst, long dNode,
+                      const vector<ProfileNode>& src, long sNode)
+{
+  dst[dNode].merge(src[sNode]);
+  const vector<long>& ch = src[sNode].children;
+  for (long i = 0; i < lsize(ch); i++) {
+    const FHEtimer *timer = src[ch[i]].timer;
+    long d = -1;
+    for (long j = 0; j < lsize(dst[dNode].children); j++)
+      if (dst[dst[dNode].children[j]].timer == timer) {
+        d = dst[dNode].children[j];
+        break;
+      }
+    if (d < 0) {
+      dst.push_back(ProfileNode(timer));
+      d = lsize(dst)-1;
+      dst[dNode].children.push_back(d);
+    }
+    mergeTree(dst, d, src, ch[i]);
+  }
+}
+
+static void printJSONTree(ostream& str, vector<ProfileNode>& nodes,
+                          long node, long indent)
+{
+  string pad(indent, ' ');
+  ProfileNode& nd = nodes[node];
+  str << pad << "{";
+  if (nd.timer) {
+    str << "\"name\": "; printJSONString(str, nd.timer->name);
+    str << ", \"loc\": "; printJSONString(str, nd.timer->loc);
+    str << ", \"calls\": " << nd.calls
+        << ", \"inclusive\": " << double(nd.incl)/CLOCK_SCALE
+        << ", \"exclusive\": " << double(nd.excl)/CLOCK_SCALE
+        << ", \"min\": " << double(nd.minT)/CLOCK_SCALE
+        << ", \"max\": " << double(nd.maxT)/CLOCK_SCALE
+        << ", \"p50\": " << quantile(nd.samples, 0.5)
+        << ", \"p90\": " << quantile(nd.samples, 0.9)
+        << ", \"p99\": " << quantile(nd.samples, 0.99) << ", ";
+  }
+  str << "\"children\": [";
+  // print the most expensive children first
+  vector< pair<unsigned long,long> > order;
+  for (long i = 0; i < lsize(nd.children); i++)
+    order.push_back(make_pair(nodes[nd.children[i]].incl, nd.children[i]));
+  sort(order.rbegin(), order.rend());
+  for (long i = 0; i < lsize(order); i++) {
+    str << (i? ",\n" : "\n");
+    printJSONTree(str, nodes, order[i].second, indent+2);
+  }
+  if (!order.empty()) str << "\n" << pad;
+  str << "]}";
+}
+
+void printProfileJSON(ostream& str)
+{
+  FHE_MUTEX_GUARD(profileListMx);
+
+  // Take a snapshot of each thread, so timed code is not blocked
+  // for the duration of the printing
+  vector< vector<ProfileNode> > threads(profileList.size());
+  for (long i = 0; i < lsize(profileList); i++) {
+    FHE_MUTEX_GUARD(profileList[i]->mx);
+    threads[i] = profileList[i]->nodes;
+  }
+
+  vector<ProfileNode> merged(1);
+  for (long i = 0; i < lsize(threads); i++)
+    mergeTree(merged, 0, threads[i], 0);
+
+  str << "{\"threads\": " << threads.size() << ",\n";
+  str << "\"profile\":\n";
+  printJSONTree(str, merged, 0, 1);
+  str << ",\n\"perThread\": [";
+  for (long i = 0; i < lsize(threads); i++) {
+    str << (i? ",\n" : "\n") << " {\"tid\": " << i << ", \"profile\":\n";
+    printJSONTree(str, threads[i], 0, 2);
+    str << "}";
+  }
+  str << "\n]}\n";
+}
+
+void writeChromeTrace(ostream& str)
+{
+  FHE_MUTEX_GUARD(profileListMx);
+
+  // timestamps are in microseconds
+  double scale = 1000000.0 / CLOCK_SCALE;
+  bool first = true;
+  long dropped = 0;
+  str << "{\"traceEvents\": [";
+  for (long i = 0; i < lsize(profileList); i++) {
+    ThreadProfile& tp = *profileList[i];
+    FHE_MUTEX_GUARD(tp.mx);
+    dropped += tp.droppedEvents;
+    for (long j = 0; j < lsize(tp.events); j++) {
+      const TraceEvent& e = tp.events[j];
+      str << (first? "\n" : ",\n") << "{\"name\": ";
+      printJSONString(str, e.timer->name);
+      str << ", \"cat\": \"FHE\", \"ph\": \"X\", \"pid\": 0, \"tid\": "
+          << tp.tid << ", \"ts\": " << double(e.start - profileEpoch)*scale
+          << ", \"dur\": " << double(e.dur)*scale << ", \"args\": {\"loc\": ";
+      printJSONString(str, e.timer->loc);
+      str << "}}";
+      first = false;
+    }
+  }
+  str << "\n], \"displayTimeUnit\": \"ms\", \"otherData\": {\"droppedEvents\": "
+      << dropped << "}}\n";
+}
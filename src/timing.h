@@ -40,18 +40,18 @@ class FHEtimer;
 void registerTimer(FHEtimer *timer);
 unsigned long GetTimerClock();
 
-//! A simple class to accumulate time
+//! A simple class to accumulate time. The time and the number of calls
+//! are accumulated by each thread separately, and summed over the threads
+//! by getTime and getNumCalls, so that timers that are stopped on many
+//! threads at once do not contend on shared counters.
 class FHEtimer {
 public:
   const char *name;
   const char *loc;
-
-  // THREADS: these need to be atomic
-  FHE_atomic_ulong counter;
-  FHE_atomic_long numCalls;
+  long id; // index of the timer in the per-thread totals
 
   FHEtimer(const char *_name, const char *_loc) :
-    name(_name), loc(_loc), counter(0), numCalls(0) 
+    name(_name), loc(_loc), id(-1)
   { registerTimer(this); }
 
   void reset();
@@ -67,6 +67,11 @@ inline bool areTimersOn()  { return true; }
 
 const FHEtimer *getTimerByName(const char *name);
 
+//! The total time (in seconds) of all the timers with this name. Timers of
+//! different functions (e.g., overloads) may share a name, getTimerByName
+//! only returns the first of them.
+double getTimeByName(const char *name);
+
 
 void resetAllTimers();
 
@@ -77,21 +82,70 @@ void printAllTimers(std::ostream& str=std::cerr);
 bool printNamedTimer(ostream& str, const char* name);
 
 
+/****************** Hierarchical profiling ******************/
+/* When profiling is turned on, every FHE_TIMER_START/FHE_NTIMER_START also
+ * reports to a per-thread call-stack profiler. Each thread aggregates its
+ * own tree of call paths (so keySwitchPart under reLinearize under
+ * multiplyBy is a different node than keySwitchPart called directly),
+ * recording inclusive and exclusive time, call counts, min/max and a
+ * bounded sample of call durations for the percentiles. The per-thread
+ * trees are only merged when a report is requested. Optionally, every
+ * timed call is also recorded as an event for a Chrome trace.
+ *
+ * When profiling is off (the default), the overhead of a timed scope is
+ * testing a global flag on entry, and on exit adding its time to the flat
+ * totals of the calling thread. These are only written by that thread,
+ * without a lock, and are summed over the threads when a timer is read.
+ */
+
+//! Turn on profiling, if traceEvents is set then also record trace events.
+//! Should be called before starting any parallel work.
+void setProfilingOn(bool traceEvents=false);
+void setProfilingOff();
+
+extern FHE_atomic_bool fheProfilingFlag;
+inline bool isProfilingOn() { return fheProfilingFlag; }
+
+//! Discard all the profiling data (of all threads) collected so far.
+//! Should not be called while timed code is running on other threads.
+void resetProfile();
+
+//! Print the profile as a JSON object, with the merged tree of call paths
+//! and the tree of each thread. Times are in seconds.
+void printProfileJSON(std::ostream& str);
+
+//! Write the recorded trace events in the Chrome trace-event format,
+//! which can be loaded in chrome://tracing or Perfetto
+void writeChromeTrace(std::ostream& str);
+
+//! \cond FALSE (make doxygen ignore these)
+// Called by auto_timer, add amt to the totals of the calling thread
+void timerAccumulate(const FHEtimer *timer, unsigned long amt);
+// Called by auto_timer, enter returns a frame id to pass to exit
+long profileEnter(const FHEtimer *timer, unsigned long start);
+void profileExit(long frame, unsigned long start, unsigned long end);
+//! \endcond
+
+
 //! \cond FALSE (make doxygen ignore these classes)
 class auto_timer {
 public:
   FHEtimer *timer;
   unsigned long amt;
   bool running;
+  long frame; // profiler frame, -1 if not profiled
 
   auto_timer(FHEtimer *_timer) : 
-    timer(_timer), amt(GetTimerClock()), running(true) { }
+    timer(_timer), amt(GetTimerClock()), running(true), frame(-1)
+  { if (isProfilingOn()) frame = profileEnter(timer, amt); }
 
   void stop() {
-    amt = GetTimerClock() - amt; 
-    timer->counter += amt;
-    timer->numCalls++;
+    unsigned long start = amt;
+    unsigned long end = GetTimerClock();
+    amt = end - start;
+    timerAccumulate(timer, amt);
     running = false;
+    if (frame >= 0) profileExit(frame, start, end);
   }
 
   ~auto_timer() { if (running) stop(); }